@@ -0,0 +1,881 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "log_message.h"
+#include "archive.h"
+#include "timestamp.h"
+
+#define ARCHIVE_STORED     0
+#define ARCHIVE_DEFLATED   1
+
+/* Entry header: "SBAE" method:u8 namelen:u8 reserved:u16 size:u32
+   stored:u32 crc:u32, followed by the name and the data. The index
+   can be rebuilt from the headers if needed. */
+#define ARCHIVE_HEADER_SIZE 20
+
+typedef struct _archive_entry_t {
+        char archive[16];
+        char* name;
+        long offset;
+        long size;
+        long stored;
+        int method;
+} archive_entry_t;
+
+struct _archive_t {
+        char* dir;
+        char* archive_dir;
+        char* index_file;
+        int period;
+        archive_entry_t* entries;
+        int num_entries;
+        int max_entries;
+};
+
+typedef struct _archive_file_t {
+        char date[9];
+        char* name;
+} archive_file_t;
+
+static int archive_load_index(archive_t* archive);
+
+/* Copies the date in the file name into date (9 bytes). Returns -1
+   if the name doesn't start with a date. */
+static int archive_date(const char* name, char* date)
+{
+        if (strncmp(name, "datapoints-", 11) == 0)
+                name += 11;
+        for (int i = 0; i < 8; i++)
+                if (!isdigit((unsigned char) name[i]))
+                        return -1;
+        if (name[8] != '-')
+                return -1;
+        memcpy(date, name, 8);
+        date[8] = 0;
+        return 0;
+}
+
+static void archive_key(archive_t* archive, const char* date, char* key)
+{
+        int len = (archive->period == ARCHIVE_MONTHLY)? 6 : 8;
+        memcpy(key, date, len);
+        key[len] = 0;
+}
+
+static void archive_path(archive_t* archive, const char* key, char* path, int len)
+{
+        snprintf(path, len, "%s/%s.sba", archive->archive_dir, key);
+        path[len-1] = 0;
+}
+
+archive_t* new_archive(const char* dir, int period)
+{
+        char path[512];
+
+        archive_t* archive = (archive_t*) malloc(sizeof(archive_t));
+        if (archive == NULL) {
+                log_err("Archive: out of memory");
+                return NULL;
+        }
+        memset(archive, 0, sizeof(archive_t));
+
+        archive->period = period;
+        archive->dir = strdup(dir);
+
+        snprintf(path, 512, "%s/archives", dir);
+        path[511] = 0;
+        archive->archive_dir = strdup(path);
+
+        snprintf(path, 512, "%s/archives/index.txt", dir);
+        path[511] = 0;
+        archive->index_file = strdup(path);
+
+        if ((mkdir(archive->archive_dir, 0755) != 0) && (errno != EEXIST)) {
+                log_err("Archive: Failed to create the directory '%s'",
+                        archive->archive_dir);
+                delete_archive(archive);
+                return NULL;
+        }
+
+        if (archive_load_index(archive) != 0) {
+                delete_archive(archive);
+                return NULL;
+        }
+
+        return archive;
+}
+
+static void archive_clear_entries(archive_t* archive)
+{
+        for (int i = 0; i < archive->num_entries; i++)
+                free(archive->entries[i].name);
+        if (archive->entries)
+                free(archive->entries);
+        archive->entries = NULL;
+        archive->num_entries = 0;
+        archive->max_entries = 0;
+}
+
+void delete_archive(archive_t* archive)
+{
+        archive_clear_entries(archive);
+        if (archive->dir)
+                free(archive->dir);
+        if (archive->archive_dir)
+                free(archive->archive_dir);
+        if (archive->index_file)
+                free(archive->index_file);
+        free(archive);
+}
+
+static archive_entry_t* archive_add_entry(archive_t* archive, const char* key,
+                                          const char* name)
+{
+        if (archive->num_entries >= archive->max_entries) {
+                int len = (archive->max_entries == 0)? 256 : 2 * archive->max_entries;
+                archive_entry_t* p = (archive_entry_t*) realloc(archive->entries,
+                                                                 len * sizeof(archive_entry_t));
+                if (p == NULL) {
+                        log_err("Archive: out of memory");
+                        return NULL;
+                }
+                archive->entries = p;
+                archive->max_entries = len;
+        }
+
+        archive_entry_t* e = &archive->entries[archive->num_entries++];
+        memset(e, 0, sizeof(archive_entry_t));
+        strncpy(e->archive, key, 15);
+        e->name = strdup(name);
+        return e;
+}
+
+static int archive_load_index(archive_t* archive)
+{
+        char line[512];
+        char key[16];
+        char name[256];
+        long offset, size, stored;
+        int method;
+
+        FILE* fp = fopen(archive->index_file, "r");
+        if (fp == NULL)
+                return (errno == ENOENT)? 0 : -1;
+
+        while (fgets(line, 512, fp) != NULL) {
+                /* A line without a newline was torn by a crash. Its
+                   file is still in the backup directory. */
+                if (line[strlen(line) - 1] != '\n')
+                        continue;
+                if (sscanf(line, "%15s %255s %ld %ld %ld %d",
+                           key, name, &offset, &size, &stored, &method) != 6) {
+                        log_warn("Archive: Skipping invalid index line: %s", line);
+                        continue;
+                }
+                archive_entry_t* e = archive_add_entry(archive, key, name);
+                if (e == NULL) {
+                        fclose(fp);
+                        return -1;
+                }
+                e->offset = offset;
+                e->size = size;
+                e->stored = stored;
+                e->method = method;
+        }
+
+        fclose(fp);
+        return 0;
+}
+
+static void archive_print_entry(archive_entry_t* e, FILE* fp)
+{
+        fprintf(fp, "%s %s %ld %ld %ld %d\n", e->archive, e->name,
+                e->offset, e->size, e->stored, e->method);
+}
+
+/* Appends the entries [first, num_entries[ to the index and syncs
+   it. */
+static int archive_append_index(archive_t* archive, int first)
+{
+        if (first >= archive->num_entries)
+                return 0;
+
+        FILE* fp = fopen(archive->index_file, "a");
+        if (fp == NULL) {
+                log_err("Archive: Failed to open the index '%s'", archive->index_file);
+                return -1;
+        }
+        for (int i = first; i < archive->num_entries; i++)
+                archive_print_entry(&archive->entries[i], fp);
+
+        int err = 0;
+        if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0))
+                err = -1;
+        if (fclose(fp) != 0)
+                err = -1;
+        if (err != 0)
+                log_err("Archive: Failed to write the index '%s'", archive->index_file);
+        return err;
+}
+
+/* Rewrites the whole index, through a temporary file. */
+static int archive_save_index(archive_t* archive)
+{
+        char tmpfile[512];
+
+        snprintf(tmpfile, 512, "%s.tmp", archive->index_file);
+        tmpfile[511] = 0;
+
+        FILE* fp = fopen(tmpfile, "w");
+        if (fp == NULL) {
+                log_err("Archive: Failed to create '%s'", tmpfile);
+                return -1;
+        }
+        for (int i = 0; i < archive->num_entries; i++)
+                archive_print_entry(&archive->entries[i], fp);
+
+        int err = 0;
+        if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0))
+                err = -1;
+        if (fclose(fp) != 0)
+                err = -1;
+        if ((err == 0) && (rename(tmpfile, archive->index_file) != 0))
+                err = -1;
+        if (err != 0) {
+                log_err("Archive: Failed to save the index '%s'", archive->index_file);
+                unlink(tmpfile);
+        }
+        return err;
+}
+
+static int archive_compare_names(const void* a, const void* b)
+{
+        return strcmp(*(const char**) a, *(const char**) b);
+}
+
+/* The names of the archived files, sorted, to check whether a
+   backup file was archived already. */
+static char** archive_sorted_names(archive_t* archive)
+{
+        char** names = (char**) malloc((archive->num_entries + 1) * sizeof(char*));
+        if (names == NULL)
+                return NULL;
+        for (int i = 0; i < archive->num_entries; i++)
+                names[i] = archive->entries[i].name;
+        qsort(names, archive->num_entries, sizeof(char*), archive_compare_names);
+        return names;
+}
+
+static int archive_compare_files(const void* a, const void* b)
+{
+        const archive_file_t* fa = (const archive_file_t*) a;
+        const archive_file_t* fb = (const archive_file_t*) b;
+        int r = strcmp(fa->date, fb->date);
+        return (r != 0)? r : strcmp(fa->name, fb->name);
+}
+
+/* The backup files that can be archived, oldest first. */
+static archive_file_t* archive_list_files(archive_t* archive, int* count)
+{
+        struct dirent *entry;
+        struct stat buf;
+        char path[512];
+        archive_file_t* files = NULL;
+        int len = 0;
+
+        *count = 0;
+
+        DIR* dir = opendir(archive->dir);
+        if (dir == NULL) {
+                log_err("Archive: Failed to open the directory '%s'", archive->dir);
+                return NULL;
+        }
+
+        while ((entry = readdir(dir)) != NULL) {
+                char date[9];
+                if (archive_date(entry->d_name, date) != 0)
+                        continue;
+                if (strlen(entry->d_name) > 255)
+                        continue;
+                snprintf(path, 512, "%s/%s", archive->dir, entry->d_name);
+                path[511] = 0;
+                if ((stat(path, &buf) != 0) || !S_ISREG(buf.st_mode))
+                        continue;
+
+                if (*count >= len) {
+                        len = (len == 0)? 64 : 2 * len;
+                        archive_file_t* p = (archive_file_t*) realloc(files, len * sizeof(archive_file_t));
+                        if (p == NULL) {
+                                log_err("Archive: out of memory");
+                                break;
+                        }
+                        files = p;
+                }
+                strcpy(files[*count].date, date);
+                files[*count].name = strdup(entry->d_name);
+                (*count)++;
+        }
+        closedir(dir);
+
+        if (*count > 0)
+                qsort(files, *count, sizeof(archive_file_t), archive_compare_files);
+
+        return files;
+}
+
+static void archive_free_files(archive_file_t* files, int count)
+{
+        for (int i = 0; i < count; i++)
+                free(files[i].name);
+        if (files)
+                free(files);
+}
+
+static int archive_read_file(const char* path, unsigned char** data, long* size)
+{
+        struct stat st;
+
+        *data = NULL;
+        *size = 0;
+
+        if (stat(path, &st) != 0)
+                return -1;
+
+        unsigned char* buf = (unsigned char*) malloc(st.st_size > 0? st.st_size : 1);
+        if (buf == NULL) {
+                log_err("Archive: out of memory");
+                return -1;
+        }
+
+        FILE* fp = fopen(path, "r");
+        if ((fp == NULL)
+            || ((st.st_size > 0) && (fread(buf, st.st_size, 1, fp) != 1))) {
+                log_err("Archive: Failed to read '%s'", path);
+                if (fp) fclose(fp);
+                free(buf);
+                return -1;
+        }
+        fclose(fp);
+
+        *data = buf;
+        *size = st.st_size;
+        return 0;
+}
+
+static int archive_is_photo(const char* name)
+{
+        int len = strlen(name);
+        return (len > 4) && (strcmp(name + len - 4, ".jpg") == 0);
+}
+
+/* Appends one backup file to the open archive fd. */
+static int archive_append_file(archive_t* archive, int fd, const char* key,
+                               const char* name)
+{
+        char path[512];
+        unsigned char* data;
+        long size;
+
+        snprintf(path, 512, "%s/%s", archive->dir, name);
+        path[511] = 0;
+
+        if (archive_read_file(path, &data, &size) != 0)
+                return -1;
+
+        /* JPEG doesn't compress, so don't spend the CPU on it. */
+        int method = archive_is_photo(name)? ARCHIVE_STORED : ARCHIVE_DEFLATED;
+        int namelen = strlen(name);
+        uLongf stored = (method == ARCHIVE_DEFLATED)? compressBound(size) : (uLongf) size;
+
+        unsigned char* buf = (unsigned char*) malloc(ARCHIVE_HEADER_SIZE + namelen + stored);
+        if (buf == NULL) {
+                log_err("Archive: out of memory");
+                free(data);
+                return -1;
+        }
+        unsigned char* p = buf + ARCHIVE_HEADER_SIZE + namelen;
+
+        if ((method == ARCHIVE_DEFLATED)
+            && ((compress2(p, &stored, data, size, 6) != Z_OK)
+                || (stored >= (uLongf) size)))
+                method = ARCHIVE_STORED;
+
+        if (method == ARCHIVE_STORED) {
+                memcpy(p, data, size);
+                stored = size;
+        }
+
+        uint32_t v;
+        memcpy(buf, "SBAE", 4);
+        buf[4] = method;
+        buf[5] = namelen;
+        buf[6] = 0;
+        buf[7] = 0;
+        v = size;
+        memcpy(buf + 8, &v, 4);
+        v = stored;
+        memcpy(buf + 12, &v, 4);
+        v = crc32(0, data, size);
+        memcpy(buf + 16, &v, 4);
+        memcpy(buf + ARCHIVE_HEADER_SIZE, name, namelen);
+        free(data);
+
+        off_t offset = lseek(fd, 0, SEEK_END);
+        long len = ARCHIVE_HEADER_SIZE + namelen + stored;
+        if ((offset == (off_t) -1) || (write(fd, buf, len) != len)) {
+                log_err("Archive: Failed to append '%s' to archive %s", name, key);
+                free(buf);
+                return -1;
+        }
+        free(buf);
+
+        archive_entry_t* e = archive_add_entry(archive, key, name);
+        if (e == NULL)
+                return -1;
+        e->offset = offset;
+        e->size = size;
+        e->stored = stored;
+        e->method = method;
+
+        return 0;
+}
+
+int archive_compact(archive_t* archive, int budget)
+{
+        char key[16];
+        char path[512];
+        int count;
+        int archived = 0;
+        int err = 0;
+
+        time_t start = time(NULL);
+
+        archive_file_t* files = archive_list_files(archive, &count);
+        if (count == 0) {
+                archive_free_files(files, count);
+                return 0;
+        }
+
+        char** names = archive_sorted_names(archive);
+        if (names == NULL) {
+                log_err("Archive: out of memory");
+                archive_free_files(files, count);
+                return -1;
+        }
+        int num_names = archive->num_entries;
+
+        int i = 0;
+        while ((i < count) && (time(NULL) - start < budget) && (err == 0)) {
+
+                /* The files of one archive are appended in a batch,
+                   with a single sync of the archive and the
+                   index. The originals are removed only then. */
+                archive_key(archive, files[i].date, key);
+                archive_path(archive, key, path, 512);
+
+                int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+                if (fd == -1) {
+                        log_err("Archive: Failed to open '%s'", path);
+                        err = -1;
+                        break;
+                }
+
+                int first_entry = archive->num_entries;
+                int first_file = i;
+
+                while ((i < count)
+                       && (strncmp(files[i].date, key, strlen(key)) == 0)
+                       && (time(NULL) - start < budget)) {
+                        const char* name = files[i].name;
+                        /* Archived before, but the original wasn't
+                           removed. */
+                        if (bsearch(&name, names, num_names, sizeof(char*),
+                                    archive_compare_names) == NULL) {
+                                if (archive_append_file(archive, fd, key, name) != 0) {
+                                        err = -1;
+                                        break;
+                                }
+                        }
+                        i++;
+                }
+
+                if (fdatasync(fd) != 0) {
+                        log_err("Archive: Failed to sync '%s'", path);
+                        err = -1;
+                }
+                close(fd);
+
+                if ((err == 0) && (archive_append_index(archive, first_entry) != 0))
+                        err = -1;
+
+                if (err != 0) {
+                        /* The data written after the last index
+                           entry is ignored. */
+                        for (int j = first_entry; j < archive->num_entries; j++)
+                                free(archive->entries[j].name);
+                        archive->num_entries = first_entry;
+                        break;
+                }
+
+                for (int j = first_file; j < i; j++) {
+                        snprintf(path, 512, "%s/%s", archive->dir, files[j].name);
+                        path[511] = 0;
+                        if (unlink(path) != 0)
+                                log_warn("Archive: Failed to remove '%s'", path);
+                        else archived++;
+                }
+        }
+
+        if (i < count)
+                log_info("Archive: %d files left for the next run", count - i);
+
+        free(names);
+        archive_free_files(files, count);
+
+        log_info("Archive: Archived %d files in %ld sec", archived, (long) (time(NULL) - start));
+
+        return (err == 0)? archived : -1;
+}
+
+typedef struct _archive_stat_t {
+        char key[16];
+        long size;
+        int remove;
+} archive_stat_t;
+
+static int archive_compare_stats(const void* a, const void* b)
+{
+        return strcmp(((const archive_stat_t*) a)->key, ((const archive_stat_t*) b)->key);
+}
+
+static archive_stat_t* archive_list_archives(archive_t* archive, int* count)
+{
+        struct dirent *entry;
+        struct stat buf;
+        char path[512];
+        archive_stat_t* list = NULL;
+        int len = 0;
+
+        *count = 0;
+
+        DIR* dir = opendir(archive->archive_dir);
+        if (dir == NULL)
+                return NULL;
+
+        while ((entry = readdir(dir)) != NULL) {
+                int n = strlen(entry->d_name);
+                if ((n < 5) || (n > 19) || (strcmp(entry->d_name + n - 4, ".sba") != 0))
+                        continue;
+                snprintf(path, 512, "%s/%s", archive->archive_dir, entry->d_name);
+                path[511] = 0;
+                if (stat(path, &buf) != 0)
+                        continue;
+                if (*count >= len) {
+                        len = (len == 0)? 32 : 2 * len;
+                        archive_stat_t* p = (archive_stat_t*) realloc(list, len * sizeof(archive_stat_t));
+                        if (p == NULL)
+                                break;
+                        list = p;
+                }
+                memcpy(list[*count].key, entry->d_name, n - 4);
+                list[*count].key[n - 4] = 0;
+                list[*count].size = buf.st_size;
+                list[*count].remove = 0;
+                (*count)++;
+        }
+        closedir(dir);
+
+        if (*count > 0)
+                qsort(list, *count, sizeof(archive_stat_t), archive_compare_stats);
+
+        return list;
+}
+
+long archive_size(archive_t* archive)
+{
+        int count;
+        long size = 0;
+        archive_stat_t* list = archive_list_archives(archive, &count);
+        for (int i = 0; i < count; i++)
+                size += list[i].size;
+        if (list)
+                free(list);
+        return size;
+}
+
+int archive_retain(archive_t* archive, long max_size, int max_age)
+{
+        char date[TIMESTAMP_MAXLEN];
+        char cutoff[16];
+        char path[512];
+        int count;
+        int removed = 0;
+
+        archive_stat_t* list = archive_list_archives(archive, &count);
+        if (count <= 1) {
+                if (list)
+                        free(list);
+                return 0;
+        }
+
+        if (max_age > 0) {
+                time_t t = time(NULL) - (time_t) max_age * 86400;
+                timestamp_format(NULL, t, TIMESTAMP_DATE, date);
+                archive_key(archive, date, cutoff);
+                for (int i = 0; i < count - 1; i++)
+                        if (strcmp(list[i].key, cutoff) < 0)
+                                list[i].remove = 1;
+        }
+
+        if (max_size > 0) {
+                long total = 0;
+                for (int i = 0; i < count; i++)
+                        if (!list[i].remove)
+                                total += list[i].size;
+                for (int i = 0; (i < count - 1) && (total > max_size); i++) {
+                        if (!list[i].remove) {
+                                list[i].remove = 1;
+                                total -= list[i].size;
+                        }
+                }
+        }
+
+        for (int i = 0; i < count; i++)
+                removed += list[i].remove;
+
+        if (removed == 0) {
+                free(list);
+                return 0;
+        }
+
+        /* Drop the entries from the index first, so that it never
+           refers to a missing archive. */
+        int n = 0;
+        for (int i = 0; i < archive->num_entries; i++) {
+                archive_entry_t* e = &archive->entries[i];
+                archive_stat_t k;
+                strcpy(k.key, e->archive);
+                archive_stat_t* s = (archive_stat_t*) bsearch(&k, list, count, sizeof(archive_stat_t),
+                                                              archive_compare_stats);
+                if ((s != NULL) && s->remove) {
+                        free(e->name);
+                        continue;
+                }
+                archive->entries[n++] = *e;
+        }
+        archive->num_entries = n;
+
+        if (archive_save_index(archive) != 0) {
+                free(list);
+                return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+                if (!list[i].remove)
+                        continue;
+                archive_path(archive, list[i].key, path, 512);
+                log_info("Archive: Removing archive %s (%ld bytes)", list[i].key, list[i].size);
+                if (unlink(path) != 0)
+                        log_warn("Archive: Failed to remove '%s'", path);
+        }
+
+        free(list);
+        return removed;
+}
+
+static int archive_match(archive_entry_t* e, const char* prefix)
+{
+        char date[9];
+        if (prefix == NULL)
+                return 1;
+        if (strncmp(e->name, prefix, strlen(prefix)) == 0)
+                return 1;
+        return (archive_date(e->name, date) == 0)
+                && (strncmp(date, prefix, strlen(prefix)) == 0);
+}
+
+int archive_list(archive_t* archive, const char* prefix, FILE* fp)
+{
+        for (int i = 0; i < archive->num_entries; i++)
+                if (archive_match(&archive->entries[i], prefix))
+                        archive_print_entry(&archive->entries[i], fp);
+        return 0;
+}
+
+/* Reads and checks the data of an entry. The caller must free the
+   returned buffer. */
+static unsigned char* archive_read_entry(archive_t* archive, archive_entry_t* e)
+{
+        char path[512];
+        unsigned char header[ARCHIVE_HEADER_SIZE + 256];
+        int namelen = strlen(e->name);
+        int err = -1;
+
+        archive_path(archive, e->archive, path, 512);
+
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+                log_err("Archive: Failed to open '%s'", path);
+                return NULL;
+        }
+
+        unsigned char* stored = (unsigned char*) malloc(e->stored > 0? e->stored : 1);
+        unsigned char* data = (unsigned char*) malloc(e->size > 0? e->size : 1);
+        if ((stored == NULL) || (data == NULL)) {
+                log_err("Archive: out of memory");
+                goto clean_exit;
+        }
+
+        int hlen = ARCHIVE_HEADER_SIZE + namelen;
+        if ((pread(fd, header, hlen, e->offset) != hlen)
+            || (memcmp(header, "SBAE", 4) != 0)
+            || (header[5] != namelen)
+            || (memcmp(header + ARCHIVE_HEADER_SIZE, e->name, namelen) != 0)
+            || (pread(fd, stored, e->stored, e->offset + hlen) != e->stored)) {
+                log_err("Archive: Invalid entry for '%s' in %s", e->name, path);
+                goto clean_exit;
+        }
+
+        if (e->method == ARCHIVE_DEFLATED) {
+                uLongf size = e->size;
+                if ((uncompress(data, &size, stored, e->stored) != Z_OK)
+                    || (size != (uLongf) e->size)) {
+                        log_err("Archive: Failed to decompress '%s'", e->name);
+                        goto clean_exit;
+                }
+        } else {
+                memcpy(data, stored, e->size);
+        }
+
+        uint32_t crc;
+        memcpy(&crc, header + 16, 4);
+        if (crc != crc32(0, data, e->size)) {
+                log_err("Archive: Checksum error for '%s'", e->name);
+                goto clean_exit;
+        }
+
+        err = 0;
+
+ clean_exit:
+        if (stored)
+                free(stored);
+        if ((err != 0) && data) {
+                free(data);
+                data = NULL;
+        }
+        close(fd);
+        return data;
+}
+
+static int archive_extract_entry(archive_t* archive, archive_entry_t* e, const char* dir)
+{
+        char path[512];
+        int err = -1;
+
+        unsigned char* data = archive_read_entry(archive, e);
+        if (data == NULL)
+                return -1;
+
+        snprintf(path, 512, "%s/%s", dir, e->name);
+        path[511] = 0;
+
+        FILE* fp = fopen(path, "w");
+        if (fp == NULL) {
+                log_err("Archive: Failed to create '%s'", path);
+                free(data);
+                return -1;
+        }
+        if ((e->size > 0) && (fwrite(data, e->size, 1, fp) != 1))
+                log_err("Archive: Failed to write '%s'", path);
+        else err = 0;
+        fclose(fp);
+        free(data);
+
+        log_info("Archive: Extracted %s", path);
+
+        return err;
+}
+
+int archive_count(archive_t* archive)
+{
+        return archive->num_entries;
+}
+
+const char* archive_get_name(archive_t* archive, int index)
+{
+        if ((index < 0) || (index >= archive->num_entries))
+                return NULL;
+        return archive->entries[index].name;
+}
+
+int archive_read(archive_t* archive, const char* name, unsigned char** data, long* size)
+{
+        *data = NULL;
+        *size = 0;
+
+        /* The newest entry wins, in case a file was archived twice. */
+        for (int i = archive->num_entries - 1; i >= 0; i--) {
+                archive_entry_t* e = &archive->entries[i];
+                if (strcmp(e->name, name) != 0)
+                        continue;
+                *data = archive_read_entry(archive, e);
+                if (*data == NULL)
+                        return -1;
+                *size = e->size;
+                return 0;
+        }
+        return -1;
+}
+
+int archive_extract(archive_t* archive, const char* key, const char* dir)
+{
+        char date[9];
+        int count = 0;
+
+        for (int i = 0; i < archive->num_entries; i++) {
+                archive_entry_t* e = &archive->entries[i];
+                if ((strcmp(e->name, key) != 0)
+                    && ((archive_date(e->name, date) != 0) || (strcmp(date, key) != 0)))
+                        continue;
+                if (archive_extract_entry(archive, e, dir) != 0)
+                        return -1;
+                count++;
+        }
+
+        if (count == 0)
+                log_warn("Archive: No entry found for '%s'", key);
+
+        return count;
+}
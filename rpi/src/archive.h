@@ -0,0 +1,92 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* The uploaded datapoint files and photos are rolled from
+           the backup directory into one archive per day or per
+           month, in <backup>/archives/. Each entry in an archive is
+           a small header followed by the file's data, compressed
+           with zlib (photos are stored as is). The file
+           <backup>/archives/index.txt has one line per entry:
+
+             archive name offset size stored-size method
+
+           Only the files whose name starts with a date
+           (YYYYMMDD-*.jpg and datapoints-YYYYMMDD-*.csv) are
+           archived. The other backups are left alone. */
+
+        enum {
+                ARCHIVE_DAILY,
+                ARCHIVE_MONTHLY
+        };
+
+        typedef struct _archive_t archive_t;
+
+        archive_t* new_archive(const char* backup_dir, int period);
+        void delete_archive(archive_t* archive);
+
+        /* Moves the backup files into the archives, oldest first,
+           until all files are done or the time budget, in seconds,
+           is spent. Returns the number of files archived, or -1 on
+           error. */
+        int archive_compact(archive_t* archive, int budget);
+
+        /* Removes the oldest archives until the total size is below
+           max_size bytes, and the archives of the periods that ended
+           more than max_age days ago. Zero disables a limit. The
+           newest archive is always kept. */
+        int archive_retain(archive_t* archive, long max_size, int max_age);
+
+        /* Prints the index entries whose name or date starts with
+           the given prefix (all entries if prefix is NULL). */
+        int archive_list(archive_t* archive, const char* prefix, FILE* fp);
+
+        /* Extracts the entry with the given name, or all the
+           entries of a day if key is a date (YYYYMMDD), into the
+           directory dir. Returns the number of files extracted, or
+           -1 on error. */
+        int archive_extract(archive_t* archive, const char* key, const char* dir);
+
+        /* The entries, in the order they were archived. */
+        int archive_count(archive_t* archive);
+        const char* archive_get_name(archive_t* archive, int index);
+
+        /* Reads the archived file into memory. The caller must free
+           the data. */
+        int archive_read(archive_t* archive, const char* name,
+                         unsigned char** data, long* size);
+
+        /* The total size of the archives, in bytes. */
+        long archive_size(archive_t* archive);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
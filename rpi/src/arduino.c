@@ -673,27 +673,27 @@ datapoint_t* arduino_read_data(arduino_t* arduino, int* num_points)
                 goto error_recovery;
 
         if (sensors & SENSOR_TRH) {
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_T);
                 datastreams[num_streams++] = DATASTREAM_T;
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_RH);
                 datastreams[num_streams++] = DATASTREAM_RH;
         }
         if (sensors & SENSOR_TRHX) {
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_TX);
                 datastreams[num_streams++] = DATASTREAM_TX;
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_RHX);
                 datastreams[num_streams++] = DATASTREAM_RHX;
         }
         if (sensors & SENSOR_LUM) {
-                factors[num_streams] = 1.0f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_LUM);
                 datastreams[num_streams++] = DATASTREAM_LUM;
         }
         if (sensors & SENSOR_USBBAT) {
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_USBBAT);
                 datastreams[num_streams++] = DATASTREAM_USBBAT;
         }
         if (sensors & SENSOR_SOIL) {
-                factors[num_streams] = 1.0f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_SOIL);
                 datastreams[num_streams++] = DATASTREAM_SOIL;
         }
 
@@ -711,10 +711,8 @@ datapoint_t* arduino_read_data(arduino_t* arduino, int* num_points)
 
         log_info("Arduino: Found %d measurement frames", stack.frames); 
 
-        if (stack.frames == 0) {
-                err = arduino_set_state_(arduino, STATE_MEASURING);
+        if (stack.frames == 0)
                 goto clean_exit;
-        }
 
         err = arduino_get_checksum_(arduino, &stack.checksum);
         if (err != 0)
@@ -760,9 +758,15 @@ datapoint_t* arduino_read_data(arduino_t* arduino, int* num_points)
  clean_exit:
  error_recovery:
 
-        if (err == 0) {
+        /* On success, the Arduino stays suspended and keeps its
+           stack until the caller has stored the data safely and
+           calls arduino_reset_stack(), or arduino_resume() if
+           storing failed. The Arduino resumes by itself after a
+           few minutes if neither happens. */
+        if ((err == 0) && (datapoints != NULL)) {
                 log_info("Arduino: Download successful"); 
-                err = arduino_set_state_(arduino, STATE_RESETSTACK);
+        } else if (err == 0) {
+                err = arduino_set_state_(arduino, STATE_MEASURING);
         } else {
                 log_info("Arduino: Download failed"); 
                 err = arduino_set_state_(arduino, STATE_MEASURING);
@@ -792,27 +796,27 @@ datapoint_t* arduino_measure(arduino_t* arduino, int* num_points)
                 goto error_recovery;
 
         if (sensors & SENSOR_TRH) {
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_T);
                 datastreams[num_streams++] = DATASTREAM_T;
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_RH);
                 datastreams[num_streams++] = DATASTREAM_RH;
         }
         if (sensors & SENSOR_TRHX) {
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_TX);
                 datastreams[num_streams++] = DATASTREAM_TX;
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_RHX);
                 datastreams[num_streams++] = DATASTREAM_RHX;
         }
         if (sensors & SENSOR_LUM) {
-                factors[num_streams] = 1.0f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_LUM);
                 datastreams[num_streams++] = DATASTREAM_LUM;
         }
         if (sensors & SENSOR_USBBAT) {
-                factors[num_streams] = 0.01f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_USBBAT);
                 datastreams[num_streams++] = DATASTREAM_USBBAT;
         }
         if (sensors & SENSOR_SOIL) {
-                factors[num_streams] = 1.0f;
+                factors[num_streams] = arduino_datastream_factor(DATASTREAM_SOIL);
                 datastreams[num_streams++] = DATASTREAM_SOIL;
         }
 
@@ -1068,3 +1072,16 @@ void arduino_reset_stack(arduino_t* arduino)
         //return arduino_disconnect(arduino);
 }
 
+void arduino_resume(arduino_t* arduino)
+{
+        int err;
+
+        err = arduino_connect(arduino);
+        if (err != 0) 
+                return;
+
+        err = arduino_set_state_(arduino, STATE_MEASURING);
+        if (err != 0)
+                arduino_disconnect(arduino);
+}
+
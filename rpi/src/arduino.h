@@ -24,6 +24,7 @@
 #define _ARDUINO_API_H_
 
 #include <time.h>
+#include "datastream.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,22 +43,6 @@ extern "C" {
 #define SENSOR_USBBAT      (1 << 3)
 #define SENSOR_SOIL        (1 << 4)
 
-
-#define DATASTREAM_T       1
-#define DATASTREAM_RH      2
-#define DATASTREAM_TX      3
-#define DATASTREAM_RHX     4
-#define DATASTREAM_LUM     5
-#define DATASTREAM_SOIL    6
-#define DATASTREAM_USBBAT  7
-#define DATASTREAM_COUNT   8
-
-typedef struct _datapoint_t {
-        int datastream;
-        time_t timestamp;
-        float value;
-} datapoint_t;
-
 typedef struct _arduino_t arduino_t;
 
 arduino_t* new_arduino(int bus, int address);
@@ -95,12 +80,18 @@ int arduino_get_poweroff(arduino_t* arduino, int* minutes);
 /*                                         time_t timestamp, */
 /*                                         float value); */
 
+/* After a successful download, the Arduino is left suspended with
+   its data. Call arduino_reset_stack() once the datapoints are
+   stored durably, or arduino_resume() to keep them on the Arduino
+   for the next download. */
 datapoint_t* arduino_read_data(arduino_t* arduino, int* num_points);
 
 datapoint_t* arduino_measure(arduino_t* arduino, int* num_points);
 
 void arduino_reset_stack(arduino_t* arduino);
 
+void arduino_resume(arduino_t* arduino);
+
 #ifdef __cplusplus
 }
 #endif
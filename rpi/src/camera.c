@@ -61,6 +61,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <malloc.h>
+#include <setjmp.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -281,6 +282,116 @@ unsigned char* camera_getimagebuffer(camera_t* camera)
         return camera->jpeg_buffer;
 }
 
+/* By default, libjpeg calls exit() on an error, such as a corrupt
+   file. The thumbnails are made by the upload worker, so the error
+   jumps back to camera_thumbnail() instead. */
+typedef struct _camera_jpeg_error_t {
+        struct jpeg_error_mgr mgr;
+        jmp_buf jump;
+} camera_jpeg_error_t;
+
+static void camera_jpeg_output_message(j_common_ptr info)
+{
+        char msg[JMSG_LENGTH_MAX];
+        (*info->err->format_message)(info, msg);
+        log_warn("Camera: %s", msg);
+}
+
+static void camera_jpeg_error_exit(j_common_ptr info)
+{
+        camera_jpeg_error_t* err = (camera_jpeg_error_t*) info->err;
+        char msg[JMSG_LENGTH_MAX];
+        (*info->err->format_message)(info, msg);
+        log_err("Camera: %s", msg);
+        longjmp(err->jump, 1);
+}
+
+int camera_thumbnail(const char* src, const char* dst, int scale, int quality)
+{
+        struct jpeg_decompress_struct dinfo;
+        struct jpeg_compress_struct cinfo;
+        camera_jpeg_error_t jerr;
+        unsigned char* volatile row = NULL;
+        JSAMPROW row_pointer[1];
+
+        FILE* in = fopen(src, "rb");
+        if (in == NULL) {
+                log_err("Camera: Failed to open '%s'", src);
+                return -1;
+        }
+        FILE* out = fopen(dst, "wb");
+        if (out == NULL) {
+                log_err("Camera: Failed to create '%s'", dst);
+                fclose(in);
+                return -1;
+        }
+
+        dinfo.err = jpeg_std_error(&jerr.mgr);
+        cinfo.err = &jerr.mgr;
+        jerr.mgr.error_exit = camera_jpeg_error_exit;
+        jerr.mgr.output_message = camera_jpeg_output_message;
+        jpeg_create_decompress(&dinfo);
+        jpeg_create_compress(&cinfo);
+
+        if (setjmp(jerr.jump)) {
+                log_err("Camera: Failed to make a thumbnail of '%s'", src);
+                jpeg_destroy_compress(&cinfo);
+                jpeg_destroy_decompress(&dinfo);
+                free(row);
+                fclose(in);
+                fclose(out);
+                unlink(dst);
+                return -1;
+        }
+
+        jpeg_stdio_src(&dinfo, in);
+        jpeg_read_header(&dinfo, TRUE);
+
+        /* Let the decoder do the downscaling: libjpeg supports 1/2,
+           1/4, and 1/8 in the IDCT, which is much cheaper than
+           decoding the full image and resampling it. */
+        dinfo.scale_num = 1;
+        dinfo.scale_denom = scale;
+        dinfo.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&dinfo);
+
+        jpeg_stdio_dest(&cinfo, out);
+        cinfo.image_width = dinfo.output_width;
+        cinfo.image_height = dinfo.output_height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        jpeg_start_compress(&cinfo, TRUE);
+
+        row = (unsigned char*) malloc(dinfo.output_width * 3);
+        if (row == NULL) {
+                log_err("Camera: out of memory");
+                jpeg_destroy_compress(&cinfo);
+                jpeg_destroy_decompress(&dinfo);
+                fclose(in);
+                fclose(out);
+                unlink(dst);
+                return -1;
+        }
+        row_pointer[0] = (JSAMPROW) row;
+
+        while (dinfo.output_scanline < dinfo.output_height) {
+                jpeg_read_scanlines(&dinfo, row_pointer, 1);
+                jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        }
+
+        jpeg_finish_compress(&cinfo);
+        jpeg_finish_decompress(&dinfo);
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        free(row);
+        fclose(in);
+        fclose(out);
+
+        return 0;
+}
+
 /**
    Convert from YUV422 format to RGB888. Formulae are described on http://en.wikipedia.org/wiki/YUV
 
@@ -48,6 +48,10 @@ int camera_capture(camera_t* camera);
 int camera_getimagesize(camera_t* camera);
 unsigned char* camera_getimagebuffer(camera_t* camera);
 
+/* Writes a reduced copy of the JPEG file src to dst. The scale is
+   the denominator of the reduction (2, 4, or 8). */
+int camera_thumbnail(const char* src, const char* dst, int scale, int quality);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,7 @@
 
 */
 #define _BSD_SOURCE
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -31,10 +32,81 @@
 
 static char* _file = NULL;
 
+/* The configuration is edited as text. Once it is parsed, a snapshot
+   is written next to it, in the binary JSON format, together with
+   the size and the time of the text it was made from. As long as the
+   text doesn't change, the snapshot is loaded instead, which costs
+   little more than mapping the file. */
+/* Returns -1 if the name doesn't fit: a truncated name could be
+   another file. */
+static int config_get_snapshot_file(const char* file, char* filename, int len)
+{
+        int n = snprintf(filename, len, "%s.bin", file);
+        return ((n < 0) || (n >= len))? -1 : 0;
+}
+
+static json_object_t config_load_snapshot(const char* file, struct stat* st)
+{
+        int err;
+        char buffer[512];
+        char filename[512];
+
+        if ((config_get_snapshot_file(file, filename, 512) != 0)
+            || (access(filename, F_OK) != 0))
+                return json_null();
+
+        json_object_t snapshot = json_load(filename, &err, buffer, 512);
+        if (err != 0) {
+                log_debug("%s", buffer);
+                return json_null();
+        }
+
+        json_object_t config = json_object_get(snapshot, "config");
+        if (!json_isobject(config)
+            || (json_object_getnum(snapshot, "size") != (double) st->st_size)
+            || (json_object_getnum(snapshot, "mtime") != (double) st->st_mtime)
+            || (json_object_getnum(snapshot, "mtime-ns") != (double) st->st_mtim.tv_nsec)) {
+                json_unref(snapshot);
+                return json_null();
+        }
+
+        json_ref(config);
+        json_unref(snapshot);
+        return config;
+}
+
+static void config_save_snapshot(const char* file, struct stat* st, json_object_t config)
+{
+        char filename[512];
+        char tmpfile[512];
+
+        if ((config_get_snapshot_file(file, filename, 512) != 0)
+            || (snprintf(tmpfile, 512, "%s.tmp", filename) >= 512)) {
+                log_debug("Config: The name of the snapshot of '%s' is too long", file);
+                return;
+        }
+
+        json_object_t snapshot = json_object_create();
+        json_object_setnum(snapshot, "size", (double) st->st_size);
+        json_object_setnum(snapshot, "mtime", (double) st->st_mtime);
+        json_object_setnum(snapshot, "mtime-ns", (double) st->st_mtim.tv_nsec);
+        json_object_set(snapshot, "config", config);
+
+        /* A process that has the old snapshot mapped keeps reading
+           it after the rename. */
+        if ((json_tofile(snapshot, k_json_binary, tmpfile) != 0)
+            || (rename(tmpfile, filename) != 0)) {
+                log_debug("Config: Failed to write the snapshot '%s'", filename);
+                unlink(tmpfile);
+        }
+        json_unref(snapshot);
+}
+
 json_object_t config_load(const char* file)
 {
         int err;
         char buffer[512];
+        struct stat st;
 
         // For backward compatibility.
         {
@@ -43,18 +115,33 @@ json_object_t config_load(const char* file)
                 _file = strdup(file);
         }
 
+        int have_stat = (stat(file, &st) == 0);
+        if (have_stat) {
+                json_object_t config = config_load_snapshot(file, &st);
+                if (!json_isnull(config))
+                        return config;
+        }
+
         json_object_t config = json_load(file, &err, buffer, 512);
         if (err != 0) {
                 log_err("%s", buffer); 
                 return json_null();
         } 
+
+        if (have_stat)
+                config_save_snapshot(file, &st, config);
+
         return config;
 }
 
 // For backward compatibility.
 static void config_save(json_object_t config)
 {
+        struct stat st;
+
         json_tofile(config, k_json_pretty, _file);
+        if (stat(_file, &st) == 0)
+                config_save_snapshot(_file, &st, config);
 }
 
 int config_get_sensors(json_object_t config, 
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -32,6 +33,7 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include "log_message.h"
+#include "live.h"
 
 #define VERSION_MAJOR 1
 #define VERSION_MINOR 0
@@ -39,6 +41,7 @@
 
 static char* pidFile = "/var/run/p2pfoodlab-daemon.pid";
 static char* logFile = "/var/log/p2pfoodlab.log";
+static char* liveFile = "/var/p2pfoodlab/live.dat";
 static int port = 10080;
 static int nodaemon = 0;
 static int serverSocket = -1;
@@ -416,6 +419,104 @@ typedef struct _response_t {
         int len;
 } response_t;
 
+/* Decodes the %XX escapes of a URL argument, in place. */
+static void urlDecode(char* s)
+{
+        char* d = s;
+        while (*s) {
+                if ((s[0] == '%') && isxdigit((unsigned char) s[1]) 
+                    && isxdigit((unsigned char) s[2])) {
+                        char hex[3] = { s[1], s[2], 0 };
+                        *d++ = (char) strtol(hex, NULL, 16);
+                        s += 3;
+                } else {
+                        *d++ = *s++;
+                }
+        }
+        *d = 0;
+}
+
+/* The arguments end up on a shell command line, so only the
+   characters needed for names, numbers and dates are accepted. An
+   argument that starts with '-' would be taken for an option of
+   sensorbox. */
+static int isSafeArgument(const char* s)
+{
+        if ((s == NULL) || (*s == 0) || (*s == '-'))
+                return 0;
+        for ( ; *s; s++)
+                if (!isalnum((unsigned char) *s) && (strchr("-_:.", *s) == NULL))
+                        return 0;
+        return 1;
+}
+
+/* /query?datastream=t&from=2015-03-01&to=2015-03-31&function=mean&bucket=86400 */
+int buildQueryCommand(request_t* req, char* cmdline, int len)
+{
+        static const char* names[] = { "datastream", "from", "to", "function", "bucket" };
+        const char* values[] = { NULL, NULL, NULL, "raw", "0" };
+
+        for (int i = 0; i < req->num_args; i++) {
+                if (req->values[i] == NULL)
+                        continue;
+                urlDecode(req->values[i]);
+                for (int k = 0; k < 5; k++)
+                        if (strcmp(req->names[i], names[k]) == 0)
+                                values[k] = req->values[i];
+        }
+
+        for (int k = 0; k < 5; k++) {
+                if (!isSafeArgument(values[k])) {
+                        log_warn("Daemon: Invalid query argument: %s\n", names[k]);
+                        return -1;
+                }
+        }
+
+        snprintf(cmdline, len, 
+                 "/var/p2pfoodlab/bin/sensorbox -l /var/p2pfoodlab/log.txt "
+                 "query %s %s %s %s %s", 
+                 values[0], values[1], values[2], values[3], values[4]);
+        cmdline[len-1] = 0;
+        return 0;
+}
+
+/* /live returns the latest readings as JSON. The file is read
+   directly, so the request doesn't wait for sensorbox. */
+static live_t* live = NULL;
+static live_snapshot_t liveSnapshot;
+static char liveBuffer[32768];
+
+static int serveLive(int client)
+{
+        int len = -1;
+
+        for (int attempt = 0; (attempt < 2) && (len < 0); attempt++) {
+                /* The mapping is kept between requests. It is
+                   renewed if the file became unreadable, in case it
+                   was replaced. */
+                if (live == NULL)
+                        live = new_live(liveFile, 0);
+                if (live == NULL)
+                        break;
+                if (live_read(live, &liveSnapshot) == 0) {
+                        len = live_format_json(&liveSnapshot, liveBuffer, sizeof(liveBuffer));
+                } else {
+                        delete_live(live);
+                        live = NULL;
+                }
+        }
+
+        if (len < 0) {
+                clientPrint(client, "HTTP/1.1 503\r\n");
+                return -1;
+        }
+
+        clientPrintf(client, "HTTP/1.1 200\r\nContent-Type: application/json\r\n"
+                     "Content-Length: %d\r\n\r\n", len);
+        clientWrite(client, liveBuffer, len);
+        return 0;
+}
+
 int parseRequest(int client, request_t* req, response_t* resp)
 {
         enum {
@@ -703,6 +804,7 @@ int main(int argc, char **argv)
         request_t req;
         response_t resp;
         output_t output;
+        char queryline[512];
 
         memset(&output, 0, sizeof(output_t));
                 
@@ -729,8 +831,24 @@ int main(int argc, char **argv)
                                 printf("arg[%d]: %s = %s\n", i, req.names[i], req.values[i]);
                 }
 
+                if (strcmp(req.path, "/live") == 0) {
+                        serveLive(client);
+                        closeClient(client);
+                        if (req.path) free(req.path);
+                        continue;
+                }
+
                 const char* cmdline = findCommand(req.path);
 
+                if ((cmdline == NULL) && (strcmp(req.path, "/query") == 0)) {
+                        if (buildQueryCommand(&req, queryline, sizeof(queryline)) != 0) {
+                                clientPrint(client, "HTTP/1.1 400\r\n");
+                                closeClient(client);
+                                continue;
+                        }
+                        cmdline = queryline;
+                }
+
                 if (cmdline == NULL) {
                         log_warn("Daemon: Invalid path: '%s'\n", req.path);
                         clientPrint(client, "HTTP/1.1 404\r\n");
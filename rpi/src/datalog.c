@@ -0,0 +1,872 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <zlib.h>
+#include "log_message.h"
+#include "datalog.h"
+#include "timestamp.h"
+
+#define DATALOG_VERSION 2
+#define DATALOG_MAX_STREAMS DATASTREAM_COUNT
+
+/* Version 1 segments have no checksums. They are still read so that
+   the data stored by an older version isn't lost. */
+#define DATALOG_HEADER_SIZE(__v, __n) ((((__v) >= 2)? 12 : 8) + 8 * (__n))
+#define DATALOG_RECORD_SIZE(__v, __n) ((((__v) >= 2)? 8 : 4) + 2 * (__n))
+#define DATALOG_MAX_HEADER_SIZE DATALOG_HEADER_SIZE(DATALOG_VERSION, DATALOG_MAX_STREAMS)
+
+typedef struct _datalog_header_t {
+        int version;
+        int num_streams;
+        int datastream[DATALOG_MAX_STREAMS];
+        int32_t osd_id[DATALOG_MAX_STREAMS];
+        float scale[DATALOG_MAX_STREAMS];
+} datalog_header_t;
+
+struct _datalog_t {
+        char* dir;
+        datalog_stats_t stats;
+        /* Set by datalog_recover(). Until then, the log is only
+           read. */
+        int writable;
+};
+
+datalog_t* new_datalog(const char* dir)
+{
+        datalog_t* log = (datalog_t*) malloc(sizeof(datalog_t));
+        if (log == NULL) {
+                log_err("Datalog: out of memory");
+                return NULL;
+        }
+        memset(log, 0, sizeof(datalog_t));
+        log->dir = strdup(dir);
+
+        if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+                log_err("Datalog: Failed to create the directory '%s'", dir);
+                delete_datalog(log);
+                return NULL;
+        }
+
+        return log;
+}
+
+void delete_datalog(datalog_t* log)
+{
+        if (log->dir)
+                free(log->dir);
+        free(log);
+}
+
+static int datalog_is_segment(const char* name)
+{
+        int len = strlen(name);
+        return (len > 4) && (strcmp(name + len - 4, ".seg") == 0);
+}
+
+static int datalog_compare_names(const void* a, const void* b)
+{
+        return strcmp(*(const char**) a, *(const char**) b);
+}
+
+/* Returns the segment names in chronological order. The caller
+   must free the list and the names. */
+static char** datalog_list_segments(datalog_t* log, int* count)
+{
+        struct dirent *entry;
+        char** names = NULL;
+        int len = 0;
+
+        *count = 0;
+
+        DIR* dir = opendir(log->dir);
+        if (dir == NULL) {
+                log_err("Datalog: Failed to open the directory '%s'", log->dir);
+                return NULL;
+        }
+
+        while ((entry = readdir(dir)) != NULL) {
+                if (!datalog_is_segment(entry->d_name))
+                        continue;
+                if (*count >= len) {
+                        len = (len == 0)? 8 : 2 * len;
+                        char** p = (char**) realloc(names, len * sizeof(char*));
+                        if (p == NULL) {
+                                log_err("Datalog: out of memory");
+                                break;
+                        }
+                        names = p;
+                }
+                names[(*count)++] = strdup(entry->d_name);
+        }
+        closedir(dir);
+
+        if (*count > 0)
+                qsort(names, *count, sizeof(char*), datalog_compare_names);
+
+        return names;
+}
+
+static void datalog_free_list(char** names, int count)
+{
+        for (int i = 0; i < count; i++)
+                free(names[i]);
+        if (names)
+                free(names);
+}
+
+static void datalog_encode_header(datalog_header_t* h, unsigned char* buf)
+{
+        memcpy(buf, "SBDL", 4);
+        buf[4] = DATALOG_VERSION;
+        buf[5] = h->num_streams;
+        buf[6] = 0;
+        buf[7] = 0;
+        for (int i = 0; i < h->num_streams; i++) {
+                unsigned char* p = buf + 8 + 8 * i;
+                memcpy(p, &h->osd_id[i], 4);
+                memcpy(p + 4, &h->scale[i], 4);
+        }
+        int len = 8 + 8 * h->num_streams;
+        uint32_t crc = crc32(0, buf, len);
+        memcpy(buf + len, &crc, 4);
+}
+
+static int datalog_decode_header(datalog_header_t* h, const unsigned char* buf, int len)
+{
+        if ((len < 8)
+            || (memcmp(buf, "SBDL", 4) != 0)
+            || (buf[4] < 1) || (buf[4] > DATALOG_VERSION)
+            || (buf[5] > DATALOG_MAX_STREAMS)
+            || (len < DATALOG_HEADER_SIZE(buf[4], buf[5])))
+                return -1;
+
+        if (buf[4] >= 2) {
+                uint32_t crc;
+                memcpy(&crc, buf + 8 + 8 * buf[5], 4);
+                if (crc != crc32(0, buf, 8 + 8 * buf[5]))
+                        return -1;
+        }
+
+        h->version = buf[4];
+        h->num_streams = buf[5];
+        for (int i = 0; i < h->num_streams; i++) {
+                const unsigned char* p = buf + 8 + 8 * i;
+                memcpy(&h->osd_id[i], p, 4);
+                memcpy(&h->scale[i], p + 4, 4);
+        }
+        return 0;
+}
+
+static int datalog_same_header(datalog_header_t* a, datalog_header_t* b)
+{
+        if ((a->version != b->version) || (a->num_streams != b->num_streams))
+                return 0;
+        for (int i = 0; i < a->num_streams; i++)
+                if ((a->osd_id[i] != b->osd_id[i]) || (a->scale[i] != b->scale[i]))
+                        return 0;
+        return 1;
+}
+
+static int datalog_read_header(const char* path, datalog_header_t* h)
+{
+        unsigned char buf[DATALOG_MAX_HEADER_SIZE];
+
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL)
+                return -1;
+        int n = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+
+        return datalog_decode_header(h, buf, n);
+}
+
+static void datalog_sync_dir(datalog_t* log)
+{
+        int fd = open(log->dir, O_RDONLY);
+        if (fd == -1)
+                return;
+        if (fsync(fd) == 0)
+                log->stats.fsyncs++;
+        close(fd);
+}
+
+/* Returns the file descriptor of the lock of the log, or -1. The
+   lock is held while the segments are appended to and while they are
+   exported and removed, so that a record that arrives from another
+   process during an export either makes it into the export or stays
+   in the log. */
+static int datalog_lock(datalog_t* log)
+{
+        char path[512];
+
+        if (!log->writable) {
+                log_err("Datalog: '%s' is opened read-only", log->dir);
+                return -1;
+        }
+
+        snprintf(path, 512, "%s/lock", log->dir);
+        path[511] = 0;
+
+        int fd = open(path, O_CREAT | O_RDWR, 0666);
+        if (fd == -1) {
+                log_err("Datalog: Failed to open %s", path);
+                return -1;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+                log_err("Datalog: Failed to lock %s", path);
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+static void datalog_unlock(int fd)
+{
+        flock(fd, LOCK_UN);
+        close(fd);
+}
+
+/* Opens the segment that the frames with the given header should be
+   appended to: the last segment if its header matches, a new one
+   otherwise. */
+static int datalog_open_segment(datalog_t* log, datalog_header_t* h, time_t t)
+{
+        char path[512];
+        datalog_header_t last;
+        int count;
+
+        char** names = datalog_list_segments(log, &count);
+        if (count > 0) {
+                snprintf(path, 512, "%s/%s", log->dir, names[count-1]);
+                path[511] = 0;
+                if ((datalog_read_header(path, &last) == 0)
+                    && datalog_same_header(h, &last)) {
+                        datalog_free_list(names, count);
+                        return open(path, O_WRONLY | O_APPEND);
+                }
+        }
+        datalog_free_list(names, count);
+
+        for (long i = 0; i < 100; i++) {
+                snprintf(path, 512, "%s/%010lu-%02ld.seg", log->dir, (unsigned long) t, i);
+                path[511] = 0;
+
+                int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+                if ((fd == -1) && (errno == EEXIST))
+                        continue;
+                if (fd == -1)
+                        break;
+
+                unsigned char buf[DATALOG_MAX_HEADER_SIZE];
+                int len = DATALOG_HEADER_SIZE(h->version, h->num_streams);
+                datalog_encode_header(h, buf);
+                log->stats.writes++;
+                if (write(fd, buf, len) != len) {
+                        log_err("Datalog: Failed to write the segment header");
+                        close(fd);
+                        unlink(path);
+                        return -1;
+                }
+                log->stats.bytes_written += len;
+
+                /* Make the new directory entry durable. The header
+                   itself is synced with the first records. */
+                datalog_sync_dir(log);
+                return fd;
+        }
+
+        log_err("Datalog: Failed to create a new segment in '%s'", log->dir);
+        return -1;
+}
+
+/* Stores the checksum of the record in its last four bytes. */
+static void datalog_seal_record(unsigned char* rec, int recsize)
+{
+        uint32_t crc = crc32(0, rec, recsize - 4);
+        memcpy(rec + recsize - 4, &crc, 4);
+}
+
+static int datalog_check_record(datalog_header_t* h, const unsigned char* rec)
+{
+        if (h->version < 2)
+                return 0;
+        int recsize = DATALOG_RECORD_SIZE(h->version, h->num_streams);
+        uint32_t crc;
+        memcpy(&crc, rec + recsize - 4, 4);
+        return (crc == crc32(0, rec, recsize - 4))? 0 : -1;
+}
+
+/* Appends the frames points[start..end[ that all share the
+   datastreams of header h. This is the group commit: all the records
+   go out with one write() and are made durable with one
+   fdatasync(). */
+static int datalog_write_frames(datalog_t* log, datalog_header_t* h,
+                                datapoint_t* points, int start, int end,
+                                const int* osd_ids)
+{
+        int recsize = DATALOG_RECORD_SIZE(h->version, h->num_streams);
+        int num_frames = 0;
+
+        for (int i = start; i < end; i++)
+                if ((i == start) || (points[i].timestamp != points[i-1].timestamp))
+                        num_frames++;
+
+        unsigned char* buf = (unsigned char*) malloc(num_frames * recsize);
+        if (buf == NULL) {
+                log_err("Datalog: out of memory");
+                return -1;
+        }
+
+        unsigned char* rec = buf - recsize;
+        for (int i = start; i < end; i++) {
+                if ((i == start) || (points[i].timestamp != points[i-1].timestamp)) {
+                        if (i > start)
+                                datalog_seal_record(rec, recsize);
+                        rec += recsize;
+                        uint32_t t = (uint32_t) points[i].timestamp;
+                        memcpy(rec, &t, 4);
+                        memset(rec + 4, 0, recsize - 4);
+                }
+                if (osd_ids[points[i].datastream] == -1)
+                        continue;
+                for (int j = 0; j < h->num_streams; j++) {
+                        if (h->datastream[j] == points[i].datastream) {
+                                int16_t v = (int16_t) lrintf(points[i].value / h->scale[j]);
+                                memcpy(rec + 4 + 2 * j, &v, 2);
+                                break;
+                        }
+                }
+        }
+
+        datalog_seal_record(rec, recsize);
+
+        int fd = datalog_open_segment(log, h, points[start].timestamp);
+        if (fd == -1) {
+                free(buf);
+                return -1;
+        }
+
+        int len = num_frames * recsize;
+        int ret = 0;
+        log->stats.writes++;
+        if (write(fd, buf, len) != len) {
+                log_err("Datalog: Failed to append %d records", num_frames);
+                ret = -1;
+        } else if (fdatasync(fd) != 0) {
+                log_err("Datalog: Failed to sync %d records", num_frames);
+                ret = -1;
+        } else {
+                log->stats.bytes_written += len;
+                log->stats.fsyncs++;
+                log->stats.commits++;
+                log->stats.records += num_frames;
+        }
+        if (close(fd) != 0)
+                ret = -1;
+        free(buf);
+
+        return ret;
+}
+
+static void datalog_frame_header(datapoint_t* points, int start, int end,
+                                 const int* osd_ids, datalog_header_t* h)
+{
+        h->version = DATALOG_VERSION;
+        h->num_streams = 0;
+        for (int i = start; i < end; i++) {
+                int ds = points[i].datastream;
+                if (osd_ids[ds] == -1)
+                        continue;
+                h->datastream[h->num_streams] = ds;
+                h->osd_id[h->num_streams] = osd_ids[ds];
+                h->scale[h->num_streams] = arduino_datastream_factor(ds);
+                h->num_streams++;
+        }
+}
+
+int datalog_append(datalog_t* log, datapoint_t* points,
+                   int num_points, const int* osd_ids)
+{
+        datalog_header_t h, cur;
+        int start = 0;
+        int ret = 0;
+
+        int lock = datalog_lock(log);
+        if (lock == -1)
+                return -1;
+
+        /* Runs of frames with the same datastreams go into the same
+           segment, with a single write. */
+        int i = 0;
+        while (i < num_points) {
+                int end = i + 1;
+                while ((end < num_points)
+                       && (points[end].timestamp == points[i].timestamp))
+                        end++;
+
+                datalog_frame_header(points, i, end, osd_ids, &h);
+
+                if (i == 0) {
+                        cur = h;
+                } else if (!datalog_same_header(&h, &cur)) {
+                        if ((cur.num_streams > 0)
+                            && (datalog_write_frames(log, &cur, points, start, i, osd_ids) != 0))
+                                ret = -1;
+                        start = i;
+                        cur = h;
+                }
+                i = end;
+        }
+
+        if ((num_points > 0) && (cur.num_streams > 0)
+            && (datalog_write_frames(log, &cur, points, start, num_points, osd_ids) != 0))
+                ret = -1;
+
+        datalog_unlock(lock);
+        return ret;
+}
+
+long datalog_size(datalog_t* log)
+{
+        char path[512];
+        struct stat buf;
+        long size = 0;
+        int count;
+
+        char** names = datalog_list_segments(log, &count);
+        for (int i = 0; i < count; i++) {
+                snprintf(path, 512, "%s/%s", log->dir, names[i]);
+                path[511] = 0;
+                if (stat(path, &buf) == 0)
+                        size += buf.st_size;
+        }
+        datalog_free_list(names, count);
+
+        return size;
+}
+
+/* Calls fun for every datapoint in the segment, in the order they
+   were stored. */
+int datalog_foreach_file(const char* path, datalog_callback_t fun, void* data)
+{
+        datalog_header_t h;
+        struct stat st;
+        int ret = 0;
+
+        if (stat(path, &st) != 0)
+                return -1;
+
+        unsigned char* buf = (unsigned char*) malloc(st.st_size > 0? st.st_size : 1);
+        if (buf == NULL) {
+                log_err("Datalog: out of memory");
+                return -1;
+        }
+
+        FILE* in = fopen(path, "r");
+        if ((in == NULL)
+            || ((st.st_size > 0) && (fread(buf, st.st_size, 1, in) != 1))) {
+                log_err("Datalog: Failed to read '%s'", path);
+                if (in) fclose(in);
+                free(buf);
+                return -1;
+        }
+        fclose(in);
+
+        if (datalog_decode_header(&h, buf, st.st_size) != 0) {
+                log_err("Datalog: Invalid segment '%s'", path);
+                free(buf);
+                return -1;
+        }
+
+        int hdrsize = DATALOG_HEADER_SIZE(h.version, h.num_streams);
+        int recsize = DATALOG_RECORD_SIZE(h.version, h.num_streams);
+        int num_records = (st.st_size - hdrsize) / recsize;
+
+        for (int k = 0; (k < num_records) && (ret == 0); k++) {
+                unsigned char* rec = buf + hdrsize + k * recsize;
+                uint32_t t;
+
+                if (datalog_check_record(&h, rec) != 0) {
+                        log_warn("Datalog: Corrupt record in '%s', skipping the rest", path);
+                        break;
+                }
+                memcpy(&t, rec, 4);
+
+                for (int j = 0; (j < h.num_streams) && (ret == 0); j++) {
+                        int16_t v;
+                        memcpy(&v, rec + 4 + 2 * j, 2);
+                        ret = fun(data, h.osd_id[j], (time_t) t, h.scale[j] * (float) v);
+                }
+        }
+
+        free(buf);
+        return ret;
+}
+
+int datalog_foreach(datalog_t* log, datalog_callback_t fun, void* data)
+{
+        char path[512];
+        int count;
+        int ret = 0;
+
+        char** names = datalog_list_segments(log, &count);
+        for (int i = 0; (i < count) && (ret == 0); i++) {
+                snprintf(path, 512, "%s/%s", log->dir, names[i]);
+                path[511] = 0;
+                ret = datalog_foreach_file(path, fun, data);
+        }
+        datalog_free_list(names, count);
+
+        return ret;
+}
+
+typedef struct _datalog_csv_t {
+        FILE* fp;
+        time_t timestamp;
+        timestamp_cache_t cache;
+        char s[TIMESTAMP_MAXLEN];
+} datalog_csv_t;
+
+static int datalog_print_csv(void* data, int osd_id, time_t timestamp, float value)
+{
+        datalog_csv_t* csv = (datalog_csv_t*) data;
+
+        /* All the datastreams of a record share the timestamp. */
+        if ((timestamp != csv->timestamp) || (csv->s[0] == 0)) {
+                timestamp_format(&csv->cache, timestamp, TIMESTAMP_ISO, csv->s);
+                csv->timestamp = timestamp;
+        }
+
+        fprintf(csv->fp, "%d,%s,%f\n", osd_id, csv->s, value);
+        return 0;
+}
+
+int datalog_export_csv(datalog_t* log, FILE* fp)
+{
+        datalog_csv_t csv;
+        memset(&csv, 0, sizeof(datalog_csv_t));
+        csv.fp = fp;
+        return datalog_foreach(log, datalog_print_csv, &csv);
+}
+
+/* Removes the segments in names[0..count[. */
+static int datalog_remove_segments(datalog_t* log, char** names, int count)
+{
+        char path[512];
+        int ret = 0;
+
+        for (int i = 0; i < count; i++) {
+                snprintf(path, 512, "%s/%s", log->dir, names[i]);
+                path[511] = 0;
+                if (unlink(path) != 0) {
+                        log_err("Datalog: Failed to remove '%s'", path);
+                        ret = -1;
+                }
+        }
+        return ret;
+}
+
+int datalog_drain_csv(datalog_t* log, FILE* fp)
+{
+        char path[512];
+        datalog_csv_t csv;
+        int count;
+        int ret = 0;
+
+        int lock = datalog_lock(log);
+        if (lock == -1)
+                return -1;
+
+        memset(&csv, 0, sizeof(datalog_csv_t));
+        csv.fp = fp;
+
+        /* Only the segments listed here are exported and removed. */
+        char** names = datalog_list_segments(log, &count);
+        for (int i = 0; (i < count) && (ret == 0); i++) {
+                snprintf(path, 512, "%s/%s", log->dir, names[i]);
+                path[511] = 0;
+                ret = datalog_foreach_file(path, datalog_print_csv, &csv);
+        }
+        if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0))
+                ret = -1;
+        if (ret == 0)
+                ret = datalog_remove_segments(log, names, count);
+        datalog_free_list(names, count);
+
+        datalog_unlock(lock);
+        return ret;
+}
+
+int datalog_clear(datalog_t* log)
+{
+        int count;
+
+        int lock = datalog_lock(log);
+        if (lock == -1)
+                return -1;
+
+        char** names = datalog_list_segments(log, &count);
+        int ret = datalog_remove_segments(log, names, count);
+        datalog_free_list(names, count);
+
+        datalog_unlock(lock);
+        return ret;
+}
+
+static int datalog_read_file(const char* path, unsigned char** data, long* size)
+{
+        struct stat st;
+
+        if (stat(path, &st) != 0)
+                return -1;
+        *data = (unsigned char*) malloc(st.st_size > 0? st.st_size : 1);
+        if (*data == NULL) {
+                log_err("Datalog: out of memory");
+                return -1;
+        }
+        int fd = open(path, O_RDONLY);
+        if ((fd == -1) || (read(fd, *data, st.st_size) != st.st_size)) {
+                log_err("Datalog: Failed to read '%s'", path);
+                if (fd != -1)
+                        close(fd);
+                free(*data);
+                return -1;
+        }
+        close(fd);
+        *size = st.st_size;
+        return 0;
+}
+
+/* Returns 1 if the segment starts with the data: it is the copy of a
+   segment that was moved before the original could be removed. New
+   records may have been appended to it since. */
+static int datalog_was_moved(const char* path, unsigned char* data, long size)
+{
+        unsigned char* copy;
+        long len;
+
+        if (datalog_read_file(path, &copy, &len) != 0)
+                return 0;
+        int same = (len >= size) && (memcmp(copy, data, size) == 0);
+        free(copy);
+        return same;
+}
+
+/* Each segment is written under a temporary name and renamed into
+   place, so that a move that is killed half-way never leaves a
+   partial segment behind. A segment that is already in place, left
+   by a move that was killed before it removed the originals, only
+   has its original removed. */
+int datalog_move(datalog_t* from, datalog_t* to)
+{
+        char path[512];
+        char tmp[512];
+        unsigned char* data;
+        long size;
+        int count;
+        int moved = 0;
+        int ret = 0;
+
+        if (!from->writable) {
+                log_err("Datalog: '%s' is opened read-only", from->dir);
+                return -1;
+        }
+
+        int lock = datalog_lock(to);
+        if (lock == -1)
+                return -1;
+
+        char** names = datalog_list_segments(from, &count);
+
+        for (int i = 0; i < count; i++) {
+                snprintf(path, 512, "%s/%s", from->dir, names[i]);
+                path[511] = 0;
+                if (datalog_read_file(path, &data, &size) != 0) {
+                        ret = -1;
+                        break;
+                }
+
+                /* Keep the name, so that the segment sorts in the
+                   same place. */
+                snprintf(path, 512, "%s/%s", to->dir, names[i]);
+                path[511] = 0;
+                if (access(path, F_OK) == 0) {
+                        int moved_before = datalog_was_moved(path, data, size);
+                        free(data);
+                        if (!moved_before) {
+                                log_err("Datalog: '%s' already exists", path);
+                                ret = -1;
+                                break;
+                        }
+                        moved++;
+                        continue;
+                }
+
+                snprintf(tmp, 512, "%s/%s.tmp", to->dir, names[i]);
+                tmp[511] = 0;
+                int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd == -1) {
+                        log_err("Datalog: Failed to create '%s'", tmp);
+                        free(data);
+                        ret = -1;
+                        break;
+                }
+                to->stats.writes++;
+                int err = ((write(fd, data, size) != size) || (fdatasync(fd) != 0));
+                if (close(fd) != 0)
+                        err = 1;
+                free(data);
+                if (err || (rename(tmp, path) != 0)) {
+                        log_err("Datalog: Failed to write '%s'", path);
+                        unlink(tmp);
+                        ret = -1;
+                        break;
+                }
+                to->stats.bytes_written += size;
+                to->stats.fsyncs++;
+                to->stats.commits++;
+                moved++;
+        }
+
+        /* The originals are only removed once the new directory
+           entries are on the disk. */
+        if (moved > 0) {
+                datalog_sync_dir(to);
+                for (int i = 0; i < moved; i++) {
+                        snprintf(path, 512, "%s/%s", from->dir, names[i]);
+                        path[511] = 0;
+                        if (unlink(path) != 0) {
+                                log_err("Datalog: Failed to remove '%s'", path);
+                                ret = -1;
+                        }
+                }
+        }
+        datalog_free_list(names, count);
+
+        datalog_unlock(lock);
+        return ret;
+}
+
+void datalog_get_stats(datalog_t* log, datalog_stats_t* stats)
+{
+        *stats = log->stats;
+}
+
+/* Checks a segment after an unclean shutdown. A segment whose header
+   didn't make it to the disk is removed. Otherwise, the segment is
+   truncated after the last complete record with a valid checksum. */
+static int datalog_recover_segment(datalog_t* log, const char* path)
+{
+        datalog_header_t h;
+        struct stat st;
+
+        if (stat(path, &st) != 0)
+                return -1;
+
+        unsigned char* buf = (unsigned char*) malloc(st.st_size > 0? st.st_size : 1);
+        if (buf == NULL) {
+                log_err("Datalog: out of memory");
+                return -1;
+        }
+
+        FILE* in = fopen(path, "r");
+        if ((in == NULL)
+            || ((st.st_size > 0) && (fread(buf, st.st_size, 1, in) != 1))) {
+                log_err("Datalog: Failed to read '%s'", path);
+                if (in) fclose(in);
+                free(buf);
+                return -1;
+        }
+        fclose(in);
+
+        if (datalog_decode_header(&h, buf, st.st_size) != 0) {
+                log_warn("Datalog: Removing segment '%s' with a torn header", path);
+                free(buf);
+                log->stats.truncated_bytes += st.st_size;
+                return unlink(path);
+        }
+
+        int hdrsize = DATALOG_HEADER_SIZE(h.version, h.num_streams);
+        int recsize = DATALOG_RECORD_SIZE(h.version, h.num_streams);
+        long valid = hdrsize;
+
+        while (valid + recsize <= st.st_size) {
+                if (datalog_check_record(&h, buf + valid) != 0)
+                        break;
+                valid += recsize;
+        }
+        free(buf);
+
+        if (valid == st.st_size)
+                return 0;
+
+        log_warn("Datalog: Truncating '%s' from %ld to %ld bytes",
+                 path, (long) st.st_size, valid);
+
+        int fd = open(path, O_WRONLY);
+        if (fd == -1)
+                return -1;
+        int ret = 0;
+        if ((ftruncate(fd, valid) != 0) || (fsync(fd) != 0)) {
+                log_err("Datalog: Failed to truncate '%s'", path);
+                ret = -1;
+        } else {
+                log->stats.fsyncs++;
+                log->stats.truncated_bytes += st.st_size - valid;
+        }
+        close(fd);
+
+        return ret;
+}
+
+int datalog_recover(datalog_t* log)
+{
+        char path[512];
+        int count;
+        int ret = 0;
+
+        log->writable = 1;
+
+        char** names = datalog_list_segments(log, &count);
+        for (int i = 0; i < count; i++) {
+                snprintf(path, 512, "%s/%s", log->dir, names[i]);
+                path[511] = 0;
+                if (datalog_recover_segment(log, path) != 0)
+                        ret = -1;
+        }
+        datalog_free_list(names, count);
+
+        return ret;
+}
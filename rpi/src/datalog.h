@@ -0,0 +1,121 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _DATALOG_H_
+#define _DATALOG_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "datastream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* The datapoints waiting to be uploaded are stored in an
+           append-only binary log, split in segments. A segment
+           starts with a header that lists the datastreams (their
+           OpenSensorData ID and scale factor) and is followed by
+           fixed-size records: the timestamp, in seconds, and the
+           raw 16-bit value of each datastream, as sent by the
+           Arduino. A new segment is started whenever the list of
+           datastreams changes.
+
+           Each record ends with a CRC-32 checksum. A download from
+           the Arduino is committed as a group, with a single write
+           and a single fdatasync. Torn or corrupt records at the
+           end of a segment, left by a power cut, are skipped by the
+           readers and truncated by datalog_recover().
+
+           The CSV that the server expects is only produced when the
+           data is exported for the upload. */
+
+        typedef struct _datalog_t datalog_t;
+
+        typedef struct _datalog_stats_t {
+                long commits;
+                long records;
+                long fsyncs;
+                long writes;
+                long bytes_written;
+                long truncated_bytes;
+        } datalog_stats_t;
+
+        datalog_t* new_datalog(const char* dir);
+        void delete_datalog(datalog_t* log);
+
+        /* Truncates the torn or corrupt records at the end of the
+           segments, and removes the segments with a torn header.
+           Only the process that writes to the log may call it,
+           before its first append: the log is read-only until
+           then. */
+        int datalog_recover(datalog_t* log);
+
+        /* The datapoints must be grouped by timestamp, as returned
+           by arduino_read_data(). osd_ids maps the datastream
+           index to the OpenSensorData ID. Datastreams with ID -1
+           are not stored. When it returns 0, the datapoints are
+           on the disk. */
+        int datalog_append(datalog_t* log, datapoint_t* points,
+                           int num_points, const int* osd_ids);
+
+        /* Returns the total size of the segments, in bytes. */
+        long datalog_size(datalog_t* log);
+
+        typedef int (*datalog_callback_t)(void* data, int osd_id,
+                                          time_t timestamp, float value);
+
+        /* Calls fun for every datapoint, oldest first. Stops at the
+           first non-zero value returned by fun, and returns it. */
+        int datalog_foreach(datalog_t* log, datalog_callback_t fun, void* data);
+
+        /* Calls fun for the datapoints of a single segment file,
+           for example one copied from another box. The file isn't
+           changed: a torn or corrupt end is skipped. */
+        int datalog_foreach_file(const char* path, datalog_callback_t fun, void* data);
+
+        /* Writes all the datapoints, in CSV format. */
+        int datalog_export_csv(datalog_t* log, FILE* fp);
+
+        /* Writes the datapoints in CSV format, makes fp durable and
+           removes the segments that were written. Appends from
+           other processes wait until it is done, so a record is
+           never removed without having been exported. */
+        int datalog_drain_csv(datalog_t* log, FILE* fp);
+
+        /* Removes all the segments. */
+        int datalog_clear(datalog_t* log);
+
+        /* Moves the segments of one log into another, typically on
+           a different file system. Each segment is copied with a
+           single write and fdatasync, and only removed from the
+           first log once the copies are durable. */
+        int datalog_move(datalog_t* from, datalog_t* to);
+
+        /* The counters since the log was opened, including the
+           recovery. */
+        void datalog_get_stats(datalog_t* log, datalog_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#include "datastream.h"
+
+float arduino_datastream_factor(int datastream)
+{
+        switch (datastream) {
+        case DATASTREAM_T:
+        case DATASTREAM_RH:
+        case DATASTREAM_TX:
+        case DATASTREAM_RHX:
+        case DATASTREAM_USBBAT:
+                return 0.01f;
+        default:
+                return 1.0f;
+        }
+}
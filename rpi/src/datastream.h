@@ -0,0 +1,54 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _DATASTREAM_H_
+#define _DATASTREAM_H_
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DATASTREAM_T       1
+#define DATASTREAM_RH      2
+#define DATASTREAM_TX      3
+#define DATASTREAM_RHX     4
+#define DATASTREAM_LUM     5
+#define DATASTREAM_SOIL    6
+#define DATASTREAM_USBBAT  7
+#define DATASTREAM_COUNT   8
+
+typedef struct _datapoint_t {
+        int datastream;
+        time_t timestamp;
+        float value;
+} datapoint_t;
+
+/* The Arduino sends the values as 16-bit integers. The factor
+   converts them to the datastream's unit. */
+float arduino_datastream_factor(int datastream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
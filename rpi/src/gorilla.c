@@ -0,0 +1,510 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "log_message.h"
+#include "gorilla.h"
+#include "timestamp.h"
+
+#define GORILLA_VERSION 1
+#define GORILLA_MAX_STREAMS 255
+
+typedef struct _gorilla_stream_t {
+        int datastream;
+        int count;
+
+        unsigned char* data;
+        int length;     /* allocated bytes */
+        int bits;       /* bits written */
+
+        uint32_t timestamp;
+        int32_t delta;
+        uint32_t value;
+        int leading;
+        int trailing;
+} gorilla_stream_t;
+
+struct _gorilla_t {
+        gorilla_stream_t* streams;
+        int num_streams;
+        int count;
+};
+
+typedef struct _gorilla_reader_t {
+        const unsigned char* data;
+        int bits;
+        int pos;
+} gorilla_reader_t;
+
+static inline float gorilla_tofloat(uint32_t u)
+{
+        float f;
+        memcpy(&f, &u, 4);
+        return f;
+}
+
+static inline uint32_t gorilla_fromfloat(float f)
+{
+        uint32_t u;
+        memcpy(&u, &f, 4);
+        return u;
+}
+
+static int gorilla_write_bits(gorilla_stream_t* s, uint32_t value, int n)
+{
+        if (s->bits + n > 8 * s->length) {
+                int newlen = (s->length == 0)? 256 : 2 * s->length;
+                unsigned char* p = (unsigned char*) realloc(s->data, newlen);
+                if (p == NULL) {
+                        log_err("Gorilla: out of memory");
+                        return -1;
+                }
+                memset(p + s->length, 0, newlen - s->length);
+                s->data = p;
+                s->length = newlen;
+        }
+        for (int i = n - 1; i >= 0; i--) {
+                if ((value >> i) & 1)
+                        s->data[s->bits >> 3] |= 0x80 >> (s->bits & 7);
+                s->bits++;
+        }
+        return 0;
+}
+
+static int gorilla_read_bits(gorilla_reader_t* r, int n, uint32_t* value)
+{
+        uint32_t v = 0;
+        if (r->pos + n > r->bits)
+                return -1;
+        for (int i = 0; i < n; i++) {
+                v = (v << 1) | ((r->data[r->pos >> 3] >> (7 - (r->pos & 7))) & 1);
+                r->pos++;
+        }
+        *value = v;
+        return 0;
+}
+
+static int gorilla_leading_zeros(uint32_t x)
+{
+        int n = 0;
+        while (!(x & 0x80000000)) {
+                x <<= 1;
+                n++;
+        }
+        return n;
+}
+
+static int gorilla_trailing_zeros(uint32_t x)
+{
+        int n = 0;
+        while (!(x & 1)) {
+                x >>= 1;
+                n++;
+        }
+        return n;
+}
+
+gorilla_t* new_gorilla()
+{
+        gorilla_t* g = (gorilla_t*) malloc(sizeof(gorilla_t));
+        if (g == NULL) {
+                log_err("Gorilla: out of memory");
+                return NULL;
+        }
+        memset(g, 0, sizeof(gorilla_t));
+        return g;
+}
+
+void delete_gorilla(gorilla_t* g)
+{
+        for (int i = 0; i < g->num_streams; i++)
+                if (g->streams[i].data)
+                        free(g->streams[i].data);
+        if (g->streams)
+                free(g->streams);
+        free(g);
+}
+
+int gorilla_count(gorilla_t* g)
+{
+        return g->count;
+}
+
+static gorilla_stream_t* gorilla_get_stream(gorilla_t* g, int datastream)
+{
+        for (int i = 0; i < g->num_streams; i++)
+                if (g->streams[i].datastream == datastream)
+                        return &g->streams[i];
+
+        if (g->num_streams == GORILLA_MAX_STREAMS) {
+                log_err("Gorilla: too many datastreams");
+                return NULL;
+        }
+        gorilla_stream_t* p = (gorilla_stream_t*) realloc(g->streams,
+                                                          (g->num_streams + 1) * sizeof(gorilla_stream_t));
+        if (p == NULL) {
+                log_err("Gorilla: out of memory");
+                return NULL;
+        }
+        g->streams = p;
+        gorilla_stream_t* s = &g->streams[g->num_streams++];
+        memset(s, 0, sizeof(gorilla_stream_t));
+        s->datastream = datastream;
+        return s;
+}
+
+/* Delta-of-delta buckets: '0' for a regular interval, then
+   '10', '110', '1110' followed by a 7, 9, or 12 bit signed value,
+   and '1111' followed by the full 32 bits. */
+static int gorilla_write_timestamp(gorilla_stream_t* s, uint32_t t)
+{
+        int32_t delta = (int32_t) (t - s->timestamp);
+        int32_t dod = delta - s->delta;
+        int err;
+
+        if (dod == 0)
+                err = gorilla_write_bits(s, 0, 1);
+        else if ((dod >= -64) && (dod <= 63))
+                err = (gorilla_write_bits(s, 0x2, 2)
+                       || gorilla_write_bits(s, (uint32_t) dod & 0x7f, 7));
+        else if ((dod >= -256) && (dod <= 255))
+                err = (gorilla_write_bits(s, 0x6, 3)
+                       || gorilla_write_bits(s, (uint32_t) dod & 0x1ff, 9));
+        else if ((dod >= -2048) && (dod <= 2047))
+                err = (gorilla_write_bits(s, 0xe, 4)
+                       || gorilla_write_bits(s, (uint32_t) dod & 0xfff, 12));
+        else
+                err = (gorilla_write_bits(s, 0xf, 4)
+                       || gorilla_write_bits(s, (uint32_t) dod, 32));
+
+        s->delta = delta;
+        s->timestamp = t;
+        return err? -1 : 0;
+}
+
+/* Values: '0' if equal to the previous one, '10' followed by the
+   meaningful bits if they fit in the previous window, and '11',
+   5 bits of leading zeros, 5 bits of length-1, and the meaningful
+   bits otherwise. */
+static int gorilla_write_value(gorilla_stream_t* s, uint32_t v)
+{
+        uint32_t x = v ^ s->value;
+        int err;
+
+        s->value = v;
+
+        if (x == 0)
+                return gorilla_write_bits(s, 0, 1);
+
+        int leading = gorilla_leading_zeros(x);
+        int trailing = gorilla_trailing_zeros(x);
+
+        if ((s->leading >= 0)
+            && (leading >= s->leading)
+            && (trailing >= s->trailing)) {
+                int n = 32 - s->leading - s->trailing;
+                err = (gorilla_write_bits(s, 0x2, 2)
+                       || gorilla_write_bits(s, x >> s->trailing, n));
+        } else {
+                int n = 32 - leading - trailing;
+                err = (gorilla_write_bits(s, 0x3, 2)
+                       || gorilla_write_bits(s, leading, 5)
+                       || gorilla_write_bits(s, n - 1, 5)
+                       || gorilla_write_bits(s, x >> trailing, n));
+                s->leading = leading;
+                s->trailing = trailing;
+        }
+        return err? -1 : 0;
+}
+
+int gorilla_append(gorilla_t* g, int datastream, time_t timestamp, float value)
+{
+        gorilla_stream_t* s = gorilla_get_stream(g, datastream);
+        if (s == NULL)
+                return -1;
+
+        uint32_t t = (uint32_t) timestamp;
+        uint32_t v = gorilla_fromfloat(value);
+
+        if (s->count == 0) {
+                if (gorilla_write_bits(s, t, 32) || gorilla_write_bits(s, v, 32))
+                        return -1;
+                s->timestamp = t;
+                s->delta = 0;
+                s->value = v;
+                s->leading = -1;
+                s->trailing = 0;
+        } else {
+                if (gorilla_write_timestamp(s, t) || gorilla_write_value(s, v))
+                        return -1;
+        }
+
+        s->count++;
+        g->count++;
+        return 0;
+}
+
+static int gorilla_write_u32(FILE* fp, uint32_t v)
+{
+        unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+        return (fwrite(b, 4, 1, fp) != 1)? -1 : 0;
+}
+
+int gorilla_write(gorilla_t* g, FILE* fp)
+{
+        unsigned char header[6] = { 'O', 'S', 'D', 'G', GORILLA_VERSION, g->num_streams };
+
+        if (fwrite(header, 6, 1, fp) != 1)
+                return -1;
+
+        for (int i = 0; i < g->num_streams; i++) {
+                gorilla_stream_t* s = &g->streams[i];
+                int bytes = (s->bits + 7) / 8;
+                if (gorilla_write_u32(fp, s->datastream)
+                    || gorilla_write_u32(fp, s->count)
+                    || gorilla_write_u32(fp, s->bits))
+                        return -1;
+                if ((bytes > 0) && (fwrite(s->data, bytes, 1, fp) != 1))
+                        return -1;
+        }
+        return 0;
+}
+
+static uint32_t gorilla_get_u32(const unsigned char* p)
+{
+        return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+                | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static int32_t gorilla_sign_extend(uint32_t v, int n)
+{
+        if (v & (1u << (n - 1)))
+                return (int32_t) (v | ~((1u << n) - 1));
+        return (int32_t) v;
+}
+
+static int gorilla_decode_stream(gorilla_reader_t* r, int datastream, int count,
+                                 gorilla_callback_t fun, void* data)
+{
+        uint32_t t, v, bit, x;
+        int32_t delta = 0;
+        int leading = 0, trailing = 0;
+        int ret;
+
+        if (count == 0)
+                return 0;
+
+        if (gorilla_read_bits(r, 32, &t) || gorilla_read_bits(r, 32, &v))
+                return -1;
+        ret = fun(data, datastream, (time_t) t, gorilla_tofloat(v));
+        if (ret != 0)
+                return ret;
+
+        for (int i = 1; i < count; i++) {
+                int32_t dod;
+                int ones = 0;
+
+                while (ones < 4) {
+                        if (gorilla_read_bits(r, 1, &bit))
+                                return -1;
+                        if (bit == 0)
+                                break;
+                        ones++;
+                }
+                switch (ones) {
+                case 0: dod = 0; break;
+                case 1: if (gorilla_read_bits(r, 7, &x)) return -1; dod = gorilla_sign_extend(x, 7); break;
+                case 2: if (gorilla_read_bits(r, 9, &x)) return -1; dod = gorilla_sign_extend(x, 9); break;
+                case 3: if (gorilla_read_bits(r, 12, &x)) return -1; dod = gorilla_sign_extend(x, 12); break;
+                default: if (gorilla_read_bits(r, 32, &x)) return -1; dod = (int32_t) x; break;
+                }
+                delta += dod;
+                t += (uint32_t) delta;
+
+                if (gorilla_read_bits(r, 1, &bit))
+                        return -1;
+                if (bit) {
+                        if (gorilla_read_bits(r, 1, &bit))
+                                return -1;
+                        if (bit) {
+                                uint32_t l, n;
+                                if (gorilla_read_bits(r, 5, &l) || gorilla_read_bits(r, 5, &n))
+                                        return -1;
+                                leading = l;
+                                trailing = 32 - leading - (n + 1);
+                                if (trailing < 0)
+                                        return -1;
+                        }
+                        int n = 32 - leading - trailing;
+                        if (gorilla_read_bits(r, n, &x))
+                                return -1;
+                        v ^= x << trailing;
+                }
+
+                ret = fun(data, datastream, (time_t) t, gorilla_tofloat(v));
+                if (ret != 0)
+                        return ret;
+        }
+        return 0;
+}
+
+int gorilla_decode(const unsigned char* buffer, int len,
+                   gorilla_callback_t fun, void* data)
+{
+        if ((len < 6) || (memcmp(buffer, "OSDG", 4) != 0)) {
+                log_err("Gorilla: Not an encoded datapoints file");
+                return -1;
+        }
+        if (buffer[4] != GORILLA_VERSION) {
+                log_err("Gorilla: Unsupported version %d", buffer[4]);
+                return -1;
+        }
+
+        int num_streams = buffer[5];
+        int offset = 6;
+
+        for (int i = 0; i < num_streams; i++) {
+                if (offset + 12 > len)
+                        return -1;
+                int datastream = (int) gorilla_get_u32(buffer + offset);
+                int count = (int) gorilla_get_u32(buffer + offset + 4);
+                uint32_t bits = gorilla_get_u32(buffer + offset + 8);
+                offset += 12;
+
+                int bytes = (int) ((bits + 7) / 8);
+                if ((bytes < 0) || (offset + bytes > len))
+                        return -1;
+
+                gorilla_reader_t r = { buffer + offset, (int) bits, 0 };
+                int ret = gorilla_decode_stream(&r, datastream, count, fun, data);
+                if (ret != 0)
+                        return ret;
+                offset += bytes;
+        }
+        return 0;
+}
+
+int gorilla_encode_csv(const char* csvfile, const char* outfile)
+{
+        char line[256];
+        int lineno = 0;
+        int ret = -1;
+
+        FILE* in = fopen(csvfile, "r");
+        if (in == NULL) {
+                log_err("Gorilla: Failed to open '%s'", csvfile);
+                return -1;
+        }
+
+        gorilla_t* g = new_gorilla();
+        if (g == NULL) {
+                fclose(in);
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), in) != NULL) {
+                int id;
+                struct tm tm;
+                float value;
+
+                lineno++;
+                memset(&tm, 0, sizeof(tm));
+                if (sscanf(line, "%d,%d-%d-%dT%d:%d:%d,%f", &id,
+                           &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                           &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &value) != 8) {
+                        log_warn("Gorilla: %s:%d: unexpected line", csvfile, lineno);
+                        goto cleanup;
+                }
+                tm.tm_year -= 1900;
+                tm.tm_mon -= 1;
+
+                if (gorilla_append(g, id, timegm(&tm), value) != 0)
+                        goto cleanup;
+        }
+
+        FILE* out = fopen(outfile, "w");
+        if (out == NULL) {
+                log_err("Gorilla: Failed to create '%s'", outfile);
+                goto cleanup;
+        }
+        if (gorilla_write(g, out) != 0) {
+                log_err("Gorilla: Failed to write '%s'", outfile);
+                fclose(out);
+                goto cleanup;
+        }
+        fclose(out);
+        ret = gorilla_count(g);
+
+ cleanup:
+        delete_gorilla(g);
+        fclose(in);
+        return ret;
+}
+
+static int gorilla_print_csv(void* data, int datastream, time_t timestamp, float value)
+{
+        FILE* out = (FILE*) data;
+        static timestamp_cache_t cache = { 1 };
+        char s[TIMESTAMP_MAXLEN];
+
+        timestamp_format(&cache, timestamp, TIMESTAMP_ISO, s);
+        fprintf(out, "%d,%s,%f\n", datastream, s, value);
+        return 0;
+}
+
+int gorilla_decode_to_csv(const char* infile, FILE* out)
+{
+        FILE* in = fopen(infile, "r");
+        if (in == NULL) {
+                log_err("Gorilla: Failed to open '%s'", infile);
+                return -1;
+        }
+
+        fseek(in, 0, SEEK_END);
+        long len = ftell(in);
+        fseek(in, 0, SEEK_SET);
+
+        unsigned char* buffer = (unsigned char*) malloc(len > 0? len : 1);
+        if (buffer == NULL) {
+                log_err("Gorilla: out of memory");
+                fclose(in);
+                return -1;
+        }
+        if ((len > 0) && (fread(buffer, len, 1, in) != 1)) {
+                log_err("Gorilla: Failed to read '%s'", infile);
+                free(buffer);
+                fclose(in);
+                return -1;
+        }
+        fclose(in);
+
+        int ret = gorilla_decode(buffer, (int) len, gorilla_print_csv, out);
+        if (ret != 0)
+                log_err("Gorilla: Corrupt file '%s'", infile);
+
+        free(buffer);
+        return ret;
+}
@@ -0,0 +1,81 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _GORILLA_H_
+#define _GORILLA_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* Compact binary encoding of the datapoints, after the
+           Gorilla time series compression (Pelkonen et al.,
+           VLDB 2015): the timestamps are stored as
+           delta-of-deltas and the values as the XOR with the
+           previous value.
+
+           File layout (all integers big-endian):
+             "OSDG" version:u8 streams:u8
+             for each stream:
+               datastream:u32 count:u32 bits:u32 data[(bits+7)/8]
+
+           The timestamps are the wall-clock time of the datapoint
+           counted as if it were UTC, so that decoding gives back
+           exactly the same CSV text, whatever the time zone. */
+
+        #define GORILLA_MIME_TYPE "application/x-osd-gorilla"
+
+        typedef struct _gorilla_t gorilla_t;
+
+        gorilla_t* new_gorilla();
+        void delete_gorilla(gorilla_t* g);
+
+        /* The datapoints of a datastream must be appended in
+           chronological order. Returns 0 on success. */
+        int gorilla_append(gorilla_t* g, int datastream, time_t timestamp, float value);
+
+        int gorilla_count(gorilla_t* g);
+
+        int gorilla_write(gorilla_t* g, FILE* fp);
+
+        typedef int (*gorilla_callback_t)(void* data, int datastream,
+                                          time_t timestamp, float value);
+
+        /* Calls fun for every datapoint in the buffer. Returns 0 on
+           success, -1 if the data is corrupt, or the non-zero value
+           returned by fun. */
+        int gorilla_decode(const unsigned char* buffer, int len,
+                           gorilla_callback_t fun, void* data);
+
+        /* Converts between the datapoints CSV file and the binary
+           encoding. gorilla_encode_csv returns the number of
+           datapoints, or -1 on failure. */
+        int gorilla_encode_csv(const char* csvfile, const char* outfile);
+        int gorilla_decode_to_csv(const char* infile, FILE* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,389 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "log_message.h"
+#include "hashset.h"
+
+#define HASHSET_VERSION 1
+#define HASHSET_HEADER_SIZE 64
+#define HASHSET_INITIAL_CAPACITY 1024
+
+/* The slots are read this many at a time while probing. */
+#define HASHSET_PROBE_SLOTS 16
+
+struct _hashset_t {
+        char* file;
+        int fd;
+        uint32_t capacity;
+        uint32_t count;
+};
+
+static const unsigned char _empty[HASHSET_KEY_SIZE];
+
+static int hashset_lock(hashset_t* set, int type)
+{
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = 0;
+        fl.l_len = 0;
+        return fcntl(set->fd, F_SETLKW, &fl);
+}
+
+static void hashset_sync_dir(const char* file)
+{
+        char dir[512];
+        snprintf(dir, 512, "%s", file);
+        dir[511] = 0;
+        char* s = strrchr(dir, '/');
+        if (s == NULL)
+                return;
+        *s = 0;
+        int fd = open(dir, O_RDONLY);
+        if (fd != -1) {
+                fsync(fd);
+                close(fd);
+        }
+}
+
+/* Writes a table with the given slots (capacity slots, or none for
+   an empty table) to a new file that replaces the set's file. An
+   empty table doesn't replace a file that another process created
+   in the meantime. */
+static int hashset_write_table(const char* file, uint32_t capacity, uint32_t count,
+                               const unsigned char* slots)
+{
+        char tmp[512];
+        unsigned char header[HASHSET_HEADER_SIZE];
+        uint32_t version = HASHSET_VERSION;
+
+        memset(header, 0, HASHSET_HEADER_SIZE);
+        memcpy(header, "SBHS", 4);
+        memcpy(header + 4, &version, 4);
+        memcpy(header + 8, &capacity, 4);
+        memcpy(header + 12, &count, 4);
+
+        snprintf(tmp, 512, "%s.%d.tmp", file, (int) getpid());
+        tmp[511] = 0;
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                log_err("Hashset: Failed to create '%s'", tmp);
+                return -1;
+        }
+
+        long size = (long) capacity * HASHSET_KEY_SIZE;
+        int err = (write(fd, header, HASHSET_HEADER_SIZE) != HASHSET_HEADER_SIZE);
+        if (!err && (slots != NULL))
+                err = (write(fd, slots, size) != size);
+        if (!err)
+                err = (ftruncate(fd, HASHSET_HEADER_SIZE + size) != 0);
+        if (!err)
+                err = (fsync(fd) != 0);
+        if (close(fd) != 0)
+                err = 1;
+
+        if (!err && (slots == NULL)) {
+                err = ((link(tmp, file) != 0) && (errno != EEXIST));
+                unlink(tmp);
+        } else if (!err) {
+                err = (rename(tmp, file) != 0);
+        }
+        if (err) {
+                log_err("Hashset: Failed to write '%s'", file);
+                unlink(tmp);
+                return -1;
+        }
+        hashset_sync_dir(file);
+        return 0;
+}
+
+static int hashset_read_header(hashset_t* set)
+{
+        unsigned char header[16];
+        struct stat st;
+        uint32_t version;
+
+        if ((pread(set->fd, header, 16, 0) != 16)
+            || (memcmp(header, "SBHS", 4) != 0)
+            || (fstat(set->fd, &st) != 0))
+                return -1;
+
+        memcpy(&version, header + 4, 4);
+        memcpy(&set->capacity, header + 8, 4);
+        memcpy(&set->count, header + 12, 4);
+
+        if ((version != HASHSET_VERSION)
+            || (set->capacity == 0)
+            || ((set->capacity & (set->capacity - 1)) != 0)
+            || (st.st_size < HASHSET_HEADER_SIZE + (off_t) set->capacity * HASHSET_KEY_SIZE))
+                return -1;
+
+        return 0;
+}
+
+static int hashset_open(hashset_t* set)
+{
+        if (set->fd != -1)
+                close(set->fd);
+
+        set->fd = open(set->file, O_RDWR);
+        if ((set->fd == -1) && (errno == ENOENT)) {
+                if (hashset_write_table(set->file, HASHSET_INITIAL_CAPACITY, 0, NULL) != 0)
+                        return -1;
+                set->fd = open(set->file, O_RDWR);
+        }
+        if (set->fd == -1) {
+                log_err("Hashset: Failed to open '%s'", set->file);
+                return -1;
+        }
+        return 0;
+}
+
+/* Locks the file and reads the header. The file may have been
+   replaced by a larger table since it was opened. */
+static int hashset_acquire(hashset_t* set, int type)
+{
+        struct stat a, b;
+
+        for (int attempt = 0; attempt < 10; attempt++) {
+                if (hashset_lock(set, type) != 0) {
+                        log_err("Hashset: Failed to lock '%s'", set->file);
+                        return -1;
+                }
+                if ((fstat(set->fd, &a) == 0) && (stat(set->file, &b) == 0)
+                    && (a.st_ino == b.st_ino) && (a.st_dev == b.st_dev)) {
+                        if (hashset_read_header(set) == 0)
+                                return 0;
+                        log_err("Hashset: Invalid file '%s'", set->file);
+                        hashset_lock(set, F_UNLCK);
+                        return -1;
+                }
+                hashset_lock(set, F_UNLCK);
+                if (hashset_open(set) != 0)
+                        return -1;
+        }
+        return -1;
+}
+
+static void hashset_release(hashset_t* set)
+{
+        hashset_lock(set, F_UNLCK);
+}
+
+hashset_t* new_hashset(const char* file)
+{
+        hashset_t* set = (hashset_t*) malloc(sizeof(hashset_t));
+        if (set == NULL) {
+                log_err("Hashset: out of memory");
+                return NULL;
+        }
+        memset(set, 0, sizeof(hashset_t));
+        set->fd = -1;
+        set->file = strdup(file);
+
+        if (hashset_open(set) != 0) {
+                delete_hashset(set);
+                return NULL;
+        }
+        return set;
+}
+
+void delete_hashset(hashset_t* set)
+{
+        if (set->fd != -1)
+                close(set->fd);
+        if (set->file)
+                free(set->file);
+        free(set);
+}
+
+/* An empty slot marks the end of a probe, so a key of zeros is
+   stored with its first bit set. */
+static void hashset_key(const unsigned char* key, unsigned char* k)
+{
+        memcpy(k, key, HASHSET_KEY_SIZE);
+        if (memcmp(k, _empty, HASHSET_KEY_SIZE) == 0)
+                k[0] = 1;
+}
+
+static uint32_t hashset_start(const unsigned char* k, uint32_t capacity)
+{
+        uint32_t h;
+        memcpy(&h, k, 4);
+        return h & (capacity - 1);
+}
+
+/* Probes the table for the key. Returns 1 and the slot of the key,
+   0 and the first empty slot, or -1. */
+static int hashset_find(hashset_t* set, const unsigned char* k, uint32_t* slot)
+{
+        unsigned char buf[HASHSET_PROBE_SLOTS * HASHSET_KEY_SIZE];
+        uint32_t i = hashset_start(k, set->capacity);
+        uint32_t probed = 0;
+
+        while (probed < set->capacity) {
+                uint32_t n = HASHSET_PROBE_SLOTS;
+                if (i + n > set->capacity)
+                        n = set->capacity - i;
+                ssize_t len = n * HASHSET_KEY_SIZE;
+                if (pread(set->fd, buf, len, HASHSET_HEADER_SIZE + (off_t) i * HASHSET_KEY_SIZE) != len) {
+                        log_err("Hashset: Failed to read '%s'", set->file);
+                        return -1;
+                }
+                for (uint32_t j = 0; j < n; j++) {
+                        unsigned char* s = buf + j * HASHSET_KEY_SIZE;
+                        if (memcmp(s, k, HASHSET_KEY_SIZE) == 0) {
+                                *slot = i + j;
+                                return 1;
+                        }
+                        if (memcmp(s, _empty, HASHSET_KEY_SIZE) == 0) {
+                                *slot = i + j;
+                                return 0;
+                        }
+                }
+                probed += n;
+                i = (i + n) & (set->capacity - 1);
+        }
+
+        log_err("Hashset: The table '%s' is full", set->file);
+        return -1;
+}
+
+int hashset_contains(hashset_t* set, const unsigned char* key)
+{
+        unsigned char k[HASHSET_KEY_SIZE];
+        uint32_t slot;
+
+        hashset_key(key, k);
+        if (hashset_acquire(set, F_RDLCK) != 0)
+                return -1;
+        int ret = hashset_find(set, k, &slot);
+        hashset_release(set);
+        return ret;
+}
+
+/* Rebuilds the table at twice the size. Called with the lock
+   held. The other processes notice the new file once they get the
+   lock. */
+static int hashset_grow(hashset_t* set)
+{
+        uint32_t capacity = 2 * set->capacity;
+        uint32_t count = 0;
+        long size = (long) set->capacity * HASHSET_KEY_SIZE;
+
+        unsigned char* old = (unsigned char*) malloc(size);
+        unsigned char* slots = (unsigned char*) calloc(capacity, HASHSET_KEY_SIZE);
+        if ((old == NULL) || (slots == NULL)) {
+                log_err("Hashset: out of memory");
+                if (old) free(old);
+                if (slots) free(slots);
+                return -1;
+        }
+
+        if (pread(set->fd, old, size, HASHSET_HEADER_SIZE) != size) {
+                log_err("Hashset: Failed to read '%s'", set->file);
+                free(old);
+                free(slots);
+                return -1;
+        }
+
+        for (uint32_t i = 0; i < set->capacity; i++) {
+                unsigned char* k = old + (long) i * HASHSET_KEY_SIZE;
+                if (memcmp(k, _empty, HASHSET_KEY_SIZE) == 0)
+                        continue;
+                uint32_t j = hashset_start(k, capacity);
+                while (memcmp(slots + (long) j * HASHSET_KEY_SIZE, _empty, HASHSET_KEY_SIZE) != 0)
+                        j = (j + 1) & (capacity - 1);
+                memcpy(slots + (long) j * HASHSET_KEY_SIZE, k, HASHSET_KEY_SIZE);
+                count++;
+        }
+
+        int err = hashset_write_table(set->file, capacity, count, slots);
+        free(old);
+        free(slots);
+        if (err != 0)
+                return -1;
+
+        /* The lock on the old file is dropped with its descriptor. */
+        if (hashset_open(set) != 0)
+                return -1;
+        if ((hashset_lock(set, F_WRLCK) != 0) || (hashset_read_header(set) != 0)) {
+                log_err("Hashset: Failed to reopen '%s'", set->file);
+                return -1;
+        }
+        return 0;
+}
+
+int hashset_add(hashset_t* set, const unsigned char* key)
+{
+        unsigned char k[HASHSET_KEY_SIZE];
+        uint32_t slot;
+        int ret;
+
+        hashset_key(key, k);
+        if (hashset_acquire(set, F_WRLCK) != 0)
+                return -1;
+
+        ret = hashset_find(set, k, &slot);
+        if (ret != 0)
+                goto done;
+
+        if (2 * (set->count + 1) > set->capacity) {
+                if ((hashset_grow(set) != 0) || (hashset_find(set, k, &slot) != 0)) {
+                        ret = -1;
+                        goto done;
+                }
+        }
+
+        set->count++;
+        if ((pwrite(set->fd, k, HASHSET_KEY_SIZE,
+                    HASHSET_HEADER_SIZE + (off_t) slot * HASHSET_KEY_SIZE) != HASHSET_KEY_SIZE)
+            || (pwrite(set->fd, &set->count, 4, 12) != 4)
+            || (fdatasync(set->fd) != 0)) {
+                log_err("Hashset: Failed to write '%s'", set->file);
+                ret = -1;
+        }
+
+ done:
+        hashset_release(set);
+        return (ret < 0)? -1 : 0;
+}
+
+long hashset_count(hashset_t* set)
+{
+        if (hashset_acquire(set, F_RDLCK) != 0)
+                return -1;
+        long count = set->count;
+        hashset_release(set);
+        return count;
+}
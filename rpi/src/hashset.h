@@ -0,0 +1,70 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _HASHSET_H_
+#define _HASHSET_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* A set of fixed-size keys, such as content hashes, kept in
+           a file as an open-addressing hash table. A lookup or an
+           insertion reads or writes a few slots, whatever the size
+           of the set. The file is
+
+             0   "SBHS"
+             4   version
+             8   capacity (number of slots, a power of two)
+             12  number of keys
+             16  reserved, up to 64
+
+           followed by the slots. A slot of zeros is empty. The first
+           bytes of the key pick the slot, and collisions go to the
+           next free slot. The table is rebuilt at twice the size,
+           into a new file, when it gets half full.
+
+           The file is locked (fcntl) during each operation, so that
+           processes can share it. */
+
+        #define HASHSET_KEY_SIZE 16
+
+        typedef struct _hashset_t hashset_t;
+
+        /* Opens the set, and creates the file if needed. */
+        hashset_t* new_hashset(const char* file);
+        void delete_hashset(hashset_t* set);
+
+        /* Returns 1 if the key is in the set, 0 if not, -1 on
+           error. */
+        int hashset_contains(hashset_t* set, const unsigned char* key);
+
+        /* Adds the key, and syncs the file. Returns 0 if the key is
+           in the set. */
+        int hashset_add(hashset_t* set, const unsigned char* key);
+
+        long hashset_count(hashset_t* set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1153 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "log_message.h"
+#include "archive.h"
+#include "timestamp.h"
+#include "import.h"
+
+#define IMPORT_MAX_JOBS 16
+#define IMPORT_MAX_DEPTH 16
+#define IMPORT_DAY 86400
+
+/* The number of spill files a worker keeps open. The sources are
+   mostly in time order, so the current day is nearly always one of
+   them. */
+#define IMPORT_OPEN_FILES 16
+
+/* The CSV files are read in blocks of this size. */
+#define IMPORT_BLOCK (256 * 1024)
+
+enum {
+        IMPORT_CSV,
+        IMPORT_SEGMENT,
+        IMPORT_PHOTO,
+        IMPORT_ARCHIVED
+};
+
+typedef struct _import_item_t {
+        int type;
+        /* The path of the file, or its name in the archive */
+        char* path;
+        int archive;
+        long size;
+} import_item_t;
+
+/* The format of the spill files */
+typedef struct _import_record_t {
+        uint32_t timestamp;
+        int32_t osd_id;
+        float value;
+} import_record_t;
+
+typedef struct _import_list_t {
+        import_record_t* records;
+        long count;
+        long len;
+} import_list_t;
+
+typedef struct _import_spill_t {
+        long day;
+        FILE* fp;
+        unsigned long used;
+} import_spill_t;
+
+/* Shared with the workers: the next task to take, and the counters
+   of each worker. */
+typedef struct _import_shared_t {
+        int next;
+        import_stats_t stats[IMPORT_MAX_JOBS];
+} import_shared_t;
+
+struct _import_t {
+        char* work_dir;
+        char* queue_dir;
+        char* photo_dir;
+        int jobs;
+
+        import_scan_t scan;
+        import_has_photo_t has_photo;
+        void* data;
+
+        import_item_t* items;
+        int num_items;
+        int max_items;
+
+        archive_t** archives;
+        int num_archives;
+
+        long* days;
+        int num_days;
+
+        import_shared_t* shared;
+        import_stats_t stats;
+
+        /* The state of a worker */
+        int worker;
+        import_spill_t spill[IMPORT_OPEN_FILES];
+        unsigned long clock;
+        timestamp_cache_t cache;
+
+        /* Cache for the conversion of the CSV timestamps: the epoch
+           time of the last "YYYY-MM-DDTHH" seen. */
+        char hour[14];
+        time_t hour_start;
+};
+
+typedef int (*import_task_t)(import_t* imp, int index);
+
+import_t* new_import(const char* work_dir, const char* queue_dir,
+                     const char* photo_dir, int jobs)
+{
+        import_t* imp = (import_t*) malloc(sizeof(import_t));
+        if (imp == NULL) {
+                log_err("Import: out of memory");
+                return NULL;
+        }
+        memset(imp, 0, sizeof(import_t));
+
+        imp->work_dir = strdup(work_dir);
+        imp->queue_dir = strdup(queue_dir);
+        imp->photo_dir = strdup(photo_dir);
+        imp->jobs = (jobs < 1)? 1 : (jobs > IMPORT_MAX_JOBS)? IMPORT_MAX_JOBS : jobs;
+
+        imp->shared = (import_shared_t*) mmap(NULL, sizeof(import_shared_t),
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (imp->shared == MAP_FAILED) {
+                log_err("Import: Failed to map the shared counters");
+                imp->shared = NULL;
+                delete_import(imp);
+                return NULL;
+        }
+
+        return imp;
+}
+
+void delete_import(import_t* imp)
+{
+        for (int i = 0; i < imp->num_items; i++)
+                free(imp->items[i].path);
+        if (imp->items)
+                free(imp->items);
+        for (int i = 0; i < imp->num_archives; i++)
+                delete_archive(imp->archives[i]);
+        if (imp->archives)
+                free(imp->archives);
+        if (imp->days)
+                free(imp->days);
+        if (imp->shared)
+                munmap(imp->shared, sizeof(import_shared_t));
+        free(imp->work_dir);
+        free(imp->queue_dir);
+        free(imp->photo_dir);
+        free(imp);
+}
+
+void import_set_store(import_t* imp, import_scan_t scan,
+                      import_has_photo_t has_photo, void* data)
+{
+        imp->scan = scan;
+        imp->has_photo = has_photo;
+        imp->data = data;
+}
+
+void import_get_stats(import_t* imp, import_stats_t* stats)
+{
+        *stats = imp->stats;
+}
+
+static import_stats_t* import_worker_stats(import_t* imp)
+{
+        return &imp->shared->stats[imp->worker];
+}
+
+static int import_has_suffix(const char* name, const char* suffix)
+{
+        int len = strlen(name);
+        int n = strlen(suffix);
+        return (len > n) && (strcmp(name + len - n, suffix) == 0);
+}
+
+static int import_is_digits(const char* s, int n)
+{
+        for (int i = 0; i < n; i++)
+                if (!isdigit((unsigned char) s[i]))
+                        return 0;
+        return 1;
+}
+
+/* YYYYMMDD-HHMMSS.jpg, as in the photostream */
+static int import_is_photo(const char* name)
+{
+        return (strlen(name) == 19) && import_is_digits(name, 8) && (name[8] == '-')
+                && import_is_digits(name + 9, 6) && (strcmp(name + 15, ".jpg") == 0);
+}
+
+static int import_is_datapoints(const char* name)
+{
+        return import_has_suffix(name, ".csv") && (strcmp(name, "rollups.csv") != 0);
+}
+
+int import_queue_day(const char* name, time_t* start)
+{
+        struct tm tm;
+
+        if ((strlen(name) != 12) || !import_is_digits(name, 8)
+            || (strcmp(name + 8, ".csv") != 0))
+                return 0;
+
+        memset(&tm, 0, sizeof(struct tm));
+        if (sscanf(name, "%4d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3)
+                return 0;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        *start = timegm(&tm);
+        return 1;
+}
+
+static void import_queue_path(import_t* imp, long day, const char* ext, char* path, int len)
+{
+        timestamp_cache_t utc = { 1 };
+        char date[TIMESTAMP_MAXLEN];
+
+        timestamp_format(&utc, (time_t) day * IMPORT_DAY, TIMESTAMP_DATE, date);
+        snprintf(path, len, "%s/%s.%s", imp->queue_dir, date, ext);
+        path[len-1] = 0;
+}
+
+static int import_add_item(import_t* imp, int type, const char* path, int archive, long size)
+{
+        if (imp->num_items >= imp->max_items) {
+                int len = (imp->max_items == 0)? 256 : 2 * imp->max_items;
+                import_item_t* p = (import_item_t*) realloc(imp->items, len * sizeof(import_item_t));
+                if (p == NULL) {
+                        log_err("Import: out of memory");
+                        return -1;
+                }
+                imp->items = p;
+                imp->max_items = len;
+        }
+        import_item_t* item = &imp->items[imp->num_items];
+        item->type = type;
+        item->path = strdup(path);
+        item->archive = archive;
+        item->size = size;
+        if (item->path == NULL) {
+                log_err("Import: out of memory");
+                return -1;
+        }
+        imp->num_items++;
+        return 0;
+}
+
+/* The datapoints files and photos in the archives of a backup
+   directory. */
+static int import_add_archive(import_t* imp, const char* backup_dir)
+{
+        archive_t** p = (archive_t**) realloc(imp->archives, (imp->num_archives + 1) * sizeof(archive_t*));
+        if (p == NULL) {
+                log_err("Import: out of memory");
+                return -1;
+        }
+        imp->archives = p;
+
+        archive_t* archive = new_archive(backup_dir, ARCHIVE_MONTHLY);
+        if (archive == NULL)
+                return -1;
+
+        int index = imp->num_archives++;
+        imp->archives[index] = archive;
+
+        for (int i = 0; i < archive_count(archive); i++) {
+                const char* name = archive_get_name(archive, i);
+                if ((import_is_datapoints(name) || import_is_photo(name))
+                    && (import_add_item(imp, IMPORT_ARCHIVED, name, index, 0) != 0))
+                        return -1;
+        }
+        return 0;
+}
+
+static int import_walk(import_t* imp, const char* dirname, int depth)
+{
+        struct dirent *entry;
+        struct stat st;
+        char path[512];
+        int err = 0;
+
+        if (depth > IMPORT_MAX_DEPTH)
+                return 0;
+
+        DIR* dir = opendir(dirname);
+        if (dir == NULL) {
+                log_err("Import: Failed to open the directory '%s'", dirname);
+                return -1;
+        }
+
+        while ((err == 0) && ((entry = readdir(dir)) != NULL)) {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                int n = snprintf(path, 512, "%s/%s", dirname, entry->d_name);
+                if ((n < 0) || (n >= 512)) {
+                        log_warn("Import: Skipping %s/%s: the path is too long", 
+                                 dirname, entry->d_name);
+                        continue;
+                }
+
+                /* Symbolic links aren't followed. */
+                if (lstat(path, &st) != 0)
+                        continue;
+
+                if (S_ISDIR(st.st_mode)) {
+                        char index[512];
+                        n = snprintf(index, 512, "%s/index.txt", path);
+                        if ((strcmp(entry->d_name, "archives") == 0)
+                            && (n > 0) && (n < 512)
+                            && (access(index, R_OK) == 0))
+                                err = import_add_archive(imp, dirname);
+                        else
+                                err = import_walk(imp, path, depth + 1);
+
+                } else if (S_ISREG(st.st_mode) && (st.st_size > 0)) {
+                        if (import_is_datapoints(entry->d_name))
+                                err = import_add_item(imp, IMPORT_CSV, path, -1, st.st_size);
+                        else if (import_has_suffix(entry->d_name, ".seg"))
+                                err = import_add_item(imp, IMPORT_SEGMENT, path, -1, st.st_size);
+                        else if (import_is_photo(entry->d_name))
+                                err = import_add_item(imp, IMPORT_PHOTO, path, -1, st.st_size);
+                }
+        }
+
+        closedir(dir);
+        return err;
+}
+
+static int import_read_file(const char* path, unsigned char** data, long* size)
+{
+        struct stat st;
+
+        *data = NULL;
+        *size = 0;
+
+        if (stat(path, &st) != 0)
+                return -1;
+
+        *data = (unsigned char*) malloc(st.st_size > 0? st.st_size : 1);
+        if (*data == NULL) {
+                log_err("Import: out of memory");
+                return -1;
+        }
+
+        FILE* fp = fopen(path, "r");
+        if ((fp == NULL)
+            || ((st.st_size > 0) && (fread(*data, st.st_size, 1, fp) != 1))) {
+                log_err("Import: Failed to read '%s'", path);
+                if (fp) fclose(fp);
+                free(*data);
+                *data = NULL;
+                return -1;
+        }
+        fclose(fp);
+
+        *size = st.st_size;
+        return 0;
+}
+
+/* Converts "YYYY-MM-DDTHH:MM:SS", in local time. mktime() is only
+   called once per hour of data. */
+static int import_convert_time(import_t* imp, const char* s, time_t* t)
+{
+        if (memcmp(s, imp->hour, 13) != 0) {
+                struct tm tm;
+                memset(&tm, 0, sizeof(struct tm));
+                if (sscanf(s, "%4d-%2d-%2dT%2d", &tm.tm_year, &tm.tm_mon,
+                           &tm.tm_mday, &tm.tm_hour) != 4)
+                        return -1;
+                tm.tm_year -= 1900;
+                tm.tm_mon -= 1;
+                tm.tm_isdst = -1;
+                imp->hour_start = mktime(&tm);
+                memcpy(imp->hour, s, 13);
+                imp->hour[13] = 0;
+        }
+        if (!isdigit((unsigned char) s[14]) || !isdigit((unsigned char) s[15])
+            || !isdigit((unsigned char) s[17]) || !isdigit((unsigned char) s[18]))
+                return -1;
+        *t = imp->hour_start
+                + 60 * (10 * (s[14] - '0') + (s[15] - '0'))
+                + 10 * (s[17] - '0') + (s[18] - '0');
+        return 0;
+}
+
+/* Parses the complete lines in the buffer and returns the number of
+   bytes used, or -1 if fun failed. Invalid lines are counted and
+   skipped. */
+static long import_parse_csv(import_t* imp, const char* buf, long len,
+                             datalog_callback_t fun, void* data)
+{
+        const char* end = buf + len;
+        const char* p = buf;
+        char number[32];
+
+        while (p < end) {
+                const char* eol = memchr(p, '\n', end - p);
+                if (eol == NULL)
+                        break;
+
+                char* e;
+                long id = strtol(p, &e, 10);
+                time_t t;
+                if ((e > p) && (e + 21 < eol) && (*e == ',') && (e[20] == ',')
+                    && (import_convert_time(imp, e + 1, &t) == 0)) {
+                        int n = eol - (e + 21);
+                        if (n > 31)
+                                n = 31;
+                        memcpy(number, e + 21, n);
+                        number[n] = 0;
+                        if (fun(data, (int) id, t, strtof(number, NULL)) != 0)
+                                return -1;
+                } else {
+                        import_worker_stats(imp)->invalid++;
+                }
+                p = eol + 1;
+        }
+
+        return p - buf;
+}
+
+static int import_close_spill(import_spill_t* spill)
+{
+        int err = 0;
+        if (spill->fp != NULL) {
+                if (fclose(spill->fp) != 0) {
+                        log_err("Import: Failed to write a spill file");
+                        err = -1;
+                }
+                spill->fp = NULL;
+        }
+        return err;
+}
+
+static FILE* import_spill_file(import_t* imp, long day)
+{
+        char path[512];
+        int k = 0;
+
+        for (int i = 0; i < IMPORT_OPEN_FILES; i++) {
+                if ((imp->spill[i].fp != NULL) && (imp->spill[i].day == day)) {
+                        imp->spill[i].used = ++imp->clock;
+                        return imp->spill[i].fp;
+                }
+                if (imp->spill[i].used < imp->spill[k].used)
+                        k = i;
+        }
+
+        /* Reuse the least recently used slot. */
+        import_spill_t* spill = &imp->spill[k];
+        if (import_close_spill(spill) != 0)
+                return NULL;
+
+        snprintf(path, 512, "%s/%06ld-%02d.spill", imp->work_dir, day, imp->worker);
+        path[511] = 0;
+
+        spill->fp = fopen(path, "a");
+        if (spill->fp == NULL) {
+                log_err("Import: Failed to open '%s'", path);
+                return NULL;
+        }
+        spill->day = day;
+        spill->used = ++imp->clock;
+        return spill->fp;
+}
+
+static int import_spill(void* data, int osd_id, time_t timestamp, float value)
+{
+        import_t* imp = (import_t*) data;
+        import_stats_t* stats = import_worker_stats(imp);
+        import_record_t rec;
+
+        if ((timestamp <= 0) || (osd_id < 0)) {
+                stats->invalid++;
+                return 0;
+        }
+
+        FILE* fp = import_spill_file(imp, (long) (timestamp / IMPORT_DAY));
+        if (fp == NULL)
+                return -1;
+
+        rec.timestamp = (uint32_t) timestamp;
+        rec.osd_id = (int32_t) osd_id;
+        rec.value = value;
+        if (fwrite(&rec, sizeof(import_record_t), 1, fp) != 1) {
+                log_err("Import: Failed to write a spill file");
+                return -1;
+        }
+        stats->datapoints++;
+        return 0;
+}
+
+/* Reads a CSV file in blocks, so that large files don't have to
+   fit in memory. */
+static int import_read_csv(import_t* imp, const char* path)
+{
+        int err = 0;
+        long len = 0;
+
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL) {
+                log_err("Import: Failed to open '%s'", path);
+                return -1;
+        }
+
+        char* buf = (char*) malloc(IMPORT_BLOCK);
+        if (buf == NULL) {
+                log_err("Import: out of memory");
+                fclose(fp);
+                return -1;
+        }
+
+        while (1) {
+                size_t n = fread(buf + len, 1, IMPORT_BLOCK - len, fp);
+                if (n == 0)
+                        break;
+                len += n;
+
+                long used = import_parse_csv(imp, buf, len, import_spill, imp);
+                if (used < 0) {
+                        err = -1;
+                        break;
+                }
+                if ((used == 0) && (len == IMPORT_BLOCK)) {
+                        /* Not a datapoints file */
+                        import_worker_stats(imp)->invalid++;
+                        len = 0;
+                        continue;
+                }
+                memmove(buf, buf + used, len - used);
+                len -= used;
+        }
+
+        if (ferror(fp)) {
+                log_err("Import: Failed to read '%s'", path);
+                err = -1;
+        }
+
+        /* A last line without a newline may have been torn. */
+        if ((err == 0) && (len > 0))
+                import_worker_stats(imp)->invalid++;
+
+        free(buf);
+        fclose(fp);
+        return err;
+}
+
+static int import_copy_photo(import_t* imp, const char* name,
+                             const unsigned char* data, long size)
+{
+        import_stats_t* stats = import_worker_stats(imp);
+        char path[512];
+        char tmp[512];
+
+        snprintf(path, 512, "%s/%s", imp->photo_dir, name);
+        path[511] = 0;
+
+        if ((access(path, F_OK) == 0)
+            || ((imp->has_photo != NULL) && imp->has_photo(imp->data, name))) {
+                stats->photo_duplicates++;
+                return 0;
+        }
+
+        snprintf(tmp, 512, "%s/%s.%d.tmp", imp->work_dir, name, imp->worker);
+        tmp[511] = 0;
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                log_err("Import: Failed to create %s", tmp);
+                return -1;
+        }
+        int err = ((write(fd, data, size) != size) || (fdatasync(fd) != 0));
+        if (close(fd) != 0)
+                err = 1;
+        if (err) {
+                log_err("Import: Failed to write %s", tmp);
+                unlink(tmp);
+                return -1;
+        }
+
+        /* link() doesn't replace a photo that another worker copied
+           in the meantime. */
+        if (link(tmp, path) == 0) {
+                stats->photos++;
+        } else if (errno == EEXIST) {
+                stats->photo_duplicates++;
+        } else {
+                log_err("Import: Failed to create %s", path);
+                err = 1;
+        }
+        unlink(tmp);
+
+        return err? -1 : 0;
+}
+
+static const char* import_basename(const char* path)
+{
+        const char* s = strrchr(path, '/');
+        return (s != NULL)? s + 1 : path;
+}
+
+/* The first pass: one source file */
+static int import_read_item(import_t* imp, int index)
+{
+        import_item_t* item = &imp->items[index];
+        import_stats_t* stats = import_worker_stats(imp);
+        unsigned char* data;
+        long size;
+        int err = 0;
+
+        switch (item->type) {
+
+        case IMPORT_CSV:
+                stats->files++;
+                return import_read_csv(imp, item->path);
+
+        case IMPORT_SEGMENT:
+                stats->files++;
+                return datalog_foreach_file(item->path, import_spill, imp);
+
+        case IMPORT_PHOTO:
+                if (import_read_file(item->path, &data, &size) != 0)
+                        return -1;
+                err = import_copy_photo(imp, import_basename(item->path), data, size);
+                free(data);
+                return err;
+
+        case IMPORT_ARCHIVED:
+                if (archive_read(imp->archives[item->archive], item->path, &data, &size) != 0) {
+                        log_err("Import: Failed to read '%s' in the archives", item->path);
+                        return -1;
+                }
+                if (import_is_photo(item->path)) {
+                        err = import_copy_photo(imp, item->path, data, size);
+                } else {
+                        stats->files++;
+                        long used = import_parse_csv(imp, (const char*) data, size, import_spill, imp);
+                        if (used < 0)
+                                err = -1;
+                        else if (used < size)
+                                stats->invalid++;
+                }
+                free(data);
+                return err;
+        }
+
+        return 0;
+}
+
+static int import_finish_reading(import_t* imp)
+{
+        int err = 0;
+        for (int i = 0; i < IMPORT_OPEN_FILES; i++)
+                if (import_close_spill(&imp->spill[i]) != 0)
+                        err = -1;
+        return err;
+}
+
+static int import_list_add(void* data, int osd_id, time_t timestamp, float value)
+{
+        import_list_t* list = (import_list_t*) data;
+        if (list->count >= list->len) {
+                long len = (list->len == 0)? 4096 : 2 * list->len;
+                import_record_t* p = (import_record_t*) realloc(list->records, len * sizeof(import_record_t));
+                if (p == NULL) {
+                        log_err("Import: out of memory");
+                        return -1;
+                }
+                list->records = p;
+                list->len = len;
+        }
+        import_record_t* rec = &list->records[list->count++];
+        rec->timestamp = (uint32_t) timestamp;
+        rec->osd_id = (int32_t) osd_id;
+        rec->value = value;
+        return 0;
+}
+
+static int import_list_append_file(import_list_t* list, const char* path)
+{
+        struct stat st;
+
+        if (stat(path, &st) != 0)
+                return 0;
+
+        long n = st.st_size / sizeof(import_record_t);
+        if (list->count + n > list->len) {
+                import_record_t* p = (import_record_t*) realloc(list->records,
+                                                                (list->count + n) * sizeof(import_record_t));
+                if (p == NULL) {
+                        log_err("Import: out of memory");
+                        return -1;
+                }
+                list->records = p;
+                list->len = list->count + n;
+        }
+
+        FILE* fp = fopen(path, "r");
+        if ((fp == NULL)
+            || ((n > 0) && (fread(list->records + list->count, sizeof(import_record_t), n, fp) != (size_t) n))) {
+                log_err("Import: Failed to read '%s'", path);
+                if (fp) fclose(fp);
+                return -1;
+        }
+        fclose(fp);
+        list->count += n;
+        return 0;
+}
+
+static int import_compare_records(const void* a, const void* b)
+{
+        const import_record_t* ra = (const import_record_t*) a;
+        const import_record_t* rb = (const import_record_t*) b;
+        if (ra->timestamp != rb->timestamp)
+                return (ra->timestamp < rb->timestamp)? -1 : 1;
+        return (ra->osd_id < rb->osd_id)? -1 : (ra->osd_id > rb->osd_id)? 1 : 0;
+}
+
+/* Sorts the list and removes the records with the same datastream
+   and timestamp as the one before. Returns the number removed. */
+static long import_list_unique(import_list_t* list)
+{
+        if (list->count == 0)
+                return 0;
+
+        qsort(list->records, list->count, sizeof(import_record_t), import_compare_records);
+
+        long n = 1;
+        for (long i = 1; i < list->count; i++)
+                if (import_compare_records(&list->records[i], &list->records[n-1]) != 0)
+                        list->records[n++] = list->records[i];
+
+        long removed = list->count - n;
+        list->count = n;
+        return removed;
+}
+
+/* Removes the records of list that are also in stored. Both lists
+   must be sorted. Returns the number removed. */
+static long import_list_subtract(import_list_t* list, import_list_t* stored)
+{
+        long n = 0;
+        long k = 0;
+
+        for (long i = 0; i < list->count; i++) {
+                while ((k < stored->count)
+                       && (import_compare_records(&stored->records[k], &list->records[i]) < 0))
+                        k++;
+                if ((k < stored->count)
+                    && (import_compare_records(&stored->records[k], &list->records[i]) == 0))
+                        continue;
+                list->records[n++] = list->records[i];
+        }
+
+        long removed = list->count - n;
+        list->count = n;
+        return removed;
+}
+
+static int import_write_queue(import_t* imp, long day, import_list_t* list)
+{
+        char path[512];
+        char tmp[512];
+        char s[TIMESTAMP_MAXLEN];
+
+        import_queue_path(imp, day, "csv", path, 512);
+        import_queue_path(imp, day, "tmp", tmp, 512);
+
+        FILE* fp = fopen(tmp, "w");
+        if (fp == NULL) {
+                log_err("Import: Failed to create '%s'", tmp);
+                return -1;
+        }
+
+        for (long i = 0; i < list->count; i++) {
+                import_record_t* rec = &list->records[i];
+                timestamp_format(&imp->cache, (time_t) rec->timestamp, TIMESTAMP_ISO, s);
+                fprintf(fp, "%d,%s,%f\n", (int) rec->osd_id, s, rec->value);
+        }
+
+        int err = ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0));
+        if (fclose(fp) != 0)
+                err = 1;
+        if (err || (rename(tmp, path) != 0)) {
+                log_err("Import: Failed to write '%s'", path);
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+static int import_write_records(const char* path, import_list_t* list)
+{
+        FILE* fp = fopen(path, "w");
+        if (fp == NULL) {
+                log_err("Import: Failed to create '%s'", path);
+                return -1;
+        }
+        int err = ((list->count > 0)
+                   && (fwrite(list->records, sizeof(import_record_t), list->count, fp)
+                       != (size_t) list->count));
+        if (fclose(fp) != 0)
+                err = 1;
+        if (err) {
+                log_err("Import: Failed to write '%s'", path);
+                return -1;
+        }
+        return 0;
+}
+
+/* The second pass: the datapoints of one day */
+static int import_merge_day(import_t* imp, int index)
+{
+        import_stats_t* stats = import_worker_stats(imp);
+        import_list_t list, stored;
+        char path[512];
+        unsigned char* data;
+        long size;
+        long added;
+        long day = imp->days[index];
+        time_t start = (time_t) day * IMPORT_DAY;
+        int err = 0;
+
+        memset(&list, 0, sizeof(import_list_t));
+        memset(&stored, 0, sizeof(import_list_t));
+
+        for (int k = 0; (k < imp->jobs) && (err == 0); k++) {
+                snprintf(path, 512, "%s/%06ld-%02d.spill", imp->work_dir, day, k);
+                path[511] = 0;
+                err = import_list_append_file(&list, path);
+        }
+        if (err != 0)
+                goto cleanup;
+
+        stats->duplicates += import_list_unique(&list);
+
+        /* What is stored already, including the day's file in the
+           queue. */
+        if (imp->scan != NULL) {
+                err = imp->scan(imp->data, start, start + IMPORT_DAY - 1, import_list_add, &stored);
+                if (err != 0) {
+                        log_err("Import: Failed to read the stored datapoints");
+                        goto cleanup;
+                }
+                import_list_unique(&stored);
+                stats->duplicates += import_list_subtract(&list, &stored);
+        }
+
+        if (list.count == 0)
+                goto cleanup;
+
+        /* The new datapoints are passed back to the main process... */
+        snprintf(path, 512, "%s/%06ld.new", imp->work_dir, day);
+        path[511] = 0;
+        err = import_write_records(path, &list);
+        if (err != 0)
+                goto cleanup;
+
+        /* ... and merged with the day's file in the queue. */
+        added = list.count;
+        import_queue_path(imp, day, "csv", path, 512);
+        if ((access(path, F_OK) == 0) && (import_read_file(path, &data, &size) == 0)) {
+                if (import_parse_csv(imp, (const char*) data, size, import_list_add, &list) < 0)
+                        err = -1;
+                free(data);
+                if (err != 0)
+                        goto cleanup;
+                import_list_unique(&list);
+        }
+
+        err = import_write_queue(imp, day, &list);
+        if (err == 0) {
+                stats->added += added;
+                stats->days++;
+        }
+
+ cleanup:
+        if (list.records)
+                free(list.records);
+        if (stored.records)
+                free(stored.records);
+        return err;
+}
+
+static void import_work(import_t* imp, int count, import_task_t task)
+{
+        int err = 0;
+
+        while (1) {
+                int i = __sync_fetch_and_add(&imp->shared->next, 1);
+                if (i >= count)
+                        break;
+                if (task(imp, i) != 0)
+                        err = -1;
+        }
+        if ((task == import_read_item) && (import_finish_reading(imp) != 0))
+                err = -1;
+
+        fflush(NULL);
+        _exit((err == 0)? 0 : 1);
+}
+
+/* Runs the task for the indices [0, count) in the worker
+   processes. Returns -1 if one of the tasks failed. */
+static int import_spawn(import_t* imp, int count, import_task_t task)
+{
+        pid_t pids[IMPORT_MAX_JOBS];
+        int started = 0;
+        int err = 0;
+
+        if (count == 0)
+                return 0;
+
+        imp->shared->next = 0;
+        fflush(NULL);
+
+        for (int k = 0; (k < imp->jobs) && (k < count); k++) {
+                pid_t pid = fork();
+                if (pid == -1) {
+                        log_err("Import: fork failed: %s", strerror(errno));
+                        break;
+                } else if (pid == 0) {
+                        imp->worker = k;
+                        import_work(imp, count, task);
+                        /* not reached */
+                }
+                pids[started++] = pid;
+        }
+
+        if (started == 0)
+                return -1;
+
+        for (int k = 0; k < started; k++) {
+                int status;
+                if ((waitpid(pids[k], &status, 0) != pids[k])
+                    || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+                        err = -1;
+        }
+
+        return err;
+}
+
+static int import_compare_items(const void* a, const void* b)
+{
+        long sa = ((const import_item_t*) a)->size;
+        long sb = ((const import_item_t*) b)->size;
+        return (sa > sb)? -1 : (sa < sb)? 1 : 0;
+}
+
+static int import_compare_days(const void* a, const void* b)
+{
+        long da = *(const long*) a;
+        long db = *(const long*) b;
+        return (da < db)? -1 : (da > db)? 1 : 0;
+}
+
+/* The days that have spill files, in order. */
+static int import_list_days(import_t* imp)
+{
+        struct dirent *entry;
+        long day;
+        int worker;
+        int len = 0;
+
+        imp->num_days = 0;
+
+        DIR* dir = opendir(imp->work_dir);
+        if (dir == NULL) {
+                log_err("Import: Failed to open the directory '%s'", imp->work_dir);
+                return -1;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+                if (!import_has_suffix(entry->d_name, ".spill")
+                    || (sscanf(entry->d_name, "%ld-%d", &day, &worker) != 2))
+                        continue;
+                if (imp->num_days >= len) {
+                        len = (len == 0)? 256 : 2 * len;
+                        long* p = (long*) realloc(imp->days, len * sizeof(long));
+                        if (p == NULL) {
+                                log_err("Import: out of memory");
+                                closedir(dir);
+                                return -1;
+                        }
+                        imp->days = p;
+                }
+                imp->days[imp->num_days++] = day;
+        }
+        closedir(dir);
+
+        if (imp->num_days > 1) {
+                qsort(imp->days, imp->num_days, sizeof(long), import_compare_days);
+                int n = 1;
+                for (int i = 1; i < imp->num_days; i++)
+                        if (imp->days[i] != imp->days[n-1])
+                                imp->days[n++] = imp->days[i];
+                imp->num_days = n;
+        }
+        return 0;
+}
+
+static void import_clean(import_t* imp)
+{
+        struct dirent *entry;
+        char path[512];
+
+        DIR* dir = opendir(imp->work_dir);
+        if (dir == NULL)
+                return;
+        while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.')
+                        continue;
+                snprintf(path, 512, "%s/%s", imp->work_dir, entry->d_name);
+                path[511] = 0;
+                unlink(path);
+        }
+        closedir(dir);
+}
+
+static int import_mkdir(const char* path)
+{
+        if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+                log_err("Import: Failed to create the directory '%s'", path);
+                return -1;
+        }
+        return 0;
+}
+
+static void import_sync_dir(const char* path)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+                fsync(fd);
+                close(fd);
+        }
+}
+
+/* Hands the new datapoints to fun, one day after the other. */
+static int import_report(import_t* imp, datalog_callback_t fun, void* data)
+{
+        import_list_t list;
+        char path[512];
+        int err = 0;
+
+        memset(&list, 0, sizeof(import_list_t));
+
+        for (int i = 0; (i < imp->num_days) && (err == 0); i++) {
+                snprintf(path, 512, "%s/%06ld.new", imp->work_dir, imp->days[i]);
+                path[511] = 0;
+                list.count = 0;
+                err = import_list_append_file(&list, path);
+                for (long k = 0; (k < list.count) && (err == 0); k++)
+                        err = fun(data, list.records[k].osd_id,
+                                  (time_t) list.records[k].timestamp,
+                                  list.records[k].value);
+        }
+
+        if (list.records)
+                free(list.records);
+        return err;
+}
+
+int import_run(import_t* imp, const char* source, datalog_callback_t fun, void* data)
+{
+        int err = 0;
+
+        memset(&imp->stats, 0, sizeof(import_stats_t));
+        memset(imp->shared, 0, sizeof(import_shared_t));
+
+        if ((import_mkdir(imp->work_dir) != 0)
+            || (import_mkdir(imp->queue_dir) != 0)
+            || (import_mkdir(imp->photo_dir) != 0))
+                return -1;
+
+        /* Left over by an import that didn't finish */
+        import_clean(imp);
+
+        if (import_walk(imp, source, 0) != 0)
+                return -1;
+
+        log_info("Import: %d files and %d archives in '%s', %d workers",
+                 imp->num_items, imp->num_archives, source, imp->jobs);
+
+        /* The largest files first, so that the workers finish at
+           about the same time. */
+        qsort(imp->items, imp->num_items, sizeof(import_item_t), import_compare_items);
+
+        if (import_spawn(imp, imp->num_items, import_read_item) != 0) {
+                log_err("Import: Some of the files could not be read");
+                err = -1;
+        }
+        import_sync_dir(imp->photo_dir);
+
+        if (import_list_days(imp) != 0) {
+                import_clean(imp);
+                return -1;
+        }
+
+        if (import_spawn(imp, imp->num_days, import_merge_day) != 0) {
+                log_err("Import: Some of the days could not be merged");
+                err = -1;
+        }
+        import_sync_dir(imp->queue_dir);
+
+        if ((fun != NULL) && (import_report(imp, fun, data) != 0))
+                err = -1;
+
+        import_clean(imp);
+        rmdir(imp->work_dir);
+
+        for (int k = 0; k < IMPORT_MAX_JOBS; k++) {
+                import_stats_t* s = &imp->shared->stats[k];
+                imp->stats.files += s->files;
+                imp->stats.datapoints += s->datapoints;
+                imp->stats.invalid += s->invalid;
+                imp->stats.duplicates += s->duplicates;
+                imp->stats.added += s->added;
+                imp->stats.days += s->days;
+                imp->stats.photos += s->photos;
+                imp->stats.photo_duplicates += s->photo_duplicates;
+        }
+
+        return err;
+}
@@ -0,0 +1,105 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _IMPORT_H_
+#define _IMPORT_H_
+
+#include <time.h>
+#include "datalog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* Bulk import of the data of a box that was offline for a
+           long time, or of an SD card taken from the field. The
+           source directory is walked recursively for:
+
+             *.csv      datapoints, "id,YYYY-MM-DDTHH:MM:SS,value"
+                        (except rollups.csv)
+             *.seg      segments of a datapoints log
+             archives/  the archives of a backup directory
+             *.jpg      photos named YYYYMMDD-HHMMSS.jpg
+
+           The import runs in two passes, each spread over a number
+           of worker processes. The first pass reads the sources and
+           sorts the datapoints into one spill file per day (UTC) in
+           the work directory, and copies the new photos. The second
+           pass takes one day at a time: it sorts the datapoints,
+           drops the duplicates (same datastream and timestamp) and
+           the datapoints that are already stored, and merges the
+           rest into the day's file in the queue directory,
+           <queue>/YYYYMMDD.csv, in time order. The memory used by a
+           worker is bounded by the datapoints of one day.
+
+           A card image has to be mounted first (mount -o loop,ro). */
+
+        typedef struct _import_stats_t {
+                long files;
+                long datapoints;
+                long invalid;
+                long duplicates;
+                long added;
+                long days;
+                long photos;
+                long photo_duplicates;
+        } import_stats_t;
+
+        /* Calls fun for the datapoints in [from, to] that are
+           already stored, in any order. */
+        typedef int (*import_scan_t)(void* data, time_t from, time_t to,
+                                     datalog_callback_t fun, void* fun_data);
+
+        /* Returns 1 if a photo with this name is already stored. */
+        typedef int (*import_has_photo_t)(void* data, const char* name);
+
+        typedef struct _import_t import_t;
+
+        /* The work directory, the queue directory and the photo
+           directory must be on the same file system. jobs is the
+           number of worker processes. */
+        import_t* new_import(const char* work_dir, const char* queue_dir,
+                             const char* photo_dir, int jobs);
+        void delete_import(import_t* imp);
+
+        /* The stored data, to check for duplicates. The callbacks
+           are called in the worker processes. */
+        void import_set_store(import_t* imp, import_scan_t scan,
+                              import_has_photo_t has_photo, void* data);
+
+        /* Imports the data in the source directory. fun is called
+           in this process for every datapoint that was added, one
+           day after the other, and in time order within a day.
+           Returns 0 if all the sources were imported. */
+        int import_run(import_t* imp, const char* source,
+                       datalog_callback_t fun, void* data);
+
+        void import_get_stats(import_t* imp, import_stats_t* stats);
+
+        /* Returns 1 if the name is that of a day file in the queue
+           directory, and sets the start of the day. */
+        int import_queue_day(const char* name, time_t* start);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
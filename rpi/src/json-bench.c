@@ -0,0 +1,454 @@
+/*
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Times the operations of json.c on fixed documents: a small config
+   file and a large server response, both built in. Each benchmark is
+   repeated until it has run for a while, and the time and the number
+   of allocations per operation are printed. The allocations are
+   counted by wrapping malloc, calloc and realloc at link time
+   (-Wl,--wrap), see the json-bench target of the Makefile. */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "json.h"
+
+static double _min_time = 0.5;
+static const char* _filter = NULL;
+
+/******************************************************************************/
+
+static long _allocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+        _allocs++;
+        return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+        _allocs++;
+        return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+        _allocs++;
+        return __real_realloc(ptr, size);
+}
+
+/******************************************************************************/
+
+/* The config of a sensorbox, as saved by the web interface. */
+static const char* _config_text =
+        "{\n"
+        "  \"login\": {\"pwsalt\": \"g2jDI7088+kl\", \"pwhash\": \"dd9dc0780de4c0ff4bad8789f821e16b\"},\n"
+        "  \"general\": {\"name\": \"test_test\", \"email\": \"yourname@example.com\",\n"
+        "              \"timezone\": \"1\", \"latitude\": \"0.000000\", \"longitude\": \"0.000000\"},\n"
+        "  \"wired\": {\"enable\": \"yes\", \"inet\": \"dhcp\",\n"
+        "            \"static\": {\"address\": \"192.168.3.14\", \"netmask\": \"255.255.255.0\",\n"
+        "                       \"gateway\": \"192.168.3.1\"}},\n"
+        "  \"wifi\": {\"enable\": \"no\", \"ssid\": \"\", \"password\": \"\"},\n"
+        "  \"gsm\": {\"enable\": \"no\", \"pin\": \"\", \"apn\": \"orange.fr\", \"username\": \"orange\",\n"
+        "          \"password\": \"orange\", \"phone\": \"*99#\", \"baud\": \"115200\"},\n"
+        "  \"opensensordata\": {\"server\": \"http:\\/\\/opensensordata.net\",\n"
+        "                     \"key\": \"aaaa-bbbbcccc-dddd-eeee-ffff\", \"encoding\": \"csv\", \"rollup\": \"0\"},\n"
+        "  \"camera\": {\"enable\": \"yes\", \"device\": \"\\/dev\\/video0\", \"size\": \"640x480\",\n"
+        "             \"update\": \"fixed\", \"period\": \"30\",\n"
+        "             \"fixed\": [{\"h\": \"12\", \"m\": \"00\"}, {\"h\": \"\", \"m\": \"\"},\n"
+        "                       {\"h\": \"\", \"m\": \"\"}, {\"h\": \"\", \"m\": \"\"}]},\n"
+        "  \"sensors\": {\"trh\": \"yes\", \"trhx\": \"yes\", \"light\": \"yes\", \"usbbat\": \"yes\",\n"
+        "              \"soil\": \"no\", \"update\": \"60\", \"upload\": \"fixed\", \"period\": \"30\",\n"
+        "              \"fixed\": [{\"h\": \"12\", \"m\": \"00\"}, {\"h\": \"\", \"m\": \"\"},\n"
+        "                        {\"h\": \"\", \"m\": \"\"}, {\"h\": \"\", \"m\": \"\"}]},\n"
+        "  \"power\": {\"poweroff\": \"no\"},\n"
+        "  \"uplink\": {\"daily\": \"0\", \"session\": \"0\", \"deadline\": \"600\"},\n"
+        "  \"backup\": {\"archive\": \"month\", \"budget\": \"10\", \"maxsize\": \"0\"}\n"
+        "}\n";
+
+/* A response of the OpenSensorData server with 2000 datapoints. The
+   values come from a fixed generator, so the document is the same on
+   every run. */
+#define RESPONSE_POINTS 2000
+
+static char* response_create(int32* len)
+{
+        static const char* names[] = { "t", "rh", "tx", "rhx", "lum", "soil", "usbbat" };
+        int32 size = RESPONSE_POINTS * 256 + 64;
+        char* s = malloc(size);
+        unsigned long r = 12345;
+        int32 n = 0;
+
+        if (s == NULL)
+                return NULL;
+
+        n += sprintf(s + n, "{\"status\": \"ok\", \"datapoints\": [\n");
+        for (int i = 0; i < RESPONSE_POINTS; i++) {
+                r = r * 1103515245 + 12345;
+                int k = (r >> 16) % 7;
+                double value = (double) ((r >> 8) % 100000) / 100.0;
+                n += sprintf(s + n,
+                             "  {\"id\": %d, \"datastream\": %d, \"name\": \"%s\", "
+                             "\"timestamp\": \"2014-05-%02dT%02d:%02d:00Z\", "
+                             "\"value\": %g, \"flags\": [%s, %s], \"comment\": null}%s\n",
+                             100000 + i, 1000 + k, names[k],
+                             1 + (i / 1440) % 28, (i / 60) % 24, i % 60,
+                             value, (i & 1)? "true" : "false", (i & 2)? "true" : "false",
+                             (i < RESPONSE_POINTS - 1)? "," : "");
+        }
+        n += sprintf(s + n, "]}\n");
+        *len = n;
+        return s;
+}
+
+/******************************************************************************/
+
+typedef void (*bench_func_t)(void* data, long n);
+
+static double now()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec / 1.0e9;
+}
+
+/* Runs func with a growing number of operations until it takes at
+   least _min_time, and prints the time and allocations per operation
+   of the last run. */
+static void bench(const char* name, bench_func_t func, void* data)
+{
+        long n = 1;
+        double t;
+        long allocs;
+
+        if ((_filter != NULL) && (strstr(name, _filter) == NULL))
+                return;
+
+        for (;;) {
+                allocs = _allocs;
+                t = now();
+                func(data, n);
+                t = now() - t;
+                allocs = _allocs - allocs;
+                if (t >= _min_time)
+                        break;
+                if (t < _min_time / 100)
+                        n *= 10;
+                else
+                        n = (long) (1.2 * n * _min_time / t) + 1;
+        }
+
+        printf("%-28s %12.1f ns/op %10.2f allocs/op %10ld ops\n",
+               name, 1.0e9 * t / n, (double) allocs / n, n);
+        fflush(stdout);
+}
+
+/******************************************************************************/
+
+typedef struct _text_t {
+        const char* s;
+        int32 len;
+        json_parser_t* parser;
+} text_t;
+
+static json_object_t parse(json_parser_t* parser, const char* s, int32 len)
+{
+        json_parser_reset(parser);
+        if ((json_parser_feed(parser, s, len) != 0) || !json_parser_done(parser)) {
+                fprintf(stderr, "json-bench: %s\n", json_parser_errstr(parser));
+                exit(EXIT_FAILURE);
+        }
+        return json_parser_result(parser);
+}
+
+static void bench_parse(void* data, long n)
+{
+        text_t* text = (text_t*) data;
+        for (long i = 0; i < n; i++)
+                json_unref(parse(text->parser, text->s, text->len));
+}
+
+/******************************************************************************/
+
+typedef struct _path_bench_t {
+        json_object_t doc;
+        const char* expression;
+        json_path_t* path;
+} path_bench_t;
+
+static void bench_get(void* data, long n)
+{
+        path_bench_t* b = (path_bench_t*) data;
+        for (long i = 0; i < n; i++)
+                if (json_isnull(json_get(b->doc, b->expression)))
+                        exit(EXIT_FAILURE);
+}
+
+static void bench_path_eval(void* data, long n)
+{
+        path_bench_t* b = (path_bench_t*) data;
+        for (long i = 0; i < n; i++)
+                if (json_isnull(json_path_eval(b->path, b->doc)))
+                        exit(EXIT_FAILURE);
+}
+
+static void bench_path_compile(void* data, long n)
+{
+        path_bench_t* b = (path_bench_t*) data;
+        for (long i = 0; i < n; i++) {
+                json_path_t* path = json_path_compile(b->expression);
+                if (json_isnull(json_path_eval(path, b->doc)))
+                        exit(EXIT_FAILURE);
+                json_path_free(path);
+        }
+}
+
+/******************************************************************************/
+
+/* An operation is the set or the get of one member of an object of
+   the given size. */
+typedef struct _object_bench_t {
+        int32 size;
+        char** keys;
+        json_object_t object;
+} object_bench_t;
+
+static void bench_object_set(void* data, long n)
+{
+        object_bench_t* b = (object_bench_t*) data;
+        long done = 0;
+        while (done < n) {
+                json_object_t object = json_object_create();
+                for (int32 i = 0; (i < b->size) && (done < n); i++, done++)
+                        json_object_setnum(object, b->keys[i], i);
+                json_unref(object);
+        }
+}
+
+static void bench_object_get(void* data, long n)
+{
+        object_bench_t* b = (object_bench_t*) data;
+        int32 i = 0;
+        for (long k = 0; k < n; k++) {
+                if (json_isnull(json_object_get(b->object, b->keys[i])))
+                        exit(EXIT_FAILURE);
+                if (++i == b->size)
+                        i = 0;
+        }
+}
+
+/******************************************************************************/
+
+typedef struct _buffer_t {
+        char* s;
+        int32 len;
+        int32 size;
+} buffer_t;
+
+static int32 buffer_write(void* userdata, const char* s, int32 len)
+{
+        buffer_t* buffer = (buffer_t*) userdata;
+        if (buffer->len + len > buffer->size)
+                return -1;
+        memcpy(buffer->s + buffer->len, s, len);
+        buffer->len += len;
+        return 0;
+}
+
+typedef struct _serialise_bench_t {
+        json_object_t doc;
+        int32 flags;
+        buffer_t buffer;
+} serialise_bench_t;
+
+static void bench_serialise(void* data, long n)
+{
+        serialise_bench_t* b = (serialise_bench_t*) data;
+        for (long i = 0; i < n; i++) {
+                b->buffer.len = 0;
+                if (json_serialise(b->doc, b->flags, buffer_write, &b->buffer) != 0) {
+                        fprintf(stderr, "json-bench: serialisation failed\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+/******************************************************************************/
+
+static void usage(FILE* fp, int argc, char** argv)
+{
+        fprintf (fp,
+                 "Usage: %s [options] [file...]\n\n"
+                 "Options:\n"
+                 "-h | --help              Print this message\n"
+                 "-t | --time              Minimum time per benchmark, in seconds (default: 0.5)\n"
+                 "-f | --filter            Only run the benchmarks whose name contains the string\n"
+                 "The files are parsed as extra parse benchmarks.\n"
+                 "",
+                 argv[0]);
+}
+
+static void parse_arguments(int argc, char **argv)
+{
+        static const char short_options [] = "ht:f:";
+
+        static const struct option
+                long_options [] = {
+                { "help",        no_argument, NULL, 'h' },
+                { "time",        required_argument, NULL, 't' },
+                { "filter",      required_argument, NULL, 'f' },
+                { 0, 0, 0, 0 }
+        };
+
+        for (;;) {
+                int index, c = 0;
+
+                c = getopt_long(argc, argv, short_options, long_options, &index);
+
+                if (-1 == c)
+                        break;
+
+                switch (c) {
+                case 0: /* getopt_long() flag */
+                        break;
+
+                case 'h':
+                        usage(stdout, argc, argv);
+                        exit(EXIT_SUCCESS);
+                case 't':
+                        _min_time = atof(optarg);
+                        break;
+                case 'f':
+                        _filter = optarg;
+                        break;
+                default:
+                        usage(stderr, argc, argv);
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+static char* read_file(const char* filename, int32* len)
+{
+        FILE* fp = fopen(filename, "rb");
+        if (fp == NULL)
+                return NULL;
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        rewind(fp);
+        char* s = malloc(size + 1);
+        if ((s == NULL) || (fread(s, 1, size, fp) != size)) {
+                free(s);
+                fclose(fp);
+                return NULL;
+        }
+        fclose(fp);
+        *len = (int32) size;
+        return s;
+}
+
+int main(int argc, char **argv)
+{
+        static const int32 sizes[] = { 4, 16, 256, 4096 };
+        static const int32 flags[] = { 0, k_json_pretty, k_json_binary };
+        static const char* flag_names[] = { "compact", "pretty", "binary" };
+        char name[256];
+
+        parse_arguments(argc, argv);
+
+        json_parser_t* parser = json_parser_create();
+        text_t config = { _config_text, strlen(_config_text), parser };
+        text_t response = { NULL, 0, parser };
+        response.s = response_create(&response.len);
+        if ((parser == NULL) || (response.s == NULL))
+                return EXIT_FAILURE;
+
+        bench("parse/config", bench_parse, &config);
+        bench("parse/response", bench_parse, &response);
+        for (int i = optind; i < argc; i++) {
+                text_t file = { NULL, 0, parser };
+                file.s = read_file(argv[i], &file.len);
+                if (file.s == NULL) {
+                        fprintf(stderr, "json-bench: failed to read %s\n", argv[i]);
+                        return EXIT_FAILURE;
+                }
+                snprintf(name, sizeof(name), "parse/%s", argv[i]);
+                bench(name, bench_parse, &file);
+                free((char*) file.s);
+        }
+
+        json_object_t doc = parse(parser, config.s, config.len);
+        path_bench_t path = { doc, "wired.static.gateway", NULL };
+        path.path = json_path_compile(path.expression);
+        bench("get/interned", bench_get, &path);
+        bench("get/compiled", bench_path_eval, &path);
+        bench("get/compile-and-eval", bench_path_compile, &path);
+        json_path_free(path.path);
+        json_unref(doc);
+
+        for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                object_bench_t b = { sizes[i], NULL, NULL };
+                b.keys = malloc(b.size * sizeof(char*));
+                for (int32 k = 0; k < b.size; k++) {
+                        char key[32];
+                        snprintf(key, sizeof(key), "datastream-%ld", k);
+                        b.keys[k] = strdup(key);
+                }
+                b.object = json_object_create();
+                for (int32 k = 0; k < b.size; k++)
+                        json_object_setnum(b.object, b.keys[k], k);
+
+                snprintf(name, sizeof(name), "object/set-%ld", b.size);
+                bench(name, bench_object_set, &b);
+                snprintf(name, sizeof(name), "object/get-%ld", b.size);
+                bench(name, bench_object_get, &b);
+
+                json_unref(b.object);
+                for (int32 k = 0; k < b.size; k++)
+                        free(b.keys[k]);
+                free(b.keys);
+        }
+
+        doc = parse(parser, response.s, response.len);
+        for (int i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+                serialise_bench_t b = { doc, flags[i], { NULL, 0, 4 * response.len } };
+                b.buffer.s = malloc(b.buffer.size);
+                snprintf(name, sizeof(name), "serialise/%s", flag_names[i]);
+                bench(name, bench_serialise, &b);
+                free(b.buffer.s);
+        }
+        json_unref(doc);
+
+        free((char*) response.s);
+        json_parser_destroy(parser);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* A fuzz target for the parser and the path evaluator of json.c, for
+   libFuzzer (the json-fuzz target of the Makefile) or AFL (the
+   json-fuzz-afl target, built with JSON_FUZZ_MAIN).
+
+   If the input starts with a line of at most 128 bytes, that line is
+   used as a path expression and the rest as the document. The
+   document is parsed in one piece and again in two pieces, split at a
+   place picked by the input, and the two results must serialise to
+   the same text: where the buffers end must not change what the
+   parser sees. The document is then serialised in each format, and
+   the expression is evaluated on it. The events of a streaming parse
+   are counted too. */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "json.h"
+
+#define FUZZ_MAX_EXPRESSION 128
+#define FUZZ_MAX_OUTPUT (1 << 20)
+
+typedef struct _buffer_t {
+        char s[FUZZ_MAX_OUTPUT];
+        int32 len;
+} buffer_t;
+
+static buffer_t _out1;
+static buffer_t _out2;
+
+static int32 buffer_write(void* userdata, const char* s, int32 len)
+{
+        buffer_t* buffer = (buffer_t*) userdata;
+        if (buffer->len + len > FUZZ_MAX_OUTPUT)
+                return -1;
+        memcpy(buffer->s + buffer->len, s, len);
+        buffer->len += len;
+        return 0;
+}
+
+/* Returns the document, or NULL if it isn't valid. A document that is
+   followed by garbage is complete but refused, as in json_load(). */
+static json_object_t parse(json_parser_t* parser, const char* s, int32 len, int32 split)
+{
+        json_parser_reset(parser);
+        if ((json_parser_feed(parser, s, split) != 0)
+            || (json_parser_feed(parser, s + split, len - split) != 0)) {
+                if (json_parser_done(parser))
+                        json_unref(json_parser_result(parser));
+                return NULL;
+        }
+        if (!json_parser_done(parser))
+                return NULL;
+        return json_parser_result(parser);
+}
+
+static int32 count_event(void* userdata)
+{
+        (*(long*) userdata)++;
+        return 0;
+}
+
+static int32 count_string(void* userdata, const char* s, int32 len)
+{
+        (*(long*) userdata)++;
+        return 0;
+}
+
+static int32 count_number(void* userdata, double value)
+{
+        (*(long*) userdata)++;
+        return 0;
+}
+
+static int32 count_boolean(void* userdata, int32 value)
+{
+        (*(long*) userdata)++;
+        return 0;
+}
+
+static const json_sax_t _counter = {
+        count_event, count_event, count_event, count_event,
+        count_string, count_string, count_number, count_boolean,
+        count_event
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+        static json_parser_t* parser = NULL;
+        char expression[FUZZ_MAX_EXPRESSION + 1];
+        const char* s = (const char*) data;
+        int32 len = (size > 0x7fffffff)? 0x7fffffff : (int32) size;
+        int32 n = 0;
+        long events = 0;
+
+        if (parser == NULL) {
+                parser = json_parser_create();
+                if (parser == NULL)
+                        abort();
+        }
+
+        expression[0] = 0;
+        const char* nl = memchr(s, '\n', (len < FUZZ_MAX_EXPRESSION)? len : FUZZ_MAX_EXPRESSION);
+        if (nl != NULL) {
+                n = nl - s;
+                memcpy(expression, s, n);
+                expression[n] = 0;
+                s += n + 1;
+                len -= n + 1;
+        }
+
+        json_object_t doc = parse(parser, s, len, len);
+        int32 split = (len > 0)? (int32) (data[size - 1] % (len + 1)) : 0;
+        json_object_t doc2 = parse(parser, s, len, split);
+        if ((doc == NULL) != (doc2 == NULL))
+                abort();
+
+        if (doc != NULL) {
+                _out1.len = 0;
+                _out2.len = 0;
+                if ((json_serialise(doc, 0, buffer_write, &_out1) == 0)
+                    && (json_serialise(doc2, 0, buffer_write, &_out2) == 0)
+                    && ((_out1.len != _out2.len)
+                        || (memcmp(_out1.s, _out2.s, _out1.len) != 0)))
+                        abort();
+                _out1.len = 0;
+                json_serialise(doc, k_json_pretty, buffer_write, &_out1);
+                _out1.len = 0;
+                json_serialise(doc, k_json_binary, buffer_write, &_out1);
+        } else {
+                doc = json_null();
+        }
+
+        json_path_t* path = json_path_compile(expression);
+        if (path != NULL) {
+                json_path_eval(path, doc);
+                json_path_free(path);
+        }
+        json_get(doc, expression);
+        json_getstr(doc, expression);
+        json_getnum(doc, expression);
+
+        json_unref(doc2);
+        json_unref(doc);
+
+        json_parser_set_handler(parser, &_counter, &events);
+        parse(parser, s, len, split);
+        json_parser_set_handler(parser, NULL, NULL);
+
+        return 0;
+}
+
+#if defined(JSON_FUZZ_MAIN)
+
+/* Runs the files given on the command line, or the standard input,
+   through the target. With AFL, the standard input is read again for
+   each test case. */
+
+static int run_file(FILE* fp)
+{
+        static uint8_t buffer[FUZZ_MAX_OUTPUT];
+        size_t len = fread(buffer, 1, sizeof(buffer), fp);
+        return LLVMFuzzerTestOneInput(buffer, len);
+}
+
+int main(int argc, char **argv)
+{
+        if (argc > 1) {
+                for (int i = 1; i < argc; i++) {
+                        FILE* fp = fopen(argv[i], "rb");
+                        if (fp == NULL) {
+                                fprintf(stderr, "json-fuzz: failed to open %s\n", argv[i]);
+                                return EXIT_FAILURE;
+                        }
+                        run_file(fp);
+                        fclose(fp);
+                }
+                return EXIT_SUCCESS;
+        }
+
+#if defined(__AFL_LOOP)
+        while (__AFL_LOOP(1000)) {
+                run_file(stdin);
+                clearerr(stdin);
+        }
+#else
+        run_file(stdin);
+#endif
+        return EXIT_SUCCESS;
+}
+
+#endif
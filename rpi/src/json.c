@@ -18,6 +18,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _BSD_SOURCE
 #include "json.h"
 
 #include <stdlib.h>
@@ -25,9 +26,26 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <math.h>
+#include <stdint.h>
+#include <float.h>
+#if !defined(JSON_EMBEDDED)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
-#define HASHTABLE_MIN_SIZE 7
-#define HASHTABLE_MAX_SIZE 13845163
+/* The parser looks for the end of the whitespace and of the string
+   bodies 16 bytes at a time when the target has SSE2 or NEON. Define
+   JSON_NO_SIMD to use the plain loops. */
+#if !defined(JSON_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_SIMD_SSE2 1
+#elif !defined(JSON_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define JSON_SIMD_NEON 1
+#endif
 
 char* json_strdup(const char* s);
 
@@ -35,10 +53,31 @@ char* json_strdup(const char* s);
 #define base_get(_b,_type) ((_type*)(_b)->value.data)
 #define base_getnum(_b)    (_b)->value.number
 
-static base_t* _null = NULL;
-static base_t* _true = NULL;
-static base_t* _false = NULL;
-static base_t* _undefined = NULL;
+/* The counters that are shared between threads: the refcounts, the
+   number of live values of an arena, and the slots of the path
+   cache. */
+#if defined(__ATOMIC_ACQ_REL)
+#define json_atomic_add(_p, _v)      __atomic_add_fetch(_p, _v, __ATOMIC_ACQ_REL)
+#define json_atomic_load(_p)         __atomic_load_n(_p, __ATOMIC_ACQUIRE)
+#define json_atomic_cas(_p, _old, _new) \
+        __atomic_compare_exchange_n(_p, _old, _new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define json_atomic_add(_p, _v)      __sync_add_and_fetch(_p, _v)
+#define json_atomic_load(_p)         __sync_add_and_fetch(_p, 0)
+#define json_atomic_cas(_p, _old, _new) ({                          \
+        __typeof__(*(_old)) __o = *(_old);                              \
+        *(_old) = __sync_val_compare_and_swap(_p, __o, _new);           \
+        *(_old) == __o; })
+#endif
+
+#define JSON_FROZEN 1
+
+/* The constants are shared by all the threads, and are never counted
+   or freed. */
+static base_t _null = { 1, k_json_null, JSON_FROZEN, NULL, { NULL } };
+static base_t _true = { 1, k_json_true, JSON_FROZEN, NULL, { NULL } };
+static base_t _false = { 1, k_json_false, JSON_FROZEN, NULL, { NULL } };
+static base_t _undefined = { 1, k_json_undefined, JSON_FROZEN, NULL, { NULL } };
 
 #define CHECK_MEMORY 0
 
@@ -95,79 +134,202 @@ void __attribute__ ((destructor)) json_cleanup()
 
 /******************************************************************************/
 
-base_t* base_new(int type, int len)
+/* The parser allocates the values of a document, with their
+   strings, arrays and hash tables, from an arena: a list of chunks
+   that are carved up in order and never freed piece by piece. Each
+   value points back to its arena, and the arena counts the values
+   that are still alive. The chunks are freed together when the last
+   of them is deleted. A value that is still referenced after its
+   document is dropped keeps the arena alive, so the refcounting
+   works the same as for the values that are allocated on their own.
+   Once the parser hands the document out, the arena is sealed: the
+   memory that a parsed array or object takes when it is changed
+   later comes from malloc(), and is freed as usual, so that a tree
+   that is edited for a long time doesn't grow its arena. The arena
+   counts these blocks, and json_release() only looks whether a
+   block lies in the arena when there are some. A document loaded
+   from a binary file keeps the mapping of the file in its arena: its
+   strings and keys point into it. */
+
+#define JSON_ARENA_MIN_CHUNK 4096
+#define JSON_ARENA_MAX_CHUNK 262144
+#define JSON_ARENA_MAX_RESERVE 16777216
+
+typedef struct _json_chunk_t {
+        struct _json_chunk_t* next;
+        int32 size;
+        int32 used;
+        double data[];
+} json_chunk_t;
+
+struct _json_arena_t {
+        json_chunk_t* chunks;
+        int32 chunk_size;
+        int32 live;  /* updated atomically */
+        int32 sealed;
+        int32 heap;  /* blocks taken from malloc() once sealed, updated atomically */
+        char* map;
+        int32 maplen;
+};
+
+static json_arena_t* json_arena_create()
+{
+        json_arena_t* arena = JSON_NEW(json_arena_t);
+        if (arena == NULL)
+                return NULL;
+        arena->chunks = NULL;
+        arena->chunk_size = JSON_ARENA_MIN_CHUNK;
+        arena->live = 0;
+        arena->sealed = 0;
+        arena->heap = 0;
+        arena->map = NULL;
+        arena->maplen = 0;
+        return arena;
+}
+
+static void json_arena_destroy(json_arena_t* arena)
+{
+        json_chunk_t* chunk = arena->chunks;
+        while (chunk != NULL) {
+                json_chunk_t* next = chunk->next;
+                JSON_FREE(chunk);
+                chunk = next;
+        }
+#if !defined(JSON_EMBEDDED)
+        if (arena->map != NULL)
+                munmap(arena->map, arena->maplen);
+#endif
+        JSON_FREE(arena);
+}
+
+/* Makes the next chunk at least len bytes, for a document whose size
+   is known before it is built. */
+static void json_arena_reserve(json_arena_t* arena, uint32_t len)
 {
-        base_t* base = JSON_NEW(base_t);
+        if (len > JSON_ARENA_MAX_RESERVE)
+                len = JSON_ARENA_MAX_RESERVE;
+        if (arena->chunk_size < (int32) len)
+                arena->chunk_size = len;
+}
+
+/* Returns zeroed memory, like calloc(). */
+static void* json_arena_alloc(json_arena_t* arena, int32 len)
+{
+        json_chunk_t* chunk = arena->chunks;
+
+        len = (len + 7) & ~7;
+
+        if ((chunk == NULL) || (chunk->used + len > chunk->size)) {
+                int32 size = arena->chunk_size;
+                if (size < len)
+                        size = len;
+                chunk = (json_chunk_t*) JSON_NEW_ARRAY(char, sizeof(json_chunk_t) + size);
+                if (chunk == NULL)
+                        return NULL;
+                chunk->size = size;
+                chunk->used = 0;
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+                if (arena->chunk_size < JSON_ARENA_MAX_CHUNK)
+                        arena->chunk_size *= 2;
+        }
+
+        void* ptr = (char*) chunk->data + chunk->used;
+        chunk->used += len;
+        return ptr;
+}
+
+static int32 json_arena_owns(json_arena_t* arena, void* ptr)
+{
+        char* p = (char*) ptr;
+        for (json_chunk_t* chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+                if (((char*) chunk->data <= p) && (p < (char*) chunk->data + chunk->size))
+                        return 1;
+        return (arena->map != NULL) && (arena->map <= p) && (p < arena->map + arena->maplen);
+}
+
+static void* json_alloc(json_arena_t* arena, int32 len)
+{
+        if (arena == NULL)
+                return JSON_NEW_ARRAY(char, len);
+        if (!arena->sealed)
+                return json_arena_alloc(arena, len);
+        void* ptr = JSON_NEW_ARRAY(char, len);
+        if (ptr != NULL)
+                json_atomic_add(&arena->heap, 1);
+        return ptr;
+}
+
+/* Memory in an arena is only given back with the arena. */
+static void json_release(json_arena_t* arena, void* ptr)
+{
+        if (arena == NULL) {
+                JSON_FREE(ptr);
+        } else if ((json_atomic_load(&arena->heap) > 0)
+                   && !json_arena_owns(arena, ptr)) {
+                JSON_FREE(ptr);
+                json_atomic_add(&arena->heap, -1);
+        }
+}
+
+static base_t* base_new_in(json_arena_t* arena, int type, int len)
+{
+        base_t* base = (base_t*) json_alloc(arena, sizeof(base_t));
         if (base == NULL)
                 return NULL;
         base->refcount = 1;
         base->type = type;
+        base->flags = 0;
+        base->arena = arena;
         if (len > 0) {
-                base->value.data = JSON_NEW_ARRAY(char, len);
+                base->value.data = json_alloc(arena, len);
                 if (base->value.data == NULL) {
-                        JSON_FREE(base);
+                        json_release(arena, base);
                         return NULL;
                 }
         }
+        /* Only the parser adds to an arena, before the document can
+           be seen by other threads, so the count needs no lock here,
+           unlike in base_free(). */
+        if (arena != NULL)
+                arena->live++;
         return base;
 }
 
+base_t* base_new(int type, int len)
+{
+        return base_new_in(NULL, type, len);
+}
+
+static void base_free(base_t* base)
+{
+        json_arena_t* arena = base->arena;
+        if (arena == NULL)
+                JSON_FREE(base);
+        else if (json_atomic_add(&arena->live, -1) == 0)
+                json_arena_destroy(arena);
+}
+
 /******************************************************************************/
 
 json_object_t json_null()
 {
-        if (_null == NULL) {
-                _null = base_new(k_json_null, 0);
-                _null->type = k_json_null;
-                if (_null == NULL) {
-                        fprintf(stderr, "Failed to allocate the null object\n");
-                        exit(1);
-                }
-        }
-
-	return _null;
+	return &_null;
 }
 
 json_object_t json_true()
 {
-        if (_true == NULL) {
-                _true = base_new(k_json_true, 0);
-                _true->type = k_json_true;
-                if (_true == NULL) {
-                        fprintf(stderr, "Failed to allocate the null object\n");
-                        exit(1);
-                }
-        }
-
-	return _true;
+	return &_true;
 }
 
 json_object_t json_false()
 {
-        if (_false == NULL) {
-                _false = base_new(k_json_false, 0);
-                _false->type = k_json_false;
-                if (_false == NULL) {
-                        fprintf(stderr, "Failed to allocate the null object\n");
-                        exit(1);
-                }
-        }
-
-	return _false;
+	return &_false;
 }
 
 json_object_t json_undefined()
 {
-        if (_undefined == NULL) {
-                _undefined = base_new(k_json_undefined, 0);
-                _undefined->type = k_json_undefined;
-                if (_undefined == NULL) {
-                        fprintf(stderr, "Failed to allocate the null object\n");
-                        exit(1);
-                }
-        }
-
-	return _undefined;
+	return &_undefined;
 }
 
 /******************************************************************************/
@@ -200,10 +362,10 @@ char* json_strdup(const char* s)
 
 /******************************************************************************/
 
-json_object_t json_number_create(double value)
+static json_object_t json_number_create_in(json_arena_t* arena, double value)
 {
 	base_t *base;
-        base = base_new(k_json_object, 0);
+        base = base_new_in(arena, k_json_object, 0);
         if (base == NULL)
                 return json_null();
 	base->type = k_json_number;
@@ -211,6 +373,11 @@ json_object_t json_number_create(double value)
 	return base;
 }
 
+json_object_t json_number_create(double value)
+{
+        return json_number_create_in(NULL, value);
+}
+
 static void delete_number(base_t* base)
 {
 }
@@ -227,13 +394,13 @@ typedef struct _string_t {
 	char s[0];
 } string_t;
 
-json_object_t json_string_create(const char* s)
+static json_object_t json_string_create_in(json_arena_t* arena, const char* s)
 {
 	base_t *base;
 	string_t *string;
        	int len = strlen(s);
 
-        base = base_new(k_json_string, sizeof(string_t) + len + 1);
+        base = base_new_in(arena, k_json_string, sizeof(string_t) + len + 1);
         if (base == NULL)
                 return json_null();
         base->type = k_json_string;
@@ -246,10 +413,15 @@ json_object_t json_string_create(const char* s)
 	return base;
 }
 
+json_object_t json_string_create(const char* s)
+{
+        return json_string_create_in(NULL, s);
+}
+
 static void delete_string(base_t* base)
 {
 	string_t *string = base_get(base, string_t);
-	JSON_FREE(string);
+	json_release(base->arena, string);
 }
 
 const char* json_string_value(json_object_t obj)
@@ -291,14 +463,14 @@ typedef struct _array_t {
 	json_object_t data[0];
 } array_t;
 
-json_object_t json_array_create()
+static json_object_t json_array_create_in(json_arena_t* arena)
 {
 	base_t *base;
 	array_t *array;
        	int len = 4;
         int memlen = sizeof(array_t) + len * sizeof(json_object_t);
 
-        base = base_new(k_json_array, memlen);
+        base = base_new_in(arena, k_json_array, memlen);
         if (base == NULL)
                 return json_null();
         base->type = k_json_array;
@@ -311,6 +483,11 @@ json_object_t json_array_create()
 	return base;
 }
 
+json_object_t json_array_create()
+{
+        return json_array_create_in(NULL);
+}
+
 static void delete_array(base_t* base)
 {
 	array_t *array = base_get(base, array_t);
@@ -318,7 +495,7 @@ static void delete_array(base_t* base)
 
         for (i = 0; i < array->length; i++)
                 json_unref(array->data[i]);
-	JSON_FREE(array);
+	json_release(base->arena, array);
 }
 
 int32 json_array_length(json_object_t array)
@@ -357,6 +534,8 @@ int32 json_array_set(json_object_t obj, json_object_t value, int32 index)
 	base_t* base = (base_t*) obj;
 	if (base_type(base) != k_json_array)
 		return 0;
+        if (base->flags & JSON_FROZEN)
+                return -1;
 	array_t *array = base_get(base, array_t);
         // LOCK
 	if (index >= array->datalen) {
@@ -366,7 +545,7 @@ int32 json_array_set(json_object_t obj, json_object_t value, int32 index)
 		} 
                 
                 int memlen = sizeof(array_t) + newlen * sizeof(json_object_t);
-                array_t *newarray = JSON_NEW_ARRAY(array_t, memlen);
+                array_t *newarray = (array_t*) json_alloc(base->arena, memlen);
 		if (newarray == NULL) {
                         // UNLOCK
 			return -1;
@@ -379,7 +558,7 @@ int32 json_array_set(json_object_t obj, json_object_t value, int32 index)
 
                 base->value.data = newarray;                
 
-                JSON_FREE(array);
+                json_release(base->arena, array);
                 array = newarray;
 	}
 
@@ -432,265 +611,280 @@ const char* json_array_getstr(json_object_t array, int32 index)
 
 /******************************************************************************/
 
-typedef struct _hashnode_t hashnode_t;
-
-struct _hashnode_t {
+/* An object keeps its members in a dense array, in the order in
+   which they were added, so that the output keeps the order of the
+   input. The first members fit in the object itself. Small objects
+   are searched linearly, comparing the hashes first. Beyond that, an
+   index of slots is added that is searched with open addressing: a
+   slot holds the position of an entry plus one, and zero marks an
+   empty slot. The index has at least twice as many slots as there
+   can be entries, and is rebuilt when the entries are reallocated or
+   one is removed. */
+
+#define JSON_OBJECT_INLINE 4
+#define JSON_OBJECT_LINEAR 8
+
+typedef struct _entry_t {
+	uint32_t hash;
 	char* key;
 	json_object_t value;
-	hashnode_t *next;
-};
-
-static hashnode_t* new_json_hashnode(const char* key, json_object_t* value);
-static void delete_json_hashnode(hashnode_t *hash_node);
-static void delete_json_hashnodes(hashnode_t *hash_node);
-uint32 json_strhash(const char* v);
-
-static hashnode_t* new_json_hashnode(const char* key, json_object_t* value)
-{
-	hashnode_t *hash_node = JSON_NEW(hashnode_t);
-	if (hash_node == NULL) {
-		return NULL;
+} entry_t;
+
+typedef struct _object_t {
+	json_arena_t* arena;
+	int32 length;
+	int32 capacity;
+	entry_t* entries;
+	int32 mask;
+	int32* index;
+	entry_t inline_entries[JSON_OBJECT_INLINE];
+} object_t;
+
+#define ROTL32(__x, __n) (((__x) << (__n)) | ((__x) >> (32 - (__n))))
+
+/* MurmurHash3 (32 bit), which hashes four bytes at a time and mixes
+   the bits well enough for a power-of-two table. uint32 is a long,
+   so the hash uses the fixed-size type. */
+static uint32_t json_keyhash(const char* key, int32 len)
+{
+	const unsigned char* p = (const unsigned char*) key;
+	uint32_t h = 0x9747b28c;
+	uint32_t k;
+	int32 n = len >> 2;
+
+	for (int32 i = 0; i < n; i++, p += 4) {
+		JSON_MEMCPY(&k, p, 4);
+		k *= 0xcc9e2d51;
+		k = ROTL32(k, 15);
+		k *= 0x1b873593;
+		h ^= k;
+		h = ROTL32(h, 13);
+		h = h * 5 + 0xe6546b64;
 	}
 
-	hash_node->key = json_strdup(key);
-	if (hash_node->key == NULL) {
-		JSON_FREE(hash_node);
-		return NULL;
+	k = 0;
+	switch (len & 3) {
+	case 3: k ^= (uint32_t) p[2] << 16; /* fall through */
+	case 2: k ^= (uint32_t) p[1] << 8;  /* fall through */
+	case 1: k ^= p[0];
+		k *= 0xcc9e2d51;
+		k = ROTL32(k, 15);
+		k *= 0x1b873593;
+		h ^= k;
 	}
-	hash_node->value = *value;
-	json_ref(hash_node->value);
-	hash_node->next = NULL;
-	
-	return hash_node;
+
+	h ^= (uint32_t) len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
 }
 
-static void delete_json_hashnode(hashnode_t *hash_node)
+static void object_init(object_t* object, json_arena_t* arena)
 {
-	json_unref(hash_node->value);
-	JSON_FREE(hash_node->key);
-	JSON_FREE(hash_node);
+	object->arena = arena;
+	object->length = 0;
+	object->capacity = JSON_OBJECT_INLINE;
+	object->entries = object->inline_entries;
+	object->mask = 0;
+	object->index = NULL;
 }
 
-static void delete_json_hashnodes(hashnode_t *hash_node)
+static void object_cleanup(object_t* object)
 {
-	while (hash_node) {
-		hashnode_t *next = hash_node->next;
-		delete_json_hashnode(hash_node);
-		hash_node = next;
-	}  
+	for (int32 i = 0; i < object->length; i++) {
+		json_unref(object->entries[i].value);
+		json_release(object->arena, object->entries[i].key);
+	}
+	if (object->entries != object->inline_entries)
+		json_release(object->arena, object->entries);
+	if (object->index != NULL)
+		json_release(object->arena, object->index);
 }
 
-/******************************************************************************/
-
-typedef struct _hashtable_t {
-	uint32 refcount;
-        int32 size;
-        int32 num_nodes;
-	hashnode_t **nodes;
-} hashtable_t;
-
-
-static hashtable_t* new_hashtable();
-static void delete_hashtable(hashtable_t *hashtable);
-static int32 hashtable_set(hashtable_t *hashtable, const char* key, json_object_t value);
-static json_object_t hashtable_get(hashtable_t *hashtable, const char* key);
-static int32 hashtable_unset(hashtable_t *hashtable, const char* key);
-static int32 hashtable_foreach(hashtable_t *hashtable, json_iterator_t func, void* data);
-static int32 hashtable_size(hashtable_t *hashtable);
-static void hashtable_resize(hashtable_t *hashtable);
-static hashnode_t** hashtable_lookup_node(hashtable_t *hashtable, const char* key);
-
-static hashtable_t* new_hashtable()
+static int32 object_reindex(object_t* object)
 {
-	hashtable_t *hashtable;
-	
-	hashtable = JSON_NEW(hashtable_t);
-	if (hashtable == NULL) {
-		return NULL;
+	int32 size = 16;
+	while (size < 2 * object->capacity)
+		size *= 2;
+
+	int32* index = (int32*) json_alloc(object->arena, size * sizeof(int32));
+	if (index == NULL)
+		return -1;
+	if (object->index != NULL)
+		json_release(object->arena, object->index);
+	object->index = index;
+	object->mask = size - 1;
+
+	for (int32 i = 0; i < object->length; i++) {
+		uint32 slot = object->entries[i].hash & object->mask;
+		while (index[slot] != 0)
+			slot = (slot + 1) & object->mask;
+		index[slot] = i + 1;
 	}
-	hashtable->refcount = 0;
-	hashtable->num_nodes = 0;
-	hashtable->size = 0;
-	hashtable->nodes = NULL;
-	
-	return hashtable;
+	return 0;
 }
 
-static void delete_hashtable(hashtable_t *hashtable)
+static int32 object_lookup(object_t* object, const char* key, uint32_t hash)
 {
-	if (hashtable == NULL) {
-		return;
-	}
+	entry_t* entries = object->entries;
 
-	if (hashtable->nodes) {
-		for (int32 i = 0; i < hashtable->size; i++) {
-			delete_json_hashnodes(hashtable->nodes[i]);
+	if (object->index == NULL) {
+		for (int32 i = 0; i < object->length; i++) {
+			if ((entries[i].hash == hash) && (JSON_STRCMP(entries[i].key, key) == 0))
+				return i;
 		}
-		JSON_FREE(hashtable->nodes);
+		return -1;
 	}
 
-	JSON_FREE(hashtable);
+	uint32 slot = hash & object->mask;
+	int32 i;
+	while ((i = object->index[slot]) != 0) {
+		i--;
+		if ((entries[i].hash == hash) && (JSON_STRCMP(entries[i].key, key) == 0))
+			return i;
+		slot = (slot + 1) & object->mask;
+	}
+	return -1;
 }
 
-static hashnode_t** hashtable_lookup_node(hashtable_t* hashtable, const char* key)
+static int32 object_grow(object_t* object)
 {
-	hashnode_t **node;
-	
-	if (hashtable->nodes == NULL) {
-		hashtable->size = HASHTABLE_MIN_SIZE;
-		hashtable->nodes = JSON_NEW_ARRAY(hashnode_t*, hashtable->size);	
-		for (int32 i = 0; i < hashtable->size; i++) {
-			hashtable->nodes[i] = NULL;
-		}
-	}
-	
-	node = &hashtable->nodes[json_strhash(key) % hashtable->size];
-	
-	while (*node && (JSON_STRCMP((*node)->key, key) != 0)) {
-		node = &(*node)->next;
-	}
-	
-	return node;
+	int32 capacity = 2 * object->capacity;
+	entry_t* entries = (entry_t*) json_alloc(object->arena, capacity * sizeof(entry_t));
+	if (entries == NULL)
+		return -1;
+	JSON_MEMCPY(entries, object->entries, object->length * sizeof(entry_t));
+	if (object->entries != object->inline_entries)
+		json_release(object->arena, object->entries);
+	object->entries = entries;
+	object->capacity = capacity;
+	return (capacity > JSON_OBJECT_LINEAR)? object_reindex(object) : 0;
 }
 
-static int32 hashtable_set(hashtable_t *hashtable, const char* key, json_object_t value)
+static int32 object_set(object_t* object, const char* key, json_object_t value)
 {
-  
-	if ((key == NULL) || (JSON_STRLEN(key) == 0)) {
+	if ((key == NULL) || (key[0] == 0)) {
 		return -1;
 	}
 
-	hashnode_t **node = hashtable_lookup_node(hashtable, key);
+	int32 len = JSON_STRLEN(key);
+	uint32_t hash = json_keyhash(key, len);
+	int32 i = object_lookup(object, key, hash);
 
-	if (*node) {
-		json_object_t oldvalue = (*node)->value;
-		(*node)->value = value;
-		json_ref((*node)->value);
+	if (i >= 0) {
+		json_object_t oldvalue = object->entries[i].value;
+		object->entries[i].value = value;
+		json_ref(value);
 		json_unref(oldvalue);
+		return 0;
+	}
 
-	} else {
-		*node = new_json_hashnode(key, &value);
-		if (*node == NULL) {
-			return -1;
-		}
-		hashtable->num_nodes++;
-
-		if ((3 * hashtable->size <= hashtable->num_nodes)
-		    && (hashtable->size < HASHTABLE_MAX_SIZE)) {
-			hashtable_resize(hashtable);
-		} 
+	if ((object->length == object->capacity) && (object_grow(object) != 0)) {
+		return -1;
 	}
 
-        char buffer[256];
-        json_tostring(value, buffer, sizeof(buffer));
-        //printf("hash node %s - %s\n", key, buffer);
+	char* s = (char*) json_alloc(object->arena, len + 1);
+	if (s == NULL) {
+		return -1;
+	}
+	JSON_MEMCPY(s, key, len + 1);
+
+	i = object->length++;
+	object->entries[i].hash = hash;
+	object->entries[i].key = s;
+	object->entries[i].value = value;
+	json_ref(value);
+
+	if (object->index != NULL) {
+		uint32 slot = hash & object->mask;
+		while (object->index[slot] != 0)
+			slot = (slot + 1) & object->mask;
+		object->index[slot] = i + 1;
+	}
 
 	return 0;
 }
 
-static json_object_t hashtable_get(hashtable_t *hashtable, const char* key)
+static json_object_t object_get(object_t* object, const char* key)
 {
-	hashnode_t *node;
-	node = *hashtable_lookup_node(hashtable, key);
-       	return (node)? node->value : json_null();
+	uint32_t hash = json_keyhash(key, JSON_STRLEN(key));
+	int32 i = object_lookup(object, key, hash);
+	return (i >= 0)? object->entries[i].value : json_null();
 }
 
-static int32 hashtable_unset(hashtable_t *hashtable, const char* key)
+/* Removing a member shifts the ones that follow, to keep the order,
+   and rebuilds the index. Objects are rarely modified this way. */
+static int32 object_unset(object_t* object, const char* key)
 {
-	hashnode_t **node, *dest;
-  
-	node = hashtable_lookup_node(hashtable, key);
-	if (*node) {
-		dest = *node;
-		(*node) = dest->next;
-		delete_json_hashnode(dest);
-		hashtable->num_nodes--;
-		return 0;
+	uint32_t hash = json_keyhash(key, JSON_STRLEN(key));
+	int32 i = object_lookup(object, key, hash);
+	if (i < 0) {
+		return -1;
 	}
-	
-	return -1;
-}
 
-static int32 hashtable_foreach(hashtable_t *hashtable, json_iterator_t func, void* data)
-{
-	hashnode_t *node = NULL;
-	
-	for (int32 i = 0; i < hashtable->size; i++) {
-		for (node = hashtable->nodes[i]; node != NULL; node = node->next) {
-			int32 r = (*func)(node->key, node->value, data);
-                        if (r != 0) return r;
+	entry_t entry = object->entries[i];
+	object->length--;
+	memmove(&object->entries[i], &object->entries[i+1], 
+		(object->length - i) * sizeof(entry_t));
+	if (object->index != NULL) {
+		JSON_MEMSET(object->index, 0, (object->mask + 1) * sizeof(int32));
+		for (int32 j = 0; j < object->length; j++) {
+			uint32 slot = object->entries[j].hash & object->mask;
+			while (object->index[slot] != 0)
+				slot = (slot + 1) & object->mask;
+			object->index[slot] = j + 1;
 		}
 	}
-        return 0;
-}
 
-static int32 hashtable_size(hashtable_t *hashtable)
-{
-	return hashtable->num_nodes;
+	json_unref(entry.value);
+	json_release(object->arena, entry.key);
+	return 0;
 }
 
-
-static void hashtable_resize(hashtable_t *hashtable)
+static int32 object_foreach(object_t* object, json_iterator_t func, void* data)
 {
-	hashnode_t **new_nodes;
-	hashnode_t *node;
-	hashnode_t *next;
-	uint32 hash_val;
-	int32 new_size;
-	
-	new_size = 3 * hashtable->size + 1;
-	new_size = (new_size > HASHTABLE_MAX_SIZE)? HASHTABLE_MAX_SIZE : new_size;
-	
-	new_nodes = JSON_NEW_ARRAY(hashnode_t*, new_size);
-	
-	for (int32 i = 0; i < hashtable->size; i++) {
-		for (node = hashtable->nodes[i]; node; node = next) {
-			next = node->next;
-			hash_val = json_strhash(node->key) % new_size;      
-			node->next = new_nodes[hash_val];
-			new_nodes[hash_val] = node;
-		}
+	for (int32 i = 0; i < object->length; i++) {
+		int32 r = (*func)(object->entries[i].key, object->entries[i].value, data);
+		if (r != 0) return r;
 	}
-	
-	JSON_FREE(hashtable->nodes);
-	hashtable->nodes = new_nodes;
-	hashtable->size = new_size;
+        return 0;
 }
 
 /******************************************************************************/
 
-json_object_t json_object_create()
+static json_object_t json_object_create_in(json_arena_t* arena)
 {
 	base_t *base;
-	hashtable_t* hashtable;
 
-        base = base_new(k_json_object, 0);
+        base = base_new_in(arena, k_json_object, sizeof(object_t));
         if (base == NULL)
                 return json_null();
 	base->type = k_json_object;
-	hashtable = new_hashtable();
-	if (hashtable == NULL) {
-                JSON_FREE(base);
-                return json_null();
-	}
-	
-	base->value.data = hashtable;
+	object_init(base_get(base, object_t), arena);
 	return base;
 }
 
+json_object_t json_object_create()
+{
+        return json_object_create_in(NULL);
+}
+
 static void delete_object(base_t* base)
 {
-	hashtable_t *hashtable = base_get(base, hashtable_t);
-        delete_hashtable(hashtable);
+	object_t *object = base_get(base, object_t);
+        object_cleanup(object);
+	json_release(base->arena, object);
 }
 
 int32 json_object_set(json_object_t object, const char* key, json_object_t value)
 {
-	if (object->type != k_json_object) {
+	if ((object->type != k_json_object) || (object->flags & JSON_FROZEN)) {
 		return -1;
 	}
-	hashtable_t *hashtable = base_get(object, hashtable_t);
-	return hashtable_set(hashtable, key, value);
+	return object_set(base_get(object, object_t), key, value);
 }
 
 json_object_t json_object_get(json_object_t object, const char* key)
@@ -698,8 +892,7 @@ json_object_t json_object_get(json_object_t object, const char* key)
 	if (object->type != k_json_object) {
 		return json_null();
 	}
-	hashtable_t *hashtable = base_get(object, hashtable_t);
-	return hashtable_get(hashtable, key);
+	return object_get(base_get(object, object_t), key);
 }
 
 double json_object_getnum(json_object_t object, const char* key)
@@ -707,8 +900,7 @@ double json_object_getnum(json_object_t object, const char* key)
 	if (object->type != k_json_object) {
 		return NAN;
 	}
-	hashtable_t *hashtable = base_get(object, hashtable_t);
-	json_object_t val = hashtable_get(hashtable, key);
+	json_object_t val = object_get(base_get(object, object_t), key);
         if (val->type == k_json_number) {
                 return json_number_value(val);
         } else {
@@ -720,8 +912,7 @@ const char* json_object_getstr(json_object_t object, const char* key)
 {
 	if (object->type != k_json_object)
 		return NULL;
-	hashtable_t *hashtable = base_get(object, hashtable_t);
-	json_object_t val = hashtable_get(hashtable, key);
+	json_object_t val = object_get(base_get(object, object_t), key);
         if (val->type == k_json_string) {
                 return json_string_value(val);
         } else {
@@ -731,36 +922,40 @@ const char* json_object_getstr(json_object_t object, const char* key)
 
 int32 json_object_unset(json_object_t object, const char* key)
 {
-	if (object->type != k_json_object)
+	if ((object->type != k_json_object) || (object->flags & JSON_FROZEN))
 		return -1;
-	hashtable_t *hashtable = base_get(object, hashtable_t);
-	return hashtable_unset(hashtable, key);
+	return object_unset(base_get(object, object_t), key);
 }
 
 
 int32 json_object_setnum(json_object_t object, const char* key, double value)
 {
-	return json_object_set(object, key, json_number_create(value));
+        json_object_t num = json_number_create(value);
+	int32 r = json_object_set(object, key, num);
+        json_unref(num);
+        return r;
 }
 
 int32 json_object_setstr(json_object_t object, const char* key, const char* value)
 {
-	return json_object_set(object, key, json_string_create(value));
+        json_object_t s = json_string_create(value);
+	int32 r = json_object_set(object, key, s);
+        json_unref(s);
+        return r;
 }
 
 int32 json_object_foreach(json_object_t object, json_iterator_t func, void* data)
 {
 	if (object->type != k_json_object)
 		return -1;
-	hashtable_t *hashtable = base_get(object, hashtable_t);
-	return hashtable_foreach(hashtable, func, data);
+	return object_foreach(base_get(object, object_t), func, data);
 }
 
 int32 json_object_length(json_object_t object)
 {
 	if (object->type != k_json_object)
 		return 0;
-	return hashtable_size(base_get(object, hashtable_t));
+	return base_get(object, object_t)->length;
 }
 
 /******************************************************************************/
@@ -929,7 +1124,7 @@ static void _delete(base_t *base)
 	default: break;
 	}
 
-        JSON_FREE(base);
+        base_free(base);
 }
 
 void json_refcount(json_object_t obj, int32 val)
@@ -937,13 +1132,195 @@ void json_refcount(json_object_t obj, int32 val)
 	if ((obj == NULL) || (obj->type < 100)) {
                 return;
         }
-        obj->refcount += val;
-        if (obj->refcount <= 0)
+        /* Past the limit, the value stays alive for good rather than
+           letting the count wrap around to zero. */
+        if (json_atomic_load(&obj->refcount) >= JSON_REFCOUNT_MAX)
+                return;
+        if (json_atomic_add(&obj->refcount, (unsigned int) val) == 0)
                 _delete(obj);
 }
 
+void json_freeze(json_object_t obj)
+{
+        if ((obj == NULL) || (obj->flags & JSON_FROZEN))
+                return;
+        obj->flags |= JSON_FROZEN;
+
+        if (obj->type == k_json_array) {
+                array_t* array = base_get(obj, array_t);
+                for (int32 i = 0; i < array->length; i++)
+                        json_freeze(array->data[i]);
+        } else if (obj->type == k_json_object) {
+                object_t* object = base_get(obj, object_t);
+                for (int32 i = 0; i < object->length; i++)
+                        json_freeze(object->entries[i].value);
+        }
+}
+
+int32 json_isfrozen(json_object_t obj)
+{
+        return (obj != NULL) && (obj->flags & JSON_FROZEN);
+}
+
 /******************************************************************************/
 
+/* Numbers */
+
+static const double json_pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define JSON_MAX_EXACT 9007199254740992.0 // 2^53
+
+/* Converts the text of a number, as checked by the parser, to the
+   nearest double. When the digits fit in a double without rounding
+   and the power of ten is exact (up to 1e22), a single multiplication
+   or division gives the correctly rounded result (Clinger's fast
+   path). This covers the values of the sensors and the timestamps.
+   The other numbers are handed to strtod(). */
+static double json_strtod(const char* s)
+{
+        const char* p = s;
+        uint64_t m = 0;
+        int32 digits = 0;
+        int32 exp10 = 0;
+        int neg = 0;
+        double d;
+
+        if (*p == '-') {
+                neg = 1;
+                p++;
+        }
+        while (('0' <= *p) && (*p <= '9')) {
+                m = 10 * m + (*p++ - '0');
+                if (m != 0) digits++;
+        }
+        if (*p == '.') {
+                p++;
+                while (('0' <= *p) && (*p <= '9')) {
+                        m = 10 * m + (*p++ - '0');
+                        if (m != 0) digits++;
+                        exp10--;
+                }
+        }
+        if ((*p == 'e') || (*p == 'E')) {
+                int32 e = 0;
+                int eneg = 0;
+                p++;
+                if (*p == '-') {
+                        eneg = 1;
+                        p++;
+                } else if (*p == '+') {
+                        p++;
+                }
+                while (('0' <= *p) && (*p <= '9')) {
+                        if (e < 100000) e = 10 * e + (*p - '0');
+                        p++;
+                }
+                exp10 += eneg? -e : e;
+        }
+
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD != 0)
+        /* The intermediate results would be rounded twice. */
+        return strtod(s, NULL);
+#endif
+        if (digits > 19) 
+                return strtod(s, NULL);
+        if (m == 0) 
+                return neg? -0.0 : 0.0;
+        if (m > (uint64_t) JSON_MAX_EXACT)
+                return strtod(s, NULL);
+
+        /* 12345e25 is 123450000000e18: move the extra powers of ten
+           into the mantissa while it stays exact. */
+        while ((exp10 > 22) && (m < (uint64_t) JSON_MAX_EXACT / 10)) {
+                m *= 10;
+                exp10--;
+        }
+        if ((exp10 < -22) || (exp10 > 22))
+                return strtod(s, NULL);
+
+        d = (double) m;
+        if (exp10 < 0)
+                d /= json_pow10[-exp10];
+        else 
+                d *= json_pow10[exp10];
+
+        return neg? -d : d;
+}
+
+/* Writes n with the given number of decimals, e.g. 12345 with two
+   decimals as 123.45, without the trailing zeros. */
+static void json_fixedtostr(uint64_t n, int neg, int32 decimals, char* buf)
+{
+        char digits[24];
+        int32 i = 0;
+
+        while ((decimals > 0) && (n % 10 == 0)) {
+                n /= 10;
+                decimals--;
+        }
+        do {
+                digits[i++] = '0' + (char) (n % 10);
+                n /= 10;
+        } while ((n > 0) || (i <= decimals));
+
+        if (neg) 
+                *buf++ = '-';
+        while (i > 0) {
+                if (i == decimals)
+                        *buf++ = '.';
+                *buf++ = digits[--i];
+        }
+        *buf = 0;
+}
+
+/* Writes the shortest text that reads back as the same double.
+   Integers below 2^53 are written digit by digit, and so are the
+   numbers with a few decimals, such as the readings of the sensors,
+   once they are checked to read back. The other numbers get the
+   fewest significant digits, from 15 up to 17, that give the value
+   back: a shorter text that reads back also comes out of "%.15g",
+   once %g drops the trailing zeros. Subnormals don't have 15 digits
+   of precision and are tried from a single digit up. The buffer must
+   hold at least 32 bytes. */
+static void json_numtostr(double v, char* buf, int32 len)
+{
+        double a = fabs(v);
+        int neg = signbit(v);
+
+        if ((a == floor(a)) && (a < JSON_MAX_EXACT) && !((v == 0.0) && neg)) {
+                json_fixedtostr((uint64_t) a, neg, 0, buf);
+                return;
+        }
+
+        if ((a >= 1e-3) && (a < 1e9)) {
+                for (int32 decimals = 1; decimals <= 6; decimals++) {
+                        double scaled = a * json_pow10[decimals];
+                        if (scaled == floor(scaled)) {
+                                json_fixedtostr((uint64_t) scaled, neg, decimals, buf);
+                                if (json_strtod(buf) == v)
+                                        return;
+                                break;
+                        }
+                }
+        }
+
+        if (isnan(v) || isinf(v)) {
+                snprintf(buf, len, "%g", v);
+                return;
+        }
+
+        for (int precision = (a < DBL_MIN)? 1 : 15; precision < 17; precision++) {
+                snprintf(buf, len, "%.*g", precision, v);
+                if (json_strtod(buf) == v)
+                        return;
+        }
+        snprintf(buf, len, "%.17g", v);
+}
+
 typedef struct _json_serialise_t {
         int pretty;
         int indent;
@@ -953,6 +1330,9 @@ int32 json_serialise_text(json_serialise_t* serialise,
                           json_object_t object, 
                           json_writer_t fun, 
                           void* userdata);
+static int32 json_serialise_binary(json_object_t object, 
+                                   json_writer_t fun, 
+                                   void* userdata);
 
 typedef struct _json_strbuf_t {
         char* s;
@@ -992,7 +1372,8 @@ static int32 json_file_writer(void* userdata, const char* s, int32 len)
 int32 json_tofilep(json_object_t object, int32 flags, FILE* fp)
 {
         int32 res = json_serialise(object, flags, json_file_writer, (void*) fp);
-        fprintf(fp, "\n");
+        if ((flags & k_json_binary) == 0)
+                fprintf(fp, "\n");
         return res;
 }
 
@@ -1018,7 +1399,7 @@ int32 json_serialise(json_object_t object,
         serialise.indent = 0;
 
 	if (flags & k_json_binary) {
-		return -1;
+		return json_serialise_binary(object, fun, userdata);
 	} else {
 		return json_serialise_text(&serialise, object, fun, userdata);
 	}
@@ -1039,13 +1420,8 @@ int32 json_serialise_text(json_serialise_t* serialise,
 	switch (object->type) {
 
 	case k_json_number: {
-		char buf[128];
-		if (floor(object->value.number) == object->value.number) 
-			snprintf(buf, 128, "%g", object->value.number);
-		else 
-			snprintf(buf, 128, "%e", object->value.number);
-		
-		buf[127] = 0;
+		char buf[32];
+		json_numtostr(object->value.number, buf, 32);
 		r = json_print(fun, userdata, buf);
 		if (r != 0) return r;
 	} break;
@@ -1102,33 +1478,29 @@ int32 json_serialise_text(json_serialise_t* serialise,
                 }
 		if (r != 0) return r;
 
-		hashtable_t* hashtable = (hashtable_t*) object->value.data;
-		hashnode_t *node = NULL;
-		int32 count = 0;
-		for (int32 i = 0; i < hashtable->size; i++) {
-			for (node = hashtable->nodes[i]; node != NULL; node = node->next) {
-                                if (serialise->pretty) {
-                                        for (int ii = 0; ii < serialise->indent; ii++) {
-                                                r = json_print(fun, userdata, " ");
-                                                if (r != 0) return r;
-                                        }
+		object_t* members = (object_t*) object->value.data;
+		for (int32 i = 0; i < members->length; i++) {
+                        if (serialise->pretty) {
+                                for (int ii = 0; ii < serialise->indent; ii++) {
+                                        r = json_print(fun, userdata, " ");
+                                        if (r != 0) return r;
                                 }
-				r = json_print(fun, userdata, "\"");
-				if (r != 0) return r;
-				r = json_print(fun, userdata, node->key);
-				if (r != 0) return r;
-				r = json_print(fun, userdata, "\": ");
-				if (r != 0) return r;
-				r = json_serialise_text(serialise, node->value, fun, userdata);
-				if (r != 0) return r;
-				if (++count < hashtable->num_nodes) {
-					r = json_print(fun, userdata, ", ");
-				}
-                                if (serialise->pretty) {
-                                        r = json_print(fun, userdata, "\n");
-                                }
-                                if (r != 0) return r;
+                        }
+			r = json_print(fun, userdata, "\"");
+			if (r != 0) return r;
+			r = json_print(fun, userdata, members->entries[i].key);
+			if (r != 0) return r;
+			r = json_print(fun, userdata, "\": ");
+			if (r != 0) return r;
+			r = json_serialise_text(serialise, members->entries[i].value, fun, userdata);
+			if (r != 0) return r;
+			if (i + 1 < members->length) {
+				r = json_print(fun, userdata, ", ");
 			}
+                        if (serialise->pretty) {
+                                r = json_print(fun, userdata, "\n");
+                        }
+                        if (r != 0) return r;
 		}
 
                 if (serialise->pretty) {
@@ -1147,6 +1519,486 @@ int32 json_serialise_text(json_serialise_t* serialise,
 
 /******************************************************************************/
 
+/* The binary format, described in json.h. The writer first walks the
+   document to count the values and to number the keys in the order
+   of their first use. The readers check every length and index
+   against the end of the file before they use it. */
+
+enum {
+        k_bin_null = 0,
+        k_bin_true = 1,
+        k_bin_false = 2,
+        k_bin_int = 3,
+        k_bin_number = 4,
+        k_bin_string = 5,
+        k_bin_array = 6,
+        k_bin_object = 7
+};
+
+#define JSON_BINARY_MAGIC    "JSNB"
+#define JSON_BINARY_VERSION  1
+#define JSON_BINARY_HEADER   16
+#define JSON_BINARY_DEPTH    256
+
+typedef struct _json_binwriter_t {
+        json_writer_t fun;
+        void* userdata;
+        int32 offset;
+        uint32_t values;
+        object_t keys;
+} json_binwriter_t;
+
+static int32 json_binary_write(json_binwriter_t* w, const void* data, int32 len)
+{
+        w->offset += len;
+        return (*w->fun)(w->userdata, (const char*) data, len);
+}
+
+static int32 json_binary_write_tag(json_binwriter_t* w, int tag)
+{
+        unsigned char c = (unsigned char) tag;
+        return json_binary_write(w, &c, 1);
+}
+
+static int32 json_binary_write_u32(json_binwriter_t* w, uint32_t n)
+{
+        return json_binary_write(w, &n, 4);
+}
+
+static int32 json_binary_collect(json_binwriter_t* w, json_object_t value)
+{
+        w->values++;
+
+        if (value->type == k_json_array) {
+                array_t* array = base_get(value, array_t);
+                for (int32 i = 0; i < array->length; i++) {
+                        if (json_binary_collect(w, array->data[i]) != 0)
+                                return -1;
+                }
+        } else if (value->type == k_json_object) {
+                object_t* object = base_get(value, object_t);
+                for (int32 i = 0; i < object->length; i++) {
+                        entry_t* e = &object->entries[i];
+                        if ((object_lookup(&w->keys, e->key, e->hash) < 0)
+                            && (object_set(&w->keys, e->key, json_null()) != 0))
+                                return -1;
+                        if (json_binary_collect(w, e->value) != 0)
+                                return -1;
+                }
+        }
+        return 0;
+}
+
+static int32 json_binary_write_value(json_binwriter_t* w, json_object_t value)
+{
+        static const char zeros[4] = { 0, 0, 0, 0 };
+        int32 r;
+
+        switch (value->type) {
+
+        case k_json_number: {
+                double d = value->value.number;
+                if ((d >= -2147483648.0) && (d <= 2147483647.0) 
+                    && (d == (double) (int32_t) d) && !((d == 0.0) && signbit(d))) {
+                        int32_t n = (int32_t) d;
+                        r = json_binary_write_tag(w, k_bin_int);
+                        if (r != 0) return r;
+                        r = json_binary_write(w, &n, 4);
+                } else {
+                        r = json_binary_write_tag(w, k_bin_number);
+                        if (r != 0) return r;
+                        r = json_binary_write(w, &d, 8);
+                }
+        } break;
+
+        case k_json_string: {
+                /* Laid out as a string_t, on four bytes, so that the
+                   loader can point at it. */
+                string_t* string = base_get(value, string_t);
+                int32_t len = string->length;
+                r = json_binary_write_tag(w, k_bin_string);
+                if (r != 0) return r;
+                r = json_binary_write(w, zeros, (4 - (w->offset & 3)) & 3);
+                if (r != 0) return r;
+                r = json_binary_write(w, &len, 4);
+                if (r != 0) return r;
+                r = json_binary_write(w, string->s, len + 1);
+        } break;
+
+        case k_json_true: 
+                r = json_binary_write_tag(w, k_bin_true);
+                break;
+
+        case k_json_false: 
+                r = json_binary_write_tag(w, k_bin_false);
+                break;
+
+        case k_json_boolean: 
+                r = json_binary_write_tag(w, value->value.number? k_bin_true : k_bin_false);
+                break;
+
+        case k_json_array: {
+                array_t* array = base_get(value, array_t);
+                r = json_binary_write_tag(w, k_bin_array);
+                if (r != 0) return r;
+                r = json_binary_write_u32(w, array->length);
+                for (int32 i = 0; (r == 0) && (i < array->length); i++)
+                        r = json_binary_write_value(w, array->data[i]);
+        } break;
+
+        case k_json_object: {
+                object_t* object = base_get(value, object_t);
+                r = json_binary_write_tag(w, k_bin_object);
+                if (r != 0) return r;
+                r = json_binary_write_u32(w, object->length);
+                for (int32 i = 0; (r == 0) && (i < object->length); i++) {
+                        entry_t* e = &object->entries[i];
+                        r = json_binary_write_u32(w, object_lookup(&w->keys, e->key, e->hash));
+                        if (r != 0) return r;
+                        r = json_binary_write_value(w, e->value);
+                }
+        } break;
+
+        default: 
+                r = json_binary_write_tag(w, k_bin_null);
+                break;
+        }
+
+        return r;
+}
+
+static int32 json_serialise_binary(json_object_t object, 
+                                   json_writer_t fun, 
+                                   void* userdata)
+{
+        json_binwriter_t w;
+        int32 r;
+
+        w.fun = fun;
+        w.userdata = userdata;
+        w.offset = 0;
+        w.values = 0;
+        object_init(&w.keys, NULL);
+
+        r = json_binary_collect(&w, object);
+        if (r == 0) r = json_binary_write(&w, JSON_BINARY_MAGIC, 4);
+        if (r == 0) r = json_binary_write_u32(&w, JSON_BINARY_VERSION);
+        if (r == 0) r = json_binary_write_u32(&w, w.keys.length);
+        if (r == 0) r = json_binary_write_u32(&w, w.values);
+
+        for (int32 i = 0; (r == 0) && (i < w.keys.length); i++) {
+                const char* key = w.keys.entries[i].key;
+                uint32_t len = JSON_STRLEN(key);
+                r = json_binary_write_u32(&w, len);
+                if (r == 0) r = json_binary_write(&w, key, len + 1);
+        }
+
+        if (r == 0) r = json_binary_write_value(&w, object);
+
+        object_cleanup(&w.keys);
+        return r;
+}
+
+typedef struct _json_binreader_t {
+        const char* start;
+        const char* p;
+        const char* end;
+        uint32_t num_keys;
+        const char** keys;
+        int32* lengths;
+        uint32_t* hashes;
+        json_arena_t* arena;
+        int32 depth;
+} json_binreader_t;
+
+/* Returns non-zero if the text starts like a binary document. */
+static int32 json_isbinary(const char* text, int32 len)
+{
+        return (len >= JSON_BINARY_HEADER) && (JSON_MEMCMP(text, JSON_BINARY_MAGIC, 4) == 0);
+}
+
+static int32 json_binary_read(json_binreader_t* r, void* data, int32 len)
+{
+        if (r->end - r->p < len)
+                return -1;
+        JSON_MEMCPY(data, r->p, len);
+        r->p += len;
+        return 0;
+}
+
+static void json_binary_close(json_binreader_t* r)
+{
+        if (r->keys != NULL) JSON_FREE(r->keys);
+        if (r->lengths != NULL) JSON_FREE(r->lengths);
+        if (r->hashes != NULL) JSON_FREE(r->hashes);
+}
+
+/* Checks the header and reads the keys. */
+static int32 json_binary_open(json_binreader_t* r, const char* text, int32 len, uint32_t* values)
+{
+        uint32_t version;
+
+        JSON_MEMSET(r, 0, sizeof(json_binreader_t));
+        r->start = text;
+        r->p = text + 4;
+        r->end = text + len;
+
+        if (!json_isbinary(text, len)
+            || (json_binary_read(r, &version, 4) != 0)
+            || (version != JSON_BINARY_VERSION)
+            || (json_binary_read(r, &r->num_keys, 4) != 0)
+            || (json_binary_read(r, values, 4) != 0)
+            || (r->num_keys > (uint32_t) (r->end - r->p) / 5)
+            || (*values > (uint32_t) (r->end - r->p)))
+                return -1;
+
+        if (r->num_keys > 0) {
+                r->keys = JSON_NEW_ARRAY(const char*, r->num_keys);
+                r->lengths = JSON_NEW_ARRAY(int32, r->num_keys);
+                r->hashes = JSON_NEW_ARRAY(uint32_t, r->num_keys);
+                if ((r->keys == NULL) || (r->lengths == NULL) || (r->hashes == NULL))
+                        return -1;
+        }
+
+        for (uint32_t i = 0; i < r->num_keys; i++) {
+                uint32_t n;
+                if ((json_binary_read(r, &n, 4) != 0)
+                    || (n == 0)
+                    || (n >= (uint32_t) (r->end - r->p))
+                    || (r->p[n] != 0)
+                    || (memchr(r->p, 0, n) != NULL))
+                        return -1;
+                r->keys[i] = r->p;
+                r->lengths[i] = n;
+                r->hashes[i] = json_keyhash(r->p, n);
+                r->p += n + 1;
+        }
+        return 0;
+}
+
+/* Reads the string that starts at the next multiple of four bytes.
+   Returns its record, or NULL if it doesn't fit in the file. */
+static const string_t* json_binary_string(json_binreader_t* r)
+{
+        int32_t len;
+
+        r->p += (4 - ((r->p - r->start) & 3)) & 3;
+        if ((r->p > r->end) || (json_binary_read(r, &len, 4) != 0))
+                return NULL;
+        if ((len < 0) || (len >= r->end - r->p) || (r->p[len] != 0))
+                return NULL;
+        const string_t* string = (const string_t*) (r->p - 4);
+        r->p += len + 1;
+        return string;
+}
+
+/* Creates the values in the arena, with the strings and keys in
+   place in the file. Returns NULL if the file is corrupt. */
+static json_object_t json_binary_build(json_binreader_t* r)
+{
+        unsigned char tag;
+        uint32_t count;
+        base_t* base;
+
+        if (json_binary_read(r, &tag, 1) != 0)
+                return NULL;
+
+        switch (tag) {
+        case k_bin_null: 
+                return json_null();
+        case k_bin_true: 
+                return json_true();
+        case k_bin_false: 
+                return json_false();
+
+        case k_bin_int: {
+                int32_t n;
+                if (json_binary_read(r, &n, 4) != 0)
+                        return NULL;
+                base = json_number_create_in(r->arena, n);
+                return json_isnull(base)? NULL : base;
+        }
+
+        case k_bin_number: {
+                double d;
+                if (json_binary_read(r, &d, 8) != 0)
+                        return NULL;
+                base = json_number_create_in(r->arena, d);
+                return json_isnull(base)? NULL : base;
+        }
+
+        case k_bin_string: {
+                const string_t* string = json_binary_string(r);
+                if (string == NULL)
+                        return NULL;
+                base = base_new_in(r->arena, k_json_string, 0);
+                if (base == NULL)
+                        return NULL;
+                base->value.data = (void*) string;
+                return base;
+        }
+
+        case k_bin_array: {
+                if ((json_binary_read(r, &count, 4) != 0)
+                    || (count > (uint32_t) (r->end - r->p))
+                    || (r->depth >= JSON_BINARY_DEPTH))
+                        return NULL;
+                base = base_new_in(r->arena, k_json_array, 
+                                   sizeof(array_t) + count * sizeof(json_object_t));
+                if (base == NULL)
+                        return NULL;
+                array_t* array = base_get(base, array_t);
+                array->length = 0;
+                array->datalen = count;
+                r->depth++;
+                while ((uint32_t) array->length < count) {
+                        json_object_t value = json_binary_build(r);
+                        if (value == NULL) {
+                                json_unref(base);
+                                return NULL;
+                        }
+                        array->data[array->length++] = value;
+                }
+                r->depth--;
+                return base;
+        }
+
+        case k_bin_object: {
+                if ((json_binary_read(r, &count, 4) != 0)
+                    || (count > (uint32_t) (r->end - r->p) / 5)
+                    || (r->depth >= JSON_BINARY_DEPTH))
+                        return NULL;
+                base = json_object_create_in(r->arena);
+                if (json_isnull(base))
+                        return NULL;
+                object_t* object = base_get(base, object_t);
+                if (count > JSON_OBJECT_INLINE) {
+                        object->entries = (entry_t*) json_alloc(r->arena, count * sizeof(entry_t));
+                        if (object->entries == NULL) {
+                                object->entries = object->inline_entries;
+                                json_unref(base);
+                                return NULL;
+                        }
+                        object->capacity = count;
+                }
+                r->depth++;
+                while ((uint32_t) object->length < count) {
+                        uint32_t k;
+                        json_object_t value;
+                        if ((json_binary_read(r, &k, 4) != 0) 
+                            || (k >= r->num_keys)
+                            || ((value = json_binary_build(r)) == NULL)) {
+                                json_unref(base);
+                                return NULL;
+                        }
+                        entry_t* e = &object->entries[object->length++];
+                        e->hash = r->hashes[k];
+                        e->key = (char*) r->keys[k];
+                        e->value = value;
+                }
+                r->depth--;
+                if ((object->capacity > JSON_OBJECT_LINEAR) && (object_reindex(object) != 0)) {
+                        json_unref(base);
+                        return NULL;
+                }
+                return base;
+        }
+        }
+
+        return NULL;
+}
+
+#define json_binary_emit(__handler, __event, ...)                       \
+        if ((__handler)->__event != NULL                                \
+            && (__handler)->__event(__VA_ARGS__) != 0)                  \
+                return 1;
+
+/* Passes the values to the handler. Returns 0, 1 if the handler
+   stopped, or -1 if the file is corrupt. */
+static int32 json_binary_events(json_binreader_t* r, const json_sax_t* handler, void* userdata)
+{
+        unsigned char tag;
+        uint32_t count;
+        int32 ret;
+
+        if (json_binary_read(r, &tag, 1) != 0)
+                return -1;
+
+        switch (tag) {
+        case k_bin_null: 
+                json_binary_emit(handler, null, userdata);
+                return 0;
+        case k_bin_true: 
+                json_binary_emit(handler, boolean, userdata, 1);
+                return 0;
+        case k_bin_false: 
+                json_binary_emit(handler, boolean, userdata, 0);
+                return 0;
+
+        case k_bin_int: {
+                int32_t n;
+                if (json_binary_read(r, &n, 4) != 0)
+                        return -1;
+                json_binary_emit(handler, number, userdata, (double) n);
+                return 0;
+        }
+
+        case k_bin_number: {
+                double d;
+                if (json_binary_read(r, &d, 8) != 0)
+                        return -1;
+                json_binary_emit(handler, number, userdata, d);
+                return 0;
+        }
+
+        case k_bin_string: {
+                const string_t* string = json_binary_string(r);
+                if (string == NULL)
+                        return -1;
+                json_binary_emit(handler, string, userdata, string->s, string->length);
+                return 0;
+        }
+
+        case k_bin_array: 
+                if ((json_binary_read(r, &count, 4) != 0)
+                    || (r->depth >= JSON_BINARY_DEPTH))
+                        return -1;
+                json_binary_emit(handler, array_start, userdata);
+                r->depth++;
+                for (uint32_t i = 0; i < count; i++) {
+                        ret = json_binary_events(r, handler, userdata);
+                        if (ret != 0)
+                                return ret;
+                }
+                r->depth--;
+                json_binary_emit(handler, array_end, userdata);
+                return 0;
+
+        case k_bin_object: 
+                if ((json_binary_read(r, &count, 4) != 0)
+                    || (r->depth >= JSON_BINARY_DEPTH))
+                        return -1;
+                json_binary_emit(handler, object_start, userdata);
+                r->depth++;
+                for (uint32_t i = 0; i < count; i++) {
+                        uint32_t k;
+                        if ((json_binary_read(r, &k, 4) != 0) || (k >= r->num_keys))
+                                return -1;
+                        json_binary_emit(handler, key, userdata, r->keys[k], r->lengths[k]);
+                        ret = json_binary_events(r, handler, userdata);
+                        if (ret != 0)
+                                return ret;
+                }
+                r->depth--;
+                json_binary_emit(handler, object_end, userdata);
+                return 0;
+        }
+
+        return -1;
+}
+
+/******************************************************************************/
+
 typedef enum {
 	k_end_of_string = -5,
 	k_stack_overflow = -4,
@@ -1191,11 +2043,15 @@ struct _json_parser_t {
 	int32 numstate;
 	int32 error_code;
 	char* error_message;
+        json_arena_t* arena;
+        const json_sax_t* handler;
+        void* userdata;
 
 	int32 stack_top;
 	int32 stack_depth;
-	json_object_t value_stack[256];
 	int32 state_stack[256];
+	int32 value_top;
+	json_object_t value_stack[256];
 };
 
 static inline int32 whitespace(int32 c)
@@ -1203,6 +2059,88 @@ static inline int32 whitespace(int32 c)
 	return ((c == ' ') || (c == '\r') || (c == '\n') || (c == '\t'));
 }
 
+#if defined(JSON_SIMD_NEON)
+/* NEON has no movemask: this only tells whether any byte is set, and
+   the plain loop finds which one. */
+static inline int json_neon_any(uint8x16_t m)
+{
+        uint8x8_t m8 = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+        return vget_lane_u64(vreinterpret_u64_u8(m8), 0) != 0;
+}
+#endif
+
+/* Returns the first character of the text that is not whitespace,
+   or its end. */
+static inline const char* json_skip_whitespace(const char* p, const char* end)
+{
+        /* Most runs are a single space, or none. */
+        if ((p < end) && !whitespace(*p))
+                return p;
+
+#if defined(JSON_SIMD_SSE2)
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i nl = _mm_set1_epi8('\n');
+        const __m128i cr = _mm_set1_epi8('\r');
+        while (end - p >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*) p);
+                __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), 
+                                                       _mm_cmpeq_epi8(v, tab)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(v, nl), 
+                                                       _mm_cmpeq_epi8(v, cr)));
+                int mask = ~_mm_movemask_epi8(ws) & 0xffff;
+                if (mask != 0)
+                        return p + __builtin_ctz(mask);
+                p += 16;
+        }
+#elif defined(JSON_SIMD_NEON)
+        const uint8x16_t space = vdupq_n_u8(' ');
+        const uint8x16_t tab = vdupq_n_u8('\t');
+        const uint8x16_t nl = vdupq_n_u8('\n');
+        const uint8x16_t cr = vdupq_n_u8('\r');
+        while (end - p >= 16) {
+                uint8x16_t v = vld1q_u8((const uint8_t*) p);
+                uint8x16_t ws = vorrq_u8(vorrq_u8(vceqq_u8(v, space), vceqq_u8(v, tab)),
+                                         vorrq_u8(vceqq_u8(v, nl), vceqq_u8(v, cr)));
+                if (json_neon_any(vmvnq_u8(ws)))
+                        break;
+                p += 16;
+        }
+#endif
+        while ((p < end) && whitespace(*p))
+                p++;
+        return p;
+}
+
+/* Returns the first quote or backslash of the text, or its end. */
+static inline const char* json_scan_string(const char* p, const char* end)
+{
+#if defined(JSON_SIMD_SSE2)
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        while (end - p >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*) p);
+                int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), 
+                                                          _mm_cmpeq_epi8(v, backslash)));
+                if (mask != 0)
+                        return p + __builtin_ctz(mask);
+                p += 16;
+        }
+#elif defined(JSON_SIMD_NEON)
+        const uint8x16_t quote = vdupq_n_u8('"');
+        const uint8x16_t backslash = vdupq_n_u8('\\');
+        while (end - p >= 16) {
+                uint8x16_t v = vld1q_u8((const uint8_t*) p);
+                if (json_neon_any(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash))))
+                        break;
+                p += 16;
+        }
+#endif
+        while ((p < end) && (*p != '"') && (*p != '\\'))
+                p++;
+        return p;
+}
+
 json_parser_t* json_parser_create()
 {
 	json_parser_t* parser = JSON_NEW(json_parser_t);
@@ -1221,6 +2159,40 @@ void json_parser_destroy(json_parser_t* parser)
 	}
 }
 
+/* The values of each document go in a new arena, created with the
+   first value. The parser counts as one more user of the arena until
+   it is reset, so that the arena stays valid even when the document
+   was already dropped. The values of a document that was not parsed
+   completely can't be reached from outside the parser, and are freed
+   with their arena. */
+static json_arena_t* json_parser_arena(json_parser_t* parser)
+{
+        if (parser->arena == NULL) {
+                parser->arena = json_arena_create();
+                if (parser->arena != NULL)
+                        parser->arena->live++;
+        }
+        return parser->arena;
+}
+
+/* The document leaves the parser: its arena takes no more memory. */
+static void json_parser_seal_arena(json_parser_t* parser)
+{
+        if ((parser->arena != NULL) && json_parser_done(parser))
+                parser->arena->sealed = 1;
+}
+
+static void json_parser_release_arena(json_parser_t* parser)
+{
+        json_arena_t* arena = parser->arena;
+        parser->arena = NULL;
+        if (arena == NULL)
+                return;
+        if (!json_parser_done(parser) 
+            || (json_atomic_add(&arena->live, -1) == 0))
+                json_arena_destroy(arena);
+}
+
 void json_parser_init(json_parser_t* parser)
 {
 	JSON_MEMSET(parser, 0, sizeof(*parser));
@@ -1229,6 +2201,7 @@ void json_parser_init(json_parser_t* parser)
 
 void json_parser_cleanup(json_parser_t* parser)
 {
+        json_parser_release_arena(parser);
         if (parser->buffer != NULL) {
                 JSON_FREE(parser->buffer);
         }
@@ -1250,6 +2223,9 @@ char* json_parser_errstr(json_parser_t* parser)
 static void json_parser_set_error(json_parser_t* parser, int32 error, const char* message)
 {
 	parser->error_code = error;
+	if (parser->error_message != NULL) {
+		JSON_FREE(parser->error_message);
+	}
 	parser->error_message = json_strdup(message);
 }
 
@@ -1293,14 +2269,44 @@ static int32 json_parser_append(json_parser_t* parser, char c)
 	return k_continue;
 }
 
+static int32 json_parser_append_block(json_parser_t* parser, const char* s, int32 len)
+{
+	if (parser->bufindex + len > parser->buflen) {
+		int32 newlen = (parser->buflen == 0)? 128 : 2 * parser->buflen;
+		while (newlen < parser->bufindex + len) {
+			newlen *= 2;
+		}
+		char* newbuf = JSON_NEW_ARRAY(char, newlen);
+		if (newbuf == NULL) {
+			return k_out_of_memory;
+		}
+		if (parser->buffer != NULL) {
+			JSON_MEMCPY(newbuf, parser->buffer, parser->bufindex);
+			JSON_FREE(parser->buffer);
+		}
+		parser->buffer = newbuf;
+		parser->buflen = newlen;
+	}
+
+	JSON_MEMCPY(parser->buffer + parser->bufindex, s, len);
+	parser->bufindex += len;
+
+	return k_continue;
+}
+
 
-enum { k_parse_done = -1, k_parse_value = 0, k_object_1, k_object_2, k_object_3, k_object_4, k_array_1, k_array_2 }; 
+enum { k_parse_done = -1, k_parse_value = 0, k_object_0, k_object_1, k_object_2, k_object_3, k_object_4, k_array_0, k_array_1, k_array_2 }; 
+
+static const json_sax_t json_builder;
 
 void json_parser_reset(json_parser_t* parser)
 {
+        json_parser_release_arena(parser);
 	parser->stack_top = 0;
 	parser->stack_depth = 256;
 	parser->state_stack[0] = k_parse_value;
+	parser->value_top = 0;
+	parser->value_stack[0] = json_null();
 	parser->state = k_do;
 	parser->bufindex = 0;
 	parser->unicode = 0;
@@ -1311,6 +2317,23 @@ void json_parser_reset(json_parser_t* parser)
 		JSON_FREE(parser->error_message);
 		parser->error_message = NULL;
 	}
+        if (parser->handler == NULL) {
+                parser->handler = &json_builder;
+                parser->userdata = parser;
+        }
+}
+
+void json_parser_set_handler(json_parser_t* parser, 
+                             const json_sax_t* handler, 
+                             void* userdata)
+{
+        if (handler == NULL) {
+                parser->handler = &json_builder;
+                parser->userdata = parser;
+        } else {
+                parser->handler = handler;
+                parser->userdata = userdata;
+        }
 }
 
 void json_parser_reset_buffer(json_parser_t* parser)
@@ -1318,6 +2341,128 @@ void json_parser_reset_buffer(json_parser_t* parser)
 	parser->bufindex = 0;
 }
 
+/******************************************************************************/
+
+/* The builder is the default handler. It creates the values in the
+   arena of the document. The open objects and arrays, and the key
+   that waits for its value, are kept on the value stack. The
+   document ends up in slot 0. */
+
+static int32 json_builder_error(json_parser_t* parser)
+{
+        json_parser_set_error(parser, -1, "Out of memory");
+        return -1;
+}
+
+static int32 json_builder_push(json_parser_t* parser, json_object_t value)
+{
+        if (json_isnull(value)) {
+                return json_builder_error(parser);
+        }
+        if (parser->value_top + 1 >= parser->stack_depth) {
+                json_unref(value);
+                json_parser_set_error(parser, 1, "too many nested values");
+                return -1;
+        }
+        parser->value_stack[++parser->value_top] = value;
+        return 0;
+}
+
+/* Adds a value to the object or array on top of the stack. */
+static int32 json_builder_add(json_parser_t* parser, json_object_t value)
+{
+        if (parser->value_top == 0) {
+                parser->value_stack[0] = value;
+                return 0;
+        }
+        json_object_t top = parser->value_stack[parser->value_top];
+        int32 r;
+        if (json_isstring(top)) {
+                json_object_t object = parser->value_stack[--parser->value_top];
+                r = json_object_set(object, json_string_value(top), value);
+                json_unref(top);
+        } else {
+                r = json_array_push(top, value);
+        }
+        /* The document isn't shared with other threads yet, so the
+           builder drops its reference without the atomic update of
+           json_unref() once the container holds the value. */
+        if ((r == 0) && (value->type >= 100))
+                value->refcount--;
+        else
+                json_unref(value);
+        return 0;
+}
+
+static int32 json_builder_object_start(void* userdata)
+{
+        json_parser_t* parser = (json_parser_t*) userdata;
+        return json_builder_push(parser, json_object_create_in(json_parser_arena(parser)));
+}
+
+static int32 json_builder_array_start(void* userdata)
+{
+        json_parser_t* parser = (json_parser_t*) userdata;
+        return json_builder_push(parser, json_array_create_in(json_parser_arena(parser)));
+}
+
+static int32 json_builder_end(void* userdata)
+{
+        json_parser_t* parser = (json_parser_t*) userdata;
+        json_object_t value = parser->value_stack[parser->value_top--];
+        return json_builder_add(parser, value);
+}
+
+static int32 json_builder_key(void* userdata, const char* key, int32 len)
+{
+        json_parser_t* parser = (json_parser_t*) userdata;
+        return json_builder_push(parser, json_string_create_in(json_parser_arena(parser), key));
+}
+
+static int32 json_builder_string(void* userdata, const char* s, int32 len)
+{
+        json_parser_t* parser = (json_parser_t*) userdata;
+        json_object_t value = json_string_create_in(json_parser_arena(parser), s);
+        if (json_isnull(value)) {
+                return json_builder_error(parser);
+        }
+        return json_builder_add(parser, value);
+}
+
+static int32 json_builder_number(void* userdata, double d)
+{
+        json_parser_t* parser = (json_parser_t*) userdata;
+        json_object_t value = json_number_create_in(json_parser_arena(parser), d);
+        if (json_isnull(value)) {
+                return json_builder_error(parser);
+        }
+        return json_builder_add(parser, value);
+}
+
+static int32 json_builder_boolean(void* userdata, int32 value)
+{
+        return json_builder_add((json_parser_t*) userdata, value? json_true() : json_false());
+}
+
+static int32 json_builder_null(void* userdata)
+{
+        return json_builder_add((json_parser_t*) userdata, json_null());
+}
+
+static const json_sax_t json_builder = {
+        json_builder_object_start,
+        json_builder_end,
+        json_builder_array_start,
+        json_builder_end,
+        json_builder_key,
+        json_builder_string,
+        json_builder_number,
+        json_builder_boolean,
+        json_builder_null
+};
+
+/******************************************************************************/
+
 //
 // value = object | array | number | string | true | false | null
 // object = object_start key_value object_rest object_end  
@@ -1326,45 +2471,66 @@ void json_parser_reset_buffer(json_parser_t* parser)
 // array = array_start value array_rest array_end  
 // array_rest = , array_rest
 
-// parse_value + object_start -> object_1  & top_value = new object()
-// object_1    + string       -> object_2
+// parse_value + object_start -> object_0  & emit object_start
+// parse_value + object_end   -> (object_0 only) object_4 & parse
+// object_0/1  + string       -> object_2  & the string was emitted as a key
 // object_2    + colon        -> object_3  & top_state = parse_value & parse
-// object_3    + (value)      -> object_4  & object->set(key,top_value)
-// object_4    + object_end   -> (top_state)
+// object_3    + (value)      -> object_4
+// object_4    + object_end   -> (top_state) & emit object_end
 // object_4    + comma        -> object_1
 // 
-// parse_value + array_start  -> array_1  & top_value = new array()  
-// array_1     + (value)      -> array_2  & array.push(top_value)
-// array_2     + colon        -> array_1  & top_state = parse_value & parse 
-// array_2     + array_end    -> (top_state)
+// parse_value + array_start  -> array_0  & emit array_start
+// parse_value + array_end    -> (array_0 only) array_2 & parse
+// array_0/1   + (value)      -> array_2
+// array_2     + comma        -> array_1  & top_state = parse_value & parse 
+// array_2     + array_end    -> (top_state) & emit array_end
+//
+// The scalar values are emitted in parse_value.
+
+static int32 json_parser_token(json_parser_t* parser, int32 token);
 
+static int32 json_parser_push(json_parser_t* parser, int32 state)
+{
+	if (parser->stack_top + 1 >= parser->stack_depth) {
+		return k_stack_overflow;
+	}
+	parser->state_stack[++parser->stack_top] = state;
+	return k_continue;
+}
+
+/* The value, or the key, on top of the stack is complete: pass the
+   token on to the enclosing object or array. */
+static int32 json_parser_pop(json_parser_t* parser, int32 token)
+{
+	if (parser->stack_top > 0) {
+		parser->stack_top--;
+		return json_parser_token(parser, token);
+	}
+	parser->state_stack[parser->stack_top] = k_parse_done;
+	return k_continue;
+}
+
+static int32 json_parser_stopped(json_parser_t* parser)
+{
+        if (parser->error_code == 0) {
+                json_parser_set_error(parser, 1, "stopped by the handler");
+        }
+        return k_parsing_error;
+}
+
+#define json_parser_emit(__parser, __event, ...)                        \
+        if ((__parser)->handler->__event != NULL                        \
+            && (__parser)->handler->__event(__VA_ARGS__) != 0)          \
+                return json_parser_stopped(__parser);
 
 static int32 json_parser_token(json_parser_t* parser, int32 token)
 {
 	int32 state = parser->state_stack[parser->stack_top];
+	int32 parent = (parser->stack_top > 0)? parser->state_stack[parser->stack_top-1] : k_parse_done;
+	void* userdata = parser->userdata;
 	double d;
-	json_object_t value;
-	json_object_t key;
-	json_object_t object;
 	int32 r = k_continue;
 
-        if (0) {
-                switch (token) {
-                case k_object_start: printf("k_object_start\n"); break;
-                case k_object_end: printf("k_object_end\n"); break;
-                case k_array_start: printf("k_array_start\n"); break;
-                case k_array_end: printf("k_array_end\n"); break;
-                case k_string: printf("k_string\n"); break;
-                case k_number: printf("k_number\n"); break;
-                case k_true: printf("k_true\n"); break;
-                case k_false: printf("k_false\n"); break;
-                case k_null: printf("k_null\n"); break;
-                case k_colon: printf("k_colon\n"); break;
-                case k_comma: printf("k_comma\n"); break;
-                default: printf("unknown token\n"); break;
-                }
-        }
-
 	switch (state) {
 
 	case k_parse_done:
@@ -1374,81 +2540,71 @@ static int32 json_parser_token(json_parser_t* parser, int32 token)
 
 	case k_parse_value:
 
+		if ((parent == k_object_0) || (parent == k_object_1)) {
+			if (token == k_string) {
+				json_parser_emit(parser, key, userdata, parser->buffer, parser->bufindex - 1);
+				json_parser_reset_buffer(parser);
+				r = json_parser_pop(parser, token);
+			} else if ((token == k_object_end) && (parent == k_object_0)) {
+				parser->stack_top--;
+				parser->state_stack[parser->stack_top] = k_object_4;
+				r = json_parser_token(parser, token);
+			} else {
+				json_parser_set_error(parser, 1, "expected a string (object field)");
+				r = k_parsing_error;
+			}
+			break;
+		}
+
 		switch (token) {
 			
 		case k_object_start:
-			parser->value_stack[parser->stack_top] = json_object_create();
-			parser->state_stack[parser->stack_top] = k_object_1;
-			parser->state_stack[++parser->stack_top] = k_parse_value;
-			if (parser->stack_top >= parser->stack_depth) {
-				r = k_stack_overflow;
-			}
+			json_parser_emit(parser, object_start, userdata);
+			parser->state_stack[parser->stack_top] = k_object_0;
+			r = json_parser_push(parser, k_parse_value);
 			break;
 
 		case k_array_start:
-			parser->value_stack[parser->stack_top] = json_array_create();
-			parser->state_stack[parser->stack_top] = k_array_1;
-			parser->state_stack[++parser->stack_top] = k_parse_value;
-			if (parser->stack_top >= parser->stack_depth) {
-				r = k_stack_overflow;
+			json_parser_emit(parser, array_start, userdata);
+			parser->state_stack[parser->stack_top] = k_array_0;
+			r = json_parser_push(parser, k_parse_value);
+			break;
+
+		case k_array_end:
+			if (parent != k_array_0) {
+				json_parser_set_error(parser, 1, "expected a new value");
+				r = k_parsing_error;
+				break;
 			}
+			parser->stack_top--;
+			parser->state_stack[parser->stack_top] = k_array_2;
+			r = json_parser_token(parser, token);
 			break;
 
 		case k_string:
-			parser->value_stack[parser->stack_top] = json_string_create(parser->buffer);
+			json_parser_emit(parser, string, userdata, parser->buffer, parser->bufindex - 1);
 			json_parser_reset_buffer(parser);
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
+			r = json_parser_pop(parser, token);
 			break;
 
 		case k_number: 
-			d = atof(parser->buffer); // FIXME: use strtod
-			parser->value_stack[parser->stack_top] = json_number_create(d);
+			d = json_strtod(parser->buffer);
+			json_parser_emit(parser, number, userdata, d);
 			json_parser_reset_buffer(parser);
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
-		
+			r = json_parser_pop(parser, token);
 			break;
 
 		case k_true:
-			parser->value_stack[parser->stack_top] = json_true();
-			json_parser_reset_buffer(parser);
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
-			break;
-
 		case k_false:
-			parser->value_stack[parser->stack_top] = json_false();
+			json_parser_emit(parser, boolean, userdata, token == k_true);
 			json_parser_reset_buffer(parser);
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
+			r = json_parser_pop(parser, token);
 			break;
 
 		case k_null:
-			parser->value_stack[parser->stack_top] = json_null();
+			json_parser_emit(parser, null, userdata);
 			json_parser_reset_buffer(parser);
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
+			r = json_parser_pop(parser, token);
 			break;
 
 		default:
@@ -1458,27 +2614,16 @@ static int32 json_parser_token(json_parser_t* parser, int32 token)
 		}
 		break;
 
+	case k_object_0:
 	case k_object_1:
-		if (token == k_string) {
-			// keep the key on the stack by increase the stack top.
-			parser->stack_top++; 
-			if (parser->stack_top >= parser->stack_depth) {
-				r = k_stack_overflow;
-			}
-			parser->state_stack[parser->stack_top] = k_object_2; 
-		} else {
-                        json_parser_set_error(parser, 1, "expected a string (object field)");
-			r = k_parsing_error;
-		}
+		// keep the key's place on the stack
+		r = json_parser_push(parser, k_object_2);
 		break;
 
 	case k_object_2:
 		if (token == k_colon) {
 			parser->state_stack[parser->stack_top] = k_object_3;
-			parser->state_stack[++parser->stack_top] = k_parse_value; 
-			if (parser->stack_top >= parser->stack_depth) {
-				r = k_stack_overflow;
-			}
+			r = json_parser_push(parser, k_parse_value);
 		} else {
                         json_parser_set_error(parser, 1, "expected a colon ':'");
 			r = k_parsing_error;
@@ -1486,47 +2631,21 @@ static int32 json_parser_token(json_parser_t* parser, int32 token)
 		break;
 
 	case k_object_3:
-		switch (token) {
-		case k_object_end:
-		case k_array_end:
-		case k_string:
-		case k_number:
-		case k_true:
-		case k_false:
-		case k_null:
-			value = parser->value_stack[parser->stack_top+1];
-			key = parser->value_stack[parser->stack_top--];
-			object = parser->value_stack[parser->stack_top];
-			json_object_set(object, json_string_value(key), value);
-			json_unref(key);
-			json_unref(value);
-			parser->state_stack[parser->stack_top] = k_object_4;
-			break;
-			
-		default:
-                        json_parser_set_error(parser, 1, "expected a object field value");
-			r = k_parsing_error;
-			break;
-		}
+		// the value is complete; pop the key's place
+		parser->stack_top--;
+		parser->state_stack[parser->stack_top] = k_object_4;
 		break;
 
 	case k_object_4:
 		switch (token) {
 		case k_object_end:
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
+			json_parser_emit(parser, object_end, userdata);
+			r = json_parser_pop(parser, token);
 			break;
 
 		case k_comma:
 			parser->state_stack[parser->stack_top] = k_object_1;
-			parser->state_stack[++parser->stack_top] = k_parse_value;
-			if (parser->stack_top >= parser->stack_depth) {
-				r = k_stack_overflow;
-			}
+			r = json_parser_push(parser, k_parse_value);
 			break;
 
 		default:
@@ -1536,46 +2655,21 @@ static int32 json_parser_token(json_parser_t* parser, int32 token)
 		}
 		break;
 
+	case k_array_0:
 	case k_array_1:
-		switch (token) {
-		case k_object_end:
-		case k_array_end:
-		case k_string:
-		case k_number:
-		case k_true:
-		case k_false:
-		case k_null:
-			value = parser->value_stack[parser->stack_top+1];
-			object = parser->value_stack[parser->stack_top];
-			json_array_push(object, value);
-                        json_unref(value);
-			parser->state_stack[parser->stack_top] = k_array_2;
-			break;
-			
-		default:
-                        json_parser_set_error(parser, 1, "expected array element");
-			r = k_parsing_error;
-			break;
-		}
+		parser->state_stack[parser->stack_top] = k_array_2;
 		break;
 
 	case k_array_2:
 		switch (token) {
 		case k_comma:
 			parser->state_stack[parser->stack_top] = k_array_1;
-			parser->state_stack[++parser->stack_top] = k_parse_value;
-			if (parser->stack_top >= parser->stack_depth) {
-				r = k_stack_overflow;
-			}
+			r = json_parser_push(parser, k_parse_value);
 			break;
 			
 		case k_array_end:
-			if (parser->stack_top > 0) {
-				parser->stack_top--;
-				r = json_parser_token(parser, token);
-			} else {
-				parser->state_stack[parser->stack_top] = k_parse_done;
-			}
+			json_parser_emit(parser, array_end, userdata);
+			r = json_parser_pop(parser, token);
 			break;
 
 		default:
@@ -1987,18 +3081,85 @@ int32 json_parser_feed_one(json_parser_t* parser, char c)
 	return ret;
 }
 
-int32 json_parser_feed(json_parser_t* parser, const char* buffer, int32 len)
+/* Feeds a block of text to the parser. The whitespace between the
+   tokens, the plain characters of the strings and the digits of
+   the numbers, which make up most of the text, are handled in runs
+   instead of one character at a time. The number of bytes that were used is returned in *used:
+   on an error, the last one is the offending character. With
+   until_done, the parser stops at the end of the value and ignores
+   what follows. */
+static int32 json_parser_scan(json_parser_t* parser, const char* buffer, int32 len, 
+			      int32* used, int32 until_done)
 {
-	int32 r = 0;
-	while (len-- > 0) {
-		r = json_parser_feed_one(parser, *buffer++);
-		if (r != 0) {
+	const char* p = buffer;
+	const char* end = buffer + len;
+	const char* s;
+	int32 r = k_continue;
+
+	while (p < end) {
+		switch (parser->state) {
+		case k_do: 
+			p = json_skip_whitespace(p, end);
+			if ((p == end) || (until_done && json_parser_done(parser))) {
+				goto done;
+			}
+			r = json_parser_do(parser, *p++);
+			break;
+
+		case k_parsing_string: 
+			if (!parser->backslash && (parser->unicode == 0)) {
+				s = p;
+				p = json_scan_string(p, end);
+				if (p > s) {
+					r = json_parser_append_block(parser, s, p - s);
+					if ((r != k_continue) || (p == end)) {
+						break;
+					}
+				}
+			}
+			r = json_parser_feed_string(parser, *p++);
+			break;
+
+		case k_parsing_number: 
+			s = p;
+			while (p < end) {
+				int32 next = _numtrans[parser->numstate][json_numinput(parser, *p)];
+				if (next == _error) {
+					break;
+				}
+				parser->numstate = next;
+				p++;
+			}
+			if (p > s) {
+				r = json_parser_append_block(parser, s, p - s);
+				if ((r != k_continue) || (p == end)) {
+					break;
+				}
+			}
+			r = json_parser_feed_number(parser, *p++);
+			break;
+
+		default:
+			r = json_parser_feed_one(parser, *p++);
+			break;
+		}
+
+		if (r != k_continue) {
 			break;
 		}
 	}
+
+ done:
+	*used = p - buffer;
 	return r;
 }
 
+int32 json_parser_feed(json_parser_t* parser, const char* buffer, int32 len)
+{
+	int32 used;
+	return json_parser_scan(parser, buffer, len, &used, 0);
+}
+
 int32 json_parser_done(json_parser_t* parser)
 {
 	return parser->state_stack[parser->stack_top] == k_parse_done;
@@ -2035,14 +3196,168 @@ json_object_t json_parser_eval(json_parser_t* parser, const char* s)
 		return json_null();
 	}
 
+        json_parser_seal_arena(parser);
 	return parser->value_stack[0];
 }
 
 json_object_t json_parser_result(json_parser_t* parser)
 {
+        json_parser_seal_arena(parser);
 	return parser->value_stack[0];
 }
 
+/* Advances the line and column over the text, the same way an
+   editor counts them. */
+static void json_count_position(const char* text, int32 len, int* linenum, int* colnum)
+{
+        const char* end = text + len;
+        const char* line = NULL;
+        const char* q = text;
+
+        while ((q < end) && (q = memchr(q, '\n', end - q)) != NULL) {
+                (*linenum)++;
+                line = ++q;
+        }
+        if (line != NULL) {
+                *colnum = (int) (end - line);
+        } else {
+                *colnum += (int) len;
+        }
+}
+
+/* Loads a binary document from the mapped file. The builder gets the
+   values in place in the mapping, which then belongs to the arena of
+   the document; another handler gets the events. Returns 0, or -1
+   with the error set. */
+static int32 json_parser_load_binary(json_parser_t* parser, char* map, int32 len)
+{
+        json_binreader_t reader;
+        uint32_t values;
+        int32 r = -1;
+
+        if (json_binary_open(&reader, map, len, &values) != 0) {
+                json_binary_close(&reader);
+                munmap(map, len);
+                json_parser_set_error(parser, 1, "the binary file is corrupt");
+                return -1;
+        }
+
+        if (parser->handler == &json_builder) {
+                json_arena_t* arena = json_parser_arena(parser);
+                if (arena == NULL) {
+                        json_binary_close(&reader);
+                        munmap(map, len);
+                        json_parser_set_error(parser, -1, "Out of memory");
+                        return -1;
+                }
+                arena->map = map;
+                arena->maplen = len;
+                json_arena_reserve(arena, values * 2 * sizeof(base_t));
+                reader.arena = arena;
+                json_object_t value = json_binary_build(&reader);
+                if (value != NULL) {
+                        parser->value_stack[0] = value;
+                        r = 0;
+                }
+        } else {
+                r = json_binary_events(&reader, parser->handler, parser->userdata);
+                munmap(map, len);
+                if (r > 0) {
+                        json_binary_close(&reader);
+                        return json_parser_stopped(parser);
+                }
+        }
+
+        if ((r == 0) && (reader.p != reader.end)) {
+                json_unref(parser->value_stack[0]);
+                parser->value_stack[0] = json_null();
+                r = -1;
+        }
+        json_binary_close(&reader);
+
+        if (r != 0) {
+                json_parser_set_error(parser, 1, "the binary file is corrupt");
+                return -1;
+        }
+        parser->state_stack[0] = k_parse_done;
+        return 0;
+}
+
+/* The file is mapped in memory and parsed in one go. When it can't
+   be mapped (an empty file, a pipe), it is read in blocks. A file
+   written with k_json_binary is recognised by its first bytes, and
+   is only loaded when it can be mapped. The position of an error is
+   only worked out when there is one. */
+static int json_parser_load(json_parser_t* parser, const char* filename, 
+                            const char* caller, char* errmsg, int len)
+{
+        char block[65536];
+        struct stat st;
+        char* map = NULL;
+        int32 used = 0;
+        int32 r = k_continue;
+        int linenum = 1;
+        int colnum = 0;
+
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+                snprintf(errmsg, len, "%s: Failed to open the file: %s", caller, filename);
+                errmsg[len-1] = 0;
+                return -1;
+        }
+
+        if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) 
+            && (st.st_size > 0) && (st.st_size < 0x7fffffff)) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED) {
+                        map = NULL;
+                }
+        }
+
+        if ((map != NULL) && json_isbinary(map, (int32) st.st_size)) {
+                close(fd);
+                if (json_parser_load_binary(parser, map, (int32) st.st_size) != 0) {
+                        snprintf(errmsg, len, "%s: %s: error: %s", 
+                                 caller, filename, json_parser_errstr(parser));
+                        errmsg[len-1] = 0;
+                        return -1;
+                }
+                return 0;
+        }
+
+        if (map != NULL) {
+                r = json_parser_scan(parser, map, (int32) st.st_size, &used, 1);
+                if (r != k_continue) {
+                        json_count_position(map, used, &linenum, &colnum);
+                }
+                munmap(map, st.st_size);
+        } else {
+                while ((r == k_continue) && !json_parser_done(parser)) {
+                        ssize_t n = read(fd, block, sizeof(block));
+                        if (n <= 0) {
+                                break;
+                        }
+                        r = json_parser_scan(parser, block, (int32) n, &used, 1);
+                        json_count_position(block, used, &linenum, &colnum);
+                }
+        }
+        close(fd);
+
+        if (r != k_continue) {
+                snprintf(errmsg, len, 
+                         "%s: %s:%d:%d  error: %s",
+                         caller, filename, linenum, colnum, json_parser_errstr(parser));
+                errmsg[len-1] = 0;
+                return -1;
+        } 
+        if (!json_parser_done(parser)) {
+                snprintf(errmsg, len, "%s: The file is corrupt.", caller);
+                errmsg[len-1] = 0;
+                return -1;
+        }
+        return 0;
+}
+
 json_object_t json_load(const char* filename, int* err, char* errmsg, int len)
 {
         errmsg[0] = 0;
@@ -2055,52 +3370,43 @@ json_object_t json_load(const char* filename, int* err, char* errmsg, int len)
                 errmsg[len-1] = 0;
                 return json_null();
         }
-        FILE* fp = fopen(filename, "r");
-        if (fp == NULL) {
+
+        if (json_parser_load(parser, filename, "json_load", errmsg, len) != 0) {
                 *err = 1;
-                snprintf(errmsg, len, "json_load: Failed to open the file: %s", filename);
-                errmsg[len-1] = 0;
+                /* Text after a complete value is an error too. */
+                if (json_parser_done(parser))
+                        json_unref(json_parser_result(parser));
                 json_parser_destroy(parser);
                 return json_null();
         }
-        int linenum = 1;
-        int colnum = 0;
 
-        while (!json_parser_done(parser)) {
-                int c = fgetc(fp);
-                colnum++;
-                if (c == '\n') {
-                        linenum++;
-                        colnum = 0;
-                }
-                if (c == EOF) {
-                        *err = 1;
-                        snprintf(errmsg, len, "json_load: The file is corrupt.");
-                        errmsg[len-1] = 0;
-                        fclose(fp);
-                        json_parser_destroy(parser);
-                        return json_null();
-                }
-                int32 r = json_parser_feed_one(parser, c);
-                if (r != 0) {
-                        *err = 1;
-                        snprintf(errmsg, len, 
-                                 "json_load: %s:%d:%d  error: %s",
-                                 filename, linenum, colnum, json_parser_errstr(parser));
-                        errmsg[len-1] = 0;
-                        fclose(fp);
-                        json_parser_destroy(parser);
-                        return json_null();
-                } 
-        }
         json_object_t obj = json_parser_result(parser);
 
-        fclose(fp);
         json_parser_destroy(parser);
 
         return obj;
 }
 
+int json_load_events(const char* filename, const json_sax_t* handler, 
+                     void* userdata, char* errmsg, int len)
+{
+        errmsg[0] = 0;
+
+        json_parser_t* parser = json_parser_create();
+        if (parser == NULL) {
+                snprintf(errmsg, len, "json_load_events: Failed to create the file parser.");
+                errmsg[len-1] = 0;
+                return -1;
+        }
+        json_parser_set_handler(parser, handler, userdata);
+
+        int r = json_parser_load(parser, filename, "json_load_events", errmsg, len);
+
+        json_parser_destroy(parser);
+
+        return r;
+}
+
 /******************************************************************************/
 
 enum {
@@ -2155,6 +3461,7 @@ tokenizer_t* new_tokenizer(const char* s)
 
 void delete_tokenizer(tokenizer_t* tokenizer)
 {
+        JSON_FREE(tokenizer->s);
         JSON_FREE(tokenizer);
 }
 
@@ -2370,108 +3677,109 @@ typedef enum _evaluator_state_t {
         evaluator_state_6
 } evaluator_state_t;
 
-typedef struct _evaluator_t {
-        tokenizer_t* tokenizer;
-        evaluator_state_t state;
-} evaluator_t;
-
-void evaluator_reset(evaluator_t* evaluator);
-
-evaluator_t* new_evaluator(const char* s)
-{
-        evaluator_t* evaluator = JSON_NEW(evaluator_t);
-        if (evaluator == NULL)
-                return NULL;
+#define JSON_PATH_MAX_STEPS 32
 
-	memset(evaluator, 0, sizeof(evaluator_t));
-        evaluator->tokenizer = new_tokenizer(s);
-        evaluator->state = evaluator_state_0;
-        return evaluator;
-}
+/* A step is either a key (index == -1) or an array index. The keys
+   are stored after the steps, in the same block. */
+typedef struct _json_path_step_t {
+        const char* key;
+        int32 index;
+} json_path_step_t;
 
-void delete_evaluator(evaluator_t* evaluator)
-{
-        delete_tokenizer(evaluator->tokenizer);
-        JSON_FREE(evaluator);
-}
+struct _json_path_t {
+        char* expression;
+        int32 count;
+        json_path_step_t steps[];
+};
 
-json_object_t evaluator_do(evaluator_t* evaluator, json_object_t x)
+/* Runs the tokenizer through the state machine above and records
+   the keys and indices. Returns NULL, with *invalid set, if the
+   expression is invalid, and NULL if memory runs out. */
+static json_path_t* json_path_parse(const char* expression, int32* invalid)
 {
+        json_path_step_t steps[JSON_PATH_MAX_STEPS];
+        char* keys[JSON_PATH_MAX_STEPS];
+        int32 count = 0;
+        int32 keylen = 0;
+        evaluator_state_t state = evaluator_state_0;
         int token;
+        int r;
 
-        while (1) {
+        *invalid = 0;
 
-                if (json_isnull(x))
-                        return x;
+        tokenizer_t* tokenizer = new_tokenizer(expression);
+        if (tokenizer == NULL)
+                return NULL;
 
-                int r = tokenizer_get(evaluator->tokenizer, &token);
+        while (state != evaluator_state_6) {
+
+                r = tokenizer_get(tokenizer, &token);
                 if (r == k_tokenizer_error) 
-                        return json_null();
+                        goto error;
 
                 if (r == k_tokenizer_endofstring) { 
-                        switch (evaluator->state) {
-                        case evaluator_state_1:
-                        case evaluator_state_3:
-                                return x;
-                        default:
-                                return json_null();
+                        if ((state == evaluator_state_1) || (state == evaluator_state_3)) {
+                                state = evaluator_state_6;
+                                continue;
                         }
+                        goto error;
                 }
 
-                switch (evaluator->state) {
+                if ((count == JSON_PATH_MAX_STEPS) 
+                    && ((token == k_token_variable) || (token == k_token_number)))
+                        goto error;
+
+                switch (state) {
                 case evaluator_state_0:
+                case evaluator_state_4:
                         if (token == k_token_variable) {
-                                x = json_object_get(x, tokenizer_get_data(evaluator->tokenizer));
-                                evaluator->state = evaluator_state_1;
-                        } else if (token == k_token_bracketopen) {
-                                evaluator->state = evaluator_state_2;
+                                keys[count] = json_strdup(tokenizer_get_data(tokenizer));
+                                if (keys[count] == NULL)
+                                        goto error;
+                                keylen += JSON_STRLEN(keys[count]) + 1;
+                                steps[count++].index = -1;
+                                state = evaluator_state_1;
+                        } else if ((state == evaluator_state_0) 
+                                   && (token == k_token_bracketopen)) {
+                                state = evaluator_state_2;
                         } else {
-                                return json_null();
+                                goto error;
                         }
                         break;
 
                 case evaluator_state_1:
                         if (token == k_token_dot) {
-                                evaluator->state = evaluator_state_4;
+                                state = evaluator_state_4;
                         } else {
-                                return json_null();
+                                goto error;
                         }
                         break;
 
                 case evaluator_state_2:
                         if (token == k_token_number) {
-                                int index = atoi(tokenizer_get_data(evaluator->tokenizer));
-                                x = json_array_get(x, index);
-                                evaluator->state = evaluator_state_5;
+                                keys[count] = NULL;
+                                steps[count++].index = atoi(tokenizer_get_data(tokenizer));
+                                state = evaluator_state_5;
                         } else {
-                                return json_null();
+                                goto error;
                         }
                         break;
 
                 case evaluator_state_3:
                         if (token == k_token_dot) {
-                                evaluator->state = evaluator_state_4;
+                                state = evaluator_state_4;
                         } else if (token == k_token_bracketopen) {
-                                evaluator->state = evaluator_state_2;
-                        } else {
-                                return json_null();
-                        }
-                        break;
-
-                case evaluator_state_4:
-                        if (token == k_token_variable) {
-                                x = json_object_get(x, tokenizer_get_data(evaluator->tokenizer));
-                                evaluator->state = evaluator_state_1;
+                                state = evaluator_state_2;
                         } else {
-                                return json_null();
+                                goto error;
                         }
                         break;
 
                 case evaluator_state_5:
                         if (token == k_token_bracketclose) {
-                                evaluator->state = evaluator_state_3;
+                                state = evaluator_state_3;
                         } else {
-                                return json_null();
+                                goto error;
                         }
                         break;
 
@@ -2479,13 +3787,162 @@ json_object_t evaluator_do(evaluator_t* evaluator, json_object_t x)
                         break;
                 }
         }
+
+        delete_tokenizer(tokenizer);
+
+        int32 explen = JSON_STRLEN(expression) + 1;
+        json_path_t* path = (json_path_t*) JSON_NEW_ARRAY(char, sizeof(json_path_t) 
+                                                         + count * sizeof(json_path_step_t)
+                                                         + keylen + explen);
+        if (path == NULL) {
+                for (int32 i = 0; i < count; i++)
+                        if (keys[i]) JSON_FREE(keys[i]);
+                return NULL;
+        }
+
+        char* p = (char*) &path->steps[count];
+        path->count = count;
+        for (int32 i = 0; i < count; i++) {
+                path->steps[i].index = steps[i].index;
+                path->steps[i].key = NULL;
+                if (keys[i] != NULL) {
+                        JSON_STRCPY(p, keys[i]);
+                        path->steps[i].key = p;
+                        p += JSON_STRLEN(keys[i]) + 1;
+                        JSON_FREE(keys[i]);
+                }
+        }
+        JSON_STRCPY(p, expression);
+        path->expression = p;
+
+        return path;
+
+ error:
+        for (int32 i = 0; i < count; i++)
+                if (keys[i]) JSON_FREE(keys[i]);
+        delete_tokenizer(tokenizer);
+        *invalid = 1;
+        return NULL;
+}
+
+json_path_t* json_path_compile(const char* expression)
+{
+        int32 invalid;
+        return json_path_parse(expression, &invalid);
+}
+
+/* The entry of the cache for an expression that doesn't compile: a
+   path without steps and a count of -1. */
+static json_path_t* json_path_invalid(const char* expression)
+{
+        int32 explen = JSON_STRLEN(expression) + 1;
+        json_path_t* path = (json_path_t*) JSON_NEW_ARRAY(char, sizeof(json_path_t) + explen);
+        if (path == NULL)
+                return NULL;
+        path->count = -1;
+        path->expression = (char*) &path->steps[0];
+        JSON_STRCPY(path->expression, expression);
+        return path;
+}
+
+void json_path_free(json_path_t* path)
+{
+        if (path != NULL)
+                JSON_FREE(path);
+}
+
+json_object_t json_path_eval(json_path_t* path, json_object_t x)
+{
+        if (path == NULL)
+                return json_null();
+
+        for (int32 i = 0; i < path->count; i++) {
+                if (json_isnull(x))
+                        return x;
+                if (path->steps[i].key != NULL)
+                        x = json_object_get(x, path->steps[i].key);
+                else
+                        x = json_array_get(x, path->steps[i].index);
+        }
+        return x;
+}
+
+/* The interned expressions. The accessors are called over and over
+   with the same constant strings, so each is compiled once and kept
+   for the life of the process. The table doesn't grow: when it is
+   full, the expression is compiled for a single use. A slot is only
+   written once, with a compare-and-swap, so the threads can share
+   the table without a lock. A thread that loses the race for a slot
+   drops its copy and looks at what the winner put there. The
+   invalid expressions are kept too, so that they aren't compiled
+   again on each call. */
+
+#define JSON_PATH_CACHE_SIZE 256
+
+static json_path_t* _path_cache[JSON_PATH_CACHE_SIZE];
+static int32 _path_cache_count = 0;
+
+/* Returns the interned path, or NULL with *invalid set if the
+   expression is invalid, or NULL if the cache is full. */
+static json_path_t* json_path_lookup(const char* expression, int32* invalid)
+{
+        json_path_t* compiled = NULL;
+        uint32 h = json_strhash(expression);
+
+        *invalid = 0;
+        for (int32 i = 0; i < JSON_PATH_CACHE_SIZE; i++) {
+                uint32 slot = (h + i) & (JSON_PATH_CACHE_SIZE - 1);
+                json_path_t* path = json_atomic_load(&_path_cache[slot]);
+                while (path == NULL) {
+                        /* Keep a quarter of the slots free so that
+                           the misses stay short. */
+                        if (4 * (json_atomic_load(&_path_cache_count) + 1)
+                            > 3 * JSON_PATH_CACHE_SIZE)
+                                break;
+                        if (compiled == NULL) {
+                                compiled = json_path_parse(expression, invalid);
+                                if ((compiled == NULL) && *invalid)
+                                        compiled = json_path_invalid(expression);
+                                if (compiled == NULL)
+                                        return NULL;
+                        }
+                        if (json_atomic_cas(&_path_cache[slot], &path, compiled)) {
+                                json_atomic_add(&_path_cache_count, 1);
+                                return *invalid? NULL : compiled;
+                        }
+                        /* path now holds the winner's expression. */
+                }
+                if (path == NULL)
+                        break;
+                if (JSON_STRCMP(path->expression, expression) == 0) {
+                        json_path_free(compiled);
+                        *invalid = (path->count < 0);
+                        return *invalid? NULL : path;
+                }
+        }
+        json_path_free(compiled);
+        return NULL;
+}
+
+json_path_t* json_path_intern(const char* expression)
+{
+        int32 invalid;
+        return json_path_lookup(expression, &invalid);
 }
 
 json_object_t json_get(json_object_t obj, const char* expression)
 {
-        evaluator_t* e = new_evaluator(expression);
-        json_object_t r = evaluator_do(e, obj);
-        delete_evaluator(e);
+        int32 invalid;
+        json_path_t* path = json_path_lookup(expression, &invalid);
+        if (path != NULL)
+                return json_path_eval(path, obj);
+        if (invalid)
+                return json_null();
+
+        /* The cache is full. */
+        path = json_path_parse(expression, &invalid);
+        json_object_t r = json_path_eval(path, obj);
+        json_path_free(path);
         return r;
 }
 
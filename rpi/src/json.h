@@ -69,9 +69,15 @@ enum {
 /* 	} value;	 */
 /* } json_object_t; */
 
+typedef struct _json_arena_t json_arena_t;
+
 typedef struct _base_t {
-	unsigned short refcount;	
+	unsigned int refcount;	
 	unsigned short type;
+        unsigned short flags;
+        /* The arena of the parsed document that holds the value, or
+           NULL if it was allocated on its own. */
+        json_arena_t* arena;
 	union {
 		void* data;
 		real_t number;
@@ -80,10 +86,25 @@ typedef struct _base_t {
 
 typedef base_t* json_object_t;
 
+/* The reference counts are updated atomically, so a value can be
+   referenced and released from several threads. A value whose count
+   reaches JSON_REFCOUNT_MAX is never deleted (it leaks instead of
+   being freed while still in use). null, true, false and undefined
+   are static and are not counted. */
+#define JSON_REFCOUNT_MAX 0x40000000
+
 #define json_ref(_obj)   json_refcount(_obj, 1)
 #define json_unref(_obj) json_refcount(_obj, -1)
 void json_refcount(json_object_t object, int32 val);
 
+/* Marks the value, and all the values it contains, as read-only: the
+   setters and json_object_unset() return -1 on a frozen array or
+   object. A frozen tree can be read, referenced and released from
+   several threads at once without locking. A tree that is changed by
+   one thread while another reads it must be locked by the caller. */
+void json_freeze(json_object_t object);
+int32 json_isfrozen(json_object_t object);
+
 /* Return zero to continue, non-zero to stop the iteration. */
 typedef int32 (*json_iterator_t)(const char* key, json_object_t value, void* data);
 
@@ -97,6 +118,11 @@ typedef int32 (*json_writer_t)(void* userdata, const char* s, int32 len);
 
 //
 
+/* Loads a text file, or a file written with k_json_binary, which is
+   recognised by its first bytes. A binary file is mapped, and the
+   strings and keys of the document point into the mapping, so it
+   must be replaced by renaming a new file over it, not rewritten in
+   place. */
 json_object_t json_load(const char* filename, int* err, char* errmsg, int len);
 
 /*
@@ -111,6 +137,20 @@ const char* json_getstr(json_object_t obj, const char* expression);
 int json_streq(json_object_t obj, const char* expression, const char* value);
 double json_getnum(json_object_t obj, const char* expression);
 
+/* A compiled expression: the keys and indices to walk. json_get()
+   and its variants intern the expressions they are given, so a
+   constant expression is only parsed on its first use.
+   json_path_compile() returns NULL if the expression is invalid. The
+   paths returned by json_path_intern() belong to the cache and must
+   not be freed; it returns NULL if the expression is invalid or the
+   cache is full. The cache can be used from several threads. */
+typedef struct _json_path_t json_path_t;
+
+json_path_t* json_path_compile(const char* expression);
+void json_path_free(json_path_t* path);
+json_path_t* json_path_intern(const char* expression);
+json_object_t json_path_eval(json_path_t* path, json_object_t obj);
+
 
 // object
 
@@ -138,6 +178,28 @@ enum {
 	k_json_binary = 2,
 };
 
+/* The binary format is meant for the files that the program writes
+   for itself, such as caches. It is written in the byte order of the
+   machine, and a file from a machine with the other order is refused
+   (its version reads wrong). The file is
+
+     0   "JSNB"
+     4   version (1)
+     8   number of keys
+     12  number of values
+     16  the keys: each a 32-bit length, the characters, and a zero
+
+   followed by the value. A value is a tag byte and its data:
+
+     0 null, 1 true, 2 false
+     3 integer: a 32-bit integer
+     4 number: a double
+     5 string: zeros up to a multiple of four bytes from the start
+       of the file, a 32-bit length, the characters, and a zero
+     6 array: the number of elements (32 bits), then the elements
+     7 object: the number of members (32 bits), then for each member
+       the index of its key (32 bits) and its value */
+
 int32 json_serialise(json_object_t object, 
                      int32 flags, 
                      json_writer_t fun, 
@@ -152,6 +214,28 @@ int32 json_tofilep(json_object_t object, int32 flags, FILE* fp);
 // parsing
 typedef struct _json_parser_t json_parser_t;
 
+/* The events of a streaming parse. The strings are only valid during
+   the call, and len does not count the final zero. A callback may be
+   NULL. Returning non-zero from a callback stops the parse with an
+   error. By default, the parser passes the events to a builder that
+   creates the values returned by json_parser_result(). */
+typedef struct _json_sax_t {
+        int32 (*object_start)(void* userdata);
+        int32 (*object_end)(void* userdata);
+        int32 (*array_start)(void* userdata);
+        int32 (*array_end)(void* userdata);
+        int32 (*key)(void* userdata, const char* key, int32 len);
+        int32 (*string)(void* userdata, const char* s, int32 len);
+        int32 (*number)(void* userdata, double value);
+        int32 (*boolean)(void* userdata, int32 value);
+        int32 (*null)(void* userdata);
+} json_sax_t;
+
+/* Parses the file and passes the events to the handler, without
+   building the values. Returns 0, or -1 with the error in errmsg. */
+int json_load_events(const char* filename, const json_sax_t* handler, 
+                     void* userdata, char* errmsg, int len);
+
 json_parser_t* json_parser_create();
 void json_parser_destroy(json_parser_t* parser);
 void json_parser_init(json_parser_t* parser);
@@ -159,6 +243,12 @@ void json_parser_cleanup(json_parser_t* parser);
 
 void json_parser_reset(json_parser_t* parser);
 
+/* Sends the events to the handler instead of the builder, until it
+   is set back to NULL. */
+void json_parser_set_handler(json_parser_t* parser, 
+                             const json_sax_t* handler, 
+                             void* userdata);
+
 int32 json_parser_errno(json_parser_t* parser);
 char* json_parser_errstr(json_parser_t* parser);
 
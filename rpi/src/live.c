@@ -0,0 +1,337 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "log_message.h"
+#include "live.h"
+
+#define LIVE_VERSION 1
+
+/* Offsets in 32-bit words */
+#define LIVE_MAGIC 0
+#define LIVE_VERSION_FIELD 1
+#define LIVE_SEQ 2
+#define LIVE_NUM_STREAMS 3
+#define LIVE_DEPTH_FIELD 4
+#define LIVE_UPDATED 5
+#define LIVE_STATUS 6
+#define LIVE_HEADER_WORDS 16
+
+#define LIVE_STREAM_WORDS (4 + 2 * LIVE_DEPTH)
+#define LIVE_SIZE (4 * (LIVE_HEADER_WORDS + LIVE_STREAMS * LIVE_STREAM_WORDS))
+
+#define LIVE_READ_ATTEMPTS 1000
+
+struct _live_t {
+        int fd;
+        int writable;
+        uint32_t* map;
+        uint32_t copy[LIVE_SIZE / 4];
+};
+
+static int live_valid(volatile uint32_t* words)
+{
+        return ((memcmp((const void*) &words[LIVE_MAGIC], "SBLV", 4) == 0)
+                && (words[LIVE_VERSION_FIELD] == LIVE_VERSION)
+                && (words[LIVE_NUM_STREAMS] == LIVE_STREAMS)
+                && (words[LIVE_DEPTH_FIELD] == LIVE_DEPTH));
+}
+
+static int live_lock(live_t* live, int type)
+{
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = 0;
+        fl.l_len = 0;
+        /* fcntl() locks aren't shared with forked children, unlike
+           flock(), so the upload worker and its parent exclude each
+           other. */
+        return fcntl(live->fd, F_SETLKW, &fl);
+}
+
+static int live_init(live_t* live)
+{
+        struct stat st;
+
+        if (live_lock(live, F_WRLCK) != 0) {
+                log_err("Live: Failed to lock the file");
+                return -1;
+        }
+
+        if ((fstat(live->fd, &st) == 0) && (st.st_size == LIVE_SIZE)) {
+                live->map = (uint32_t*) mmap(NULL, LIVE_SIZE, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, live->fd, 0);
+                if (live->map == MAP_FAILED) {
+                        live->map = NULL;
+                } else if (live_valid(live->map)) {
+                        live_lock(live, F_UNLCK);
+                        return 0;
+                } else {
+                        munmap(live->map, LIVE_SIZE);
+                        live->map = NULL;
+                }
+        }
+
+        /* New file, or a different layout: start again. The magic
+           is cleared first and goes in last, so that readers ignore
+           the file until it is ready. The file is never made
+           shorter than a reader's mapping. */
+        if (ftruncate(live->fd, LIVE_SIZE) != 0) {
+                log_err("Live: Failed to resize the file");
+                live_lock(live, F_UNLCK);
+                return -1;
+        }
+        live->map = (uint32_t*) mmap(NULL, LIVE_SIZE, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, live->fd, 0);
+        if (live->map == MAP_FAILED) {
+                log_err("Live: Failed to map the file");
+                live->map = NULL;
+                live_lock(live, F_UNLCK);
+                return -1;
+        }
+        memset(&live->map[LIVE_MAGIC], 0, 4);
+        __sync_synchronize();
+        memset(&live->map[1], 0, LIVE_SIZE - 4);
+        live->map[LIVE_VERSION_FIELD] = LIVE_VERSION;
+        live->map[LIVE_NUM_STREAMS] = LIVE_STREAMS;
+        live->map[LIVE_DEPTH_FIELD] = LIVE_DEPTH;
+        __sync_synchronize();
+        memcpy(&live->map[LIVE_MAGIC], "SBLV", 4);
+
+        live_lock(live, F_UNLCK);
+        return 0;
+}
+
+live_t* new_live(const char* file, int writable)
+{
+        live_t* live = (live_t*) malloc(sizeof(live_t));
+        if (live == NULL) {
+                log_err("Live: out of memory");
+                return NULL;
+        }
+        memset(live, 0, sizeof(live_t));
+        live->writable = writable;
+
+        live->fd = open(file, writable? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+        if (live->fd == -1) {
+                if (writable)
+                        log_err("Live: Failed to open '%s'", file);
+                free(live);
+                return NULL;
+        }
+
+        if (writable) {
+                if (live_init(live) != 0) {
+                        delete_live(live);
+                        return NULL;
+                }
+        } else {
+                struct stat st;
+                if ((fstat(live->fd, &st) != 0) || (st.st_size < LIVE_SIZE)) {
+                        delete_live(live);
+                        return NULL;
+                }
+                live->map = (uint32_t*) mmap(NULL, LIVE_SIZE, PROT_READ,
+                                             MAP_SHARED, live->fd, 0);
+                if (live->map == MAP_FAILED) {
+                        log_err("Live: Failed to map '%s'", file);
+                        live->map = NULL;
+                        delete_live(live);
+                        return NULL;
+                }
+        }
+
+        return live;
+}
+
+void delete_live(live_t* live)
+{
+        if (live->map)
+                munmap(live->map, LIVE_SIZE);
+        if (live->fd != -1)
+                close(live->fd);
+        free(live);
+}
+
+int live_begin(live_t* live)
+{
+        if (!live->writable || (live_lock(live, F_WRLCK) != 0))
+                return -1;
+        volatile uint32_t* seq = &live->map[LIVE_SEQ];
+        /* An odd number here means that a writer died in the middle
+           of its changes. It is overwritten by this one. */
+        *seq = (*seq | 1) + ((*seq & 1)? 2 : 0);
+        __sync_synchronize();
+        return 0;
+}
+
+void live_end(live_t* live)
+{
+        volatile uint32_t* seq = &live->map[LIVE_SEQ];
+        live->map[LIVE_UPDATED] = (uint32_t) time(NULL);
+        __sync_synchronize();
+        *seq = *seq + 1;
+        live_lock(live, F_UNLCK);
+}
+
+static uint32_t* live_stream(uint32_t* words, int stream)
+{
+        return words + LIVE_HEADER_WORDS + stream * LIVE_STREAM_WORDS;
+}
+
+void live_set_name(live_t* live, int stream, const char* name)
+{
+        if ((stream < 0) || (stream >= LIVE_STREAMS))
+                return;
+        char buf[8];
+        memset(buf, 0, 8);
+        strncpy(buf, name, 8);
+        memcpy(live_stream(live->map, stream), buf, 8);
+}
+
+void live_add(live_t* live, int stream, time_t timestamp, float value)
+{
+        if ((stream < 0) || (stream >= LIVE_STREAMS))
+                return;
+        uint32_t* s = live_stream(live->map, stream);
+        uint32_t* p = s + 4 + 2 * (s[2] % LIVE_DEPTH);
+        p[0] = (uint32_t) timestamp;
+        memcpy(&p[1], &value, 4);
+        s[2]++;
+}
+
+int live_set_status(live_t* live, int which, time_t t, int status)
+{
+        if ((which < 0) || (which >= LIVE_STATUS_COUNT))
+                return -1;
+        if (live_begin(live) != 0)
+                return -1;
+        live->map[LIVE_STATUS + 2 * which] = (uint32_t) t;
+        live->map[LIVE_STATUS + 2 * which + 1] = (uint32_t) status;
+        live_end(live);
+        return 0;
+}
+
+static void live_decode(uint32_t* words, live_snapshot_t* snapshot)
+{
+        memset(snapshot, 0, sizeof(live_snapshot_t));
+        snapshot->updated = (time_t) words[LIVE_UPDATED];
+
+        for (int i = 0; i < LIVE_STATUS_COUNT; i++) {
+                snapshot->status[i].time = (time_t) words[LIVE_STATUS + 2 * i];
+                snapshot->status[i].status = (int32_t) words[LIVE_STATUS + 2 * i + 1];
+        }
+
+        for (int i = 0; i < LIVE_STREAMS; i++) {
+                uint32_t* s = live_stream(words, i);
+                live_stream_t* stream = &snapshot->streams[i];
+                uint32_t written = s[2];
+                int n = (written < LIVE_DEPTH)? (int) written : LIVE_DEPTH;
+
+                memcpy(stream->name, s, 8);
+                stream->name[8] = 0;
+                stream->count = n;
+
+                for (int k = 0; k < n; k++) {
+                        uint32_t* p = s + 4 + 2 * ((written - n + k) % LIVE_DEPTH);
+                        stream->points[k].timestamp = (time_t) p[0];
+                        memcpy(&stream->points[k].value, &p[1], 4);
+                }
+        }
+}
+
+int live_read(live_t* live, live_snapshot_t* snapshot)
+{
+        volatile uint32_t* words = live->map;
+
+        for (int attempt = 0; attempt < LIVE_READ_ATTEMPTS; attempt++) {
+                if (!live_valid(words))
+                        return -1;
+
+                uint32_t seq = words[LIVE_SEQ];
+                if (seq & 1) {
+                        sched_yield();
+                        continue;
+                }
+                __sync_synchronize();
+                memcpy(live->copy, (const void*) words, LIVE_SIZE);
+                __sync_synchronize();
+                if (words[LIVE_SEQ] != seq)
+                        continue;
+
+                live_decode(live->copy, snapshot);
+                return 0;
+        }
+
+        log_warn("Live: No consistent copy after %d attempts", LIVE_READ_ATTEMPTS);
+        return -1;
+}
+
+int live_format_json(live_snapshot_t* snapshot, char* buf, int len)
+{
+        static const char* names[] = { "camera", "datapoints-upload", "photos-upload" };
+        int n = 0;
+
+#define LIVE_PRINT(...) do {                                            \
+                int m = snprintf(buf + n, len - n, __VA_ARGS__);        \
+                if ((m < 0) || (m >= len - n))                          \
+                        return -1;                                      \
+                n += m;                                                 \
+        } while (0)
+
+        LIVE_PRINT("{\"updated\":%ld", (long) snapshot->updated);
+
+        for (int i = 0; i < LIVE_STATUS_COUNT; i++)
+                LIVE_PRINT(",\"%s\":{\"time\":%ld,\"status\":%d}", names[i],
+                           (long) snapshot->status[i].time, snapshot->status[i].status);
+
+        LIVE_PRINT(",\"datastreams\":{");
+        int first = 1;
+        for (int i = 0; i < LIVE_STREAMS; i++) {
+                live_stream_t* stream = &snapshot->streams[i];
+                if ((stream->count == 0) || (stream->name[0] == 0))
+                        continue;
+                LIVE_PRINT("%s\"%s\":[", first? "" : ",", stream->name);
+                for (int k = 0; k < stream->count; k++)
+                        LIVE_PRINT("%s[%ld,%g]", (k == 0)? "" : ",",
+                                   (long) stream->points[k].timestamp,
+                                   stream->points[k].value);
+                LIVE_PRINT("]");
+                first = 0;
+        }
+        LIVE_PRINT("}}\n");
+
+#undef LIVE_PRINT
+
+        return n;
+}
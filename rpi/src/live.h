@@ -0,0 +1,126 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _LIVE_H_
+#define _LIVE_H_
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* The latest readings of each datastream, and the status of
+           the camera and of the uploads, are published in a small
+           memory-mapped file (<home>/live.dat) so that the web pages
+           and the daemon can show them without running sensorbox.
+
+           The file has a fixed layout, in the byte order of the
+           machine (all fields are 32 bits):
+
+             0   "SBLV"
+             4   version
+             8   sequence number
+             12  number of streams
+             16  depth of the rings
+             20  time of the last update
+             24  camera: time, status
+             32  datapoints upload: time, status
+             40  photos upload: time, status
+             48  reserved, up to 64
+
+           followed, for each stream, by its name (8 bytes), the
+           number of readings written so far, a reserved field, and
+           a ring of (timestamp, float value) pairs. The reading n
+           is at index n % depth.
+
+           Writers take a lock on the file and make the sequence
+           number odd while they change it. Readers don't lock: they
+           copy the file and start again if the sequence number was
+           odd, or changed during the copy. A status is 0 on
+           success and -1 on failure. */
+
+        #define LIVE_STREAMS 8
+        #define LIVE_DEPTH 60
+
+        enum {
+                LIVE_CAMERA,
+                LIVE_DATA_UPLOAD,
+                LIVE_PHOTO_UPLOAD,
+                LIVE_STATUS_COUNT
+        };
+
+        typedef struct _live_point_t {
+                time_t timestamp;
+                float value;
+        } live_point_t;
+
+        typedef struct _live_stream_t {
+                char name[9];
+                int count;
+                /* Oldest first */
+                live_point_t points[LIVE_DEPTH];
+        } live_stream_t;
+
+        typedef struct _live_status_t {
+                time_t time;
+                int status;
+        } live_status_t;
+
+        typedef struct _live_snapshot_t {
+                time_t updated;
+                live_status_t status[LIVE_STATUS_COUNT];
+                live_stream_t streams[LIVE_STREAMS];
+        } live_snapshot_t;
+
+        typedef struct _live_t live_t;
+
+        /* With writable set, the file is created or reset if needed.
+           Otherwise, it is mapped read-only and NULL is returned if
+           it doesn't exist. */
+        live_t* new_live(const char* file, int writable);
+        void delete_live(live_t* live);
+
+        /* The changes of a writer go between live_begin() and
+           live_end(). */
+        int live_begin(live_t* live);
+        void live_end(live_t* live);
+
+        void live_set_name(live_t* live, int stream, const char* name);
+        void live_add(live_t* live, int stream, time_t timestamp, float value);
+
+        /* Updates one of the status fields, in a section of its
+           own. */
+        int live_set_status(live_t* live, int which, time_t t, int status);
+
+        /* Copies a consistent view of the file. Returns -1 if the
+           file is invalid or if no consistent copy could be made. */
+        int live_read(live_t* live, live_snapshot_t* snapshot);
+
+        /* Formats the snapshot as JSON. Returns the length of the
+           output, or -1 if the buffer is too small. */
+        int live_format_json(live_snapshot_t* snapshot, char* buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,6 +26,7 @@
 #include <sys/time.h>
 #include <string.h>
 #include "log_message.h"
+#include "timestamp.h"
 
 static int _log_level = LOG_DEBUG;
 static FILE* _log_file = NULL;
@@ -57,20 +58,19 @@ void log_set_level(int level)
                 _log_level = LOG_ERROR;
 }
 
-static char _timestamp_buffer[256];
+static char _timestamp_buffer[TIMESTAMP_MAXLEN];
 static time_t _timestamp_last = 0;
+static timestamp_cache_t _timestamp_cache;
 
 // Not re-entrant!
 static const char* get_timestamp()
 {
         struct timeval tv;
         gettimeofday(&tv, NULL);
-        if (tv.tv_sec != _timestamp_last) {
-                struct tm r;
-                localtime_r(&tv.tv_sec, &r);
-                snprintf(_timestamp_buffer, 256, "%04d-%02d-%02d %02d:%02d:%02d",
-                         1900 + r.tm_year, 1 + r.tm_mon, r.tm_mday, 
-                         r.tm_hour, r.tm_min, r.tm_sec);
+        if ((tv.tv_sec != _timestamp_last) || (_timestamp_buffer[0] == 0)) {
+                timestamp_format(&_timestamp_cache, tv.tv_sec, 
+                                 TIMESTAMP_LOG, _timestamp_buffer);
+                _timestamp_last = tv.tv_sec;
         }
         return _timestamp_buffer;
 }
@@ -36,6 +36,7 @@
 #include "log_message.h"
 #include "clock.h"
 #include "sensorbox.h"
+#include "gorilla.h"
 
 static char* _home_dir = "/var/p2pfoodlab";
 static char* _log_file = "/var/p2pfoodlab/log.txt";
@@ -65,9 +66,13 @@ static void usage(FILE* fp, int argc, char** argv)
                  "                         update sensors and/or camera if necessary,\n"
                  "                         upload data and photos [default]\n"
                  "  store-data             Store the latest sensor values\n"
+                 "  upload                 Upload the datapoints, status, and photos\n"
+                 "  export-data            Print the datapoints that haven't been uploaded, in CSV\n"
                  "  upload-data            Upload the datapoints\n"
+                 "  flush                  Write the staged datapoints and photos to the SD card\n"
                  "  camera                 Grab a photo\n"
                  "  upload-photos          Upload the photos on the disk\n"
+                 "  status                 Print the pending data and the uplink budget\n"
                  "  get-time               Get the current time on the arduino\n"
                  "  set-time               Set the time on the arduino\n"
                  "  list-events            Set the time on the arduino\n"
@@ -78,6 +83,15 @@ static void usage(FILE* fp, int argc, char** argv)
                  "  generate-system-files  Generate system files\n"
                  "  system-init            Generate system files and bring up the network\n"
                  "  merge filename         Merge the file into the existing config file\n"
+                 "  decode-data filename   Convert binary encoded datapoints back to CSV\n"
+                 "  query datastream from to [raw|min|max|mean|count] [bucket]\n"
+                 "                         Print the local datapoints of a datastream (ID or name)\n"
+                 "                         between two dates, or their aggregate per bucket (seconds)\n"
+                 "  compact-backup         Move the backup files into the archives\n"
+                 "  list-backup [prefix]   List the archived files (prefix: name or YYYYMMDD)\n"
+                 "  extract-backup key     Extract an archived file, or a day (YYYYMMDD), to -o dir\n"
+                 "  import dir [jobs]      Import the datapoints and photos of a directory or a mounted\n"
+                 "                         SD card, and queue the new ones for upload\n"
                  "",
                  argv[0]);
 }
@@ -182,7 +196,11 @@ int main(int argc, char **argv)
         if (box == NULL) 
                 exit(1);
 
-        if (sensorbox_lock(box) != 0) {
+        /* Queries only read the data and can run next to the
+           measurements and uploads. Without the lock, the stores
+           stay read-only: the lock holder alone repairs them after
+           a crash. */
+        if ((strcmp(command, "query") != 0) && (sensorbox_lock(box) != 0)) {
                 log_warn("Another process is already active. Exiting.");
                 delete_sensorbox(box);
                 exit(1);
@@ -212,16 +230,18 @@ int main(int argc, char **argv)
                 /* Handle all data and camera events. */
                 sensorbox_handle_events(box);
 
-                /* Upload what ever data we have. */
-                sensorbox_upload_data(box);
-                sensorbox_upload_photos(box);
-                sensorbox_upload_status(box); // Only runs if network is up
-
-                /* Bring the network down, if not needed (particularly
-                   GSM). */
-                sensorbox_bring_network_down_maybe(box);
+                /* Upload what ever data we have in a background
+                   worker, so that a slow network doesn't hold up
+                   the next measurement. The worker brings the
+                   network down when it's done. */
+                if (_test || (sensorbox_start_uploads(box) != 0)) {
+                        sensorbox_upload(box);
+                        sensorbox_bring_network_down_maybe(box);
+                }
 
-                /* Power of the RPi if in energy saving mode. */
+                /* Power of the RPi if in energy saving mode. This
+                   waits for the upload worker if a poweroff is
+                   due. */
                 sensorbox_poweroff_maybe(box);
 
                 //clock_update(box);
@@ -229,12 +249,25 @@ int main(int argc, char **argv)
         } else if (strcmp(command, "upload-data") == 0) {
                 if (sensorbox_init(box) != 0)
                         goto error_recovery;
+                if (sensorbox_begin_uploads(box) != 0)
+                        goto error_recovery;
                 sensorbox_upload_data(box);
+                sensorbox_upload_replay(box);
+                sensorbox_end_uploads(box);
+
+        } else if (strcmp(command, "upload") == 0) {
+                if (sensorbox_init(box) != 0)
+                        goto error_recovery;
+                if (sensorbox_start_uploads(box) == 0)
+                        sensorbox_wait_uploads(box);
 
         } else if (strcmp(command, "upload-photos") == 0) {
                 if (sensorbox_init(box) != 0)
                         goto error_recovery;
+                if (sensorbox_begin_uploads(box) != 0)
+                        goto error_recovery;
                 sensorbox_upload_photos(box);
+                sensorbox_end_uploads(box);
 
         } else if (strcmp(command, "list-events") == 0) {
                 if (sensorbox_init(box) != 0)
@@ -262,6 +295,14 @@ int main(int argc, char **argv)
                         goto error_recovery;
                 sensorbox_store_sensor_data(box, _output_file);
 
+        } else if (strcmp(command, "flush") == 0) {
+                if (sensorbox_flush_staging(box) != 0)
+                        goto error_recovery;
+
+        } else if (strcmp(command, "export-data") == 0) {
+                if (sensorbox_export_data(box, _output_file) != 0)
+                        goto error_recovery;
+
         } else if (strcmp(command, "update-clock") == 0) {
                 if (sensorbox_init(box) != 0)
                         goto error_recovery;
@@ -303,9 +344,72 @@ int main(int argc, char **argv)
                         goto error_recovery;
                 sensorbox_measure(box);
 
-        /* } else if (strcmp(command, "status") == 0) { */
-        /*         status_t status; */
-        /*         sensorbox_get_status(box, &status); */
+        } else if (strcmp(command, "decode-data") == 0) {
+                if (optind < argc) {
+                        const char* filename = argv[optind++];
+                        FILE* out = stdout;
+                        if ((_output_file != NULL) && (strcmp(_output_file, "-") != 0))
+                                out = fopen(_output_file, "w");
+                        if (out == NULL) {
+                                log_err("decode-data: Failed to open '%s'", _output_file);
+                                goto error_recovery;
+                        }
+                        int err = gorilla_decode_to_csv(filename, out);
+                        if (out != stdout)
+                                fclose(out);
+                        if (err != 0)
+                                goto error_recovery;
+                } else {
+                        usage(stderr, argc, argv);                        
+                }
+
+        } else if (strcmp(command, "query") == 0) {
+                if (optind + 3 <= argc) {
+                        const char* datastream = argv[optind++];
+                        const char* from = argv[optind++];
+                        const char* to = argv[optind++];
+                        const char* function = (optind < argc)? argv[optind++] : NULL;
+                        int bucket = (optind < argc)? atoi(argv[optind++]) : 0;
+                        if (sensorbox_query(box, datastream, from, to, function, bucket, stdout) != 0)
+                                goto error_recovery;
+                } else {
+                        usage(stderr, argc, argv);                        
+                }
+
+        } else if (strcmp(command, "compact-backup") == 0) {
+                /* The upload worker compacts the backup too. */
+                if (sensorbox_begin_uploads(box) != 0)
+                        goto error_recovery;
+                if (sensorbox_compact_backup(box) != 0)
+                        goto error_recovery;
+                sensorbox_end_uploads(box);
+
+        } else if (strcmp(command, "list-backup") == 0) {
+                const char* prefix = (optind < argc)? argv[optind++] : NULL;
+                if (sensorbox_list_backup(box, prefix) != 0)
+                        goto error_recovery;
+
+        } else if (strcmp(command, "extract-backup") == 0) {
+                if (optind < argc) {
+                        const char* key = argv[optind++];
+                        if (sensorbox_extract_backup(box, key, _output_file) != 0)
+                                goto error_recovery;
+                } else {
+                        usage(stderr, argc, argv);                        
+                }
+
+        } else if (strcmp(command, "import") == 0) {
+                if (optind < argc) {
+                        const char* dir = argv[optind++];
+                        int jobs = (optind < argc)? atoi(argv[optind++]) : 0;
+                        if (sensorbox_import(box, dir, jobs) != 0)
+                                goto error_recovery;
+                } else {
+                        usage(stderr, argc, argv);                        
+                }
+
+        } else if (strcmp(command, "status") == 0) {
+                sensorbox_print_status(box);
 
         } else if (strcmp(command, "reset-stack") == 0) {
                 if (sensorbox_init(box) != 0)
@@ -329,7 +433,10 @@ int main(int argc, char **argv)
                 sensorbox_bring_network_up_maybe(box);                
 
         } else if (strcmp(command, "upload-status") == 0) {
+                if (sensorbox_begin_uploads(box) != 0)
+                        goto error_recovery;
                 sensorbox_upload_status(box);
+                sensorbox_end_uploads(box);
 
         } else {
                 usage(stderr, argc, argv);
@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <curl/curl.h>
 #include "json.h"
 #include "config.h"
@@ -31,19 +33,52 @@
 #include "opensensordata.h"
 #include "log_message.h"
 
+/* Request and response bodies are kept in a list of fixed-size
+   chunks. Appending copies the data once, into the last chunk, and
+   growing the buffer never moves the data that is already there. */
+#define OSD_CHUNK_SIZE 4096
+
+typedef struct _osd_chunk_t {
+        struct _osd_chunk_t* next;
+        int length;
+        char data[OSD_CHUNK_SIZE];
+} osd_chunk_t;
+
+typedef struct _osd_buffer_t {
+        osd_chunk_t* first;
+        osd_chunk_t* last;
+        osd_chunk_t* read_chunk;
+        int read_index;
+        int size;
+} osd_buffer_t;
+
 struct _opensensordata_t {
         char* url;
         char* cache;
         char* key;
 
-        char* response;
-        int response_length;
-        int response_index;
+        osd_buffer_t request;
+        osd_buffer_t response;
+        char* response_string;
+
+        /* The definitions of the group, datastreams, and
+           photostreams, by name. Loaded from the cache dir on first
+           use. */
+        json_object_t index;
+
+        /* The ids of the definitions, by name. They are read
+           straight from the index file, without building the
+           definitions, unless the index is already loaded. An id of
+           -1 marks a definition without a valid id. */
+        json_object_t ids;
+
+        /* Bytes sent and received by the last request, including
+           the headers. */
+        long transferred;
 
-        char* request;
-        int request_length;
-        int request_write;
-        int request_read;
+        /* The content hash sent with the next upload, or an empty
+           string. */
+        char hash[72];
 
         CURL* curl;
 };
@@ -57,17 +92,102 @@ opensensordata_t* new_opensensordata(const char* url)
         osd->cache = NULL;
         osd->key = NULL;
         osd->curl = NULL;
-        osd->response = NULL;
-        osd->response_index = 0;
-        osd->response_length = 0;
-        osd->request = NULL;
-        osd->request_read = 0;
-        osd->request_write = 0;
-        osd->request_length = 0;
+        memset(&osd->request, 0, sizeof(osd_buffer_t));
+        memset(&osd->response, 0, sizeof(osd_buffer_t));
+        osd->response_string = NULL;
+        osd->transferred = 0;
+        osd->index = NULL;
+        osd->ids = NULL;
+        osd->hash[0] = 0;
 
         return osd;
 }
 
+static void osd_buffer_free(osd_buffer_t* buf)
+{
+        osd_chunk_t* c = buf->first;
+        while (c != NULL) {
+                osd_chunk_t* next = c->next;
+                free(c);
+                c = next;
+        }
+        memset(buf, 0, sizeof(osd_buffer_t));
+}
+
+/* Empties the buffer but keeps the first chunk around, so that
+   small requests don't allocate at all after the first one. */
+static void osd_buffer_clear(osd_buffer_t* buf)
+{
+        if (buf->first == NULL)
+                return;
+        osd_chunk_t* c = buf->first->next;
+        while (c != NULL) {
+                osd_chunk_t* next = c->next;
+                free(c);
+                c = next;
+        }
+        buf->first->next = NULL;
+        buf->first->length = 0;
+        buf->last = buf->first;
+        buf->read_chunk = buf->first;
+        buf->read_index = 0;
+        buf->size = 0;
+}
+
+static int osd_buffer_append(osd_buffer_t* buf, const char* s, int len)
+{
+        while (len > 0) {
+                if ((buf->last == NULL) || (buf->last->length == OSD_CHUNK_SIZE)) {
+                        osd_chunk_t* c = (osd_chunk_t*) malloc(sizeof(osd_chunk_t));
+                        if (c == NULL) {
+                                log_err("OpenSensorData: out of memory");
+                                return -1;
+                        }
+                        c->next = NULL;
+                        c->length = 0;
+                        if (buf->last == NULL) {
+                                buf->first = c;
+                                buf->read_chunk = c;
+                                buf->read_index = 0;
+                        } else {
+                                buf->last->next = c;
+                        }
+                        buf->last = c;
+                }
+                int n = OSD_CHUNK_SIZE - buf->last->length;
+                if (n > len)
+                        n = len;
+                memcpy(buf->last->data + buf->last->length, s, n);
+                buf->last->length += n;
+                buf->size += n;
+                s += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static int osd_buffer_read(osd_buffer_t* buf, char* ptr, int len)
+{
+        int count = 0;
+        while ((count < len) && (buf->read_chunk != NULL)) {
+                osd_chunk_t* c = buf->read_chunk;
+                int n = c->length - buf->read_index;
+                if (n == 0) {
+                        if (c->next == NULL)
+                                break;
+                        buf->read_chunk = c->next;
+                        buf->read_index = 0;
+                        continue;
+                }
+                if (n > len - count)
+                        n = len - count;
+                memcpy(ptr + count, c->data + buf->read_index, n);
+                buf->read_index += n;
+                count += n;
+        }
+        return count;
+}
+
 void delete_opensensordata(opensensordata_t* osd)
 {
         if (osd->url)
@@ -76,10 +196,14 @@ void delete_opensensordata(opensensordata_t* osd)
                 free(osd->cache);
         if (osd->key)
                 free(osd->key);
-        if (osd->response)
-                free(osd->response);
-        if (osd->request)
-                free(osd->request);
+        if (osd->response_string)
+                free(osd->response_string);
+        osd_buffer_free(&osd->request);
+        osd_buffer_free(&osd->response);
+        if (osd->index)
+                json_unref(osd->index);
+        if (osd->ids)
+                json_unref(osd->ids);
         free(osd);
 }
 
@@ -97,66 +221,72 @@ void opensensordata_set_key(opensensordata_t* osd, const char* key)
         osd->key = strdup(key);
 }
 
-static void opensensordata_response_append(opensensordata_t* osd, char c)
-{
-	if (osd->response_index >= osd->response_length) {
-		int newlen = 2 * osd->response_length;
-		if (newlen == 0) {
-			newlen = 128;
-		}
-		char* newbuf = (char*) calloc(newlen, sizeof(char));
-		if (newbuf == NULL) {
-			return;
-		}
-		if (osd->response != NULL) {
-			memcpy(newbuf, osd->response, osd->response_length);
-			free(osd->response);
-		}
-		osd->response = newbuf;
-		osd->response_length = newlen;
-	}
-
-	osd->response[osd->response_index++] = (char) (c & 0xff);
-}
-
-static void opensensordata_request_append(opensensordata_t* osd, char c)
-{
-	if (osd->request_write >= osd->request_length) {
-		int newlen = 2 * osd->request_length;
-		if (newlen == 0) {
-			newlen = 128;
-		}
-		char* newbuf = (char*) calloc(newlen, sizeof(char));
-		if (newbuf == NULL) {
-			return;
-		}
-		if (osd->request != NULL) {
-			memcpy(newbuf, osd->request, osd->request_length);
-			free(osd->request);
-		}
-		osd->request = newbuf;
-		osd->request_length = newlen;
-	}
-
-	osd->request[osd->request_write++] = (char) (c & 0xff);
+void opensensordata_set_hash(opensensordata_t* osd, const char* hash)
+{
+        if (hash == NULL) {
+                osd->hash[0] = 0;
+                return;
+        }
+        snprintf(osd->hash, sizeof(osd->hash), "%s", hash);
+        osd->hash[sizeof(osd->hash) - 1] = 0;
+}
+
+static void opensensordata_reset_buffers(opensensordata_t* osd)
+{
+        osd_buffer_clear(&osd->request);
+        osd_buffer_clear(&osd->response);
+        if (osd->response_string) {
+                free(osd->response_string);
+                osd->response_string = NULL;
+        }
+        osd->transferred = 0;
 }
 
 static size_t opensensordata_memorise_function(void *ptr, size_t size, size_t nmemb, void* data)
 {
         opensensordata_t* osd = (opensensordata_t*) data;
         int len = size * nmemb;
-        char* s = (char*) ptr;
-        for (int i = 0; i < len; i++) 
-                opensensordata_response_append(osd, s[i]);
+        if (osd_buffer_append(&osd->response, (const char*) ptr, len) != 0)
+                return 0;
         return len;
 }
 
+static void opensensordata_count_transfer(opensensordata_t* osd)
+{
+        long header_size = 0, request_size = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t upload = 0, download = 0;
+        curl_easy_getinfo(osd->curl, CURLINFO_SIZE_UPLOAD_T, &upload);
+        curl_easy_getinfo(osd->curl, CURLINFO_SIZE_DOWNLOAD_T, &download);
+#else
+        double upload = 0.0, download = 0.0;
+        curl_easy_getinfo(osd->curl, CURLINFO_SIZE_UPLOAD, &upload);
+        curl_easy_getinfo(osd->curl, CURLINFO_SIZE_DOWNLOAD, &download);
+#endif
+        curl_easy_getinfo(osd->curl, CURLINFO_HEADER_SIZE, &header_size);
+        curl_easy_getinfo(osd->curl, CURLINFO_REQUEST_SIZE, &request_size);
+
+        osd->transferred = (long) upload + (long) download + header_size + request_size;
+}
+
+long opensensordata_get_transferred(opensensordata_t* osd)
+{
+        return osd->transferred;
+}
+
 static int opensensordata_put_file(opensensordata_t* osd, 
                                    const char* path,
                                    const char* filename,
                                    const char* mime_type)
 {
-        osd->response_index = 0;
+        /* The hash only applies to this upload. */
+        char hash_header[128];
+        snprintf(hash_header, 128, "X-OpenSensorData-Hash: %s", osd->hash);
+        hash_header[127] = 0;
+        int has_hash = (osd->hash[0] != 0);
+        osd->hash[0] = 0;
+
+        opensensordata_reset_buffers(osd);
 
         if ((osd->url == NULL) || (strlen(osd->url) == 0)) {
                 log_err("OpenSensorData: Invalid URL.");
@@ -195,6 +325,8 @@ static int opensensordata_put_file(opensensordata_t* osd,
         struct curl_slist* header_lines = NULL;
         header_lines = curl_slist_append(header_lines, mime_header);
         header_lines = curl_slist_append(header_lines, key_header);
+        if (has_hash)
+                header_lines = curl_slist_append(header_lines, hash_header);
 
         curl_easy_setopt(osd->curl, CURLOPT_HTTPHEADER, header_lines);
         curl_easy_setopt(osd->curl, CURLOPT_UPLOAD, 1L);
@@ -207,6 +339,7 @@ static int opensensordata_put_file(opensensordata_t* osd,
         curl_easy_setopt(osd->curl, CURLOPT_TIMEOUT, 300L); // 5 minutes
         
         CURLcode res = curl_easy_perform(osd->curl);
+        opensensordata_count_transfer(osd);
         if (res != CURLE_OK) {
                 log_err("OpenSensorData: Failed to upload the data.");
                 fclose(fp);
@@ -244,9 +377,7 @@ static int opensensordata_put_file(opensensordata_t* osd,
 
 static int32 opensensordata_json_to_request(opensensordata_t* osd, const char* s, int32 len)
 {
-        for (int i =0; i < len; i++)
-                opensensordata_request_append(osd, s[i]); 
-        return 0;
+        return osd_buffer_append(&osd->request, s, len);
 }
 
 static size_t opensensordata_request_to_curl(void *ptr, 
@@ -254,15 +385,7 @@ static size_t opensensordata_request_to_curl(void *ptr,
                                              size_t nmemb, 
                                              opensensordata_t* osd)
 {
-        int len = size * nmemb;
-        int available = osd->request_write - osd->request_read;
-        
-        if (len > available) 
-                len = available;
-        memcpy(ptr, osd->request + osd->request_read, len);
-        osd->request_read += len;
-
-        return len; 
+        return osd_buffer_read(&osd->request, (char*) ptr, size * nmemb);
 }
 
 static char* opensensordata_get_cache_file(opensensordata_t* osd, 
@@ -275,18 +398,74 @@ static char* opensensordata_get_cache_file(opensensordata_t* osd,
         return filename;
 }
 
-static json_object_t opensensordata_cache_get(opensensordata_t* osd, const char* name)
+/* The index is kept in the binary JSON format, which loads without
+   parsing. Older versions kept it as text, in index.json. Returns
+   the file that holds the index, or NULL if there is none yet. */
+static char* opensensordata_get_index_file(opensensordata_t* osd, 
+                                           char* filename, 
+                                           int len,
+                                           int* is_text)
+{
+        *is_text = 0;
+        snprintf(filename, len, "%s/index.bin", osd->cache);
+        filename[len-1] = 0;
+        if (access(filename, F_OK) == 0)
+                return filename;
+
+        *is_text = 1;
+        opensensordata_get_cache_file(osd, "index", filename, len);
+        if (access(filename, F_OK) == 0)
+                return filename;
+
+        return NULL;
+}
+
+static int opensensordata_index_save(opensensordata_t* osd)
 {
-        int err;
-        char buffer[512];
         char filename[512];
+        char tmpfile[512];
 
-        if ((osd->cache == NULL) || (strlen(osd->cache) == 0)) {
-                log_err("OpenSensorData: Invalid cache dir.");
-                return json_null();
+        if ((snprintf(filename, 512, "%s/index.bin", osd->cache) >= 512)
+            || (snprintf(tmpfile, 512, "%s.tmp", filename) >= 512)) {
+                log_err("OpenSensorData: The path of the cache is too long: '%s'", 
+                        osd->cache);
+                return -1;
         }
 
-        opensensordata_get_cache_file(osd, name, filename, 512);
+        json_object_t index = json_object_create();
+        json_object_setstr(index, "version", "1");
+        json_object_set(index, "definitions", osd->index);
+
+        /* Write a new file and rename it over the old one, so that a
+           power cut never leaves a half-written index behind. */
+        FILE* fp = fopen(tmpfile, "w");
+        if (fp == NULL) {
+                log_err("OpenSensorData: Failed to create '%s'", tmpfile);
+                json_unref(index);
+                return -1;
+        }
+        int r = json_tofilep(index, k_json_binary, fp);
+        json_unref(index);
+        if ((r != 0) || (fflush(fp) != 0) || (fsync(fileno(fp)) != 0)) {
+                log_err("OpenSensorData: Failed to write '%s'", tmpfile);
+                fclose(fp);
+                unlink(tmpfile);
+                return -1;
+        }
+        fclose(fp);
+
+        if (rename(tmpfile, filename) != 0) {
+                log_err("OpenSensorData: Failed to rename '%s'", tmpfile);
+                unlink(tmpfile);
+                return -1;
+        }
+        return 0;
+}
+
+static json_object_t opensensordata_load_definition(const char* filename)
+{
+        int err;
+        char buffer[512];
 
         json_object_t def = json_load(filename, &err, buffer, 512);
         if (err) {
@@ -311,14 +490,305 @@ static json_object_t opensensordata_cache_get(opensensordata_t* osd, const char*
         return def;
 }
 
+/* Older versions kept one <name>.json file per definition. Fold
+   them into the index and remove them once the index is safely
+   on disk. */
+static void opensensordata_index_migrate(opensensordata_t* osd)
+{
+        char filename[512];
+        char name[256];
+        struct dirent *entry;
+        int count = 0;
+
+        DIR* dir = opendir(osd->cache);
+        if (dir == NULL)
+                return;
+
+        while ((entry = readdir(dir)) != NULL) {
+                int len = strlen(entry->d_name);
+                if ((len <= 5) 
+                    || (len - 5 >= (int) sizeof(name))
+                    || (strcmp(entry->d_name + len - 5, ".json") != 0)
+                    || (strcmp(entry->d_name, "index.json") == 0))
+                        continue;
+
+                memcpy(name, entry->d_name, len - 5);
+                name[len - 5] = 0;
+
+                opensensordata_get_cache_file(osd, name, filename, 512);
+                json_object_t def = opensensordata_load_definition(filename);
+                if (json_isnull(def))
+                        continue;
+                json_object_set(osd->index, name, def);
+                json_unref(def);
+                count++;
+        }
+
+        if ((count > 0) && (opensensordata_index_save(osd) == 0)) {
+                rewinddir(dir);
+                while ((entry = readdir(dir)) != NULL) {
+                        int len = strlen(entry->d_name);
+                        if ((len <= 5) 
+                            || (len - 5 >= (int) sizeof(name))
+                            || (strcmp(entry->d_name + len - 5, ".json") != 0)
+                            || (strcmp(entry->d_name, "index.json") == 0))
+                                continue;
+                        memcpy(name, entry->d_name, len - 5);
+                        name[len - 5] = 0;
+                        if (json_isnull(json_object_get(osd->index, name)))
+                                continue;
+                        opensensordata_get_cache_file(osd, name, filename, 512);
+                        unlink(filename);
+                }
+                log_info("OpenSensorData: Migrated %d cache files to the index", count);
+        }
+
+        closedir(dir);
+}
+
+static int opensensordata_index_load(opensensordata_t* osd)
+{
+        int err;
+        int is_text;
+        char buffer[512];
+        char filename[512];
+
+        if (osd->index != NULL)
+                return 0;
+
+        if ((osd->cache == NULL) || (strlen(osd->cache) == 0)) {
+                log_err("OpenSensorData: Invalid cache dir.");
+                return -1;
+        }
+
+        osd->index = json_object_create();
+
+        if (opensensordata_get_index_file(osd, filename, 512, &is_text) == NULL) {
+                opensensordata_index_migrate(osd);
+                return 0;
+        }
+
+        json_object_t index = json_load(filename, &err, buffer, 512);
+        if (err) {
+                log_err("%s", buffer); 
+                json_unref(index);
+                return -1;
+        }
+        json_object_t defs = json_object_get(index, "definitions");
+        if (json_isobject(defs)) {
+                json_unref(osd->index);
+                osd->index = defs;
+                json_ref(defs);
+                if (is_text && (opensensordata_index_save(osd) == 0))
+                        unlink(filename);
+        } else {
+                log_err("OpenSensorData: Invalid index: %s", filename); 
+        }
+        json_unref(index);
+        return 0;
+}
+
+static int opensensordata_ids_set(opensensordata_t* osd, const char* name, int id)
+{
+        json_object_t v = json_number_create(id);
+        int r = json_object_set(osd->ids, name, v);
+        json_unref(v);
+        return r;
+}
+
+/* Picks the ids out of the index file while it is parsed: the values
+   of "id" in the objects of "definitions". The depth counts the open
+   objects and arrays. */
+typedef struct _osd_id_scan_t {
+        opensensordata_t* osd;
+        int depth;
+        int in_definitions;
+        char* name;
+        int is_id;
+} osd_id_scan_t;
+
+static int32 osd_id_scan_open(void* userdata)
+{
+        osd_id_scan_t* scan = (osd_id_scan_t*) userdata;
+        scan->depth++;
+        scan->is_id = 0;
+        if ((scan->depth == 3) && scan->in_definitions && (scan->name != NULL))
+                return opensensordata_ids_set(scan->osd, scan->name, -1);
+        return 0;
+}
+
+static int32 osd_id_scan_close(void* userdata)
+{
+        osd_id_scan_t* scan = (osd_id_scan_t*) userdata;
+        scan->depth--;
+        return 0;
+}
+
+static int32 osd_id_scan_key(void* userdata, const char* key, int32 len)
+{
+        osd_id_scan_t* scan = (osd_id_scan_t*) userdata;
+        if (scan->depth == 1) {
+                scan->in_definitions = (strcmp(key, "definitions") == 0);
+        } else if ((scan->depth == 2) && scan->in_definitions) {
+                if (scan->name != NULL)
+                        free(scan->name);
+                scan->name = strdup(key);
+        } else if ((scan->depth == 3) && scan->in_definitions) {
+                scan->is_id = (strcmp(key, "id") == 0);
+        }
+        return 0;
+}
+
+static int32 osd_id_scan_value(osd_id_scan_t* scan, int id)
+{
+        int is_id = scan->is_id;
+        scan->is_id = 0;
+        if (is_id && (scan->depth == 3))
+                return opensensordata_ids_set(scan->osd, scan->name, id);
+        return 0;
+}
+
+static int32 osd_id_scan_string(void* userdata, const char* s, int32 len)
+{
+        return osd_id_scan_value((osd_id_scan_t*) userdata, atoi(s));
+}
+
+static int32 osd_id_scan_number(void* userdata, double value)
+{
+        return osd_id_scan_value((osd_id_scan_t*) userdata, (int) value);
+}
+
+static int32 osd_id_scan_boolean(void* userdata, int32 value)
+{
+        return osd_id_scan_value((osd_id_scan_t*) userdata, -1);
+}
+
+static int32 osd_id_scan_null(void* userdata)
+{
+        return osd_id_scan_value((osd_id_scan_t*) userdata, -1);
+}
+
+static const json_sax_t osd_id_scanner = {
+        osd_id_scan_open,
+        osd_id_scan_close,
+        osd_id_scan_open,
+        osd_id_scan_close,
+        osd_id_scan_key,
+        osd_id_scan_string,
+        osd_id_scan_number,
+        osd_id_scan_boolean,
+        osd_id_scan_null
+};
+
+static int32 osd_id_add(const char* name, json_object_t def, void* data)
+{
+        if (json_isobject(def))
+                opensensordata_ids_set((opensensordata_t*) data, name, osd_object_get_id(def));
+        return 0;
+}
+
+static int opensensordata_ids_load(opensensordata_t* osd)
+{
+        int is_text;
+        char buffer[512];
+        char filename[512];
+
+        if (osd->ids != NULL)
+                return 0;
+
+        if ((osd->cache == NULL) || (strlen(osd->cache) == 0)) {
+                log_err("OpenSensorData: Invalid cache dir.");
+                return -1;
+        }
+
+        osd->ids = json_object_create();
+
+        if ((osd->index == NULL) 
+            && (opensensordata_get_index_file(osd, filename, 512, &is_text) != NULL)) {
+                osd_id_scan_t scan = { osd, 0, 0, NULL, 0 };
+                int r = json_load_events(filename, &osd_id_scanner, &scan, buffer, 512);
+                if (scan.name != NULL)
+                        free(scan.name);
+                if (r != 0) {
+                        log_err("%s", buffer); 
+                        json_unref(osd->ids);
+                        osd->ids = NULL;
+                        return -1;
+                }
+        } else {
+                if (opensensordata_index_load(osd) != 0) {
+                        json_unref(osd->ids);
+                        osd->ids = NULL;
+                        return -1;
+                }
+                json_object_foreach(osd->index, osd_id_add, osd);
+        }
+
+        return 0;
+}
+
+/* Returns a new reference to the definition, or null. */
+static json_object_t opensensordata_cache_get(opensensordata_t* osd, const char* name)
+{
+        if (opensensordata_index_load(osd) != 0)
+                return json_null();
+
+        json_object_t def = json_object_get(osd->index, name);
+        if (!json_isobject(def)) {
+                log_debug("OpenSensorData: No definition for '%s'", name);
+                return json_null();
+        }
+        json_ref(def);
+        return def;
+}
+
+static int opensensordata_cache_set(opensensordata_t* osd, 
+                                    const char* name, 
+                                    const char* response)
+{
+        if (opensensordata_index_load(osd) != 0)
+                return -1;
+
+        if (response == NULL) {
+                log_err("OpenSensorData: Empty response for '%s'", name);
+                return -1;
+        }
+
+        json_parser_t* parser = json_parser_create();
+        if (parser == NULL) {
+                log_err("OpenSensorData: out of memory");
+                return -1;
+        }
+        json_object_t def = json_parser_eval(parser, response);
+        json_parser_destroy(parser);
+
+        if (!json_isobject(def)) {
+                log_err("OpenSensorData: Invalid definition for '%s'", name); 
+                json_unref(def);
+                return -1;
+        }
+        json_object_t e = json_object_get(def, "error");
+        if (!json_isnull(e)) {
+                const char* msg = json_object_getstr(def, "msg");
+                log_err("OpenSensorData: Server returned an error: %s", msg);
+                json_unref(def);
+                return -1;
+        }
+
+        json_object_set(osd->index, name, def);
+        if (osd->ids != NULL)
+                opensensordata_ids_set(osd, name, osd_object_get_id(def));
+        json_unref(def);
+
+        return opensensordata_index_save(osd);
+}
+
 static int opensensordata_put_object(opensensordata_t* osd, 
                                      const char* path,
                                      json_object_t object,
                                      const char* name)
 {
-        osd->response_index = 0;
-        osd->request_write = 0;
-        osd->request_read = 0;
+        opensensordata_reset_buffers(osd);
 
         if ((osd->url == NULL) || (strlen(osd->url) == 0)) {
                 log_err("OpenSensorData: Invalid URL.");
@@ -338,19 +808,9 @@ static int opensensordata_put_object(opensensordata_t* osd,
                 return -1;;
         }
 
-        char cache_file[512];
-        opensensordata_get_cache_file(osd, name, cache_file, 512);
-
-        FILE* fp = fopen(cache_file, "w");
-        if (fp == NULL) {
-                log_err("OpenSensorData: Failed to open the file '%s'.", cache_file);
-                return -1;;
-        }
-
         osd->curl = curl_easy_init();
         if (osd->curl == NULL) {
                 log_err("OpenSensorData: Failed to initialise curl.");
-                fclose(fp);
                 return -1;;
         }
         
@@ -374,19 +834,20 @@ static int opensensordata_put_object(opensensordata_t* osd,
         curl_easy_setopt(osd->curl, CURLOPT_URL, url);
         curl_easy_setopt(osd->curl, CURLOPT_READFUNCTION, opensensordata_request_to_curl);
         curl_easy_setopt(osd->curl, CURLOPT_READDATA, osd);
-        curl_easy_setopt(osd->curl, CURLOPT_WRITEDATA, fp);
+        curl_easy_setopt(osd->curl, CURLOPT_INFILESIZE, (long) osd->request.size);
+        curl_easy_setopt(osd->curl, CURLOPT_WRITEFUNCTION, opensensordata_memorise_function);
+        curl_easy_setopt(osd->curl, CURLOPT_WRITEDATA, osd);
         curl_easy_setopt(osd->curl, CURLOPT_TIMEOUT, 300L); // 5 minutes
         
         CURLcode res = curl_easy_perform(osd->curl);
+        opensensordata_count_transfer(osd);
         if (res != CURLE_OK) {
                 log_err("OpenSensorData: Failed to upload the data.");
-                fclose(fp);
                 curl_slist_free_all(header_lines);
                 curl_easy_cleanup(osd->curl);
                 osd->curl = NULL;
                 return -1;;
         }
-        fclose(fp);
 
         long response_code = -1;
         res = curl_easy_getinfo(osd->curl, CURLINFO_RESPONSE_CODE, &response_code);
@@ -411,8 +872,7 @@ static int opensensordata_put_object(opensensordata_t* osd,
         curl_easy_cleanup(osd->curl);
         osd->curl = NULL;
 
-
-        return 0;
+        return opensensordata_cache_set(osd, name, opensensordata_get_response(osd));
 }
 
 /*
@@ -420,7 +880,7 @@ static int opensensordata_get(opensensordata_t* osd,
                               const char* path,
                               const char* filename)
 {
-        osd->response_index = 0;
+        opensensordata_reset_buffers(osd);
 
         if ((osd->url == NULL) || (strlen(osd->url) == 0)) {
                 log_err("OpenSensorData: Invalid URL.");
@@ -464,6 +924,7 @@ static int opensensordata_get(opensensordata_t* osd,
         curl_easy_setopt(osd->curl, CURLOPT_ERRORBUFFER, errmsg);
         
         CURLcode res = curl_easy_perform(osd->curl);
+        opensensordata_count_transfer(osd);
         if (res != CURLE_OK) {
                 log_err("OpenSensorData: Failed to get the data: %s", errmsg);
                 fclose(fp);
@@ -505,6 +966,13 @@ int opensensordata_put_datapoints(opensensordata_t* osd, const char* filename)
         return opensensordata_put_file(osd, "upload", filename, "text/csv");
 }
 
+int opensensordata_put_encoded_datapoints(opensensordata_t* osd, 
+                                          const char* filename,
+                                          const char* mime_type)
+{
+        return opensensordata_put_file(osd, "upload", filename, mime_type);
+}
+
 int opensensordata_put_photo(opensensordata_t* osd, 
                               int photostream,
                               const char* id, 
@@ -552,14 +1020,15 @@ const char* osd_object_get_name(json_object_t obj)
 
 static int opensensordata_get_cached_id(opensensordata_t* osd, const char* name)
 {
-        json_object_t def = opensensordata_cache_get(osd, name);
-        if (json_isnull(def)) {
+        if (opensensordata_ids_load(osd) != 0)
                 return -1;
-        }
-
-        int id = osd_object_get_id(def);
-        json_unref(def);
 
+        json_object_t v = json_object_get(osd->ids, name);
+        if (!json_isnumber(v)) {
+                log_debug("OpenSensorData: No definition for '%s'", name);
+                return -1;
+        }
+        int id = (int) json_number_value(v);
         if (id == -1) 
                 log_err("OpenSensorData: Invalid cache object: %s", name); 
         
@@ -614,11 +1083,20 @@ int opensensordata_get_photostream_id(opensensordata_t* osd,
 
 char* opensensordata_get_response(opensensordata_t* osd)
 {
-        if ((osd->response == NULL)
-            || (osd->response_length == 0))
+        /* The response is only joined into a single string when
+           someone asks for it, which is usually to log an error. */
+        if (osd->response_string != NULL)
+                return osd->response_string;
+        if (osd->response.size == 0)
+                return NULL;
+        osd->response_string = (char*) malloc(osd->response.size + 1);
+        if (osd->response_string == NULL)
                 return NULL;
-        opensensordata_response_append(osd, '\0');
-        return osd->response;
+        osd->response.read_chunk = osd->response.first;
+        osd->response.read_index = 0;
+        int n = osd_buffer_read(&osd->response, osd->response_string, osd->response.size);
+        osd->response_string[n] = 0;
+        return osd->response_string;
 }
 
 int opensensordata_create_datastream(opensensordata_t* osd, 
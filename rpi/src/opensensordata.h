@@ -70,8 +70,17 @@ extern "C" {
         void opensensordata_set_cache_dir(opensensordata_t* osd, const char* dir);
         void opensensordata_set_key(opensensordata_t* osd, const char* key);
 
+        /* Sets the content hash (hex) that is sent in the
+           X-OpenSensorData-Hash header of the next upload, so that
+           the server can recognise a file it already has. */
+        void opensensordata_set_hash(opensensordata_t* osd, const char* hash);
+
         char* opensensordata_get_response(opensensordata_t* osd);
 
+        /* Returns the number of bytes sent and received by the last
+           request, headers included. */
+        long opensensordata_get_transferred(opensensordata_t* osd);
+
         /* groups */
 
         json_object_t opensensordata_get_group(opensensordata_t* osd, int cache_ok);
@@ -98,6 +107,12 @@ extern "C" {
 
         int opensensordata_put_datapoints(opensensordata_t* osd, const char* filename);
 
+        /* Uploads the datapoints in an alternative encoding, given
+           by the mime type. */
+        int opensensordata_put_encoded_datapoints(opensensordata_t* osd, 
+                                                  const char* filename,
+                                                  const char* mime_type);
+
         /* photostream */
 
         json_object_t opensensordata_get_photostream(opensensordata_t* osd, 
@@ -0,0 +1,652 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "log_message.h"
+#include "query.h"
+#include "timestamp.h"
+
+#define QUERY_MAX_BUCKETS 1000000
+
+typedef struct _query_point_t {
+        int osd_id;
+        time_t timestamp;
+        float value;
+} query_point_t;
+
+typedef struct _query_bucket_t {
+        float min;
+        float max;
+        double sum;
+        int count;
+} query_bucket_t;
+
+struct _query_t {
+        int osd_id;
+        time_t from;
+        time_t to;
+        int function;
+        int bucket;
+
+        int num_buckets;
+        query_bucket_t* buckets;
+
+        query_point_t* points;
+        int num_points;
+        int max_points;
+
+        /* Cache for the conversion of the CSV timestamps: the epoch
+           time of the last "YYYY-MM-DDTHH" seen. */
+        char hour[14];
+        time_t hour_start;
+};
+
+typedef struct _query_source_t {
+        char* name;
+        time_t first;
+        time_t last;
+} query_source_t;
+
+int query_parse_function(const char* name)
+{
+        static const char* names[] = { "raw", "min", "max", "mean", "count", NULL };
+        for (int i = 0; names[i] != NULL; i++)
+                if (strcmp(name, names[i]) == 0)
+                        return i;
+        return -1;
+}
+
+int query_parse_time(const char* s, time_t* t)
+{
+        struct tm tm;
+        int n;
+
+        memset(&tm, 0, sizeof(struct tm));
+
+        for (n = 0; isdigit((unsigned char) s[n]); n++)
+                ;
+        if ((n == 8) && (s[n] == 0)) {
+                /* YYYYMMDD, as in the backup file names */
+                n = sscanf(s, "%4d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday);
+        } else if ((n > 0) && (s[n] == 0)) {
+                *t = (time_t) atol(s);
+                return 0;
+        } else {
+                n = sscanf(s, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                           &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+        }
+        if ((n != 3) && (n != 5) && (n != 6))
+                return -1;
+
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        *t = mktime(&tm);
+
+        return (*t == (time_t) -1)? -1 : 0;
+}
+
+query_t* new_query(int osd_id, time_t from, time_t to, int function, int bucket)
+{
+        if (to < from) {
+                log_err("Query: Invalid time range");
+                return NULL;
+        }
+
+        query_t* q = (query_t*) malloc(sizeof(query_t));
+        if (q == NULL) {
+                log_err("Query: out of memory");
+                return NULL;
+        }
+        memset(q, 0, sizeof(query_t));
+
+        q->osd_id = osd_id;
+        q->from = from;
+        q->to = to;
+        q->function = function;
+        q->bucket = (bucket > 0)? bucket : (int) (to - from + 1);
+
+        if (function != QUERY_RAW) {
+                long n = (long) ((to - from) / q->bucket) + 1;
+                if (n > QUERY_MAX_BUCKETS) {
+                        log_err("Query: Too many buckets (%ld)", n);
+                        free(q);
+                        return NULL;
+                }
+                q->num_buckets = (int) n;
+                q->buckets = (query_bucket_t*) calloc(n, sizeof(query_bucket_t));
+                if (q->buckets == NULL) {
+                        log_err("Query: out of memory");
+                        free(q);
+                        return NULL;
+                }
+        }
+
+        return q;
+}
+
+void delete_query(query_t* q)
+{
+        if (q->buckets)
+                free(q->buckets);
+        if (q->points)
+                free(q->points);
+        free(q);
+}
+
+int query_add(void* ptr, int osd_id, time_t timestamp, float value)
+{
+        query_t* q = (query_t*) ptr;
+
+        if ((timestamp < q->from) || (timestamp > q->to))
+                return 0;
+        if ((osd_id != q->osd_id)
+            && ((q->osd_id != QUERY_ALL_DATASTREAMS) || (q->function != QUERY_RAW)))
+                return 0;
+
+        if (q->function == QUERY_RAW) {
+                if (q->num_points >= q->max_points) {
+                        int len = (q->max_points == 0)? 1024 : 2 * q->max_points;
+                        query_point_t* p = (query_point_t*) realloc(q->points, len * sizeof(query_point_t));
+                        if (p == NULL) {
+                                log_err("Query: out of memory");
+                                return -1;
+                        }
+                        q->points = p;
+                        q->max_points = len;
+                }
+                q->points[q->num_points].osd_id = osd_id;
+                q->points[q->num_points].timestamp = timestamp;
+                q->points[q->num_points].value = value;
+                q->num_points++;
+                return 0;
+        }
+
+        query_bucket_t* b = &q->buckets[(timestamp - q->from) / q->bucket];
+        if ((b->count == 0) || (value < b->min))
+                b->min = value;
+        if ((b->count == 0) || (value > b->max))
+                b->max = value;
+        b->sum += value;
+        b->count++;
+
+        return 0;
+}
+
+int query_add_summary(query_t* q, int osd_id, time_t start, int count,
+                      float min, float max, double sum)
+{
+        if ((q->function == QUERY_RAW) || (count <= 0)
+            || (osd_id != q->osd_id) || (start < q->from) || (start > q->to))
+                return 0;
+
+        query_bucket_t* b = &q->buckets[(start - q->from) / q->bucket];
+        if ((b->count == 0) || (min < b->min))
+                b->min = min;
+        if ((b->count == 0) || (max > b->max))
+                b->max = max;
+        b->sum += sum;
+        b->count += count;
+
+        return 0;
+}
+
+/* Converts "YYYY-MM-DDTHH:MM:SS", in local time. mktime() is only
+   called once per hour of data. */
+static int query_convert_time(query_t* q, const char* s, time_t* t)
+{
+        if (memcmp(s, q->hour, 13) != 0) {
+                struct tm tm;
+                memset(&tm, 0, sizeof(struct tm));
+                if (sscanf(s, "%4d-%2d-%2dT%2d", &tm.tm_year, &tm.tm_mon,
+                           &tm.tm_mday, &tm.tm_hour) != 4)
+                        return -1;
+                tm.tm_year -= 1900;
+                tm.tm_mon -= 1;
+                tm.tm_isdst = -1;
+                q->hour_start = mktime(&tm);
+                memcpy(q->hour, s, 13);
+                q->hour[13] = 0;
+        }
+        if (!isdigit((unsigned char) s[14]) || !isdigit((unsigned char) s[15])
+            || !isdigit((unsigned char) s[17]) || !isdigit((unsigned char) s[18]))
+                return -1;
+        *t = q->hour_start
+                + 60 * (10 * (s[14] - '0') + (s[15] - '0'))
+                + 10 * (s[17] - '0') + (s[18] - '0');
+        return 0;
+}
+
+typedef int (*query_csv_callback_t)(query_t* q, int osd_id, time_t timestamp,
+                                    float value, void* data);
+
+/* Parses the lines "id,YYYY-MM-DDTHH:MM:SS,value". Invalid lines are
+   skipped. */
+static int query_parse_csv(query_t* q, const char* buf, long len,
+                           query_csv_callback_t fun, void* data)
+{
+        const char* end = buf + len;
+        const char* p = buf;
+        char number[32];
+
+        while (p < end) {
+                /* An unterminated last line is being written, or
+                   was torn. */
+                const char* eol = memchr(p, '\n', end - p);
+                if (eol == NULL)
+                        break;
+
+                char* e;
+                long id = strtol(p, &e, 10);
+                time_t t;
+                if ((e > p) && (e + 21 < eol) && (*e == ',') && (e[20] == ',')
+                    && (query_convert_time(q, e + 1, &t) == 0)) {
+                        int n = eol - (e + 21);
+                        if (n > 31)
+                                n = 31;
+                        memcpy(number, e + 21, n);
+                        number[n] = 0;
+                        if (fun(q, (int) id, t, strtof(number, NULL), data) != 0)
+                                return -1;
+                }
+                p = eol + 1;
+        }
+
+        return 0;
+}
+
+static int query_add_point(query_t* q, int osd_id, time_t timestamp,
+                           float value, void* data)
+{
+        return query_add(q, osd_id, timestamp, value);
+}
+
+int query_add_csv(query_t* q, const char* buf, long len)
+{
+        return query_parse_csv(q, buf, len, query_add_point, NULL);
+}
+
+static int query_update_range(query_t* q, int osd_id, time_t timestamp,
+                              float value, void* data)
+{
+        query_source_t* s = (query_source_t*) data;
+        if ((s->first == 0) || (timestamp < s->first))
+                s->first = timestamp;
+        if (timestamp > s->last)
+                s->last = timestamp;
+        return 0;
+}
+
+static int query_read_file(const char* path, unsigned char** data, long* size)
+{
+        struct stat st;
+
+        *data = NULL;
+        *size = 0;
+
+        if (stat(path, &st) != 0)
+                return -1;
+
+        *data = (unsigned char*) malloc(st.st_size > 0? st.st_size : 1);
+        if (*data == NULL) {
+                log_err("Query: out of memory");
+                return -1;
+        }
+
+        FILE* fp = fopen(path, "r");
+        if ((fp == NULL)
+            || ((st.st_size > 0) && (fread(*data, st.st_size, 1, fp) != 1))) {
+                if (fp) fclose(fp);
+                free(*data);
+                *data = NULL;
+                return -1;
+        }
+        fclose(fp);
+
+        *size = st.st_size;
+        return 0;
+}
+
+/* Reads an uploaded datapoints file from the backup directory or,
+   once it has been rolled into the archives, from there. */
+static int query_read_source(const char* backup_dir, archive_t* archive,
+                             const char* name, unsigned char** data, long* size)
+{
+        char path[512];
+
+        snprintf(path, 512, "%s/%s", backup_dir, name);
+        path[511] = 0;
+
+        if (query_read_file(path, data, size) == 0)
+                return 0;
+        if ((archive != NULL) && (archive_read(archive, name, data, size) == 0))
+                return 0;
+        return -1;
+}
+
+static int query_compare_sources(const void* a, const void* b)
+{
+        return strcmp(((const query_source_t*) a)->name, ((const query_source_t*) b)->name);
+}
+
+static int query_compare_names(const void* a, const void* b)
+{
+        return strcmp(*(const char**) a, *(const char**) b);
+}
+
+static int query_is_datapoints_file(const char* name)
+{
+        int len = strlen(name);
+        return (strncmp(name, "datapoints-", 11) == 0)
+                && (len > 15) && (strcmp(name + len - 4, ".csv") == 0);
+}
+
+static int query_add_name(char*** names, int* count, int* len, const char* name)
+{
+        if (*count >= *len) {
+                *len = (*len == 0)? 256 : 2 * *len;
+                char** p = (char**) realloc(*names, *len * sizeof(char*));
+                if (p == NULL)
+                        return -1;
+                *names = p;
+        }
+        (*names)[(*count)++] = strdup(name);
+        return 0;
+}
+
+/* The names of all the uploaded datapoints files. */
+static char** query_list_sources(const char* backup_dir, archive_t* archive, int* count)
+{
+        struct dirent *entry;
+        char** names = NULL;
+        int len = 0;
+
+        *count = 0;
+
+        DIR* dir = opendir(backup_dir);
+        if (dir != NULL) {
+                while ((entry = readdir(dir)) != NULL)
+                        if (query_is_datapoints_file(entry->d_name)
+                            && (query_add_name(&names, count, &len, entry->d_name) != 0))
+                                break;
+                closedir(dir);
+        }
+
+        if (archive != NULL) {
+                for (int i = 0; i < archive_count(archive); i++) {
+                        const char* name = archive_get_name(archive, i);
+                        if (query_is_datapoints_file(name)
+                            && (query_add_name(&names, count, &len, name) != 0))
+                                break;
+                }
+        }
+
+        /* A file can briefly be both in the backup directory and
+           in an archive. */
+        if (*count > 1) {
+                qsort(names, *count, sizeof(char*), query_compare_names);
+                int n = 1;
+                for (int i = 1; i < *count; i++) {
+                        if (strcmp(names[i], names[n-1]) == 0)
+                                free(names[i]);
+                        else names[n++] = names[i];
+                }
+                *count = n;
+        }
+
+        return names;
+}
+
+static query_source_t* query_load_index(const char* file, int* count)
+{
+        char line[512];
+        char name[256];
+        long first, last;
+        query_source_t* sources = NULL;
+        int len = 0;
+
+        *count = 0;
+
+        FILE* fp = fopen(file, "r");
+        if (fp == NULL)
+                return NULL;
+
+        while (fgets(line, 512, fp) != NULL) {
+                if (line[strlen(line) - 1] != '\n')
+                        continue;
+                if (sscanf(line, "%255s %ld %ld", name, &first, &last) != 3)
+                        continue;
+                if (*count >= len) {
+                        len = (len == 0)? 256 : 2 * len;
+                        query_source_t* p = (query_source_t*) realloc(sources, len * sizeof(query_source_t));
+                        if (p == NULL)
+                                break;
+                        sources = p;
+                }
+                sources[*count].name = strdup(name);
+                sources[*count].first = (time_t) first;
+                sources[*count].last = (time_t) last;
+                (*count)++;
+        }
+        fclose(fp);
+
+        if (*count > 0)
+                qsort(sources, *count, sizeof(query_source_t), query_compare_sources);
+
+        return sources;
+}
+
+static void query_free_sources(query_source_t* sources, int count)
+{
+        for (int i = 0; i < count; i++)
+                free(sources[i].name);
+        if (sources)
+                free(sources);
+}
+
+/* Queries run without the sensorbox lock, so several processes may
+   index the same files at once. The new entries are appended under
+   a lock on the index, and those that another process added in the
+   meantime are left out. */
+static void query_append_index(const char* file, query_source_t* added, int num_added)
+{
+        char line[512];
+        int count;
+
+        int fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd == -1) {
+                log_warn("Query: Failed to open the index '%s'", file);
+                return;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+                close(fd);
+                return;
+        }
+
+        query_source_t* sources = query_load_index(file, &count);
+        for (int i = 0; i < num_added; i++) {
+                if (bsearch(&added[i], sources, count, sizeof(query_source_t),
+                            query_compare_sources) != NULL)
+                        continue;
+                int len = snprintf(line, 512, "%s %ld %ld\n", added[i].name,
+                                   (long) added[i].first, (long) added[i].last);
+                if ((len >= 512) || (write(fd, line, len) != len)) {
+                        log_warn("Query: Failed to update the index '%s'", file);
+                        break;
+                }
+        }
+        query_free_sources(sources, count);
+
+        flock(fd, LOCK_UN);
+        close(fd);
+}
+
+int query_scan_backup(query_t* q, const char* backup_dir, archive_t* archive)
+{
+        char index_file[512];
+        int num_sources;
+        int num_names;
+        int scanned = 0;
+        int read = 0;
+        int err = 0;
+
+        snprintf(index_file, 512, "%s/datapoints.idx", backup_dir);
+        index_file[511] = 0;
+
+        query_source_t* sources = query_load_index(index_file, &num_sources);
+        char** names = query_list_sources(backup_dir, archive, &num_names);
+
+        query_source_t* added = NULL;
+        int num_added = 0;
+
+        for (int i = 0; (i < num_names) && (err == 0); i++) {
+                query_source_t key;
+                unsigned char* data = NULL;
+                long size;
+
+                key.name = names[i];
+                query_source_t* s = (query_source_t*) bsearch(&key, sources, num_sources,
+                                                              sizeof(query_source_t),
+                                                              query_compare_sources);
+                if (s != NULL) {
+                        if ((s->last < q->from) || (s->first > q->to))
+                                continue;
+                        if (query_read_source(backup_dir, archive, names[i], &data, &size) != 0)
+                                continue;
+                        err = query_add_csv(q, (const char*) data, size);
+                        free(data);
+                        read++;
+                        continue;
+                }
+
+                /* Not indexed yet: read the file once to learn its
+                   time range, and use it right away. */
+                if (query_read_source(backup_dir, archive, names[i], &data, &size) != 0)
+                        continue;
+
+                memset(&key, 0, sizeof(query_source_t));
+                key.name = names[i];
+                query_parse_csv(q, (const char*) data, size, query_update_range, &key);
+
+                if ((key.last >= q->from) && (key.first <= q->to)) {
+                        err = query_add_csv(q, (const char*) data, size);
+                        read++;
+                }
+                free(data);
+
+                if (added == NULL)
+                        added = (query_source_t*) malloc(num_names * sizeof(query_source_t));
+                if (added != NULL)
+                        added[num_added++] = key;
+                scanned++;
+        }
+
+        if (num_added > 0)
+                query_append_index(index_file, added, num_added);
+        if (added)
+                free(added);
+
+        log_debug("Query: %d files read, %d files indexed, %d in the index",
+                  read, scanned, num_sources);
+
+        query_free_sources(sources, num_sources);
+        for (int i = 0; i < num_names; i++)
+                free(names[i]);
+        if (names)
+                free(names);
+
+        return err;
+}
+
+static int query_compare_points(const void* a, const void* b)
+{
+        time_t ta = ((const query_point_t*) a)->timestamp;
+        time_t tb = ((const query_point_t*) b)->timestamp;
+        return (ta < tb)? -1 : (ta > tb)? 1 : 0;
+}
+
+int query_overlaps(query_t* q, time_t from, time_t to)
+{
+        return (to >= q->from) && (from <= q->to);
+}
+
+static void query_format_time(time_t t, char* s, int len)
+{
+        char buf[TIMESTAMP_MAXLEN];
+        timestamp_format(NULL, t, TIMESTAMP_ISO, buf);
+        snprintf(s, len, "%s", buf);
+}
+
+int query_print(query_t* q, FILE* fp)
+{
+        char s[64];
+
+        if (q->function == QUERY_RAW) {
+                /* The sources aren't read in chronological order. */
+                qsort(q->points, q->num_points, sizeof(query_point_t), query_compare_points);
+                for (int i = 0; i < q->num_points; i++) {
+                        query_format_time(q->points[i].timestamp, s, 64);
+                        fprintf(fp, "%s,%f\n", s, q->points[i].value);
+                }
+                return 0;
+        }
+
+        for (int i = 0; i < q->num_buckets; i++) {
+                query_bucket_t* b = &q->buckets[i];
+                if (b->count == 0)
+                        continue;
+                query_format_time(q->from + (time_t) i * q->bucket, s, 64);
+                switch (q->function) {
+                case QUERY_MIN: fprintf(fp, "%s,%f\n", s, b->min); break;
+                case QUERY_MAX: fprintf(fp, "%s,%f\n", s, b->max); break;
+                case QUERY_MEAN: fprintf(fp, "%s,%f\n", s, b->sum / b->count); break;
+                case QUERY_COUNT: fprintf(fp, "%s,%d\n", s, b->count); break;
+                }
+        }
+
+        return 0;
+}
+
+int query_foreach(query_t* q, query_callback_t fun, void* data)
+{
+        if (q->function != QUERY_RAW)
+                return -1;
+
+        qsort(q->points, q->num_points, sizeof(query_point_t), query_compare_points);
+        for (int i = 0; i < q->num_points; i++) {
+                int ret = fun(data, q->points[i].osd_id, q->points[i].timestamp,
+                              q->points[i].value);
+                if (ret != 0)
+                        return ret;
+        }
+        return 0;
+}
@@ -0,0 +1,108 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "archive.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* Range queries over the local datapoints of one datastream.
+           The datapoints are fed to the query from the different
+           places they are kept (the datapoints log, the CSV files in
+           backup/, the archives) and the result is printed as CSV:
+           one line per datapoint for raw queries, one line per
+           non-empty bucket otherwise. */
+
+        enum {
+                QUERY_RAW,
+                QUERY_MIN,
+                QUERY_MAX,
+                QUERY_MEAN,
+                QUERY_COUNT
+        };
+
+        /* Returns -1 if the name isn't one of raw, min, max, mean,
+           count. */
+        int query_parse_function(const char* name);
+
+        /* Accepts YYYY-MM-DD, YYYYMMDD, YYYY-MM-DDTHH:MM[:SS] (local
+           time), or the number of seconds since the epoch. */
+        int query_parse_time(const char* s, time_t* t);
+
+        typedef struct _query_t query_t;
+
+        /* A raw query for this ID keeps the datapoints of all the
+           datastreams. */
+        #define QUERY_ALL_DATASTREAMS -1
+
+        /* Same as datalog_callback_t */
+        typedef int (*query_callback_t)(void* data, int osd_id,
+                                        time_t timestamp, float value);
+
+        /* The range [from, to] is inclusive. The bucket size is in
+           seconds. A bucket size of 0 puts the whole range in one
+           bucket. */
+        query_t* new_query(int osd_id, time_t from, time_t to,
+                           int function, int bucket);
+        void delete_query(query_t* q);
+
+        /* Adds a datapoint. Datapoints of other datastreams, or
+           outside the range, are ignored. The signature matches
+           datalog_callback_t. */
+        int query_add(void* q, int osd_id, time_t timestamp, float value);
+
+        /* Adds a summary of the datapoints that start at the given
+           time, such as a rollup bucket. The summary must not span
+           more than one bucket of the query. Ignored by raw
+           queries. */
+        int query_add_summary(query_t* q, int osd_id, time_t start, int count,
+                              float min, float max, double sum);
+
+        /* Adds the datapoints of a buffer in the datapoints CSV
+           format. Only complete lines are used. */
+        int query_add_csv(query_t* q, const char* buf, long len);
+
+        /* Adds the datapoints of the uploaded files, in backup_dir or
+           in the archives. The time range of every file is kept in
+           the index backup_dir/datapoints.idx, so only the files that
+           overlap the query are read. archive may be NULL. */
+        int query_scan_backup(query_t* q, const char* backup_dir, archive_t* archive);
+
+        /* Returns 1 if the range of the query overlaps [from, to]. */
+        int query_overlaps(query_t* q, time_t from, time_t to);
+
+        int query_print(query_t* q, FILE* fp);
+
+        /* Calls fun for the datapoints of a raw query, oldest
+           first. */
+        int query_foreach(query_t* q, query_callback_t fun, void* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
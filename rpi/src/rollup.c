@@ -0,0 +1,648 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "log_message.h"
+#include "rollup.h"
+#include "timestamp.h"
+
+const int rollup_tiers[ROLLUP_TIERS] = { 600, 3600, 86400 };
+
+/* start:u32 osd_id:i32 count:u32 min:f32 max:f32 sum:f64 */
+#define ROLLUP_RECORD_SIZE 28
+
+/* Late records are looked for this far before the start of a
+   range. */
+#define ROLLUP_SLACK (2 * 86400)
+
+#define ROLLUP_STATE_VERSION 1
+
+typedef struct _rollup_list_t {
+        rollup_record_t* records;
+        int count;
+        int len;
+} rollup_list_t;
+
+struct _rollup_t {
+        char* dir;
+        time_t since;
+
+        /* The size of the tier files as of the last save. Anything
+           beyond was written by a save that didn't complete, and is
+           dropped. */
+        int64_t length[ROLLUP_TIERS];
+
+        /* The offset of the first record not sent yet, and the one
+           reached by the last export. The first is kept in
+           exported.dat rather than in state.dat: it is committed by
+           the upload worker, whose copy of the open buckets is older
+           than the one the next run saves. */
+        int64_t exported[ROLLUP_TIERS];
+        int64_t export_end[ROLLUP_TIERS];
+
+        rollup_list_t open[ROLLUP_TIERS];
+        rollup_list_t closed[ROLLUP_TIERS];
+
+        /* Set by rollup_recover(). Until then, the rollups are
+           only read. */
+        int writable;
+
+        /* The current local day, for the daily tier. */
+        time_t day_start;
+        time_t day_end;
+};
+
+static int rollup_load(rollup_t* r);
+
+static void rollup_path(rollup_t* r, const char* name, char* path, int len)
+{
+        snprintf(path, len, "%s/%s", r->dir, name);
+        path[len-1] = 0;
+}
+
+static void rollup_tier_path(rollup_t* r, int tier, char* path, int len)
+{
+        snprintf(path, len, "%s/%d.dat", r->dir, rollup_tiers[tier]);
+        path[len-1] = 0;
+}
+
+rollup_t* new_rollup(const char* dir)
+{
+        rollup_t* r = (rollup_t*) malloc(sizeof(rollup_t));
+        if (r == NULL) {
+                log_err("Rollup: out of memory");
+                return NULL;
+        }
+        memset(r, 0, sizeof(rollup_t));
+        r->dir = strdup(dir);
+
+        if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+                log_err("Rollup: Failed to create the directory '%s'", dir);
+                delete_rollup(r);
+                return NULL;
+        }
+
+        rollup_load(r);
+
+        return r;
+}
+
+void delete_rollup(rollup_t* r)
+{
+        for (int i = 0; i < ROLLUP_TIERS; i++) {
+                if (r->open[i].records)
+                        free(r->open[i].records);
+                if (r->closed[i].records)
+                        free(r->closed[i].records);
+        }
+        if (r->dir)
+                free(r->dir);
+        free(r);
+}
+
+int rollup_tier(int seconds)
+{
+        for (int i = 0; i < ROLLUP_TIERS; i++)
+                if (rollup_tiers[i] == seconds)
+                        return i;
+        return -1;
+}
+
+time_t rollup_since(rollup_t* r)
+{
+        return r->since;
+}
+
+static rollup_record_t* rollup_list_add(rollup_list_t* list)
+{
+        if (list->count >= list->len) {
+                int len = (list->len == 0)? 8 : 2 * list->len;
+                rollup_record_t* p = (rollup_record_t*) realloc(list->records,
+                                                                len * sizeof(rollup_record_t));
+                if (p == NULL) {
+                        log_err("Rollup: out of memory");
+                        return NULL;
+                }
+                list->records = p;
+                list->len = len;
+        }
+        return &list->records[list->count++];
+}
+
+static void rollup_encode(rollup_record_t* rec, unsigned char* buf)
+{
+        uint32_t start = (uint32_t) rec->start;
+        int32_t id = rec->osd_id;
+        uint32_t count = rec->count;
+        memcpy(buf, &start, 4);
+        memcpy(buf + 4, &id, 4);
+        memcpy(buf + 8, &count, 4);
+        memcpy(buf + 12, &rec->min, 4);
+        memcpy(buf + 16, &rec->max, 4);
+        memcpy(buf + 20, &rec->sum, 8);
+}
+
+static void rollup_decode(rollup_record_t* rec, const unsigned char* buf)
+{
+        uint32_t start;
+        int32_t id;
+        uint32_t count;
+        memcpy(&start, buf, 4);
+        memcpy(&id, buf + 4, 4);
+        memcpy(&count, buf + 8, 4);
+        memcpy(&rec->min, buf + 12, 4);
+        memcpy(&rec->max, buf + 16, 4);
+        memcpy(&rec->sum, buf + 20, 8);
+        rec->start = (time_t) start;
+        rec->osd_id = id;
+        rec->count = count;
+}
+
+static time_t rollup_bucket_start(rollup_t* r, int tier, time_t t)
+{
+        if (rollup_tiers[tier] < 86400)
+                return t - (t % rollup_tiers[tier]);
+
+        /* Days start at midnight, local time. The day is cached so
+           that localtime() and mktime() are only called when the
+           date changes. */
+        if ((t < r->day_start) || (t >= r->day_end)) {
+                struct tm tm;
+                localtime_r(&t, &tm);
+                tm.tm_hour = 0;
+                tm.tm_min = 0;
+                tm.tm_sec = 0;
+                tm.tm_isdst = -1;
+                r->day_start = mktime(&tm);
+                tm.tm_mday += 1;
+                tm.tm_isdst = -1;
+                r->day_end = mktime(&tm);
+        }
+        return r->day_start;
+}
+
+static void rollup_merge(rollup_record_t* rec, float value)
+{
+        if (value < rec->min)
+                rec->min = value;
+        if (value > rec->max)
+                rec->max = value;
+        rec->sum += value;
+        rec->count++;
+}
+
+static void rollup_init_record(rollup_record_t* rec, int osd_id, time_t start, float value)
+{
+        rec->start = start;
+        rec->osd_id = osd_id;
+        rec->count = 1;
+        rec->min = value;
+        rec->max = value;
+        rec->sum = value;
+}
+
+int rollup_add(rollup_t* r, int osd_id, time_t timestamp, float value)
+{
+        if ((r->since == 0) || (timestamp < r->since))
+                r->since = timestamp;
+
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++) {
+                time_t start = rollup_bucket_start(r, tier, timestamp);
+                rollup_list_t* open = &r->open[tier];
+                rollup_record_t* rec = NULL;
+
+                for (int i = 0; i < open->count; i++) {
+                        if (open->records[i].osd_id == osd_id) {
+                                rec = &open->records[i];
+                                break;
+                        }
+                }
+
+                if (rec == NULL) {
+                        rec = rollup_list_add(open);
+                        if (rec == NULL)
+                                return -1;
+                        rollup_init_record(rec, osd_id, start, value);
+
+                } else if (start == rec->start) {
+                        rollup_merge(rec, value);
+
+                } else if (start > rec->start) {
+                        rollup_record_t* closed = rollup_list_add(&r->closed[tier]);
+                        if (closed == NULL)
+                                return -1;
+                        *closed = *rec;
+                        rollup_init_record(rec, osd_id, start, value);
+
+                } else {
+                        /* The bucket was closed already. Add a
+                           record for the late datapoints. */
+                        rollup_list_t* list = &r->closed[tier];
+                        rollup_record_t* last = (list->count > 0)? &list->records[list->count-1] : NULL;
+                        if ((last != NULL) && (last->osd_id == osd_id) && (last->start == start)) {
+                                rollup_merge(last, value);
+                        } else {
+                                last = rollup_list_add(list);
+                                if (last == NULL)
+                                        return -1;
+                                rollup_init_record(last, osd_id, start, value);
+                        }
+                }
+        }
+
+        return 0;
+}
+
+int rollup_accepts(rollup_t* r, time_t timestamp)
+{
+        if ((r->since == 0) || (timestamp < r->since))
+                return 0;
+
+        /* The open 10-minute buckets tell how far the rollups
+           are. A late record is written after them, and is found
+           by rollup_foreach() if it is within the slack. */
+        time_t latest = 0;
+        rollup_list_t* open = &r->open[0];
+        for (int i = 0; i < open->count; i++)
+                if (open->records[i].start > latest)
+                        latest = open->records[i].start;
+
+        return (timestamp + ROLLUP_SLACK / 2 >= latest);
+}
+
+static int rollup_save_state(rollup_t* r)
+{
+        char path[512];
+        char tmp[512];
+        unsigned char buf[ROLLUP_RECORD_SIZE];
+
+        rollup_path(r, "state.dat", path, 512);
+        rollup_path(r, "state.tmp", tmp, 512);
+
+        FILE* fp = fopen(tmp, "w");
+        if (fp == NULL) {
+                log_err("Rollup: Failed to create '%s'", tmp);
+                return -1;
+        }
+
+        uint32_t since = (uint32_t) r->since;
+        uint32_t count = 0;
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++)
+                count += r->open[tier].count;
+
+        fwrite("SBRU", 4, 1, fp);
+        fputc(ROLLUP_STATE_VERSION, fp);
+        fputc(ROLLUP_TIERS, fp);
+        fputc(0, fp);
+        fputc(0, fp);
+        fwrite(&since, 4, 1, fp);
+        fwrite(r->length, 8, ROLLUP_TIERS, fp);
+        fwrite(r->exported, 8, ROLLUP_TIERS, fp);
+        fwrite(&count, 4, 1, fp);
+
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++) {
+                for (int i = 0; i < r->open[tier].count; i++) {
+                        fputc(tier, fp);
+                        rollup_encode(&r->open[tier].records[i], buf);
+                        fwrite(buf, ROLLUP_RECORD_SIZE, 1, fp);
+                }
+        }
+
+        int err = ferror(fp);
+        if ((fclose(fp) != 0) || err || (rename(tmp, path) != 0)) {
+                log_err("Rollup: Failed to save '%s'", path);
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+static int rollup_save_exported(rollup_t* r)
+{
+        char path[512];
+        char tmp[512];
+
+        rollup_path(r, "exported.dat", path, 512);
+        rollup_path(r, "exported.tmp", tmp, 512);
+
+        FILE* fp = fopen(tmp, "w");
+        if (fp == NULL) {
+                log_err("Rollup: Failed to create '%s'", tmp);
+                return -1;
+        }
+        fwrite(r->exported, 8, ROLLUP_TIERS, fp);
+        int err = ferror(fp);
+        if ((fclose(fp) != 0) || err || (rename(tmp, path) != 0)) {
+                log_err("Rollup: Failed to save '%s'", path);
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+/* Reads the export positions. Without exported.dat, those of
+   state.dat, as saved by an older version, are kept. */
+static void rollup_load_exported(rollup_t* r)
+{
+        char path[512];
+        int64_t exported[ROLLUP_TIERS];
+
+        rollup_path(r, "exported.dat", path, 512);
+
+        FILE* fp = fopen(path, "r");
+        if (fp != NULL) {
+                if (fread(exported, 8, ROLLUP_TIERS, fp) == ROLLUP_TIERS)
+                        memcpy(r->exported, exported, sizeof(exported));
+                else
+                        log_warn("Rollup: Invalid export file '%s'", path);
+                fclose(fp);
+        }
+
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++)
+                if (r->exported[tier] > r->length[tier])
+                        r->exported[tier] = r->length[tier];
+}
+
+static int rollup_load(rollup_t* r)
+{
+        char path[512];
+        unsigned char header[12];
+        unsigned char buf[ROLLUP_RECORD_SIZE];
+        uint32_t since, count;
+        struct stat st;
+
+        rollup_path(r, "state.dat", path, 512);
+
+        FILE* fp = fopen(path, "r");
+        if (fp != NULL) {
+                if ((fread(header, 8, 1, fp) != 1)
+                    || (memcmp(header, "SBRU", 4) != 0)
+                    || (header[4] != ROLLUP_STATE_VERSION)
+                    || (header[5] != ROLLUP_TIERS)
+                    || (fread(&since, 4, 1, fp) != 1)
+                    || (fread(r->length, 8, ROLLUP_TIERS, fp) != ROLLUP_TIERS)
+                    || (fread(r->exported, 8, ROLLUP_TIERS, fp) != ROLLUP_TIERS)
+                    || (fread(&count, 4, 1, fp) != 1)) {
+                        log_warn("Rollup: Invalid state file '%s'", path);
+                        memset(r->length, 0, sizeof(r->length));
+                        memset(r->exported, 0, sizeof(r->exported));
+                        since = 0;
+                        count = 0;
+                }
+                r->since = (time_t) since;
+
+                for (uint32_t i = 0; i < count; i++) {
+                        int tier = fgetc(fp);
+                        if ((tier < 0) || (tier >= ROLLUP_TIERS)
+                            || (fread(buf, ROLLUP_RECORD_SIZE, 1, fp) != 1))
+                                break;
+                        rollup_record_t* rec = rollup_list_add(&r->open[tier]);
+                        if (rec == NULL)
+                                break;
+                        rollup_decode(rec, buf);
+                }
+                fclose(fp);
+        }
+
+        /* The records beyond the saved length are ignored until
+           rollup_recover() removes them. */
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++) {
+                rollup_tier_path(r, tier, path, 512);
+                if (stat(path, &st) != 0)
+                        r->length[tier] = 0;
+                else if (st.st_size < r->length[tier])
+                        r->length[tier] = st.st_size - (st.st_size % ROLLUP_RECORD_SIZE);
+        }
+
+        rollup_load_exported(r);
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++)
+                r->export_end[tier] = r->exported[tier];
+
+        return 0;
+}
+
+int rollup_recover(rollup_t* r)
+{
+        char path[512];
+        struct stat st;
+        int err = 0;
+
+        r->writable = 1;
+
+        /* Bring the tier files back to the state that was saved. */
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++) {
+                rollup_tier_path(r, tier, path, 512);
+                if ((stat(path, &st) != 0) || (st.st_size <= r->length[tier]))
+                        continue;
+                log_warn("Rollup: Truncating '%s' to %ld bytes", path, (long) r->length[tier]);
+                if (truncate(path, r->length[tier]) != 0) {
+                        log_err("Rollup: Failed to truncate '%s'", path);
+                        err = -1;
+                }
+        }
+        return err;
+}
+
+static int rollup_check_writable(rollup_t* r)
+{
+        if (r->writable)
+                return 0;
+        log_err("Rollup: '%s' is opened read-only", r->dir);
+        return -1;
+}
+
+int rollup_save(rollup_t* r)
+{
+        char path[512];
+        int err = 0;
+
+        if (rollup_check_writable(r) != 0)
+                return -1;
+
+        for (int tier = 0; tier < ROLLUP_TIERS; tier++) {
+                rollup_list_t* list = &r->closed[tier];
+                if (list->count == 0)
+                        continue;
+
+                int len = list->count * ROLLUP_RECORD_SIZE;
+                unsigned char* buf = (unsigned char*) malloc(len);
+                if (buf == NULL) {
+                        log_err("Rollup: out of memory");
+                        return -1;
+                }
+                for (int i = 0; i < list->count; i++)
+                        rollup_encode(&list->records[i], buf + i * ROLLUP_RECORD_SIZE);
+
+                rollup_tier_path(r, tier, path, 512);
+                int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+                if ((fd == -1) || (write(fd, buf, len) != len)) {
+                        log_err("Rollup: Failed to append to '%s'", path);
+                        err = -1;
+                } else {
+                        r->length[tier] += len;
+                        list->count = 0;
+                }
+                if (fd != -1)
+                        close(fd);
+                free(buf);
+        }
+
+        if (rollup_save_state(r) != 0)
+                err = -1;
+
+        return err;
+}
+
+static int rollup_read_start(int fd, int64_t index, time_t* start)
+{
+        uint32_t t;
+        if (pread(fd, &t, 4, index * ROLLUP_RECORD_SIZE) != 4)
+                return -1;
+        *start = (time_t) t;
+        return 0;
+}
+
+int rollup_foreach(rollup_t* r, int tier, time_t from, time_t to,
+                   rollup_callback_t fun, void* data)
+{
+        char path[512];
+        rollup_record_t rec;
+        int ret = 0;
+
+        rollup_tier_path(r, tier, path, 512);
+
+        int fd = open(path, O_RDONLY);
+        if (fd != -1) {
+                int64_t n = r->length[tier] / ROLLUP_RECORD_SIZE;
+                int64_t lo = 0, hi = n;
+                time_t start;
+
+                /* The records are appended in time order, except for
+                   the late ones, hence the slack. */
+                while (lo < hi) {
+                        int64_t mid = (lo + hi) / 2;
+                        if (rollup_read_start(fd, mid, &start) != 0)
+                                break;
+                        if (start < from - ROLLUP_SLACK)
+                                lo = mid + 1;
+                        else hi = mid;
+                }
+
+                enum { CHUNK = 256 };
+                unsigned char buf[CHUNK * ROLLUP_RECORD_SIZE];
+                int64_t i = lo;
+                int done = 0;
+
+                while ((i < n) && !done && (ret == 0)) {
+                        int64_t k = (n - i < CHUNK)? n - i : CHUNK;
+                        ssize_t len = k * ROLLUP_RECORD_SIZE;
+                        if (pread(fd, buf, len, i * ROLLUP_RECORD_SIZE) != len) {
+                                log_err("Rollup: Failed to read '%s'", path);
+                                ret = -1;
+                                break;
+                        }
+                        for (int j = 0; (j < k) && (ret == 0); j++) {
+                                rollup_decode(&rec, buf + j * ROLLUP_RECORD_SIZE);
+                                if (rec.start > to + ROLLUP_SLACK) {
+                                        done = 1;
+                                        break;
+                                }
+                                if ((rec.start >= from) && (rec.start <= to))
+                                        ret = fun(data, &rec);
+                        }
+                        i += k;
+                }
+                close(fd);
+        }
+
+        rollup_list_t* lists[2] = { &r->closed[tier], &r->open[tier] };
+        for (int l = 0; (l < 2) && (ret == 0); l++) {
+                for (int i = 0; (i < lists[l]->count) && (ret == 0); i++) {
+                        rollup_record_t* p = &lists[l]->records[i];
+                        if ((p->start >= from) && (p->start <= to))
+                                ret = fun(data, p);
+                }
+        }
+
+        return ret;
+}
+
+int rollup_export_csv(rollup_t* r, int tier, FILE* fp)
+{
+        char path[512];
+        char s[TIMESTAMP_MAXLEN];
+        unsigned char buf[ROLLUP_RECORD_SIZE];
+        rollup_record_t rec;
+        int lines = 0;
+
+        rollup_tier_path(r, tier, path, 512);
+
+        /* An upload that ended after this process started may have
+           moved the position. */
+        rollup_load_exported(r);
+
+        int64_t offset = r->exported[tier];
+        r->export_end[tier] = offset;
+        if (offset >= r->length[tier])
+                return 0;
+
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+                log_err("Rollup: Failed to open '%s'", path);
+                return -1;
+        }
+
+        for ( ; offset < r->length[tier]; offset += ROLLUP_RECORD_SIZE) {
+                if (pread(fd, buf, ROLLUP_RECORD_SIZE, offset) != ROLLUP_RECORD_SIZE) {
+                        log_err("Rollup: Failed to read '%s'", path);
+                        close(fd);
+                        return -1;
+                }
+                rollup_decode(&rec, buf);
+                if (rec.count == 0)
+                        continue;
+                timestamp_format(NULL, rec.start, TIMESTAMP_ISO, s);
+                fprintf(fp, "%d,%s,%f\n", rec.osd_id, s, (float) (rec.sum / rec.count));
+                lines++;
+        }
+        close(fd);
+
+        r->export_end[tier] = offset;
+        return lines;
+}
+
+int rollup_commit_export(rollup_t* r, int tier)
+{
+        if (rollup_check_writable(r) != 0)
+                return -1;
+        r->exported[tier] = r->export_end[tier];
+        return rollup_save_exported(r);
+}
@@ -0,0 +1,107 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* The rollups summarise the datapoints of each datastream
+           per 10 minutes, per hour and per day (local time): min,
+           max, sum and count. They are updated as the datapoints
+           are stored, in constant time per datapoint.
+
+           Each tier is kept in <dir>/<seconds>.dat, a file of
+           fixed-size records that is only appended to when a bucket
+           closes. The buckets that are still open are kept in
+           <dir>/state.dat. A datapoint that arrives after its bucket
+           was closed gives an extra record for the same bucket;
+           readers merge the records with the same start time. How
+           far each tier was uploaded is kept in <dir>/exported.dat. */
+
+        #define ROLLUP_TIERS 3
+
+        extern const int rollup_tiers[ROLLUP_TIERS];
+
+        typedef struct _rollup_record_t {
+                time_t start;
+                int osd_id;
+                int count;
+                float min;
+                float max;
+                double sum;
+        } rollup_record_t;
+
+        typedef struct _rollup_t rollup_t;
+
+        rollup_t* new_rollup(const char* dir);
+        void delete_rollup(rollup_t* r);
+
+        /* Returns the index of the tier with the given bucket size,
+           or -1. */
+        int rollup_tier(int seconds);
+
+        int rollup_add(rollup_t* r, int osd_id, time_t timestamp, float value);
+
+        /* Returns 1 if a datapoint that arrives late, such as an
+           imported one, can be added: the rollups must already
+           cover its time, and its bucket must not be so old that
+           readers wouldn't find the extra record. */
+        int rollup_accepts(rollup_t* r, time_t timestamp);
+
+        /* Removes what a save that didn't complete left at the end
+           of the tier files. Only the process that saves the
+           rollups may call it, before its first save: the rollups
+           are read-only until then. */
+        int rollup_recover(rollup_t* r);
+
+        /* Appends the closed buckets to the tier files and saves the
+           open buckets. */
+        int rollup_save(rollup_t* r);
+
+        /* The time of the first datapoint that was rolled up, or 0.
+           The rollups don't cover the data before. */
+        time_t rollup_since(rollup_t* r);
+
+        typedef int (*rollup_callback_t)(void* data, rollup_record_t* rec);
+
+        /* Calls fun for the records of a tier whose bucket starts in
+           [from, to], closed and open. */
+        int rollup_foreach(rollup_t* r, int tier, time_t from, time_t to,
+                           rollup_callback_t fun, void* data);
+
+        /* Writes the mean of the closed buckets of a tier that
+           weren't exported before, in the datapoints CSV format.
+           The position is only advanced by rollup_commit_export(),
+           once the data was sent. Returns the number of lines. */
+        int rollup_export_csv(rollup_t* r, int tier, FILE* fp);
+        int rollup_commit_export(rollup_t* r, int tier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -33,6 +34,8 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include "json.h"
 #include "log_message.h"
 #include "config.h"
@@ -42,6 +45,17 @@
 #include "network.h"
 #include "opensensordata.h"
 #include "system.h"
+#include "uplink.h"
+#include "gorilla.h"
+#include "datalog.h"
+#include "archive.h"
+#include "query.h"
+#include "rollup.h"
+#include "live.h"
+#include "timestamp.h"
+#include "import.h"
+#include "sha256.h"
+#include "hashset.h"
 #include "sensorbox.h"
 
 struct _sensorbox_t {
@@ -50,11 +64,27 @@ struct _sensorbox_t {
         arduino_t* arduino;
         camera_t* camera;
         opensensordata_t* osd;
+        uplink_t* uplink;
+        int upload_deadline;
+        pid_t upload_worker;
+        datalog_t* datalog;
+        rollup_t* rollup;
+        live_t* live;
+        /* The content hashes of the uploaded files. Opened on first
+           use. */
+        hashset_t* uploaded;
+        /* The staging area, on tmpfs, for new datapoints and photos.
+           NULL if it isn't used. */
+        char* staging_dir;
+        long staging_threshold;
+        datalog_t* staged;
         event_t* events;
         char filenamebuf[2048];
         int test;
         FILE* datafp;
         int lock;
+        /* The upload lock, when the uploads run in the foreground. */
+        int upload_lock;
         int use_arduino_time;
         unsigned char sensors_enabled;
         unsigned char sensors_period;
@@ -66,6 +96,7 @@ struct _sensorbox_t {
 static int sensorbox_load_config(sensorbox_t* box, const char* path);
 static int sensorbox_load_sensors(sensorbox_t* box);
 static char* sensorbox_path(sensorbox_t* box, const char* filename);
+static int sensorbox_join(char* path, int len, const char* dir, const char* name);
 static int sensorbox_init_osd(sensorbox_t* box);
 static int sensorbox_add_periodic_events(sensorbox_t* box, int period, int type);
 static int sensorbox_add_fixed_events(sensorbox_t* box, json_object_t fixed, int type);
@@ -73,6 +104,20 @@ static int sensorbox_init_arduino(sensorbox_t* box);
 static int sensorbox_init_camera(sensorbox_t* box);
 static void sensorbox_handle_event(sensorbox_t* box, event_t* e, time_t t);
 static void sensorbox_poweroff(sensorbox_t* box, int minutes);
+static int sensorbox_init_uplink(sensorbox_t* box);
+static int sensorbox_init_staging(sensorbox_t* box);
+static void sensorbox_recover_staging(sensorbox_t* box);
+static int sensorbox_lock_staging(sensorbox_t* box);
+static void sensorbox_unlock_staging(sensorbox_t* box, int fd);
+static void sensorbox_staged(sensorbox_t* box, time_t t);
+static long sensorbox_staging_size(sensorbox_t* box);
+static time_t sensorbox_read_mark(const char* path);
+static void sensorbox_write_mark(const char* path, time_t t, int sync);
+static char** sensorbox_list_photos(const char* dirname, int* count);
+static int sensorbox_lock_uploads(sensorbox_t* box);
+static long sensorbox_filesize(const char* filename);
+static void sensorbox_update_rtc_maybe(sensorbox_t* box);
+static int sensorbox_read_file(const char* path, unsigned char** data, long* size);
 
 sensorbox_t* new_sensorbox(const char* dir, const char* config_file)
 {
@@ -85,12 +130,33 @@ sensorbox_t* new_sensorbox(const char* dir, const char* config_file)
 
         box->home_dir = strdup(dir);
         box->lock = -1;
+        box->upload_lock = -1;
+        box->upload_worker = -1;
 
         if (sensorbox_load_config(box, config_file) != 0) {
                 delete_sensorbox(box);
                 return NULL;
         }
 
+        if (sensorbox_init_uplink(box) != 0) {
+                delete_sensorbox(box);
+                return NULL;
+        }
+
+        box->datalog = new_datalog(sensorbox_path(box, "datapoints"));
+        if (box->datalog == NULL) {
+                delete_sensorbox(box);
+                return NULL;
+        }
+
+        box->rollup = new_rollup(sensorbox_path(box, "rollups"));
+        if (box->rollup == NULL) {
+                delete_sensorbox(box);
+                return NULL;
+        }
+
+        sensorbox_init_staging(box);
+
         return box;
 }
 
@@ -126,6 +192,9 @@ void sensorbox_init_time(sensorbox_t* box)
         time_t t = 0;
         box->use_arduino_time = 1;
 
+        /* An upload worker may have run NTP since the last run. */
+        sensorbox_update_rtc_maybe(box);
+
         if (box->arduino == NULL) {
                 log_warn("Sensorbox: Not using Arduino's time: Arduino not initialised.");
                 box->use_arduino_time = 0;
@@ -149,6 +218,20 @@ int delete_sensorbox(sensorbox_t* box)
         json_unref(box->config);
         if (box->osd)
                 delete_opensensordata(box->osd);
+        if (box->uplink)
+                delete_uplink(box->uplink);
+        if (box->datalog)
+                delete_datalog(box->datalog);
+        if (box->rollup)
+                delete_rollup(box->rollup);
+        if (box->live)
+                delete_live(box->live);
+        if (box->uploaded)
+                delete_hashset(box->uploaded);
+        if (box->staged)
+                delete_datalog(box->staged);
+        if (box->staging_dir)
+                free(box->staging_dir);
         if (box->camera)
                 delete_camera(box->camera);
         if (box->arduino)
@@ -166,6 +249,18 @@ static char* sensorbox_path(sensorbox_t* box, const char* filename)
         return box->filenamebuf;
 }
 
+/* Writes dir/name into path, which has room for len bytes. Returns
+   -1 if the path doesn't fit, rather than use a truncated one. */
+static int sensorbox_join(char* path, int len, const char* dir, const char* name)
+{
+        int n = snprintf(path, len, "%s/%s", dir, name);
+        if ((n < 0) || (n >= len)) {
+                log_err("Sensorbox: Path too long: %s/%s", dir, name);
+                return -1;
+        }
+        return 0;
+}
+
 static int sensorbox_load_config(sensorbox_t* box, const char* path)
 {
         if (path == NULL) 
@@ -209,6 +304,33 @@ static int sensorbox_init_osd(sensorbox_t* box)
         return 0;
 }
 
+/* The budgets are given in kilobytes in the config file. 0, or a
+   missing entry, means that the uplink is not limited. */
+static int sensorbox_init_uplink(sensorbox_t* box)
+{
+        long daily = 0;
+        long session = 0;
+
+        const char* s = json_getstr(box->config, "uplink.daily");
+        if (s != NULL)
+                daily = 1024 * atol(s);
+        s = json_getstr(box->config, "uplink.session");
+        if (s != NULL)
+                session = 1024 * atol(s);
+
+        /* Maximum duration of the background upload, in seconds. */
+        box->upload_deadline = 600;
+        s = json_getstr(box->config, "uplink.deadline");
+        if ((s != NULL) && (atoi(s) > 0))
+                box->upload_deadline = atoi(s);
+
+        box->uplink = new_uplink(sensorbox_path(box, "etc/uplink.json"), daily, session);
+        if (box->uplink == NULL)
+                return -1;
+
+        return 0;
+}
+
 static int sensorbox_load_sensors(sensorbox_t* box)
 {
         /* sensors */
@@ -574,6 +696,38 @@ static int sensorbox_init_arduino(sensorbox_t* box)
         return -1;
 }
 
+/* The file with the latest readings is only opened by the commands
+   that publish something. */
+static live_t* sensorbox_live(sensorbox_t* box)
+{
+        if (box->live != NULL)
+                return box->live;
+
+        box->live = new_live(sensorbox_path(box, "live.dat"), 1);
+        if (box->live == NULL)
+                return NULL;
+
+        if (live_begin(box->live) == 0) {
+                for (int i = 0; i < DATASTREAM_COUNT; i++)
+                        if (box->datastreams[i].name != NULL)
+                                live_set_name(box->live, i, box->datastreams[i].name);
+                live_end(box->live);
+        }
+        return box->live;
+}
+
+static void sensorbox_publish_datapoints(sensorbox_t* box, datapoint_t* datapoints,
+                                         int num_points)
+{
+        live_t* live = sensorbox_live(box);
+        if ((live == NULL) || (live_begin(live) != 0))
+                return;
+        for (int i = 0; i < num_points; i++)
+                live_add(live, datapoints[i].datastream, 
+                         datapoints[i].timestamp, datapoints[i].value);
+        live_end(live);
+}
+
 static void sensorbox_handle_event(sensorbox_t* box, event_t* e, time_t t)
 {
         if (e->type == UPDATE_SENSORS) {
@@ -583,10 +737,10 @@ static void sensorbox_handle_event(sensorbox_t* box, event_t* e, time_t t)
         }
 }
 
-void sensorbox_grab_image(sensorbox_t* box, const char* filename)
+int sensorbox_grab_image(sensorbox_t* box, const char* filename)
 {
         if (box->camera == NULL)
-                return;
+                return -1;
 
         int error;
 
@@ -594,7 +748,7 @@ void sensorbox_grab_image(sensorbox_t* box, const char* filename)
                 error = camera_capture(box->camera);
                 if (error) {
                         log_err("Sensorbox: Failed to grab the image"); 
-                        return;
+                        return -1;
                 }
                 usleep(200 * 1000); // 200 msec
         }
@@ -615,7 +769,7 @@ void sensorbox_grab_image(sensorbox_t* box, const char* filename)
 
         if (fp == NULL) {
                 log_info("Sensorbox: Failed to open file '%s'", filename);
-                return;
+                return -1;
         }
 
         size_t n = 0;
@@ -625,7 +779,7 @@ void sensorbox_grab_image(sensorbox_t* box, const char* filename)
                         fclose(fp);
                         log_info("Sensorbox: Failed to write to file '%s'", 
                                  filename);
-                        return;
+                        return -1;
                         
                 }
                 n += m;
@@ -634,24 +788,36 @@ void sensorbox_grab_image(sensorbox_t* box, const char* filename)
         fclose(fp);
 
         log_info("Sensorbox: Photo capture finished");
+        return 0;
 }
 
 void sensorbox_update_camera(sensorbox_t* box, time_t t)
 {
-        char id[512];
-        struct tm tm;
+        char id[TIMESTAMP_MAXLEN + 4];
 
-        localtime_r(&t, &tm);
-        snprintf(id, 512, "%04d%02d%02d-%02d%02d%02d.jpg",
-                 1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday, 
-                 tm.tm_hour, tm.tm_min, tm.tm_sec);
+        int n = timestamp_format(NULL, t, TIMESTAMP_COMPACT, id);
+        memcpy(id + n, ".jpg", 5);
 
-        char filename[512];
-        snprintf(filename, 512, "photostream/%s", id);
+        /* The staging lock keeps a flush from copying a photo that
+           is still being written. */
+        int lock = (box->staged != NULL)? sensorbox_lock_staging(box) : -1;
+
+        char path[512];
+        snprintf(path, 512, "%s/photostream/%s", 
+                 (lock != -1)? box->staging_dir : box->home_dir, id);
+        path[511] = 0;
+
+        int err = sensorbox_grab_image(box, path);
 
-        char* path = sensorbox_path(box, filename);
+        if (lock != -1) {
+                sensorbox_unlock_staging(box, lock);
+                if (err == 0)
+                        sensorbox_staged(box, t);
+        }
 
-        sensorbox_grab_image(box, path);
+        live_t* live = sensorbox_live(box);
+        if (live)
+                live_set_status(live, LIVE_CAMERA, t, err);
 }
 
 int sensorbox_check_sensors(sensorbox_t* box)
@@ -726,22 +892,8 @@ static int sensorbox_create_photostream(sensorbox_t* box, const char* name)
         return 0;
 }
 
-int sensorbox_check_osd_definitions(sensorbox_t* box)
+static int sensorbox_check_osd_group(sensorbox_t* box, json_object_t group)
 {
-        for (int i = 0; i < DATASTREAM_COUNT; i++) {
-                if (box->datastreams[i].enabled
-                    && (box->datastreams[i].osd_id == -1)) 
-                        return -1;
-        }
-        
-        if (box->photostream.enabled
-            && (box->photostream.osd_id == -1))
-                return -1;
-
-        json_object_t group = opensensordata_get_group(box->osd, 1);
-        if (json_isnull(group)) 
-                return -1;
-        
         int id = osd_object_get_id(group);
         if (id == -1)
                 return -1;
@@ -768,6 +920,28 @@ int sensorbox_check_osd_definitions(sensorbox_t* box)
         return 0;
 }
 
+int sensorbox_check_osd_definitions(sensorbox_t* box)
+{
+        for (int i = 0; i < DATASTREAM_COUNT; i++) {
+                if (box->datastreams[i].enabled
+                    && (box->datastreams[i].osd_id == -1)) 
+                        return -1;
+        }
+        
+        if (box->photostream.enabled
+            && (box->photostream.osd_id == -1))
+                return -1;
+
+        json_object_t group = opensensordata_get_group(box->osd, 1);
+        if (json_isnull(group)) 
+                return -1;
+
+        int r = sensorbox_check_osd_group(box, group);
+        json_unref(group);
+
+        return r;
+}
+
 int sensorbox_create_osd_definitions(sensorbox_t* box)
 {
         int r;
@@ -828,6 +1002,112 @@ int sensorbox_create_osd_definitions(sensorbox_t* box)
         return r;
 }
 
+/* Resets the Arduino's stack once the downloaded data is stored, or
+   leaves the data on the Arduino for the next download if storing
+   failed. */
+static void sensorbox_release_stack(sensorbox_t* box, int err)
+{
+        if (err == 0)
+                arduino_reset_stack(box->arduino);
+        else
+                arduino_resume(box->arduino);
+}
+
+static void sensorbox_update_rollups(sensorbox_t* box, datapoint_t* datapoints,
+                                     int num_points, int* osd_ids)
+{
+        for (int i = 0; i < num_points; i++) {
+                int id = osd_ids[datapoints[i].datastream];
+                if (id == -1) 
+                        continue;
+                if (rollup_add(box->rollup, id, datapoints[i].timestamp, datapoints[i].value) != 0)
+                        break;
+        }
+        if (rollup_save(box->rollup) != 0)
+                log_err("Sensorbox: Failed to save the rollups");
+}
+
+static void sensorbox_log_journal_stats(datalog_t* log)
+{
+        datalog_stats_t stats;
+        datalog_get_stats(log, &stats);
+        log_info("Sensorbox: Journal: %ld records, %ld commits, %ld fsyncs, "
+                 "%ld writes, %ld bytes, %ld bytes truncated at recovery", 
+                 stats.records, stats.commits, stats.fsyncs,
+                 stats.writes, stats.bytes_written, stats.truncated_bytes);
+}
+
+/* With a staging area, the download goes to tmpfs and only reaches
+   the SD card with the next flush. Until then, the Arduino keeps its
+   stack, and the next download gets the same frames again. The
+   frames up to stack.txt in the staging directory were staged, the
+   ones up to stack.txt in the home directory were flushed, and both
+   are skipped. When the stack still held frames of an earlier
+   download, the staging area is flushed and the stack is reset, so
+   that the stack never holds more than two downloads. */
+static int sensorbox_stage_sensor_data(sensorbox_t* box, datapoint_t* datapoints,
+                                       int num_points, int* osd_ids)
+{
+        char path[512];
+        time_t newest = 0;
+        int carried = 0;
+        int count = 0;
+        int err = 0;
+
+        int lock = sensorbox_lock_staging(box);
+        if (lock == -1) {
+                sensorbox_release_stack(box, -1);
+                return -1;
+        }
+
+        snprintf(path, 512, "%s/stack.txt", box->staging_dir);
+        path[511] = 0;
+        time_t staged = sensorbox_read_mark(path);
+        time_t flushed = sensorbox_read_mark(sensorbox_path(box, "stack.txt"));
+        if (staged < flushed)
+                staged = flushed;
+
+        for (int i = 0; i < num_points; i++) {
+                if (datapoints[i].timestamp > newest)
+                        newest = datapoints[i].timestamp;
+                if (datapoints[i].timestamp <= staged)
+                        carried = 1;
+                else
+                        datapoints[count++] = datapoints[i];
+        }
+
+        if (count > 0) {
+                err = datalog_append(box->staged, datapoints, count, osd_ids);
+                if (err == 0)
+                        sensorbox_write_mark(path, newest, 0);
+        }
+        sensorbox_log_journal_stats(box->staged);
+        sensorbox_unlock_staging(box, lock);
+
+        if (err != 0) {
+                sensorbox_release_stack(box, err);
+                return err;
+        }
+
+        if (count > 0) {
+                sensorbox_update_rollups(box, datapoints, count, osd_ids);
+                sensorbox_publish_datapoints(box, datapoints, count);
+                /* This may flush the staging area. */
+                sensorbox_staged(box, datapoints[0].timestamp);
+        }
+
+        if (carried
+            && (sensorbox_read_mark(sensorbox_path(box, "stack.txt")) < newest))
+                sensorbox_flush_staging(box);
+
+        /* The stack is reset only if all its frames are on the SD
+           card. */
+        flushed = sensorbox_read_mark(sensorbox_path(box, "stack.txt"));
+        sensorbox_release_stack(box, (flushed >= newest)? 0 : -1);
+
+        return 0;
+}
+
 int sensorbox_store_sensor_data(sensorbox_t* box, 
                                 const char* filename)
 {
@@ -848,13 +1128,44 @@ int sensorbox_store_sensor_data(sensorbox_t* box,
         if (err != 0) 
                 return err;
 
+        int num_points;
+        datapoint_t* datapoints = NULL;
+
+        /* By default, the datapoints go into the binary log. The CSV
+           is only written when an output file is given. */
         if (filename == NULL) {
-                filename = sensorbox_path(box, "datapoints.csv");
-                box->datafp = fopen(filename, "a");
+                int osd_ids[DATASTREAM_COUNT];
+                for (int i = 0; i < DATASTREAM_COUNT; i++)
+                        osd_ids[i] = box->datastreams[i].osd_id;
 
-        } else if (strcmp(filename, "-") == 0) {
-                box->datafp = stdout;
+                datapoints = arduino_read_data(box->arduino, &num_points);
+                if (datapoints == NULL)
+                        return 0;
+
+                /* The whole download is committed with a single
+                   fsync. Only then can the Arduino drop its copy. */
+                if (box->staged != NULL) {
+                        err = sensorbox_stage_sensor_data(box, datapoints,
+                                                          num_points, osd_ids);
+                        free(datapoints);
+                        return err;
+                }
+
+                err = datalog_append(box->datalog, datapoints, num_points, osd_ids);
+
+                if (err == 0) {
+                        sensorbox_update_rollups(box, datapoints, num_points, osd_ids);
+                        sensorbox_publish_datapoints(box, datapoints, num_points);
+                }
+                free(datapoints);
+
+                sensorbox_log_journal_stats(box->datalog);
+                sensorbox_release_stack(box, err);
+                return err;
+        }
 
+        if (strcmp(filename, "-") == 0) {
+                box->datafp = stdout;
         } else {
                 box->datafp = fopen(filename, "a");
         }
@@ -865,20 +1176,15 @@ int sensorbox_store_sensor_data(sensorbox_t* box,
                 return -1;
         }
 
-        int num_points;
-        datapoint_t* datapoints = arduino_read_data(box->arduino, &num_points);
+        datapoints = arduino_read_data(box->arduino, &num_points);
 
         for (int i = 0; i < num_points; i++) {
-                struct tm r;
-                char s[256];
+                char s[TIMESTAMP_MAXLEN];
                 
                 if (box->datastreams[datapoints[i].datastream].osd_id == -1)
                         continue;
 
-                localtime_r(&datapoints[i].timestamp, &r);
-                snprintf(s, 256, "%04d-%02d-%02dT%02d:%02d:%02d",
-                         1900 + r.tm_year, 1 + r.tm_mon, r.tm_mday, 
-                         r.tm_hour, r.tm_min, r.tm_sec);
+                timestamp_format(NULL, datapoints[i].timestamp, TIMESTAMP_ISO, s);
                 
                 fprintf(box->datafp, "%d,%s,%f\n", 
                         box->datastreams[datapoints[i].datastream].osd_id, 
@@ -886,14 +1192,22 @@ int sensorbox_store_sensor_data(sensorbox_t* box,
                         datapoints[i].value);
         } 
 
-        if (datapoints)
-                free(datapoints);
+        if ((fflush(box->datafp) != 0) 
+            || ((box->datafp != stdout) && (fsync(fileno(box->datafp)) != 0))) {
+                log_err("Sensorbox: Failed to write the datapoints to %s", filename);
+                err = -1;
+        }
 
         if (box->datafp != stdout) {
                 fclose(box->datafp);
                 box->datafp = NULL;
         }
 
+        if (datapoints) {
+                free(datapoints);
+                sensorbox_release_stack(box, err);
+        }
+
         return err;
 }
 
@@ -937,12 +1251,188 @@ void sensorbox_handle_events(sensorbox_t* box)
         }
 }
 
+/* The hashes of the files that were uploaded are kept in
+   uploaded.set. A file that is still on the disk after a successful
+   upload, because the rename to the backup failed or the box went
+   down in between, is then recognised and not sent a second
+   time. The hash is that of the file as it is on the disk, before
+   any encoding. */
+static hashset_t* sensorbox_uploaded(sensorbox_t* box)
+{
+        char path[512];
+        if (box->uploaded == NULL) {
+                snprintf(path, 512, "%s/uploaded.set", box->home_dir);
+                path[511] = 0;
+                box->uploaded = new_hashset(path);
+        }
+        return box->uploaded;
+}
+
+/* Hashes the file. Returns 1 if the same content was uploaded
+   before, 0 if not, and -1 if the file can't be hashed. */
+static int sensorbox_was_uploaded(sensorbox_t* box, const char* filename, 
+                                  unsigned char* digest)
+{
+        if (sha256_file(filename, digest) != 0) {
+                log_warn("Sensorbox: Failed to hash %s", filename); 
+                return -1;
+        }
+        hashset_t* set = sensorbox_uploaded(box);
+        if (set == NULL)
+                return 0;
+        return (hashset_contains(set, digest) == 1)? 1 : 0;
+}
+
+/* Sends the hash with the next upload. */
+static void sensorbox_send_hash(sensorbox_t* box, const unsigned char* digest)
+{
+        char hex[SHA256_HEX_SIZE];
+        sha256_hex(digest, hex);
+        opensensordata_set_hash(box->osd, hex);
+}
+
+static void sensorbox_set_uploaded(sensorbox_t* box, const unsigned char* digest)
+{
+        hashset_t* set = sensorbox_uploaded(box);
+        if ((set == NULL) || (hashset_add(set, digest) != 0))
+                log_warn("Sensorbox: Failed to record the hash of the uploaded file"); 
+}
+
+/* Moves datapoints.csv, once uploaded, to the backup directory. */
+static void sensorbox_backup_datapoints(sensorbox_t* box, const char* filename)
+{
+        char backupfile[512];
+        char s[TIMESTAMP_MAXLEN];
+
+        timestamp_format(NULL, time(NULL), TIMESTAMP_COMPACT, s);
+        snprintf(backupfile, 512, "%s/backup/datapoints-%s.csv", box->home_dir, s);
+        backupfile[511] = 0;
+
+        log_info("Sensorbox: Copying datapoints to %s", backupfile);
+        
+        if (rename(filename, backupfile) == -1) {
+                log_err("Sensorbox: Failed to copy datapoints to %s", backupfile); 
+        }        
+}
+
+/* Converts the CSV file to the compact binary encoding and uploads
+   that instead. Falls back to the CSV file if the conversion
+   fails. */
+static int sensorbox_upload_encoded_data(sensorbox_t* box, const char* csvfile, long csvsize)
+{
+        char encfile[512];
+        struct stat buf;
+
+        snprintf(encfile, 512, "%s/datapoints.osdg", box->home_dir);
+        encfile[511] = 0;
+
+        int count = gorilla_encode_csv(csvfile, encfile);
+        if ((count <= 0) || (stat(encfile, &buf) == -1)) {
+                log_warn("Sensorbox: Failed to encode the datapoints, sending CSV"); 
+                unlink(encfile);
+                return opensensordata_put_datapoints(box->osd, csvfile);
+        }
+
+        log_info("Sensorbox: Encoded %d datapoints: %.2f bytes/datapoint (CSV: %.2f)", 
+                 count, (double) buf.st_size / count, (double) csvsize / count); 
+
+        int ret = opensensordata_put_encoded_datapoints(box->osd, encfile, GORILLA_MIME_TYPE);
+        unlink(encfile);
+        return ret;
+}
+
+/* Appends the datapoints in the binary log to datapoints.csv, the
+   format that is uploaded, and clears the log. */
+static int sensorbox_export_datalog(sensorbox_t* box, const char* filename)
+{
+        if (datalog_size(box->datalog) == 0)
+                return 0;
+
+        FILE* fp = fopen(filename, "a");
+        if (fp == NULL) {
+                log_err("Sensorbox: Failed to open %s", filename);
+                return -1;
+        }
+
+        int err = datalog_drain_csv(box->datalog, fp);
+        if (fclose(fp) != 0)
+                err = -1;
+
+        if (err != 0) {
+                log_err("Sensorbox: Failed to export the datapoints log");
+                return -1;
+        }
+
+        return 0;
+}
+
+int sensorbox_export_data(sensorbox_t* box, const char* filename)
+{
+        FILE* fp = stdout;
+        if ((filename != NULL) && (strcmp(filename, "-") != 0))
+                fp = fopen(filename, "w");
+        if (fp == NULL) {
+                log_err("Sensorbox: Failed to open %s", filename);
+                return -1;
+        }
+        int err = datalog_export_csv(box->datalog, fp);
+        if ((err == 0) && (box->staged != NULL))
+                err = datalog_export_csv(box->staged, fp);
+        if (fp != stdout)
+                fclose(fp);
+        return err;
+}
+
+/* The rollup tier that is uploaded instead of the datapoints, as
+   set by opensensordata.rollup (600, 3600 or 86400 seconds), or -1
+   to upload the datapoints. */
+static int sensorbox_upload_tier(sensorbox_t* box)
+{
+        const char* s = json_getstr(box->config, "opensensordata.rollup");
+        if ((s == NULL) || (atoi(s) == 0))
+                return -1;
+        int tier = rollup_tier(atoi(s));
+        if (tier < 0)
+                log_warn("Sensorbox: Invalid rollup: %s", s);
+        return tier;
+}
+
+/* Writes the rollups that weren't uploaded yet to filename. Returns
+   the number of lines. */
+static int sensorbox_export_rollups(sensorbox_t* box, int tier, const char* filename)
+{
+        FILE* fp = fopen(filename, "w");
+        if (fp == NULL) {
+                log_err("Sensorbox: Failed to open %s", filename);
+                return -1;
+        }
+        int lines = rollup_export_csv(box->rollup, tier, fp);
+        if (fclose(fp) != 0)
+                lines = -1;
+        return lines;
+}
+
 void sensorbox_upload_data(sensorbox_t* box)
 {
         struct stat buf;
+        char rollupfile[512];
+        unsigned char digest[SHA256_SIZE];
 
         char* filename = sensorbox_path(box, "datapoints.csv");
 
+        if (!box->test) {
+                /* A file that was sent but not moved to the backup
+                   must go before new datapoints are appended to
+                   it. */
+                if ((stat(filename, &buf) == 0) 
+                    && (sensorbox_was_uploaded(box, filename, digest) == 1)) {
+                        log_info("Sensorbox: The datapoints were already uploaded");
+                        sensorbox_backup_datapoints(box, filename);
+                }
+                sensorbox_flush_staging(box);
+                sensorbox_export_datalog(box, filename);
+        }
+
         if (stat(filename, &buf) == -1) {
                 log_debug("Sensorbox: No datapoints to upload");
                 return;
@@ -960,6 +1450,29 @@ void sensorbox_upload_data(sensorbox_t* box)
                 return;
         }
 
+        /* With rollups, only the summaries are sent. The
+           datapoints are kept in the backup. */
+        const char* upload_file = filename;
+        int tier = sensorbox_upload_tier(box);
+        if (tier >= 0) {
+                snprintf(rollupfile, 512, "%s/rollups.csv", box->home_dir);
+                rollupfile[511] = 0;
+                if (sensorbox_export_rollups(box, tier, rollupfile) <= 0) {
+                        log_debug("Sensorbox: No rollups to upload");
+                        unlink(rollupfile);
+                        return;
+                }
+                if (stat(rollupfile, &buf) == -1) 
+                        return;
+                upload_file = rollupfile;
+        }
+
+        int hashed = sensorbox_was_uploaded(box, upload_file, digest);
+        if (hashed == 1) {
+                log_info("Sensorbox: The datapoints were already uploaded");
+                goto uploaded;
+        }
+
         log_info("Sensorbox: Uploading datapoints (filesize=%d)", (int) buf.st_size); 
 
         if (sensorbox_bring_network_up(box) != 0) {
@@ -967,7 +1480,23 @@ void sensorbox_upload_data(sensorbox_t* box)
                 return;
         }
 
-        int ret = opensensordata_put_datapoints(box->osd, filename);
+        int ret;
+        if (hashed == 0)
+                sensorbox_send_hash(box, digest);
+        const char* encoding = json_getstr(box->config, "opensensordata.encoding");
+        if ((encoding != NULL) && (strcmp(encoding, "gorilla") == 0))
+                ret = sensorbox_upload_encoded_data(box, upload_file, (long) buf.st_size);
+        else
+                ret = opensensordata_put_datapoints(box->osd, upload_file);
+        opensensordata_set_hash(box->osd, NULL);
+        uplink_consume(box->uplink, UPLINK_DATAPOINTS, 
+                       opensensordata_get_transferred(box->osd));
+        uplink_save(box->uplink);
+
+        live_t* live = sensorbox_live(box);
+        if (live)
+                live_set_status(live, LIVE_DATA_UPLOAD, time(NULL), (ret == 0)? 0 : -1);
+
         if (ret != 0) {
                 log_err("Sensorbox: Uploading of datapoints failed"); 
                 char* resp = opensensordata_get_response(box->osd);
@@ -978,42 +1507,152 @@ void sensorbox_upload_data(sensorbox_t* box)
 
         log_info("Sensorbox: Upload successful"); 
 
-        char backupfile[512];
-        struct timeval tv;
-        struct tm r;
+        if (hashed == 0)
+                sensorbox_set_uploaded(box, digest);
 
-        gettimeofday(&tv, NULL);
-        localtime_r(&tv.tv_sec, &r);
-        snprintf(backupfile, 512, "%s/backup/datapoints-%04d%02d%02d-%02d%02d%02d.csv",
-                 box->home_dir,
-                 1900 + r.tm_year, 1 + r.tm_mon, r.tm_mday, 
-                 r.tm_hour, r.tm_min, r.tm_sec);
-        backupfile[511] = 0;
+ uploaded:
+        if (tier >= 0) {
+                rollup_commit_export(box->rollup, tier);
+                unlink(rollupfile);
+        }
 
-        log_info("Sensorbox: Copying datapoints to %s", backupfile);
-        
-        if (rename(filename, backupfile) == -1) {
-                log_err("Sensorbox: Failed to copy datapoints to %s", backupfile); 
-        }        
+        sensorbox_backup_datapoints(box, filename);
 }
 
-void sensorbox_upload_photos(sensorbox_t* box)
+/* Uploads the imported datapoints in the replay queue, one day at a
+   time and oldest first. They come after the new datapoints and
+   only use what is left of the uplink budget. A day that was sent
+   goes to the backup directory. */
+void sensorbox_upload_replay(sensorbox_t* box)
 {
-        DIR *dir;
-        struct dirent *entry;
         struct stat buf;
+        char dirname[512];
         char filename[512];
         char backupfile[512];
+        char s[TIMESTAMP_MAXLEN];
+        unsigned char digest[SHA256_SIZE];
+        time_t start;
+        int count;
+        int uploaded = 0;
+        int ret = 0;
+
+        snprintf(dirname, 512, "%s/replay", box->home_dir);
+        dirname[511] = 0;
+        if (stat(dirname, &buf) == -1)
+                return;
 
-        char* dirname = sensorbox_path(box, "photostream");
-        
-        dir = opendir(dirname);
-        if (dir == NULL) {
-                log_err("Sensorbox: Failed to open the photo directory '%s'", dirname);
+        /* The day files are named YYYYMMDD.csv, so the oldest come
+           first. */
+        char** names = sensorbox_list_photos(dirname, &count);
+        if (count == 0) {
+                if (names)
+                        free(names);
                 return;
         }
 
-        int count = 0;
+        if (!box->test && (sensorbox_bring_network_up(box) != 0)) {
+                log_err("Sensorbox: Failed to bring the network up");
+                goto cleanup;
+        }
+
+        const char* encoding = json_getstr(box->config, "opensensordata.encoding");
+
+        for (int i = 0; i < count; i++) {
+                if (!import_queue_day(names[i], &start)
+                    || (sensorbox_join(filename, 512, dirname, names[i]) != 0))
+                        continue;
+
+                long size = sensorbox_filesize(filename);
+
+                long remaining = uplink_remaining(box->uplink);
+                if ((remaining != -1) && (size > remaining)) {
+                        log_info("Sensorbox: Deferring the imported datapoints: "
+                                 "uplink budget exhausted");
+                        uplink_defer(box->uplink, UPLINK_DATAPOINTS);
+                        break;
+                }
+
+                if (box->test) {
+                        log_info("Sensorbox: Uploading imported datapoints '%s' (filesize=%ld)",
+                                 filename, size);
+                        continue;
+                }
+
+                int hashed = sensorbox_was_uploaded(box, filename, digest);
+                if (hashed == 1) {
+                        log_info("Sensorbox: The imported datapoints '%s' were already uploaded",
+                                 filename);
+                } else {
+                        log_info("Sensorbox: Uploading imported datapoints '%s' (filesize=%ld)",
+                                 filename, size);
+                        if (hashed == 0)
+                                sensorbox_send_hash(box, digest);
+                        if ((encoding != NULL) && (strcmp(encoding, "gorilla") == 0))
+                                ret = sensorbox_upload_encoded_data(box, filename, size);
+                        else
+                                ret = opensensordata_put_datapoints(box->osd, filename);
+                        opensensordata_set_hash(box->osd, NULL);
+                        uplink_consume(box->uplink, UPLINK_DATAPOINTS, 
+                                       opensensordata_get_transferred(box->osd));
+                        if (ret != 0) {
+                                log_err("Sensorbox: Uploading of imported datapoints failed"); 
+                                char* resp = opensensordata_get_response(box->osd);
+                                if (resp) 
+                                        log_err("%s", resp); 
+                                break;
+                        }
+                        if (hashed == 0)
+                                sensorbox_set_uploaded(box, digest);
+                        uploaded++;
+                }
+
+                /* The upload time goes first, as for the other
+                   datapoints files, and the day second. */
+                timestamp_format(NULL, time(NULL), TIMESTAMP_COMPACT, s);
+                snprintf(backupfile, 512, "%s/backup/datapoints-%s-%.8s.csv", 
+                         box->home_dir, s, names[i]);
+                backupfile[511] = 0;
+                if (rename(filename, backupfile) == -1)
+                        log_err("Sensorbox: Failed to copy datapoints to %s", backupfile); 
+        }
+
+        if (!box->test && ((uploaded > 0) || (ret != 0))) {
+                live_t* live = sensorbox_live(box);
+                if (live)
+                        live_set_status(live, LIVE_DATA_UPLOAD, time(NULL), (ret == 0)? 0 : -1);
+        }
+
+ cleanup:
+        uplink_save(box->uplink);
+        for (int i = 0; i < count; i++)
+                free(names[i]);
+        free(names);
+}
+
+static int sensorbox_compare_names(const void* a, const void* b)
+{
+        return strcmp(*(const char**) a, *(const char**) b);
+}
+
+/* The photo names are timestamps, so sorting them by name puts the
+   oldest photos first. The caller must free the list and the names. */
+static char** sensorbox_list_photos(const char* dirname, int* count)
+{
+        DIR *dir;
+        struct dirent *entry;
+        struct stat buf;
+        char filename[512];
+        char** names = NULL;
+        int len = 0;
+
+        *count = 0;
+
+        dir = opendir(dirname);
+        if (dir == NULL) {
+                log_err("Sensorbox: Failed to open the photo directory '%s'", dirname);
+                return NULL;
+        }
+
         while ((entry = readdir(dir)) != NULL) {
                 snprintf(filename, 511, "%s/%s", dirname, entry->d_name);
                 filename[511] = 0;
@@ -1023,51 +1662,487 @@ void sensorbox_upload_photos(sensorbox_t* box)
                     || (buf.st_size == 0))
                         continue;
 
-                count++;
+                if (*count >= len) {
+                        len = (len == 0)? 16 : 2 * len;
+                        char** p = (char**) realloc(names, len * sizeof(char*));
+                        if (p == NULL) {
+                                log_err("Sensorbox: out of memory");
+                                break;
+                        }
+                        names = p;
+                }
+                names[(*count)++] = strdup(entry->d_name);
+        }
+        
+        closedir(dir);
+
+        if (*count > 0)
+                qsort(names, *count, sizeof(char*), sensorbox_compare_names);
+
+        return names;
+}
+
+/* The staging area is set by staging.dir in the config, normally a
+   directory on tmpfs. The datapoints and photos are kept there and
+   written to the SD card in one go: before the uploads, before a
+   poweroff, and when the staged data reaches staging.flush kB. The
+   file staging.txt in the home directory tells that there is
+   staged data, so that its loss (a power cut, a reboot) is noticed
+   at the next start. If the directory can't be used, the data goes
+   to the SD card directly. */
+static int sensorbox_init_staging(sensorbox_t* box)
+{
+        char path[512];
+
+        const char* dir = json_getstr(box->config, "staging.dir");
+        if ((dir == NULL) || (dir[0] == 0))
+                return 0;
+
+        box->staging_threshold = 512 * 1024;
+        const char* s = json_getstr(box->config, "staging.flush");
+        if ((s != NULL) && (atol(s) > 0))
+                box->staging_threshold = 1024 * atol(s);
+
+        snprintf(path, 512, "%s/photostream", dir);
+        path[511] = 0;
+        if (((mkdir(dir, 0755) != 0) && (errno != EEXIST))
+            || ((mkdir(path, 0755) != 0) && (errno != EEXIST))) {
+                log_err("Sensorbox: Can't use the staging directory '%s'", dir);
+                return -1;
+        }
+
+        snprintf(path, 512, "%s/datapoints", dir);
+        path[511] = 0;
+        box->staged = new_datalog(path);
+        if (box->staged == NULL)
+                return -1;
+        box->staging_dir = strdup(dir);
+
+        return 0;
+}
+
+/* Checks the staging area after a restart: tells if the staged data
+   was lost, and truncates what a power cut left of the last
+   download. */
+static void sensorbox_recover_staging(sensorbox_t* box)
+{
+        if (box->staged == NULL)
+                return;
+
+        datalog_recover(box->staged);
+
+        char* marker = sensorbox_path(box, "staging.txt");
+        FILE* fp = fopen(marker, "r");
+        if (fp != NULL) {
+                long since = 0;
+                if (fscanf(fp, "%ld", &since) != 1)
+                        since = 0;
+                fclose(fp);
+                if (sensorbox_staging_size(box) == 0) {
+                        time_t t = (time_t) since;
+                        char* date = ctime(&t);
+                        log_err("Sensorbox: The staged data since %.24s was lost", 
+                                (date != NULL)? date : "?");
+                        unlink(marker);
+                }
+        }
+}
+
+static int sensorbox_lock_staging(sensorbox_t* box)
+{
+        char path[512];
+
+        snprintf(path, 512, "%s/lock", box->staging_dir);
+        path[511] = 0;
+
+        int fd = open(path, O_CREAT | O_RDWR, 0666);
+        if (fd == -1) {
+                log_err("Sensorbox: Failed to open %s", path);
+                return -1;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+static void sensorbox_unlock_staging(sensorbox_t* box, int fd)
+{
+        flock(fd, LOCK_UN);
+        close(fd);
+}
+
+static long sensorbox_staging_size(sensorbox_t* box)
+{
+        char dirname[512];
+        char filename[512];
+        int count;
+
+        long size = datalog_size(box->staged);
+
+        snprintf(dirname, 512, "%s/photostream", box->staging_dir);
+        dirname[511] = 0;
+        char** names = sensorbox_list_photos(dirname, &count);
+        for (int i = 0; i < count; i++) {
+                if (sensorbox_join(filename, 512, dirname, names[i]) == 0) {
+                        long n = sensorbox_filesize(filename);
+                        if (n > 0)
+                                size += n;
+                }
+                free(names[i]);
+        }
+        if (names)
+                free(names);
+
+        return size;
+}
+
+/* Returns the time in the file, or 0. */
+static time_t sensorbox_read_mark(const char* path)
+{
+        long t = 0;
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL)
+                return 0;
+        if (fscanf(fp, "%ld", &t) != 1)
+                t = 0;
+        fclose(fp);
+        return (time_t) t;
+}
+
+/* Replaces the file, through a rename so that a crash leaves the
+   old or the new time. */
+static void sensorbox_write_mark(const char* path, time_t t, int sync)
+{
+        char tmp[512];
+
+        snprintf(tmp, 512, "%s.tmp", path);
+        tmp[511] = 0;
+        FILE* fp = fopen(tmp, "w");
+        if (fp == NULL) {
+                log_err("Sensorbox: Failed to create %s", tmp);
+                return;
+        }
+        int err = (fprintf(fp, "%ld\n", (long) t) < 0) || (fflush(fp) != 0);
+        if (sync && !err)
+                err = (fsync(fileno(fp)) != 0);
+        if ((fclose(fp) != 0) || err || (rename(tmp, path) != 0)) {
+                log_err("Sensorbox: Failed to write %s", path);
+                unlink(tmp);
+        }
+}
+
+/* Called after new data was staged. */
+static void sensorbox_staged(sensorbox_t* box, time_t t)
+{
+        char* marker = sensorbox_path(box, "staging.txt");
+        struct stat buf;
+
+        if (stat(marker, &buf) != 0) {
+                FILE* fp = fopen(marker, "w");
+                if (fp != NULL) {
+                        fprintf(fp, "%ld\n", (long) t);
+                        fflush(fp);
+                        fsync(fileno(fp));
+                        fclose(fp);
+                }
+        }
+
+        if (sensorbox_staging_size(box) >= box->staging_threshold) {
+                log_info("Sensorbox: Staged data above %ld kB", 
+                         box->staging_threshold / 1024);
+                sensorbox_flush_staging(box);
         }
+}
 
+/* Copies a staged photo to the SD card with a single write. */
+static int sensorbox_flush_photo(const char* from, const char* to, long* bytes)
+{
+        unsigned char* data;
+        long size;
+
+        if (sensorbox_read_file(from, &data, &size) != 0)
+                return -1;
+
+        int fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                log_err("Sensorbox: Failed to create %s", to);
+                free(data);
+                return -1;
+        }
+        int err = ((write(fd, data, size) != size) || (fdatasync(fd) != 0));
+        if (close(fd) != 0)
+                err = 1;
+        free(data);
+        if (err) {
+                log_err("Sensorbox: Failed to write %s", to);
+                unlink(to);
+                return -1;
+        }
+        *bytes += size;
+        return 0;
+}
+
+int sensorbox_flush_staging(sensorbox_t* box)
+{
+        char dirname[512];
+        char todir[512];
+        char from[512];
+        char to[512];
+        datalog_stats_t before, after;
+        long bytes = 0;
+        int count;
+        int moved = 0;
+        int err = 0;
+
+        if (box->staged == NULL)
+                return 0;
+
+        int lock = sensorbox_lock_staging(box);
+        if (lock == -1)
+                return -1;
+
+        datalog_get_stats(box->datalog, &before);
+        if (datalog_move(box->staged, box->datalog) != 0) {
+                err = -1;
+        } else {
+                /* The frames taken off the Arduino's stack so far
+                   are now on the SD card. */
+                snprintf(from, 512, "%s/stack.txt", box->staging_dir);
+                from[511] = 0;
+                time_t staged = sensorbox_read_mark(from);
+                if (staged > sensorbox_read_mark(sensorbox_path(box, "stack.txt")))
+                        sensorbox_write_mark(sensorbox_path(box, "stack.txt"), staged, 1);
+        }
+        datalog_get_stats(box->datalog, &after);
+
+        snprintf(dirname, 512, "%s/photostream", box->staging_dir);
+        dirname[511] = 0;
+        snprintf(todir, 512, "%s/photostream", box->home_dir);
+        todir[511] = 0;
+        char** names = sensorbox_list_photos(dirname, &count);
+        for (int i = 0; i < count; i++) {
+                if ((sensorbox_join(from, 512, dirname, names[i]) != 0)
+                    || (sensorbox_join(to, 512, todir, names[i]) != 0)
+                    || (sensorbox_flush_photo(from, to, &bytes) != 0)) {
+                        err = -1;
+                        break;
+                }
+                moved++;
+        }
+
+        /* The staged photos are removed once their new directory
+           entries are on the disk. */
+        if (moved > 0) {
+                int fd = open(todir, O_RDONLY);
+                if (fd != -1) {
+                        fsync(fd);
+                        close(fd);
+                }
+                for (int i = 0; i < moved; i++) {
+                        if (sensorbox_join(from, 512, dirname, names[i]) == 0)
+                                unlink(from);
+                }
+        }
+        for (int i = 0; i < count; i++)
+                free(names[i]);
+        if (names)
+                free(names);
+
+        if (err == 0)
+                unlink(sensorbox_path(box, "staging.txt"));
+
+        sensorbox_unlock_staging(box, lock);
+
+        long writes = (after.writes - before.writes) + moved;
+        bytes += after.bytes_written - before.bytes_written;
+        if (writes > 0)
+                log_info("Sensorbox: Flushed the staging area: %d photos, "
+                         "%ld bytes in %ld writes", moved, bytes, writes);
+
+        return err;
+}
+
+static long sensorbox_filesize(const char* filename)
+{
+        struct stat buf;
+        if (stat(filename, &buf) == -1)
+                return -1;
+        return (long) buf.st_size;
+}
+
+/* Sends a reduced copy of the photo. The full photo stays on
+   the disk until there is enough budget left to send it. */
+static void sensorbox_upload_thumbnail(sensorbox_t* box, 
+                                       int photostream, 
+                                       const char* id, 
+                                       const char* filename)
+{
+        char thumbid[512];
+        char thumbfile[512];
+
+        if (uplink_has_thumbnail(box->uplink, id))
+                return;
+
+        snprintf(thumbid, 512, "thumb-%s", id);
+        thumbid[511] = 0;
+        snprintf(thumbfile, 512, "%s/thumbnail.jpg", box->home_dir);
+        thumbfile[511] = 0;
+
+        /* The thumbnail has a sixteenth of the pixels of the photo.
+           Don't spend the time to decode the photo if even that
+           share of it doesn't fit in the budget. The size of the
+           thumbnail itself is checked below. */
+        long estimate = sensorbox_filesize(filename) / 16;
+        if (!uplink_allow(box->uplink, UPLINK_THUMBNAILS, estimate)) {
+                uplink_defer(box->uplink, UPLINK_THUMBNAILS);
+                return;
+        }
+
+        if (camera_thumbnail(filename, thumbfile, 4, 60) != 0)
+                return;
+
+        long size = sensorbox_filesize(thumbfile);
+        if (!uplink_allow(box->uplink, UPLINK_THUMBNAILS, size)) {
+                uplink_defer(box->uplink, UPLINK_THUMBNAILS);
+                unlink(thumbfile);
+                return;
+        }
+
+        log_info("Sensorbox: Uploading thumbnail '%s'", thumbid);
+
+        int err = opensensordata_put_photo(box->osd, photostream, thumbid, thumbfile);
+        uplink_consume(box->uplink, UPLINK_THUMBNAILS, 
+                       opensensordata_get_transferred(box->osd));
+        if (err != 0) {
+                log_err("Sensorbox: Uploading of thumbnail failed"); 
+        } else {
+                uplink_set_thumbnail(box->uplink, id);
+        }
+
+        unlink(thumbfile);
+}
+
+void sensorbox_upload_photos(sensorbox_t* box)
+{
+        char dirname[512];
+        char filename[512];
+        char backupfile[512];
+        unsigned char* digests = NULL;
+        char* hashed = NULL;
+        int count;
+        int uploaded = 0;
+        int failed = 0;
+
+        if (!box->test)
+                sensorbox_flush_staging(box);
+
+        snprintf(dirname, 512, "%s/photostream", box->home_dir);
+        dirname[511] = 0;
+
+        char** names = sensorbox_list_photos(dirname, &count);
         if (count == 0) {
-                closedir(dir);
+                if (names)
+                        free(names);
                 return;
         }
 
         log_info("Sensorbox: Found %d %s on the disk", 
                  count, (count == 1)? "photo" : "photos");
 
+        /* Photos that were uploaded before but are still here, after
+           a failed rename, go straight to the backup. */
+        digests = (unsigned char*) malloc(count * SHA256_SIZE);
+        hashed = (char*) malloc(count);
+        if ((digests == NULL) || (hashed == NULL)) {
+                log_err("Sensorbox: out of memory");
+                failed = count;
+                goto cleanup;
+        }
+        if (!box->test) {
+                int n = 0;
+                for (int i = 0; i < count; i++) {
+                        unsigned char* digest = digests + n * SHA256_SIZE;
+                        int r = -1;
+                        if (sensorbox_join(filename, 512, dirname, names[i]) == 0)
+                                r = sensorbox_was_uploaded(box, filename, digest);
+                        if (r == 1) {
+                                log_info("Sensorbox: Photo '%s' was already uploaded", filename);
+                                uplink_clear_thumbnail(box->uplink, names[i]);
+                                snprintf(backupfile, 512, "%s/backup/%s", box->home_dir, names[i]);
+                                backupfile[511] = 0;
+                                if (rename(filename, backupfile) == -1)
+                                        log_err("Sensorbox: Failed to copy photo to %s", backupfile); 
+                                free(names[i]);
+                        } else {
+                                hashed[n] = (r == 0);
+                                names[n++] = names[i];
+                        }
+                }
+                count = n;
+                if (count == 0)
+                        goto cleanup;
+        }
+
         int photostream = opensensordata_get_datastream_id(box->osd, "webcam");
         
         if (sensorbox_bring_network_up(box) != 0) {
                 log_err("Sensorbox: Failed to bring the network up");
-                return;
+                failed = count;
+                goto cleanup;
         }
 
-        rewinddir(dir);
+        /* With a limited uplink, first send a thumbnail of every
+           photo so that the time series stays complete, then use
+           what is left of the budget for the full photos. */
+        if (uplink_limited(box->uplink) && !box->test) {
+                for (int i = 0; i < count; i++) {
+                        if (sensorbox_join(filename, 512, dirname, names[i]) == 0)
+                                sensorbox_upload_thumbnail(box, photostream, names[i], filename);
+                }
+        }
 
-        while ((entry = readdir(dir)) != NULL) {
-                snprintf(filename, 511, "%s/%s", dirname, entry->d_name);
-                filename[511] = 0;
-        
-                if ((stat(filename, &buf) == -1)
-                    || ((buf.st_mode & S_IFMT) != S_IFREG)
-                    || (buf.st_size == 0))
+        for (int i = 0; i < count; i++) {
+                if (sensorbox_join(filename, 512, dirname, names[i]) != 0) {
+                        failed++;
+                        continue;
+                }
+
+                if (!uplink_allow(box->uplink, UPLINK_PHOTOS, sensorbox_filesize(filename))) {
+                        log_info("Sensorbox: Deferring photo '%s': uplink budget exhausted", 
+                                 filename);
+                        uplink_defer(box->uplink, UPLINK_PHOTOS);
                         continue;
+                }
 
                 log_info("Sensorbox: Uploading photo '%s'", filename);
 
                 if (box->test)
                         continue;
 
+                if (hashed[i])
+                        sensorbox_send_hash(box, digests + i * SHA256_SIZE);
                 int err = opensensordata_put_photo(box->osd, photostream, 
-                                                   entry->d_name, filename);
+                                                   names[i], filename);
+                opensensordata_set_hash(box->osd, NULL);
+                uplink_consume(box->uplink, UPLINK_PHOTOS, 
+                               opensensordata_get_transferred(box->osd));
                 if (err != 0) {
                         log_err("Sensorbox: Uploading of photo failed"); 
                         char* resp = opensensordata_get_response(box->osd);
                         if (resp) 
                                 log_err("%s", resp); 
+                        failed++;
                         continue;
                 }
 
-                snprintf(backupfile, 512, "%s/backup/%s", box->home_dir, entry->d_name);
+                uploaded++;
+                if (hashed[i])
+                        sensorbox_set_uploaded(box, digests + i * SHA256_SIZE);
+                uplink_clear_thumbnail(box->uplink, names[i]);
+
+                snprintf(backupfile, 512, "%s/backup/%s", box->home_dir, names[i]);
                 backupfile[511] = 0;
 
                 log_info("Sensorbox: Copying photo to %s", backupfile);
@@ -1077,7 +2152,20 @@ void sensorbox_upload_photos(sensorbox_t* box)
                 }
         }
         
-        closedir(dir);
+ cleanup:
+        uplink_save(box->uplink);
+        if (uploaded + failed > 0) {
+                live_t* live = sensorbox_live(box);
+                if (live)
+                        live_set_status(live, LIVE_PHOTO_UPLOAD, time(NULL), (failed == 0)? 0 : -1);
+        }
+        for (int i = 0; i < count; i++)
+                free(names[i]);
+        free(names);
+        if (digests)
+                free(digests);
+        if (hashed)
+                free(hashed);
 }
 
 int sensorbox_powersaving_enabled(sensorbox_t* box)
@@ -1153,10 +2241,16 @@ void sensorbox_poweroff_maybe(sensorbox_t* box)
         }
 
         if ((delta > 3) && (uptime > 180)) {
-                if (box->test) 
+                if (box->test) {
                         printf("POWEROFF %d\n", delta - 3);
-                else
+                } else {
+                        /* Let the uploads finish (or time out)
+                           before cutting the power. */
+                        sensorbox_wait_uploads(box);
+                        sensorbox_update_rtc_maybe(box);
+                        sensorbox_flush_staging(box);
                         sensorbox_poweroff(box, delta - 3);
+                }
         } else if (delta <= 3) {
                 log_info("Not powering off, next event is coming soon");
         } else if (uptime <= 180) {
@@ -1243,6 +2337,35 @@ int sensorbox_run_ntp(sensorbox_t* box)
         return ret;
 }
 
+#define RTC_NOTE "/tmp/sensorbox-ntp"
+
+/* The system clock was just set by NTP. The upload worker has no
+   access to the Arduino, so it leaves a note and the process that
+   holds the lock sets the Arduino's clock later. */
+static void sensorbox_update_rtc(sensorbox_t* box)
+{
+        if (box->arduino != NULL) {
+                sensorbox_set_time(box, time(NULL));
+                unlink(RTC_NOTE);
+                return;
+        }
+        int fd = open(RTC_NOTE, O_CREAT | O_WRONLY, 0666);
+        if (fd == -1) {
+                log_warn("Sensorbox: Failed to create %s", RTC_NOTE);
+                return;
+        }
+        close(fd);
+}
+
+static void sensorbox_update_rtc_maybe(sensorbox_t* box)
+{
+        if ((box->arduino == NULL) || (access(RTC_NOTE, F_OK) != 0))
+                return;
+        log_info("Sensorbox: Setting the Arduino's clock to the NTP time");
+        if (sensorbox_set_time(box, time(NULL)) == 0)
+                unlink(RTC_NOTE);
+}
+
 int sensorbox_bring_network_up_and_run_ntp(sensorbox_t* box)
 {
         if (config_iface_enabled(box->config, "eth0"))
@@ -1260,7 +2383,7 @@ int sensorbox_bring_network_up_and_run_ntp(sensorbox_t* box)
         }
         
         if (sensorbox_run_ntp(box) == 0)
-                sensorbox_set_time(box, time(NULL)); 
+                sensorbox_update_rtc(box);
 
         return 0;
 }
@@ -1308,7 +2431,7 @@ void sensorbox_bring_network_up_maybe(sensorbox_t* box)
                 }
                 
                 if (sensorbox_run_ntp(box) == 0)
-                        sensorbox_set_time(box, time(NULL)); 
+                        sensorbox_update_rtc(box);
         }
 }
 
@@ -1323,9 +2446,165 @@ int sensorbox_lock(sensorbox_t* box)
                 return -1;
         }
         box->lock = fd;
+
+        /* Only the process that holds the lock repairs what an
+           unclean shutdown left. Until then, the stores are only
+           read. */
+        datalog_recover(box->datalog);
+        sensorbox_recover_staging(box);
+        rollup_recover(box->rollup);
+
         return 0;
 }
 
+#define UPLOAD_LOCK "/tmp/sensorbox-upload.lock"
+
+/* Returns the file descriptor of the upload lock, or -1 if another
+   process holds it. The lock file is never removed, so that all
+   processes always lock the same file. */
+static int sensorbox_lock_uploads(sensorbox_t* box) 
+{
+        int fd;
+        if ((fd = open(UPLOAD_LOCK, O_CREAT | O_RDWR, 0666))  < 0) {
+                log_err("Sensorbox: Failed to open %s", UPLOAD_LOCK);
+                return -1;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+int sensorbox_begin_uploads(sensorbox_t* box)
+{
+        if (box->upload_lock != -1)
+                return 0;
+        box->upload_lock = sensorbox_lock_uploads(box);
+        if (box->upload_lock == -1) {
+                log_warn("Sensorbox: An upload is in progress");
+                return -1;
+        }
+        /* The previous upload may have spent some of the budget
+           since the state was loaded. */
+        uplink_reload(box->uplink);
+        return 0;
+}
+
+void sensorbox_end_uploads(sensorbox_t* box)
+{
+        if (box->upload_lock == -1)
+                return;
+        flock(box->upload_lock, LOCK_UN);
+        close(box->upload_lock);
+        box->upload_lock = -1;
+}
+
+void sensorbox_upload(sensorbox_t* box)
+{
+        /* In order of priority: the uplink budget is spent on the
+           datapoints first, then the status, then the photos. */
+        sensorbox_upload_data(box);
+        sensorbox_upload_replay(box);
+        sensorbox_upload_status(box); // Only runs if network is up
+        sensorbox_upload_photos(box);
+
+        /* Roll what was just backed up into the archives. */
+        sensorbox_compact_backup(box);
+}
+
+static void sensorbox_upload_worker(sensorbox_t* box)
+{
+        /* The child inherited the main lock and the devices. It must
+           leave the first to the parent and not touch the others:
+           the Arduino is dropped without talking to it, since the
+           parent keeps using the I2C bus. */
+        close(box->lock);
+        box->lock = -1;
+        box->arduino = NULL;
+        box->use_arduino_time = 0;
+
+        /* The worker gets killed if it overruns its deadline. The
+           upload lock goes with it. */
+        alarm(box->upload_deadline);
+
+        /* The state of the budget is read again now that the
+           worker holds the upload lock: an earlier worker may have
+           saved it after this process was started. */
+        uplink_reload(box->uplink);
+
+        sensorbox_upload(box);
+
+        /* Bring the network down, if not needed (particularly
+           GSM). */
+        sensorbox_bring_network_down_maybe(box);
+
+        log_info("Sensorbox: Upload worker done");
+        fflush(NULL);
+        _exit(0);
+}
+
+int sensorbox_start_uploads(sensorbox_t* box)
+{
+        int fd = sensorbox_lock_uploads(box);
+        if (fd == -1) {
+                log_info("Sensorbox: Previous upload still in progress");
+                return 0;
+        }
+
+        fflush(NULL);
+        pid_t pid = fork();
+
+        if (pid == -1) {
+                log_err("Sensorbox: fork failed: %s", strerror(errno));
+                close(fd);
+                return -1;
+
+        } else if (pid == 0) {
+                sensorbox_upload_worker(box);
+                /* not reached */
+                _exit(0);
+        }
+
+        /* The lock stays held through the child's copy of the file
+           descriptor until the worker exits. */
+        close(fd);
+        box->upload_worker = pid;
+        log_info("Sensorbox: Started upload worker (pid %d)", (int) pid);
+
+        return 0;
+}
+
+void sensorbox_wait_uploads(sensorbox_t* box)
+{
+        int fd = -1;
+
+        for (int i = 0; i <= box->upload_deadline; i++) {
+                if (box->upload_worker > 0) 
+                        if (waitpid(box->upload_worker, NULL, WNOHANG) == box->upload_worker)
+                                box->upload_worker = -1;
+                fd = sensorbox_lock_uploads(box);
+                if (fd != -1) 
+                        break;
+                if (i == 0)
+                        log_info("Sensorbox: Waiting for the uploads to finish");
+                sleep(1);
+        }
+
+        if (fd == -1) {
+                log_warn("Sensorbox: Uploads did not finish in time");
+                if (box->upload_worker > 0) {
+                        kill(box->upload_worker, SIGKILL);
+                        waitpid(box->upload_worker, NULL, 0);
+                        box->upload_worker = -1;
+                }
+                return;
+        }
+
+        flock(fd, LOCK_UN);
+        close(fd);
+}
+
 void sensorbox_unlock(sensorbox_t* box) 
 {
         if (box->lock == -1)
@@ -1470,6 +2749,9 @@ void sensorbox_measure(sensorbox_t* box)
         datapoint_t* datapoints = arduino_measure(box->arduino, &num_points);
 
         printf("number of datapoints : %d\n", num_points);
+
+        if (datapoints)
+                sensorbox_publish_datapoints(box, datapoints, num_points);
                 
         for (int i = 0; i < num_points; i++) {
                 if (box->datastreams[datapoints[i].datastream].osd_id == -1)
@@ -1831,6 +3113,35 @@ void sensorbox_update_ssh(sensorbox_t* box)
                 sensorbox_install_authorized_keys(box);
 }
 
+/* Returns the number after the label in the output of rsync
+   --stats, or -1. The digits may be grouped with commas or dots. */
+static long sensorbox_rsync_stat(const char* stats, const char* label)
+{
+        const char* s = strstr(stats, label);
+        if (s == NULL)
+                return -1;
+        s += strlen(label);
+        while (*s == ' ')
+                s++;
+        if (!isdigit((unsigned char) *s))
+                return -1;
+        long n = 0;
+        for ( ; isdigit((unsigned char) *s) || (*s == ',') || (*s == '.'); s++)
+                if (isdigit((unsigned char) *s))
+                        n = 10 * n + (*s - '0');
+        return n;
+}
+
+/* The bytes that went over the link, both ways, or -1. */
+static long sensorbox_rsync_bytes(const char* stats)
+{
+        long sent = sensorbox_rsync_stat(stats, "Total bytes sent:");
+        long received = sensorbox_rsync_stat(stats, "Total bytes received:");
+        if ((sent < 0) || (received < 0))
+                return -1;
+        return sent + received;
+}
+
 int sensorbox_upload_status(sensorbox_t* box)
 {
         // FIXME: find to way to upload only once a day.
@@ -1838,6 +3149,17 @@ int sensorbox_upload_status(sensorbox_t* box)
         if (!network_connected())
                 return 0;
 
+        /* rsync only sends the differences, compressed, so the
+           size of the log file is an upper bound of the transfer. */
+        long size = sensorbox_filesize("/var/p2pfoodlab/log.txt");
+        char stats[4096];
+        if (!uplink_allow(box->uplink, UPLINK_STATUS, size)) {
+                log_info("Sensorbox: Deferring the log file upload: uplink budget exhausted");
+                uplink_defer(box->uplink, UPLINK_STATUS);
+                uplink_save(box->uplink);
+                return 0;
+        }
+
         log_info("Sensorbox: Uploading log file");
 
         char remote_name[512];
@@ -1847,14 +3169,488 @@ int sensorbox_upload_status(sensorbox_t* box)
                  json_getstr(box->config, "opensensordata.key"));
         
         char* const argv[] = { "/usr/bin/rsync", 
-                               "-qz",
+                               "-z", "--stats",
                                "-e", "/usr/bin/ssh -oStrictHostKeyChecking=no -oUserKnownHostsFile=/dev/null -q",
                                "--timeout=60", 
                                "/var/p2pfoodlab/log.txt", 
                                remote_name, 
                                NULL };
 
-        return system_run(argv, 180);
+        int ret = system_run_output(argv, 180, stats, sizeof(stats));
+
+        /* Only a transfer that went through is charged, with the
+           bytes that rsync reports. */
+        if (ret == 0) {
+                long bytes = sensorbox_rsync_bytes(stats);
+                uplink_consume(box->uplink, UPLINK_STATUS, (bytes >= 0)? bytes : size);
+                uplink_save(box->uplink);
+        }
+
+        return ret;
+}
+
+/* Returns NULL if archiving is disabled ("backup.archive" set to
+   "no"). */
+static archive_t* sensorbox_open_archive(sensorbox_t* box)
+{
+        char dirname[512];
+        int period = ARCHIVE_MONTHLY;
+
+        const char* s = json_getstr(box->config, "backup.archive");
+        if ((s != NULL) && (strcmp(s, "no") == 0))
+                return NULL;
+        if ((s != NULL) && (strcmp(s, "day") == 0))
+                period = ARCHIVE_DAILY;
+
+        snprintf(dirname, 512, "%s/backup", box->home_dir);
+        dirname[511] = 0;
+
+        return new_archive(dirname, period);
+}
+
+int sensorbox_compact_backup(sensorbox_t* box)
+{
+        int budget = 10;
+        long max_size = 0;
+        int max_age = 0;
+
+        archive_t* archive = sensorbox_open_archive(box);
+        if (archive == NULL)
+                return 0;
+
+        /* The time spent per run, in seconds. What isn't done is
+           picked up by the next run. */
+        const char* s = json_getstr(box->config, "backup.budget");
+        if ((s != NULL) && (atoi(s) > 0))
+                budget = atoi(s);
+        s = json_getstr(box->config, "backup.maxsize");
+        if (s != NULL)
+                max_size = 1024 * atol(s);
+        s = json_getstr(box->config, "backup.maxage");
+        if (s != NULL)
+                max_age = atoi(s);
+
+        int err = archive_compact(archive, budget);
+        if (archive_retain(archive, max_size, max_age) < 0)
+                err = -1;
+
+        delete_archive(archive);
+        return (err < 0)? -1 : 0;
+}
+
+int sensorbox_list_backup(sensorbox_t* box, const char* prefix)
+{
+        archive_t* archive = sensorbox_open_archive(box);
+        if (archive == NULL)
+                return -1;
+        int err = archive_list(archive, prefix, stdout);
+        delete_archive(archive);
+        return err;
+}
+
+int sensorbox_extract_backup(sensorbox_t* box, const char* key, const char* dir)
+{
+        archive_t* archive = sensorbox_open_archive(box);
+        if (archive == NULL)
+                return -1;
+        int count = archive_extract(archive, key, (dir != NULL)? dir : ".");
+        delete_archive(archive);
+        return (count > 0)? 0 : -1;
+}
+
+static int sensorbox_read_file(const char* path, unsigned char** data, long* size)
+{
+        long len = sensorbox_filesize(path);
+
+        *data = NULL;
+        *size = 0;
+        if (len < 0)
+                return -1;
+
+        FILE* fp = fopen(path, "r");
+        if (fp == NULL)
+                return -1;
+
+        *data = (unsigned char*) malloc(len > 0? len : 1);
+        if ((*data == NULL)
+            || ((len > 0) && (fread(*data, len, 1, fp) != 1))) {
+                if (*data)
+                        free(*data);
+                *data = NULL;
+                fclose(fp);
+                return -1;
+        }
+        fclose(fp);
+
+        *size = len;
+        return 0;
+}
+
+static int sensorbox_query_add_rollup(void* data, rollup_record_t* rec)
+{
+        return query_add_summary((query_t*) data, rec->osd_id, rec->start, rec->count,
+                                 rec->min, rec->max, rec->sum);
+}
+
+/* Feeds the query with the imported datapoints that wait in the
+   replay queue. Only the files of the days in the query's range are
+   read. */
+static int sensorbox_query_replay(sensorbox_t* box, query_t* q)
+{
+        struct dirent *entry;
+        char dirname[512];
+        char filename[512];
+        time_t start;
+        int err = 0;
+
+        snprintf(dirname, 512, "%s/replay", box->home_dir);
+        dirname[511] = 0;
+
+        DIR* dir = opendir(dirname);
+        if (dir == NULL)
+                return 0;
+
+        while ((err == 0) && ((entry = readdir(dir)) != NULL)) {
+                if (!import_queue_day(entry->d_name, &start)
+                    || !query_overlaps(q, start, start + 86399))
+                        continue;
+                unsigned char* data;
+                long size;
+                if (sensorbox_join(filename, 512, dirname, entry->d_name) != 0)
+                        continue;
+                if (sensorbox_read_file(filename, &data, &size) == 0) {
+                        err = query_add_csv(q, (const char*) data, size);
+                        free(data);
+                }
+        }
+
+        closedir(dir);
+        return err;
+}
+
+/* Feeds the query with all the local datapoints. archive may be
+   NULL. */
+static int sensorbox_query_local(sensorbox_t* box, query_t* q, archive_t* archive)
+{
+        char dirname[512];
+
+        /* The uploaded data... */
+        snprintf(dirname, 512, "%s/backup", box->home_dir);
+        dirname[511] = 0;
+        int err = query_scan_backup(q, dirname, archive);
+
+        /* ... and the data waiting to be uploaded. */
+        if (err == 0) {
+                unsigned char* data;
+                long size;
+                char* filename = sensorbox_path(box, "datapoints.csv");
+                if (sensorbox_read_file(filename, &data, &size) == 0) {
+                        err = query_add_csv(q, (const char*) data, size);
+                        free(data);
+                }
+        }
+        if (err == 0)
+                err = sensorbox_query_replay(box, q);
+        if (err == 0)
+                err = datalog_foreach(box->datalog, query_add, q);
+        if ((err == 0) && (box->staged != NULL))
+                err = datalog_foreach(box->staged, query_add, q);
+
+        return err;
+}
+
+/* Returns the rollup tier that can answer the query, or -1. The
+   range and the buckets of the query must be made of whole
+   10-minute or hourly rollups (for example, 2014-05-01 to
+   2014-05-01T23:59:59), and the rollups must cover the range. The
+   daily tier isn't used: local days aren't a multiple of an hour
+   apart across DST changes. */
+static int sensorbox_query_tier(sensorbox_t* box, time_t from, time_t to,
+                                int function, int bucket)
+{
+        time_t since = rollup_since(box->rollup);
+
+        if ((function == QUERY_RAW) || (bucket <= 0) || (since == 0) || (since > from))
+                return -1;
+
+        for (int tier = rollup_tier(3600); tier >= 0; tier--) {
+                int n = rollup_tiers[tier];
+                if (((bucket % n) == 0) && ((from % n) == 0) && (((to + 1) % n) == 0))
+                        return tier;
+        }
+        return -1;
+}
+
+int sensorbox_query(sensorbox_t* box, const char* datastream,
+                    const char* from, const char* to,
+                    const char* function, int bucket, FILE* fp)
+{
+        time_t t0, t1;
+        int osd_id = -1;
+
+        if ((query_parse_time(from, &t0) != 0) || (query_parse_time(to, &t1) != 0)) {
+                log_err("Sensorbox: Invalid time range: %s - %s", from, to);
+                return -1;
+        }
+
+        int fun = query_parse_function((function != NULL)? function : "raw");
+        if (fun < 0) {
+                log_err("Sensorbox: Unknown query function: %s", function);
+                return -1;
+        }
+
+        /* The datastream is given by its OpenSensorData ID or its
+           name, which is looked up in the local cache. */
+        if (isdigit((unsigned char) datastream[0])) {
+                osd_id = atoi(datastream);
+        } else {
+                if ((box->osd == NULL) && (sensorbox_init_osd(box) != 0))
+                        return -1;
+                osd_id = opensensordata_get_datastream_id(box->osd, datastream);
+        }
+        if (osd_id < 0) {
+                log_err("Sensorbox: Unknown datastream: %s", datastream);
+                return -1;
+        }
+
+        query_t* q = new_query(osd_id, t0, t1, fun, bucket);
+        if (q == NULL)
+                return -1;
+
+        int tier = sensorbox_query_tier(box, t0, t1, fun, bucket);
+        if (tier >= 0) {
+                int err = rollup_foreach(box->rollup, tier, t0, t1, 
+                                         sensorbox_query_add_rollup, q);
+                if (err == 0)
+                        err = query_print(q, fp);
+                delete_query(q);
+                return err;
+        }
+
+        archive_t* archive = sensorbox_open_archive(box);
+        int err = sensorbox_query_local(box, q, archive);
+        if (archive)
+                delete_archive(archive);
+
+        if (err == 0)
+                err = query_print(q, fp);
+
+        delete_query(q);
+        return err;
+}
+
+typedef struct _sensorbox_import_t {
+        sensorbox_t* box;
+        archive_t* archive;
+        /* The names of the archived photos, sorted */
+        char** photos;
+        int num_photos;
+        long rolled_up;
+} sensorbox_import_t;
+
+static int sensorbox_import_scan(void* data, time_t from, time_t to,
+                                 datalog_callback_t fun, void* fun_data)
+{
+        sensorbox_import_t* ctx = (sensorbox_import_t*) data;
+
+        query_t* q = new_query(QUERY_ALL_DATASTREAMS, from, to, QUERY_RAW, 0);
+        if (q == NULL)
+                return -1;
+        int err = sensorbox_query_local(ctx->box, q, ctx->archive);
+        if (err == 0)
+                err = query_foreach(q, fun, fun_data);
+        delete_query(q);
+        return err;
+}
+
+static int sensorbox_import_has_photo(void* data, const char* name)
+{
+        sensorbox_import_t* ctx = (sensorbox_import_t*) data;
+        sensorbox_t* box = ctx->box;
+        char path[512];
+
+        snprintf(path, 512, "%s/backup/%s", box->home_dir, name);
+        path[511] = 0;
+        if (access(path, F_OK) == 0)
+                return 1;
+
+        if (box->staging_dir != NULL) {
+                snprintf(path, 512, "%s/photostream/%s", box->staging_dir, name);
+                path[511] = 0;
+                if (access(path, F_OK) == 0)
+                        return 1;
+        }
+
+        return (ctx->num_photos > 0)
+                && (bsearch(&name, ctx->photos, ctx->num_photos, sizeof(char*),
+                            sensorbox_compare_names) != NULL);
+}
+
+/* The imported datapoints also go into the rollups, if they are
+   recent enough. */
+static int sensorbox_import_added(void* data, int osd_id, time_t timestamp, float value)
+{
+        sensorbox_import_t* ctx = (sensorbox_import_t*) data;
+        rollup_t* rollup = ctx->box->rollup;
+
+        if (!rollup_accepts(rollup, timestamp))
+                return 0;
+        ctx->rolled_up++;
+        return rollup_add(rollup, osd_id, timestamp, value);
+}
+
+int sensorbox_import(sensorbox_t* box, const char* source, int jobs)
+{
+        char work_dir[512];
+        char queue_dir[512];
+        char photo_dir[512];
+        sensorbox_import_t ctx;
+        import_stats_t stats;
+
+        /* The upload worker mustn't send a day of the queue while
+           it is being rewritten. */
+        int lock = sensorbox_lock_uploads(box);
+        if (lock == -1) {
+                log_err("Sensorbox: An upload is in progress, try again later");
+                return -1;
+        }
+
+        if (jobs <= 0)
+                jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+        memset(&ctx, 0, sizeof(sensorbox_import_t));
+        ctx.box = box;
+        ctx.archive = sensorbox_open_archive(box);
+        if (ctx.archive != NULL) {
+                for (int i = 0; i < archive_count(ctx.archive); i++) {
+                        const char* name = archive_get_name(ctx.archive, i);
+                        int len = strlen(name);
+                        if ((len < 4) || (strcmp(name + len - 4, ".jpg") != 0))
+                                continue;
+                        char** p = (char**) realloc(ctx.photos, (ctx.num_photos + 1) * sizeof(char*));
+                        if (p == NULL)
+                                break;
+                        ctx.photos = p;
+                        ctx.photos[ctx.num_photos++] = (char*) name;
+                }
+                if (ctx.num_photos > 1)
+                        qsort(ctx.photos, ctx.num_photos, sizeof(char*), sensorbox_compare_names);
+        }
+
+        /* Index the backup files once, before the workers look
+           things up in it. */
+        query_t* q = new_query(QUERY_ALL_DATASTREAMS, 0, 0, QUERY_RAW, 0);
+        if (q != NULL) {
+                snprintf(work_dir, 512, "%s/backup", box->home_dir);
+                work_dir[511] = 0;
+                query_scan_backup(q, work_dir, ctx.archive);
+                delete_query(q);
+        }
+
+        snprintf(work_dir, 512, "%s/import", box->home_dir);
+        work_dir[511] = 0;
+        snprintf(queue_dir, 512, "%s/replay", box->home_dir);
+        queue_dir[511] = 0;
+        snprintf(photo_dir, 512, "%s/photostream", box->home_dir);
+        photo_dir[511] = 0;
+
+        int err = -1;
+        import_t* imp = new_import(work_dir, queue_dir, photo_dir, jobs);
+        if (imp != NULL) {
+                import_set_store(imp, sensorbox_import_scan, sensorbox_import_has_photo, &ctx);
+                err = import_run(imp, source, sensorbox_import_added, &ctx);
+                if ((ctx.rolled_up > 0) && (rollup_save(box->rollup) != 0)) {
+                        log_err("Sensorbox: Failed to save the rollups");
+                        err = -1;
+                }
+
+                import_get_stats(imp, &stats);
+                log_info("Sensorbox: Imported %ld of %ld datapoints from %ld files "
+                         "(%ld duplicates, %ld invalid), over %ld days, "
+                         "%ld in the rollups",
+                         stats.added, stats.datapoints, stats.files,
+                         stats.duplicates, stats.invalid, stats.days, ctx.rolled_up);
+                log_info("Sensorbox: Imported %ld photos (%ld duplicates)",
+                         stats.photos, stats.photo_duplicates);
+                delete_import(imp);
+        }
+
+        if (ctx.photos)
+                free(ctx.photos);
+        if (ctx.archive)
+                delete_archive(ctx.archive);
+        flock(lock, LOCK_UN);
+        close(lock);
+
+        return err;
+}
+
+void sensorbox_print_status(sensorbox_t* box)
+{
+        char dirname[512];
+        int count;
+
+        json_object_t status = json_object_create();
+
+        long size = sensorbox_filesize(sensorbox_path(box, "datapoints.csv"));
+        json_object_setnum(status, "datapoints-size", (size > 0)? size : 0);
+        json_object_setnum(status, "datalog-size", datalog_size(box->datalog));
+        if (box->staged != NULL)
+                json_object_setnum(status, "staging-size", sensorbox_staging_size(box));
+
+        datalog_stats_t stats;
+        datalog_get_stats(box->datalog, &stats);
+        json_object_setnum(status, "datalog-truncated", stats.truncated_bytes);
+
+        snprintf(dirname, 512, "%s/photostream", box->home_dir);
+        dirname[511] = 0;
+        char** names = sensorbox_list_photos(dirname, &count);
+        for (int i = 0; i < count; i++)
+                free(names[i]);
+        if (names)
+                free(names);
+        json_object_setnum(status, "photos", count);
+
+        /* The imported datapoints waiting in the replay queue */
+        snprintf(dirname, 512, "%s/replay", box->home_dir);
+        dirname[511] = 0;
+        long replay_size = 0;
+        int replay_days = 0;
+        struct stat buf;
+        if (stat(dirname, &buf) == 0) {
+                names = sensorbox_list_photos(dirname, &count);
+                for (int i = 0; i < count; i++) {
+                        time_t start;
+                        if (import_queue_day(names[i], &start)) {
+                                char filename[512];
+                                if (sensorbox_join(filename, 512, dirname, names[i]) == 0)
+                                        replay_size += sensorbox_filesize(filename);
+                                replay_days++;
+                        }
+                        free(names[i]);
+                }
+                if (names)
+                        free(names);
+        }
+        json_object_setnum(status, "replay-days", replay_days);
+        json_object_setnum(status, "replay-size", replay_size);
+
+        /* The files known to be uploaded. The set isn't created
+           here. */
+        long uploaded_files = 0;
+        if (stat(sensorbox_path(box, "uploaded.set"), &buf) == 0) {
+                hashset_t* set = sensorbox_uploaded(box);
+                if (set)
+                        uploaded_files = hashset_count(set);
+        }
+        json_object_setnum(status, "uploaded-files", uploaded_files);
+
+        json_object_t uplink = uplink_status(box->uplink);
+        json_object_set(status, "uplink", uplink);
+        json_unref(uplink);
+
+        json_tofilep(status, k_json_pretty, stdout);
+        json_unref(status);
 }
 
 void sensorbox_merge_config(sensorbox_t* box, const char* filename)
@@ -91,6 +91,11 @@ extern "C" {
         void sensorbox_handle_events(sensorbox_t* box);
         void sensorbox_upload_data(sensorbox_t* box);
         void sensorbox_upload_photos(sensorbox_t* box);
+
+        /* Uploads the imported datapoints in the replay queue,
+           oldest first. */
+        void sensorbox_upload_replay(sensorbox_t* box);
+        int sensorbox_flush_staging(sensorbox_t* box);
         void sensorbox_poweroff_maybe(sensorbox_t* box);
         int sensorbox_powersaving_enabled(sensorbox_t* box);
         int sensorbox_check_sensors(sensorbox_t* box);
@@ -98,13 +103,18 @@ extern "C" {
         int sensorbox_create_osd_definitions(sensorbox_t* box);
         int sensorbox_print_events(sensorbox_t* box);
 
-        /* If filename is NULL, the default output file will be
-           used. If filename equals '-', the data will be printed to
-           the console (stdout). */
+        /* If filename is NULL, the data will be appended to the
+           datapoints log. If filename equals '-', the data will be
+           printed to the console (stdout). */
         int sensorbox_store_sensor_data(sensorbox_t* box, const char* filename);
 
+        /* Writes the datapoints in the log that haven't been
+           uploaded yet, in CSV format. If filename is NULL or '-',
+           the data is printed to the console. */
+        int sensorbox_export_data(sensorbox_t* box, const char* filename);
+
         void sensorbox_update_camera(sensorbox_t* box, time_t t);
-        void sensorbox_grab_image(sensorbox_t* box, const char* filename);
+        int sensorbox_grab_image(sensorbox_t* box, const char* filename);
         int sensorbox_get_time(sensorbox_t* box, time_t* m);
         int sensorbox_set_time(sensorbox_t* box, time_t m);
 
@@ -122,6 +132,25 @@ extern "C" {
         int sensorbox_lock(sensorbox_t* box);
         void sensorbox_unlock(sensorbox_t* box);
 
+        /* Uploads the data, status, and photos, in that order. */
+        void sensorbox_upload(sensorbox_t* box);
+
+        /* Runs sensorbox_upload() in a separate process that holds
+           its own lock and gets killed after the upload deadline
+           (config "uplink.deadline", in seconds). Does nothing if a
+           previous upload is still running. */
+        int sensorbox_start_uploads(sensorbox_t* box);
+
+        /* Waits until no upload is running, for at most the upload
+           deadline. */
+        void sensorbox_wait_uploads(sensorbox_t* box);
+
+        /* Takes the upload lock, for the commands that upload in
+           the foreground. Returns -1 if an upload worker holds
+           it. */
+        int sensorbox_begin_uploads(sensorbox_t* box);
+        void sensorbox_end_uploads(sensorbox_t* box);
+
         /* int sensorbox_get_status(sensorbox_t* box, status_t* status); */
 
         const char* sensorbox_config_getstr(sensorbox_t* box, const char* expr);
@@ -134,6 +163,38 @@ extern "C" {
         void sensorbox_generate_system_files(sensorbox_t* box);                
         int sensorbox_upload_status(sensorbox_t* box);
 
+        /* Prints the data and photos waiting on the disk and the
+           state of the uplink budget, in JSON. */
+        void sensorbox_print_status(sensorbox_t* box);
+
+        /* Prints the datapoints of a datastream (OpenSensorData ID
+           or name) in the time range [from, to], or the result of
+           function (raw, min, max, mean, count) per bucket of the
+           given size in seconds. See query.h. */
+        int sensorbox_query(sensorbox_t* box, const char* datastream,
+                            const char* from, const char* to,
+                            const char* function, int bucket, FILE* fp);
+
+        /* Moves the uploaded files in backup/ into the archives and
+           applies the retention limits (see archive.h). */
+        int sensorbox_compact_backup(sensorbox_t* box);
+
+        /* Prints the archived files whose name or date starts with
+           prefix (all files if NULL). */
+        int sensorbox_list_backup(sensorbox_t* box, const char* prefix);
+
+        /* Extracts an archived file, or all the files of a day if key
+           is a date (YYYYMMDD), into dir (the current directory if
+           NULL). */
+        int sensorbox_extract_backup(sensorbox_t* box, const char* key, const char* dir);
+
+        /* Imports the datapoints and photos in a directory, such as
+           the backup of another box or a mounted SD card, using jobs
+           worker processes (one per CPU if 0). The datapoints that
+           are new are queued in replay/ and uploaded after the
+           newer data. See import.h. */
+        int sensorbox_import(sensorbox_t* box, const char* source, int jobs);
+
 
 #ifdef __cplusplus
 }
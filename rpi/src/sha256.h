@@ -0,0 +1,59 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* SHA-256 (FIPS 180-4), to identify the content of the
+           uploaded files. */
+
+        #define SHA256_SIZE 32
+        #define SHA256_HEX_SIZE 65
+
+        typedef struct _sha256_t {
+                uint32_t state[8];
+                uint64_t length;
+                unsigned char block[64];
+                int used;
+        } sha256_t;
+
+        void sha256_init(sha256_t* ctx);
+        void sha256_update(sha256_t* ctx, const void* data, long len);
+        void sha256_final(sha256_t* ctx, unsigned char* digest);
+
+        /* Hashes the content of a file. Returns -1 if it can't be
+           read. */
+        int sha256_file(const char* path, unsigned char* digest);
+
+        /* Writes the digest as 64 lowercase hex digits and a zero. */
+        void sha256_hex(const unsigned char* digest, char* hex);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
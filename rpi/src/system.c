@@ -203,8 +203,16 @@ process_t* system_exec(char* const argv[], int wait)
         }
 }
 
-int system_run(char* const argv[], int timeout)
+/* Runs the command and logs what it prints. If output is not NULL,
+   the start of the standard output is also copied into it, up to
+   len - 1 bytes. */
+static int system_run_(char* const argv[], int timeout, char* output, int len)
 {
+        int outlen = 0;
+
+        if (output != NULL)
+                output[0] = 0;
+
         if (1) {
                 char buffer[1024];
                 int buflen = 0;
@@ -261,6 +269,10 @@ int system_run(char* const argv[], int timeout)
                                         count++;
                                         buffer[n] = 0;
                                         log_info("%s", buffer);
+                                        if ((output != NULL) && (outlen + n < len)) {
+                                                memcpy(output + outlen, buffer, n + 1);
+                                                outlen += n;
+                                        }
                                 }
                         }
                         if (FD_ISSET(p->err, &rfds)) {
@@ -301,6 +313,16 @@ int system_run(char* const argv[], int timeout)
         return ret;
 }
 
+int system_run(char* const argv[], int timeout)
+{
+        return system_run_(argv, timeout, NULL, 0);
+}
+
+int system_run_output(char* const argv[], int timeout, char* output, int len)
+{
+        return system_run_(argv, timeout, output, len);
+}
+
 int system_get_serial_number(char *buffer, int len)
 {
         FILE *f = fopen("/proc/cpuinfo", "r");
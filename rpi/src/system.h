@@ -53,6 +53,10 @@ extern "C" {
            timeout (wait indefinitely). */
         int system_run(char* const argv[], int timeout);
 
+        /* Same as system_run(), and copies the start of the standard
+           output of the command into output. */
+        int system_run_output(char* const argv[], int timeout, char* output, int len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,385 @@
+/*
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Simulates power cuts on the datapoints log: the end of a segment is
+   cut at every byte, or a byte of a record is flipped, and the
+   recovery must keep exactly the records before the damage, with
+   their values. A move of the segments from the staging area that
+   was killed half-way must be taken up by the next one. Run by make
+   check. */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "log_message.h"
+#include "datalog.h"
+
+#define NUM_RECORDS 20
+#define NUM_STREAMS 2
+#define HEADER_SIZE (12 + 8 * NUM_STREAMS)
+#define RECORD_SIZE (8 + 2 * NUM_STREAMS)
+#define SEGMENT_SIZE (HEADER_SIZE + NUM_RECORDS * RECORD_SIZE)
+
+static int _failures = 0;
+
+#define check(_cond, ...) do {                                  \
+                if (!(_cond)) {                                 \
+                        fprintf(stderr, "test-datalog: ");      \
+                        fprintf(stderr, __VA_ARGS__);           \
+                        fprintf(stderr, "\n");                  \
+                        _failures++;                            \
+                }                                               \
+        } while (0)
+
+static char _dir[256];
+static char _segment[512];
+static unsigned char _original[SEGMENT_SIZE];
+
+static const int _streams[NUM_STREAMS] = { DATASTREAM_LUM, DATASTREAM_SOIL };
+
+static int osd_ids[DATASTREAM_COUNT];
+
+static float value_of(int record, int stream)
+{
+        return (float) (100 * record + stream);
+}
+
+/* Empties the directory. */
+static void remove_files(const char* dirname)
+{
+        char path[600];
+        struct dirent* entry;
+
+        DIR* dir = opendir(dirname);
+        if (dir == NULL)
+                return;
+        while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.')
+                        continue;
+                snprintf(path, 600, "%s/%s", dirname, entry->d_name);
+                unlink(path);
+        }
+        closedir(dir);
+}
+
+/* Empties the log directory. */
+static void clear_dir()
+{
+        remove_files(_dir);
+}
+
+/* Returns the name of the only segment, or -1. */
+static int find_segment()
+{
+        struct dirent* entry;
+        int count = 0;
+
+        DIR* dir = opendir(_dir);
+        if (dir == NULL)
+                return -1;
+        while ((entry = readdir(dir)) != NULL) {
+                int len = strlen(entry->d_name);
+                if ((len > 4) && (strcmp(entry->d_name + len - 4, ".seg") == 0)) {
+                        snprintf(_segment, 512, "%s/%s", _dir, entry->d_name);
+                        count++;
+                }
+        }
+        closedir(dir);
+        return (count == 1)? 0 : -1;
+}
+
+/* Stores NUM_RECORDS records, one download each, and keeps a copy
+   of the segment. */
+static int write_log()
+{
+        datapoint_t points[NUM_STREAMS];
+
+        clear_dir();
+        datalog_t* log = new_datalog(_dir);
+        if ((log == NULL) || (datalog_recover(log) != 0))
+                return -1;
+
+        for (int k = 0; k < NUM_RECORDS; k++) {
+                for (int j = 0; j < NUM_STREAMS; j++) {
+                        points[j].timestamp = 1400000000 + 60 * k;
+                        points[j].datastream = _streams[j];
+                        points[j].value = value_of(k, j);
+                }
+                if (datalog_append(log, points, NUM_STREAMS, osd_ids) != 0) {
+                        delete_datalog(log);
+                        return -1;
+                }
+        }
+        delete_datalog(log);
+
+        if (find_segment() != 0)
+                return -1;
+        FILE* fp = fopen(_segment, "r");
+        if (fp == NULL)
+                return -1;
+        int n = fread(_original, 1, SEGMENT_SIZE + 1, fp);
+        fclose(fp);
+        return (n == SEGMENT_SIZE)? 0 : -1;
+}
+
+/* Puts the first len bytes of the saved segment back, as a power
+   cut would have left them. */
+static void restore_segment(int len)
+{
+        clear_dir();
+        int fd = open(_segment, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if ((fd == -1) || (write(fd, _original, len) != len))
+                fprintf(stderr, "test-datalog: failed to write %s\n", _segment);
+        if (fd != -1)
+                close(fd);
+}
+
+typedef struct _reader_t {
+        int count;
+        int errors;
+} reader_t;
+
+static int read_point(void* data, int osd_id, time_t timestamp, float value)
+{
+        reader_t* reader = (reader_t*) data;
+        int record = reader->count / NUM_STREAMS;
+        int stream = reader->count % NUM_STREAMS;
+        if ((osd_id != 1000 + _streams[stream])
+            || (timestamp != 1400000000 + 60 * record)
+            || (value != value_of(record, stream)))
+                reader->errors++;
+        reader->count++;
+        return 0;
+}
+
+/* Recovers the log and returns the number of records left, or -1 if
+   a record doesn't hold what was written. */
+static int recover(long* size)
+{
+        reader_t reader = { 0, 0 };
+        struct stat st;
+
+        datalog_t* log = new_datalog(_dir);
+        if (log == NULL)
+                return -1;
+        datalog_recover(log);
+        datalog_foreach(log, read_point, &reader);
+        delete_datalog(log);
+
+        *size = (stat(_segment, &st) == 0)? (long) st.st_size : -1;
+
+        if ((reader.errors > 0) || (reader.count % NUM_STREAMS != 0))
+                return -1;
+        return reader.count / NUM_STREAMS;
+}
+
+/* The write of the last download was cut at every byte. */
+static void test_torn_tail()
+{
+        long size;
+
+        for (int len = 0; len <= SEGMENT_SIZE; len++) {
+                restore_segment(len);
+                int records = recover(&size);
+
+                if (len < HEADER_SIZE) {
+                        check(size == -1, "a segment of %d bytes wasn't removed", len);
+                        continue;
+                }
+                int expected = (len - HEADER_SIZE) / RECORD_SIZE;
+                check(records == expected, "cut at %d bytes: %d records, expected %d",
+                      len, records, expected);
+                check(size == HEADER_SIZE + expected * RECORD_SIZE,
+                      "cut at %d bytes: truncated to %ld bytes", len, size);
+        }
+}
+
+/* A byte of a record is damaged: that record and the ones after it
+   go. */
+static void test_corrupt_record()
+{
+        long size;
+
+        for (int pos = HEADER_SIZE; pos < SEGMENT_SIZE; pos++) {
+                restore_segment(SEGMENT_SIZE);
+                int fd = open(_segment, O_RDWR);
+                unsigned char c = _original[pos] ^ 0x5a;
+                if ((fd == -1) || (pwrite(fd, &c, 1, pos) != 1))
+                        fprintf(stderr, "test-datalog: failed to damage %s\n", _segment);
+                if (fd != -1)
+                        close(fd);
+
+                int records = recover(&size);
+                int expected = (pos - HEADER_SIZE) / RECORD_SIZE;
+                check(records == expected, "damage at byte %d: %d records, expected %d",
+                      pos, records, expected);
+                check(size == HEADER_SIZE + expected * RECORD_SIZE,
+                      "damage at byte %d: truncated to %ld bytes", pos, size);
+        }
+}
+
+/* The recovery is done once: a second pass changes nothing, and
+   the log takes new records after the recovered ones. */
+static void test_append_after_recovery()
+{
+        datapoint_t points[NUM_STREAMS];
+        long size;
+
+        restore_segment(SEGMENT_SIZE - RECORD_SIZE / 2);
+
+        datalog_t* log = new_datalog(_dir);
+        datalog_recover(log);
+        for (int j = 0; j < NUM_STREAMS; j++) {
+                points[j].timestamp = 1400000000 + 60 * (NUM_RECORDS - 1);
+                points[j].datastream = _streams[j];
+                points[j].value = value_of(NUM_RECORDS - 1, j);
+        }
+        check(datalog_append(log, points, NUM_STREAMS, osd_ids) == 0, "append failed");
+        delete_datalog(log);
+
+        check(recover(&size) == NUM_RECORDS, "records lost after the recovery");
+        check(size == SEGMENT_SIZE, "the segment is %ld bytes, expected %d",
+              size, SEGMENT_SIZE);
+}
+
+/* Without the recovery, the log is only read. */
+static void test_read_only()
+{
+        datapoint_t point = { 1400000000, DATASTREAM_LUM, 1.0f };
+
+        restore_segment(SEGMENT_SIZE - 1);
+        datalog_t* log = new_datalog(_dir);
+        check(datalog_append(log, &point, 1, osd_ids) != 0,
+              "a log that wasn't recovered took an append");
+        delete_datalog(log);
+
+        struct stat st;
+        check((stat(_segment, &st) == 0) && (st.st_size == SEGMENT_SIZE - 1),
+              "opening the log changed the segment");
+}
+
+/* Copies the segment to the directory, as a move that was killed
+   before it removed the original would have left it. */
+static void copy_segment(const char* dir, const char* suffix, int len)
+{
+        char path[512];
+        const char* name = strrchr(_segment, '/') + 1;
+
+        snprintf(path, 512, "%s/%s%s", dir, name, suffix);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if ((fd == -1) || (write(fd, _original, len) != len))
+                fprintf(stderr, "test-datalog: failed to write %s\n", path);
+        if (fd != -1)
+                close(fd);
+}
+
+static int count_files(const char* dirname)
+{
+        struct dirent* entry;
+        int count = 0;
+
+        DIR* dir = opendir(dirname);
+        if (dir == NULL)
+                return -1;
+        while ((entry = readdir(dir)) != NULL)
+                if (entry->d_name[0] != '.')
+                        count++;
+        closedir(dir);
+        return count;
+}
+
+/* The segment was copied, completely or under its temporary name,
+   but the original is still there. */
+static void test_interrupted_move()
+{
+        char todir[300];
+        reader_t reader;
+
+        snprintf(todir, 300, "%s-to", _dir);
+        mkdir(todir, 0755);
+
+        for (int k = 0; k < 3; k++) {
+                restore_segment(SEGMENT_SIZE);
+                if (k == 0)
+                        copy_segment(todir, "", SEGMENT_SIZE);
+                else if (k == 1)
+                        copy_segment(todir, ".tmp", SEGMENT_SIZE / 2);
+
+                datalog_t* from = new_datalog(_dir);
+                datalog_t* to = new_datalog(todir);
+                datalog_recover(from);
+                datalog_recover(to);
+                check(datalog_move(from, to) == 0, "move %d failed", k);
+                check(count_files(_dir) <= 1, "move %d: the segment was left behind", k);
+
+                memset(&reader, 0, sizeof(reader));
+                datalog_foreach(to, read_point, &reader);
+                check((reader.errors == 0) && (reader.count == NUM_RECORDS * NUM_STREAMS),
+                      "move %d: %d datapoints moved, %d wrong", k, reader.count, reader.errors);
+                delete_datalog(from);
+                delete_datalog(to);
+                remove_files(todir);
+        }
+        rmdir(todir);
+}
+
+int main(int argc, char** argv)
+{
+        /* The recovery warns about every damaged segment. */
+        log_set_level(LOG_ERROR);
+
+        for (int i = 0; i < DATASTREAM_COUNT; i++)
+                osd_ids[i] = 1000 + i;
+
+        snprintf(_dir, 256, "/tmp/test-datalog-XXXXXX");
+        if (mkdtemp(_dir) == NULL) {
+                perror("test-datalog");
+                return EXIT_FAILURE;
+        }
+
+        if (write_log() != 0) {
+                fprintf(stderr, "test-datalog: failed to write the log\n");
+                _failures++;
+        } else {
+                test_torn_tail();
+                test_corrupt_record();
+                test_append_after_recovery();
+                test_read_only();
+                test_interrupted_move();
+        }
+
+        clear_dir();
+        rmdir(_dir);
+
+        if (_failures > 0) {
+                fprintf(stderr, "test-datalog: %d failures\n", _failures);
+                return EXIT_FAILURE;
+        }
+        printf("test-datalog: ok\n");
+        return EXIT_SUCCESS;
+}
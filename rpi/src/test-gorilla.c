@@ -0,0 +1,300 @@
+/*
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Round trips through the Gorilla encoding. The datapoints given to
+   the encoder must come back bit for bit from the decoder: every
+   bucket of the delta-of-deltas, and values that keep, shrink and
+   widen the XOR window. A datapoints CSV file must also come back
+   as the same lines through gorilla_encode_csv() and the decoder of
+   decode-data, gorilla_decode_to_csv(). Run by make check. */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "log_message.h"
+#include "timestamp.h"
+#include "gorilla.h"
+
+#define NUM_STREAMS 3
+#define NUM_POINTS 2000
+
+static int _failures = 0;
+
+#define check(_cond, ...) do {                                  \
+                if (!(_cond)) {                                 \
+                        fprintf(stderr, "test-gorilla: ");      \
+                        fprintf(stderr, __VA_ARGS__);           \
+                        fprintf(stderr, "\n");                  \
+                        _failures++;                            \
+                }                                               \
+        } while (0)
+
+typedef struct _point_t {
+        int datastream;
+        time_t timestamp;
+        float value;
+} point_t;
+
+static point_t _points[NUM_STREAMS * NUM_POINTS];
+static int _count = 0;
+
+static uint32_t bits_of(float f)
+{
+        uint32_t u;
+        memcpy(&u, &f, 4);
+        return u;
+}
+
+static float float_of(uint32_t u)
+{
+        float f;
+        memcpy(&f, &u, 4);
+        return f;
+}
+
+/* The intervals between the datapoints go through every bucket of
+   the delta-of-deltas, both signs, and their limits. */
+static const int32_t _intervals[] = {
+        60, 60, 60, 123, 60, 64, 1, 63, 127, 60, 316, 60,
+        315, 2108, 60, 2107, 100000, 60, 1, 1, 0, 0, 86400, 3
+};
+
+/* Values that are equal, close, far apart, and special. */
+static float value_at(int stream, int i, uint32_t* seed)
+{
+        static const float special[] = {
+                0.0f, -0.0f, 1.0f, -1.0f, 1e-45f, 1.17549435e-38f,
+                3.40282347e+38f, INFINITY, -INFINITY, 0.1f, 23.45f
+        };
+
+        *seed = *seed * 1103515245 + 12345;
+        switch ((i / 7) % 5) {
+        case 0:
+                return 20.0f + 0.01f * (float) (i % 13);
+        case 1:
+                return special[i % (sizeof(special) / sizeof(float))];
+        case 2:
+                /* Any bit pattern but a NaN, which wouldn't compare
+                   equal. */
+                if (isnan(float_of(*seed)))
+                        return 0.5f;
+                return float_of(*seed);
+        case 3:
+                return (float) stream;
+        default:
+                return (float) (i % 2) * 1000.0f;
+        }
+}
+
+static void make_points()
+{
+        time_t t[NUM_STREAMS];
+        uint32_t seed = 1;
+
+        for (int s = 0; s < NUM_STREAMS; s++)
+                t[s] = 1400000000 + s;
+
+        for (int i = 0; i < NUM_POINTS; i++) {
+                for (int s = 0; s < NUM_STREAMS; s++) {
+                        int n = sizeof(_intervals) / sizeof(int32_t);
+                        t[s] += _intervals[(i + 5 * s) % n];
+                        point_t* p = &_points[_count++];
+                        p->datastream = 10 + s;
+                        p->timestamp = t[s];
+                        p->value = value_at(s, i, &seed);
+                }
+        }
+}
+
+typedef struct _decoded_t {
+        int next[NUM_STREAMS];
+        int count;
+        int errors;
+} decoded_t;
+
+/* The decoder gives the datapoints stream by stream, each in the
+   order they were appended. */
+static int check_point(void* data, int datastream, time_t timestamp, float value)
+{
+        decoded_t* d = (decoded_t*) data;
+        int s = datastream - 10;
+
+        if ((s < 0) || (s >= NUM_STREAMS)) {
+                d->errors++;
+                return 0;
+        }
+        int k = d->next[s]++;
+        point_t* p = &_points[k * NUM_STREAMS + s];
+        if ((k >= NUM_POINTS)
+            || (p->timestamp != timestamp)
+            || (bits_of(p->value) != bits_of(value))) {
+                if (d->errors == 0)
+                        fprintf(stderr, "test-gorilla: stream %d, datapoint %d: "
+                                "%ld %08x, expected %ld %08x\n", datastream, k,
+                                (long) timestamp, bits_of(value),
+                                (long) p->timestamp, bits_of(p->value));
+                d->errors++;
+        }
+        d->count++;
+        return 0;
+}
+
+static void test_round_trip()
+{
+        decoded_t decoded;
+        char* buffer = NULL;
+        size_t len = 0;
+
+        gorilla_t* g = new_gorilla();
+        for (int i = 0; i < _count; i++)
+                check(gorilla_append(g, _points[i].datastream, _points[i].timestamp,
+                                     _points[i].value) == 0, "append %d failed", i);
+        check(gorilla_count(g) == _count, "count is %d, expected %d", gorilla_count(g), _count);
+
+        FILE* fp = open_memstream(&buffer, &len);
+        check(gorilla_write(g, fp) == 0, "write failed");
+        fclose(fp);
+        delete_gorilla(g);
+
+        memset(&decoded, 0, sizeof(decoded));
+        int ret = gorilla_decode((unsigned char*) buffer, (int) len, check_point, &decoded);
+        check(ret == 0, "decode returned %d", ret);
+        check(decoded.count == _count, "decoded %d datapoints, expected %d",
+              decoded.count, _count);
+        check(decoded.errors == 0, "%d datapoints differ", decoded.errors);
+
+        /* A truncated buffer is refused, not read past its end. */
+        memset(&decoded, 0, sizeof(decoded));
+        check(gorilla_decode((unsigned char*) buffer, (int) len - 1, check_point, &decoded) != 0,
+              "a truncated buffer was decoded");
+
+        free(buffer);
+}
+
+static int compare_lines(const void* a, const void* b)
+{
+        return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* Returns the lines of the text, sorted. */
+static char** sorted_lines(char* text, int* count)
+{
+        int n = 0;
+        for (char* p = text; *p; p++)
+                if (*p == '\n')
+                        n++;
+
+        char** lines = (char**) malloc((n + 1) * sizeof(char*));
+        *count = 0;
+        for (char* p = strtok(text, "\n"); p != NULL; p = strtok(NULL, "\n"))
+                lines[(*count)++] = p;
+        qsort(lines, *count, sizeof(char*), compare_lines);
+        return lines;
+}
+
+/* The CSV that is uploaded, through the encoding and decode-data. The
+   decoder groups the lines by datastream, so the lines are compared
+   as sets. */
+static void test_csv()
+{
+        char csvfile[] = "/tmp/test-gorilla-XXXXXX";
+        char encfile[64];
+        char* expected = NULL;
+        char* decoded = NULL;
+        size_t len = 0;
+        char s[TIMESTAMP_MAXLEN];
+        int n1, n2;
+
+        int fd = mkstemp(csvfile);
+        if (fd == -1) {
+                perror("test-gorilla");
+                _failures++;
+                return;
+        }
+        close(fd);
+        snprintf(encfile, 64, "%s.osdg", csvfile);
+
+        FILE* fp = open_memstream(&expected, &len);
+        for (int i = 0; i < _count; i++) {
+                /* The CSV has the values that the sensors give, with
+                   six decimals. */
+                if (!isfinite(_points[i].value) || (fabsf(_points[i].value) > 1e9f))
+                        continue;
+                timestamp_format(NULL, _points[i].timestamp, TIMESTAMP_ISO, s);
+                fprintf(fp, "%d,%s,%f\n", _points[i].datastream, s, _points[i].value);
+        }
+        fclose(fp);
+
+        fp = fopen(csvfile, "w");
+        fputs(expected, fp);
+        fclose(fp);
+
+        int count = gorilla_encode_csv(csvfile, encfile);
+        check(count > 0, "gorilla_encode_csv returned %d", count);
+
+        fp = open_memstream(&decoded, &len);
+        check(gorilla_decode_to_csv(encfile, fp) == 0, "gorilla_decode_to_csv failed");
+        fclose(fp);
+
+        char** a = sorted_lines(expected, &n1);
+        char** b = sorted_lines(decoded, &n2);
+        check(n1 == count, "%d lines encoded, expected %d", count, n1);
+        check(n1 == n2, "%d lines decoded, expected %d", n2, n1);
+        for (int i = 0; (i < n1) && (i < n2); i++) {
+                if (strcmp(a[i], b[i]) != 0) {
+                        check(0, "decoded '%s', expected '%s'", b[i], a[i]);
+                        break;
+                }
+        }
+
+        free(a);
+        free(b);
+        free(expected);
+        free(decoded);
+        unlink(csvfile);
+        unlink(encfile);
+}
+
+int main(int argc, char** argv)
+{
+        /* The CSV has the local time. The encoding must give it back
+           unchanged in any time zone. */
+        setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+        tzset();
+        log_set_level(LOG_ERROR);
+
+        make_points();
+        test_round_trip();
+        test_csv();
+
+        if (_failures > 0) {
+                fprintf(stderr, "test-gorilla: %d failures\n", _failures);
+                return EXIT_FAILURE;
+        }
+        printf("test-gorilla: ok\n");
+        return EXIT_SUCCESS;
+}
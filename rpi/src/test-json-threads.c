@@ -0,0 +1,201 @@
+/*
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* A stress test of the frozen trees of json.c, built with
+   -fsanitize=thread by make check-threads. Threads share two frozen
+   trees, a parsed one whose values live in an arena and one built
+   value by value, and read them, reference and release their values
+   and look them up through the path cache, all at once and without
+   locking. The main thread drops its own references while the
+   threads still hold theirs, so the trees are freed by whichever
+   thread lets go last. ThreadSanitizer reports any race. */
+
+#define _BSD_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "json.h"
+
+#define NUM_THREADS 8
+#define NUM_ROUNDS 20000
+
+static const char* _text =
+        "{ \"sensors\": { \"trh\": { \"enabled\": \"yes\", \"period\": 60 },"
+        "  \"lum\": { \"enabled\": \"no\", \"period\": 600 } },"
+        "  \"opensensordata\": { \"server\": \"https://opensensordata.net\", \"key\": \"x\" },"
+        "  \"datastreams\": [ 1, 2, 3, 4, 5, 6, 7, 8 ] }";
+
+static const char* _paths[] = {
+        "sensors.trh.enabled", "sensors.trh.period", "sensors.lum.enabled",
+        "sensors.lum.period", "opensensordata.server", "opensensordata.key",
+        "sensors.missing", "datastreams"
+};
+
+#define NUM_PATHS (sizeof(_paths) / sizeof(_paths[0]))
+
+typedef struct _shared_t {
+        json_object_t parsed;
+        json_object_t built;
+        pthread_barrier_t released;
+        long expected_length;
+} shared_t;
+
+static int32 count_bytes(void* userdata, const char* s, int32 len)
+{
+        *(long*) userdata += len;
+        return 0;
+}
+
+static json_object_t build_tree()
+{
+        json_object_t root = json_object_create();
+        json_object_t sensors = json_object_create();
+        json_object_t trh = json_object_create();
+        json_object_setstr(trh, "enabled", "yes");
+        json_object_setnum(trh, "period", 60);
+        json_object_set(sensors, "trh", trh);
+        json_object_set(root, "sensors", sensors);
+        json_object_t datastreams = json_array_create();
+        for (int i = 0; i < 8; i++)
+                json_array_setnum(datastreams, i + 1, i);
+        json_object_set(root, "datastreams", datastreams);
+        json_unref(trh);
+        json_unref(sensors);
+        json_unref(datastreams);
+        return root;
+}
+
+static void* reader(void* data)
+{
+        shared_t* shared = (shared_t*) data;
+        long errors = 0;
+        char path[64];
+
+        json_ref(shared->parsed);
+        json_ref(shared->built);
+
+        for (int round = 0; round < NUM_ROUNDS; round++) {
+                json_object_t root = (round & 1)? shared->parsed : shared->built;
+                json_ref(root);
+
+                json_object_t value = json_get(root, _paths[round % NUM_PATHS]);
+                json_ref(value);
+                if (json_isstring(value) && (json_string_length(value) == 0))
+                        errors++;
+                json_unref(value);
+
+                json_object_t sensors = json_object_get(root, "sensors");
+                json_ref(sensors);
+                if (json_getnum(sensors, "trh.period") != 60)
+                        errors++;
+                json_unref(sensors);
+
+                /* New expressions go into the path cache while the
+                   others are looked up. */
+                snprintf(path, 64, "sensors.s%d.period", round % 200);
+                if (!json_isnull(json_get(root, path)))
+                        errors++;
+
+                if (round % 64 == 0) {
+                        long length = 0;
+                        json_serialise(shared->parsed, 0, count_bytes, &length);
+                        if (length != shared->expected_length)
+                                errors++;
+                }
+
+                json_unref(root);
+        }
+
+        /* Keep a value of each tree until the main thread has let go
+           of them, then drop everything. */
+        json_object_t datastreams[2] = {
+                json_object_get(shared->parsed, "datastreams"),
+                json_object_get(shared->built, "datastreams")
+        };
+        json_ref(datastreams[0]);
+        json_ref(datastreams[1]);
+        json_unref(shared->parsed);
+        json_unref(shared->built);
+
+        pthread_barrier_wait(&shared->released);
+
+        for (int i = 0; i < 2; i++) {
+                if (json_array_length(datastreams[i]) != 8)
+                        errors++;
+                json_unref(datastreams[i]);
+        }
+
+        return (void*) errors;
+}
+
+int main(int argc, char** argv)
+{
+        pthread_t threads[NUM_THREADS];
+        shared_t shared;
+        long errors = 0;
+
+        json_parser_t* parser = json_parser_create();
+        if ((json_parser_feed(parser, _text, strlen(_text)) != 0)
+            || !json_parser_done(parser)) {
+                fprintf(stderr, "test-json-threads: failed to parse the document\n");
+                return EXIT_FAILURE;
+        }
+        shared.parsed = json_parser_result(parser);
+        json_parser_destroy(parser);
+        shared.built = build_tree();
+
+        json_freeze(shared.parsed);
+        json_freeze(shared.built);
+
+        shared.expected_length = 0;
+        json_serialise(shared.parsed, 0, count_bytes, &shared.expected_length);
+
+        if (json_object_setnum(shared.parsed, "x", 1) != -1)
+                errors++;
+
+        pthread_barrier_init(&shared.released, NULL, NUM_THREADS + 1);
+
+        for (int i = 0; i < NUM_THREADS; i++)
+                pthread_create(&threads[i], NULL, reader, &shared);
+
+        pthread_barrier_wait(&shared.released);
+
+        /* The threads still hold parts of the trees. */
+        json_unref(shared.parsed);
+        json_unref(shared.built);
+
+        for (int i = 0; i < NUM_THREADS; i++) {
+                void* ret;
+                pthread_join(threads[i], &ret);
+                errors += (long) ret;
+        }
+        pthread_barrier_destroy(&shared.released);
+
+        if (errors > 0) {
+                fprintf(stderr, "test-json-threads: %ld errors\n", errors);
+                return EXIT_FAILURE;
+        }
+        printf("test-json-threads: ok\n");
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,373 @@
+/*
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Tests of the internals of json.c, which is included here so that
+   its static functions can be called. Run by make check, as
+   test-json and as test-json-scalar, which is built with
+   JSON_NO_SIMD. */
+
+#include "json.c"
+
+static int _failures = 0;
+
+#define check(_cond, ...) do {                                  \
+                if (!(_cond)) {                                 \
+                        fprintf(stderr, "test-json: ");         \
+                        fprintf(stderr, __VA_ARGS__);           \
+                        fprintf(stderr, "\n");                  \
+                        _failures++;                            \
+                }                                               \
+        } while (0)
+
+static uint64_t _seed = 88172645463325252ull;
+
+/* xorshift64 */
+static uint64_t random64()
+{
+        _seed ^= _seed << 13;
+        _seed ^= _seed >> 7;
+        _seed ^= _seed << 17;
+        return _seed;
+}
+
+/* The number of significant digits of a number as text: without the
+   sign, the exponent, and the leading and trailing zeros. */
+static int significant_digits(const char* s)
+{
+        char digits[64];
+        int n = 0;
+
+        for ( ; *s && (*s != 'e') && (*s != 'E'); s++)
+                if (('0' <= *s) && (*s <= '9') && (n < 63))
+                        digits[n++] = *s;
+        int first = 0;
+        while ((first < n) && (digits[first] == '0'))
+                first++;
+        while ((n > first) && (digits[n-1] == '0'))
+                n--;
+        return (n > first)? n - first : 1;
+}
+
+/* The fewest significant digits that read back as v, by brute
+   force. */
+static int shortest_digits(double v)
+{
+        char buf[64];
+        for (int precision = 1; precision <= 17; precision++) {
+                snprintf(buf, 64, "%.*g", precision, v);
+                if (strtod(buf, NULL) == v)
+                        return significant_digits(buf);
+        }
+        return 17;
+}
+
+static int same_double(double a, double b)
+{
+        return (a == b) && (signbit(a) == signbit(b));
+}
+
+static void check_number(double v)
+{
+        char buf[32];
+
+        json_numtostr(v, buf, 32);
+        double libc = strtod(buf, NULL);
+        double own = json_strtod(buf);
+
+        check(same_double(libc, v), "%.17g was written as %s, which strtod() reads as %.17g",
+              v, buf, libc);
+        check(same_double(own, v), "%.17g was written as %s, which json_strtod() reads as %.17g",
+              v, buf, own);
+
+        int n = significant_digits(buf);
+        int shortest = shortest_digits(v);
+        check(n == shortest, "%.17g was written as %s, with %d digits instead of %d",
+              v, buf, n, shortest);
+}
+
+/* json_numtostr() must write the shortest text that reads back as
+   the same double, by strtod() and by the parser. */
+static void test_numbers()
+{
+        static const double corpus[] = {
+                0.0, -0.0, 1.0, -1.0, 0.1, 0.2, 0.3, -0.1, 1.5, 23.45, 1013.25,
+                0.001, 0.0001, 1e-7, 123456.789, 999999999.999999, 1e9, 1e15,
+                1e21, 1e22, 1e23, 1e-22, 1e-23, 1e300, 1e-300,
+                1.0 / 3.0, 2.0 / 3.0, 3.141592653589793, 2.718281828459045,
+                DBL_MAX, -DBL_MAX, DBL_MIN, -DBL_MIN, DBL_EPSILON,
+                5e-324, -5e-324, 1e-323, 2.5e-323, 1e-310, 2.2250738585072009e-308,
+                4.9406564584124654e-320, 1.2345678e-315,
+                9007199254740992.0, 9007199254740993.0, 9007199254740994.0,
+                9007199254740996.0, 18014398509481984.0, 18014398509481988.0,
+                123456789012345678.0, 1e17 + 8, 9223372036854775808.0,
+                18446744073709551616.0, 1.7976931348623155e308,
+                1400000000.0, 1400000000.5, 4294967295.0, 4294967296.0
+        };
+
+        for (size_t i = 0; i < sizeof(corpus) / sizeof(double); i++)
+                check_number(corpus[i]);
+
+        /* The subnormals, from the smallest up. */
+        for (uint64_t bits = 1; bits < 5000; bits += 7) {
+                double v;
+                memcpy(&v, &bits, 8);
+                check_number(v);
+        }
+
+        /* Any bit pattern but NaN and the infinities. */
+        for (int i = 0; i < 100000; i++) {
+                uint64_t bits = random64();
+                double v;
+                memcpy(&v, &bits, 8);
+                if (isfinite(v))
+                        check_number(v);
+        }
+
+        /* The readings of the sensors. */
+        for (int i = -50000; i < 50000; i += 3) {
+                check_number(i / 100.0);
+                check_number(i / 1000.0);
+        }
+}
+
+/* The plain loops that the SSE2 and NEON scanners stand in for. */
+static const char* scalar_skip_whitespace(const char* p, const char* end)
+{
+        while ((p < end) && whitespace(*p))
+                p++;
+        return p;
+}
+
+static const char* scalar_scan_string(const char* p, const char* end)
+{
+        while ((p < end) && (*p != '"') && (*p != '\\'))
+                p++;
+        return p;
+}
+
+/* Every byte value at every offset of texts of up to 40 bytes,
+   which start anywhere in a 16-byte block. Each text is made of
+   whitespace, or of plain characters, around the byte. */
+static void test_scanners()
+{
+        static const char filler[2][4] = { { ' ', '\t', '\n', '\r' }, { 'a', 'z', 0x7f, (char) 0xe9 } };
+        static char block[80] __attribute__((aligned(16)));
+        int errors = 0;
+
+        for (int kind = 0; kind < 2; kind++) {
+                for (int align = 0; align < 16; align++) {
+                        char* text = block + align;
+                        for (int len = 0; len <= 40; len++) {
+                                for (int i = 0; i < len; i++)
+                                        text[i] = filler[kind][i % 4];
+                                const char* end = text + len;
+
+                                for (int k = 0; k < len; k++) {
+                                        for (int c = 0; c < 256; c++) {
+                                                text[k] = (char) c;
+                                                if ((json_skip_whitespace(text, end) != scalar_skip_whitespace(text, end))
+                                                    || (json_scan_string(text, end) != scalar_scan_string(text, end))) {
+                                                        if (errors++ == 0)
+                                                                check(0, "scanners differ on byte 0x%02x at offset %d "
+                                                                      "of %d bytes, %d bytes into a block", c, k, len, align);
+                                                }
+                                        }
+                                        text[k] = filler[kind][k % 4];
+                                }
+                                /* Nothing to stop at. */
+                                if ((json_skip_whitespace(text, end) != scalar_skip_whitespace(text, end))
+                                    || (json_scan_string(text, end) != scalar_scan_string(text, end))) {
+                                        if (errors++ == 0)
+                                                check(0, "scanners differ on %d plain bytes", len);
+                                }
+                        }
+                }
+        }
+}
+
+/* Returns the value of the string in the document, or NULL. The
+   document is fed in two pieces, split at split. */
+static char* parse_string(json_parser_t* parser, const char* doc, int32 len, int32 split,
+                          char* value, int32 size)
+{
+        json_parser_reset(parser);
+        int32 r = json_parser_feed(parser, doc, split);
+        if (r == 0)
+                r = json_parser_feed(parser, doc + split, len - split);
+        if (!json_parser_done(parser))
+                return NULL;
+        json_object_t s = json_parser_result(parser);
+        char* ret = NULL;
+        if ((r == 0) && json_isstring(s) && (json_string_length(s) < size)) {
+                memcpy(value, json_string_value(s), json_string_length(s) + 1);
+                ret = value;
+        }
+        json_unref(s);
+        return ret;
+}
+
+/* The strings of a document with an escape, a quote or a control
+   byte at each offset of two 16-byte blocks, fed in one piece and
+   split at each byte, must parse to the same text as with the plain
+   loops. */
+static void test_strings()
+{
+        static const struct { const char* text; const char* value; } escapes[] = {
+                { "\\\"", "\"" }, { "\\\\", "\\" }, { "\\/", "/" }, { "\\n", "\n" },
+                { "\\t", "\t" }, { "\\u00e9", "\xc3\xa9" }, { "\\u20AC", "\xe2\x82\xac" },
+                { "\x01", "\x01" }, { "\x1f", "\x1f" }, { "\x7f", "\x7f" }, { "\xc3\xa9", "\xc3\xa9" }
+        };
+        char doc[128];
+        char expected[128];
+        char value[128];
+        int errors = 0;
+
+        json_parser_t* parser = json_parser_create();
+
+        for (size_t e = 0; e < sizeof(escapes) / sizeof(escapes[0]); e++) {
+                for (int k = 0; k < 32; k++) {
+                        int32 len = snprintf(doc, 128, " \"%.*s%s%.*s\" ", k,
+                                             "abcdefghijklmnopqrstuvwxyzABCDEF", escapes[e].text,
+                                             32 - k, "0123456789012345678901234567890123");
+                        snprintf(expected, 128, "%.*s%s%.*s", k,
+                                 "abcdefghijklmnopqrstuvwxyzABCDEF", escapes[e].value,
+                                 32 - k, "0123456789012345678901234567890123");
+                        for (int32 split = 0; split <= len; split++) {
+                                char* s = parse_string(parser, doc, len, split, value, 128);
+                                if ((s == NULL) || (strcmp(s, expected) != 0)) {
+                                        if (errors++ == 0)
+                                                check(0, "%s parsed as '%s', split at %ld",
+                                                      doc, (s == NULL)? "(error)" : s, split);
+                                }
+                        }
+                }
+        }
+
+        json_parser_destroy(parser);
+}
+
+/* The bytes taken from the chunks of an arena. */
+static int32 arena_used(json_arena_t* arena)
+{
+        int32 used = 0;
+        for (json_chunk_t* chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+                used += chunk->used;
+        return used;
+}
+
+/* A parsed document that is edited for a long time, as the
+   configuration is, doesn't grow its arena: the memory taken by the
+   changes comes from malloc() and is given back. */
+static void test_edited_document()
+{
+        static const char* text = "{ \"sensors\": { \"trh\": \"yes\" }, \"values\": [ 1, 2, 3 ] }";
+        char key[32];
+
+        json_parser_t* parser = json_parser_create();
+        json_parser_feed(parser, text, strlen(text));
+        json_object_t doc = json_parser_result(parser);
+        json_parser_destroy(parser);
+
+        json_arena_t* arena = doc->arena;
+        check((arena != NULL) && arena->sealed, "the arena isn't sealed");
+        if (arena == NULL)
+                return;
+        int32 used = arena_used(arena);
+
+        json_object_t sensors = json_object_get(doc, "sensors");
+        json_object_t values = json_object_get(doc, "values");
+        for (int round = 0; round < 100; round++) {
+                for (int i = 0; i < 40; i++) {
+                        snprintf(key, 32, "key%d", i);
+                        json_object_setnum(sensors, key, round);
+                        json_array_setnum(values, round, 3 + 10 * i);
+                }
+                for (int i = 0; i < 40; i++) {
+                        snprintf(key, 32, "key%d", i);
+                        json_object_unset(sensors, key);
+                }
+        }
+
+        check(arena_used(arena) == used, "the arena grew from %ld to %ld bytes",
+              used, arena_used(arena));
+        check(json_streq(sensors, "trh", "yes"), "sensors.trh was lost");
+        check(json_array_length(values) == 394, "the array has %ld values",
+              json_array_length(values));
+        check(json_array_getnum(values, 393) == 99, "the array holds the wrong values");
+
+        /* The blocks that are still in use are those of the grown
+           array and object: the entries, the index and the array. */
+        check((arena->heap > 0) && (arena->heap <= 3), "%ld blocks taken from malloc()",
+              arena->heap);
+        json_unref(doc);
+}
+
+/* Returns the entry of the path cache for the expression, or NULL. */
+static json_path_t* cached_path(const char* expression)
+{
+        for (int32 i = 0; i < JSON_PATH_CACHE_SIZE; i++)
+                if ((_path_cache[i] != NULL)
+                    && (strcmp(_path_cache[i]->expression, expression) == 0))
+                        return _path_cache[i];
+        return NULL;
+}
+
+/* An invalid expression is compiled once and is remembered as such,
+   next to the valid ones. */
+static void test_invalid_paths()
+{
+        static const char* invalid[] = { "a..b", "[", "a[x]", "a.", ".a", "a[1" };
+        json_object_t obj = json_object_create();
+        json_object_setnum(obj, "a", 1);
+
+        for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+                for (int k = 0; k < 3; k++)
+                        check(json_isnull(json_get(obj, invalid[i])),
+                              "'%s' didn't evaluate to null", invalid[i]);
+                json_path_t* path = cached_path(invalid[i]);
+                check((path != NULL) && (path->count < 0),
+                      "'%s' isn't cached as invalid", invalid[i]);
+                check(json_path_intern(invalid[i]) == NULL,
+                      "'%s' was interned", invalid[i]);
+        }
+
+        json_path_t* path = json_path_intern("a.b");
+        check((path != NULL) && (path == cached_path("a.b")), "'a.b' isn't cached");
+        check(json_getnum(obj, "a") == 1, "'a' didn't evaluate to 1");
+        json_unref(obj);
+}
+
+int main(int argc, char** argv)
+{
+        test_numbers();
+        test_scanners();
+        test_strings();
+        test_invalid_paths();
+        test_edited_document();
+
+        if (_failures > 0) {
+                fprintf(stderr, "test-json: %d failures\n", _failures);
+                return EXIT_FAILURE;
+        }
+        printf("test-json: ok\n");
+        return EXIT_SUCCESS;
+}
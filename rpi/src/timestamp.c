@@ -0,0 +1,132 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <string.h>
+#include <time.h>
+#include "timestamp.h"
+
+static const char _digits[201] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+static timestamp_cache_t _cache;
+
+static void timestamp_put2(char* s, int n)
+{
+        memcpy(s, &_digits[2 * n], 2);
+}
+
+static void timestamp_convert(timestamp_cache_t* cache, time_t t, struct tm* tm)
+{
+        if (cache->utc)
+                gmtime_r(&t, tm);
+        else 
+                localtime_r(&t, tm);
+}
+
+static void timestamp_update(timestamp_cache_t* cache, time_t t)
+{
+        struct tm tm, check;
+
+        timestamp_convert(cache, t, &tm);
+
+        int y = 1900 + tm.tm_year;
+        timestamp_put2(cache->date, y / 100);
+        timestamp_put2(cache->date + 2, y % 100);
+        timestamp_put2(cache->date + 4, 1 + tm.tm_mon);
+        timestamp_put2(cache->date + 6, tm.tm_mday);
+
+        int seconds = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+        cache->midnight = t - seconds;
+        cache->start = cache->midnight;
+        cache->end = cache->midnight + 86400;
+
+        /* If the offset isn't the same at both ends of the day, keep
+           to the current minute. */
+        if (!cache->utc) {
+                time_t last = cache->end - 1;
+                timestamp_convert(cache, cache->start, &check);
+                int same = (check.tm_hour == 0) && (check.tm_min == 0) && (check.tm_sec == 0);
+                timestamp_convert(cache, last, &check);
+                same = same && (check.tm_hour == 23) && (check.tm_min == 59) && (check.tm_sec == 59);
+                if (!same) {
+                        cache->start = t - tm.tm_sec;
+                        cache->end = cache->start + 60;
+                }
+        }
+}
+
+int timestamp_format(timestamp_cache_t* cache, time_t t, int format, char* buf)
+{
+        if (cache == NULL)
+                cache = &_cache;
+
+        if ((t < cache->start) || (t >= cache->end))
+                timestamp_update(cache, t);
+
+        int seconds = (int) (t - cache->midnight);
+        int h = seconds / 3600;
+        int m = (seconds / 60) % 60;
+        int s = seconds % 60;
+        char* p = buf;
+
+        switch (format) {
+        case TIMESTAMP_ISO:
+        case TIMESTAMP_LOG:
+                memcpy(p, cache->date, 4);
+                p[4] = '-';
+                memcpy(p + 5, cache->date + 4, 2);
+                p[7] = '-';
+                memcpy(p + 8, cache->date + 6, 2);
+                p[10] = (format == TIMESTAMP_ISO)? 'T' : ' ';
+                timestamp_put2(p + 11, h);
+                p[13] = ':';
+                timestamp_put2(p + 14, m);
+                p[16] = ':';
+                timestamp_put2(p + 17, s);
+                p += 19;
+                break;
+        case TIMESTAMP_COMPACT:
+                memcpy(p, cache->date, 8);
+                p[8] = '-';
+                timestamp_put2(p + 9, h);
+                timestamp_put2(p + 11, m);
+                timestamp_put2(p + 13, s);
+                p += 15;
+                break;
+        default:
+                memcpy(p, cache->date, 8);
+                p += 8;
+                break;
+        }
+
+        *p = 0;
+        return (int) (p - buf);
+}
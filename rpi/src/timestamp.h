@@ -0,0 +1,67 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* Formatting of the timestamps in the datapoint files, the
+           photo and backup names, and the log. The date is only
+           computed (with localtime_r) when a timestamp falls outside
+           the day of the previous one; the time of day is derived
+           from the seconds since midnight. On the days that the UTC
+           offset changes, the cache only covers one minute at a
+           time. */
+
+        enum {
+                TIMESTAMP_ISO,          /* 2014-05-01T12:30:00 */
+                TIMESTAMP_LOG,          /* 2014-05-01 12:30:00 */
+                TIMESTAMP_COMPACT,      /* 20140501-123000 */
+                TIMESTAMP_DATE          /* 20140501 */
+        };
+
+        #define TIMESTAMP_MAXLEN 20
+
+        typedef struct _timestamp_cache_t {
+                /* Set utc to format in UTC instead of local time. A
+                   cache filled with zeros is valid. */
+                int utc;
+                time_t start;
+                time_t end;
+                time_t midnight;
+                char date[8];
+        } timestamp_cache_t;
+
+        /* Writes the timestamp into buf, which must hold at least
+           TIMESTAMP_MAXLEN bytes, and returns its length. cache may
+           be NULL to use a shared, local time cache. */
+        int timestamp_format(timestamp_cache_t* cache, time_t t, int format, char* buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _BSD_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "json.h"
+#include "log_message.h"
+#include "uplink.h"
+#include "timestamp.h"
+
+static const char* _class_names[UPLINK_CLASSES] = {
+        "datapoints", "status", "thumbnails", "photos"
+};
+
+struct _uplink_t {
+        char* state_file;
+        long daily_budget;
+        long session_budget;
+        char day[16];
+        long used_today;
+        long used_session;
+        long sent[UPLINK_CLASSES];
+        int deferred[UPLINK_CLASSES];
+        json_object_t thumbnails;
+};
+
+static void uplink_today(char* buffer, int len)
+{
+        char s[TIMESTAMP_MAXLEN];
+        timestamp_format(NULL, time(NULL), TIMESTAMP_DATE, s);
+        snprintf(buffer, len, "%s", s);
+}
+
+/* State files written by earlier versions hold the counters as
+   strings. */
+static long uplink_getlong(json_object_t obj, const char* key)
+{
+        json_object_t v = json_object_get(obj, key);
+        if (json_isstring(v))
+                return atol(json_string_value(v));
+        if (json_isnumber(v))
+                return (long) json_number_value(v);
+        return 0;
+}
+
+static void uplink_setlong(json_object_t obj, const char* key, long value)
+{
+        json_object_setnum(obj, key, (double) value);
+}
+
+static void uplink_load(uplink_t* uplink)
+{
+        char today[16];
+        char errmsg[512];
+        int err;
+
+        uplink_today(today, sizeof(today));
+        strcpy(uplink->day, today);
+        uplink->used_today = 0;
+        json_unref(uplink->thumbnails);
+        uplink->thumbnails = json_array_create();
+
+        if (access(uplink->state_file, F_OK) != 0)
+                return;
+
+        json_object_t state = json_load(uplink->state_file, &err, errmsg, sizeof(errmsg));
+        if (err) {
+                log_warn("Uplink: %s", errmsg);
+                return;
+        }
+        if (!json_isobject(state)) {
+                log_warn("Uplink: Invalid state file: %s", uplink->state_file);
+                json_unref(state);
+                return;
+        }
+
+        const char* day = json_object_getstr(state, "day");
+        if ((day != NULL) && (strcmp(day, today) == 0))
+                uplink->used_today = uplink_getlong(state, "used");
+
+        json_object_t thumbnails = json_object_get(state, "thumbnails");
+        if (json_isarray(thumbnails)) {
+                for (int i = 0; i < json_array_length(thumbnails); i++) {
+                        const char* id = json_array_getstr(thumbnails, i);
+                        if (id != NULL)
+                                json_array_setstr(uplink->thumbnails, id,
+                                                  json_array_length(uplink->thumbnails));
+                }
+        }
+
+        json_unref(state);
+}
+
+uplink_t* new_uplink(const char* state_file, long daily_budget, long session_budget)
+{
+        uplink_t* uplink = (uplink_t*) malloc(sizeof(uplink_t));
+        if (uplink == NULL) {
+                log_err("Uplink: out of memory");
+                return NULL;
+        }
+        memset(uplink, 0, sizeof(uplink_t));
+
+        uplink->state_file = strdup(state_file);
+        uplink->daily_budget = (daily_budget > 0)? daily_budget : 0;
+        uplink->session_budget = (session_budget > 0)? session_budget : 0;
+        uplink->thumbnails = json_null();
+
+        uplink_load(uplink);
+
+        return uplink;
+}
+
+void uplink_reload(uplink_t* uplink)
+{
+        uplink_load(uplink);
+}
+
+void delete_uplink(uplink_t* uplink)
+{
+        if (uplink == NULL)
+                return;
+        if (uplink->state_file)
+                free(uplink->state_file);
+        json_unref(uplink->thumbnails);
+        free(uplink);
+}
+
+int uplink_limited(uplink_t* uplink)
+{
+        return (uplink->daily_budget > 0) || (uplink->session_budget > 0);
+}
+
+long uplink_remaining(uplink_t* uplink)
+{
+        long remaining = -1;
+
+        if (uplink->daily_budget > 0) {
+                remaining = uplink->daily_budget - uplink->used_today;
+                if (remaining < 0)
+                        remaining = 0;
+        }
+        if (uplink->session_budget > 0) {
+                long r = uplink->session_budget - uplink->used_session;
+                if (r < 0)
+                        r = 0;
+                if ((remaining == -1) || (r < remaining))
+                        remaining = r;
+        }
+        return remaining;
+}
+
+int uplink_allow(uplink_t* uplink, int klass, long size)
+{
+        if (klass == UPLINK_DATAPOINTS)
+                return 1;
+        long remaining = uplink_remaining(uplink);
+        if (remaining == -1)
+                return 1;
+        return size <= remaining;
+}
+
+void uplink_consume(uplink_t* uplink, int klass, long bytes)
+{
+        if ((klass < 0) || (klass >= UPLINK_CLASSES) || (bytes <= 0))
+                return;
+        uplink->used_today += bytes;
+        uplink->used_session += bytes;
+        uplink->sent[klass] += bytes;
+        log_debug("Uplink: %s: %ld bytes, %ld bytes used today",
+                  _class_names[klass], bytes, uplink->used_today);
+}
+
+void uplink_defer(uplink_t* uplink, int klass)
+{
+        if ((klass < 0) || (klass >= UPLINK_CLASSES))
+                return;
+        uplink->deferred[klass]++;
+}
+
+static int uplink_find_thumbnail(uplink_t* uplink, const char* id)
+{
+        int len = json_array_length(uplink->thumbnails);
+        for (int i = 0; i < len; i++) {
+                const char* s = json_array_getstr(uplink->thumbnails, i);
+                if ((s != NULL) && (strcmp(s, id) == 0))
+                        return i;
+        }
+        return -1;
+}
+
+int uplink_has_thumbnail(uplink_t* uplink, const char* id)
+{
+        return uplink_find_thumbnail(uplink, id) != -1;
+}
+
+void uplink_set_thumbnail(uplink_t* uplink, const char* id)
+{
+        if (uplink_find_thumbnail(uplink, id) == -1)
+                json_array_setstr(uplink->thumbnails, id,
+                                  json_array_length(uplink->thumbnails));
+}
+
+void uplink_clear_thumbnail(uplink_t* uplink, const char* id)
+{
+        if (uplink_find_thumbnail(uplink, id) == -1)
+                return;
+
+        json_object_t thumbnails = json_array_create();
+        int len = json_array_length(uplink->thumbnails);
+        for (int i = 0; i < len; i++) {
+                const char* s = json_array_getstr(uplink->thumbnails, i);
+                if ((s != NULL) && (strcmp(s, id) != 0))
+                        json_array_setstr(thumbnails, s, json_array_length(thumbnails));
+        }
+        json_unref(uplink->thumbnails);
+        uplink->thumbnails = thumbnails;
+}
+
+/* The state is written to a temporary file that is renamed over the
+   old one, so that a crash leaves either of them complete. */
+int uplink_save(uplink_t* uplink)
+{
+        char tmpfile[512];
+        int r = -1;
+
+        if (snprintf(tmpfile, 512, "%s.tmp", uplink->state_file) >= 512) {
+                log_err("Uplink: The name of the state file is too long: %s",
+                        uplink->state_file);
+                return -1;
+        }
+
+        json_object_t state = json_object_create();
+        json_object_setstr(state, "day", uplink->day);
+        uplink_setlong(state, "used", uplink->used_today);
+        json_object_set(state, "thumbnails", uplink->thumbnails);
+
+        FILE* fp = fopen(tmpfile, "w");
+        if (fp != NULL) {
+                r = json_tofilep(state, k_json_pretty, fp);
+                if ((fflush(fp) != 0) || (fsync(fileno(fp)) != 0))
+                        r = -1;
+                if (fclose(fp) != 0)
+                        r = -1;
+                if ((r == 0) && (rename(tmpfile, uplink->state_file) != 0))
+                        r = -1;
+                if (r != 0)
+                        unlink(tmpfile);
+        }
+        if (r != 0)
+                log_err("Uplink: Failed to save the state file: %s", uplink->state_file);
+
+        json_unref(state);
+        return r;
+}
+
+json_object_t uplink_status(uplink_t* uplink)
+{
+        json_object_t status = json_object_create();
+
+        json_object_setstr(status, "day", uplink->day);
+        uplink_setlong(status, "daily-budget", uplink->daily_budget);
+        uplink_setlong(status, "session-budget", uplink->session_budget);
+        uplink_setlong(status, "used-today", uplink->used_today);
+        uplink_setlong(status, "used-session", uplink->used_session);
+        uplink_setlong(status, "remaining", uplink_remaining(uplink));
+
+        json_object_t sent = json_object_create();
+        json_object_t deferred = json_object_create();
+        for (int i = 0; i < UPLINK_CLASSES; i++) {
+                uplink_setlong(sent, _class_names[i], uplink->sent[i]);
+                uplink_setlong(deferred, _class_names[i], uplink->deferred[i]);
+        }
+        json_object_set(status, "sent", sent);
+        json_object_set(status, "deferred", deferred);
+        json_unref(sent);
+        json_unref(deferred);
+
+        uplink_setlong(status, "thumbnails-pending-full",
+                       json_array_length(uplink->thumbnails));
+
+        return status;
+}
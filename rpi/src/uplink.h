@@ -0,0 +1,88 @@
+/* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef _UPLINK_H_
+#define _UPLINK_H_
+
+#include "json.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+        /* Upload classes, in order of priority. Datapoints are
+           always sent; the other classes only use what is left of
+           the daily and session budgets. */
+        enum {
+                UPLINK_DATAPOINTS = 0,
+                UPLINK_STATUS,
+                UPLINK_THUMBNAILS,
+                UPLINK_PHOTOS,
+                UPLINK_CLASSES
+        };
+
+        typedef struct _uplink_t uplink_t;
+
+        /* The budgets are measured in bytes. A value of 0 means no
+           limit. The state (bytes used today, thumbnails sent) is
+           kept in state_file between runs. */
+        uplink_t* new_uplink(const char* state_file,
+                             long daily_budget,
+                             long session_budget);
+        void delete_uplink(uplink_t* uplink);
+
+        /* Reads the state file again, for a process that saves the
+           state some time after it was started: another process may
+           have saved newer counts in between. The counts of the
+           session are kept. */
+        void uplink_reload(uplink_t* uplink);
+
+        /* Returns 1 if the budgets are limited, 0 otherwise. */
+        int uplink_limited(uplink_t* uplink);
+
+        /* Returns the number of bytes left for this session, or -1
+           if there is no limit. */
+        long uplink_remaining(uplink_t* uplink);
+
+        /* Returns 1 if an item of the given class and estimated size
+           can be sent now, 0 if it must be deferred. */
+        int uplink_allow(uplink_t* uplink, int klass, long size);
+
+        /* Accounts the bytes that were actually transferred. */
+        void uplink_consume(uplink_t* uplink, int klass, long bytes);
+
+        /* Records that an item was deferred to a later session. */
+        void uplink_defer(uplink_t* uplink, int klass);
+
+        int uplink_has_thumbnail(uplink_t* uplink, const char* id);
+        void uplink_set_thumbnail(uplink_t* uplink, const char* id);
+        void uplink_clear_thumbnail(uplink_t* uplink, const char* id);
+
+        int uplink_save(uplink_t* uplink);
+
+        /* Returns a new JSON object with the budget state. */
+        json_object_t uplink_status(uplink_t* uplink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,9 @@
 require_once "config.inc.php";
 require_once "session.inc.php";
 require_once "error.inc.php";
+require_once "live.inc.php";
+
+$live = live_read();
 
 ?><html>
   <head>
@@ -49,7 +52,32 @@ require_once "error.inc.php";
       
       <div class="main"> 
 
-      <p>The status page is still being developed.</p> 
+      <?php if ($live === FALSE): ?>
+      <p>No measurements yet.</p> 
+      <?php else: ?>
+      <table>
+        <?php foreach ($live["datastreams"] as $name => $points): 
+                $last = $points[count($points) - 1]; ?>
+        <tr>
+          <td class="label"><?php echo htmlspecialchars($name) ?></td>
+          <td><?php echo round($last[1], 2) ?></td>
+          <td><?php echo live_format_time($last[0]) ?></td>
+        </tr>
+        <?php endforeach; ?>
+        <tr>
+          <td class="label">Last photo</td>
+          <td colspan="2"><?php echo live_format_status($live["camera"]) ?></td>
+        </tr>
+        <tr>
+          <td class="label">Last datapoints upload</td>
+          <td colspan="2"><?php echo live_format_status($live["datapoints-upload"]) ?></td>
+        </tr>
+        <tr>
+          <td class="label">Last photos upload</td>
+          <td colspan="2"><?php echo live_format_status($live["photos-upload"]) ?></td>
+        </tr>
+      </table>
+      <?php endif; ?>
 
       <p>Please use:
 
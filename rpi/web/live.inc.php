@@ -0,0 +1,129 @@
+<?php /* 
+
+    P2P Food Lab Sensorbox
+
+    Copyright (C) 2013  Sony Computer Science Laboratory Paris
+    Author: Peter Hanappe
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Reads the latest readings that sensorbox publishes in live.dat
+   (see src/live.h for the layout). The file isn't locked: it is read
+   again when the sequence number shows that sensorbox changed it
+   during the read. */
+
+$live_file = $homedir . "/live.dat";
+
+function live_read_word($h, $offset)
+{
+        fseek($h, $offset);
+        $s = fread($h, 4);
+        if (strlen($s) != 4)
+                return FALSE;
+        $v = unpack("V", $s);
+        return $v[1];
+}
+
+function live_decode($data)
+{
+        $header = unpack("a4magic/Vversion/Vseq/Vstreams/Vdepth/Vupdated", $data);
+        $status = unpack("Vcamera_time/lcamera/Vdata_time/ldata/Vphotos_time/lphotos", 
+                         substr($data, 24, 24));
+
+        $live = array("updated" => $header["updated"], 
+                      "camera" => array($status["camera_time"], $status["camera"]),
+                      "datapoints-upload" => array($status["data_time"], $status["data"]),
+                      "photos-upload" => array($status["photos_time"], $status["photos"]),
+                      "datastreams" => array());
+
+        $depth = $header["depth"];
+        $stream_size = 16 + 8 * $depth;
+
+        for ($i = 0; $i < $header["streams"]; $i++) {
+                $offset = 64 + $i * $stream_size;
+                $name = rtrim(substr($data, $offset, 8), "\0");
+                $v = unpack("V", substr($data, $offset + 8, 4));
+                $written = $v[1];
+                $n = min($written, $depth);
+                if (($name == "") || ($n == 0))
+                        continue;
+
+                $points = array();
+                for ($k = 0; $k < $n; $k++) {
+                        $index = ($written - $n + $k) % $depth;
+                        $p = unpack("Vt/fv", substr($data, $offset + 16 + 8 * $index, 8));
+                        $points[] = array($p["t"], $p["v"]);
+                }
+                $live["datastreams"][$name] = $points;
+        }
+
+        return $live;
+}
+
+function live_read()
+{
+        global $live_file;
+
+        $h = @fopen($live_file, "rb");
+        if ($h === FALSE)
+                return FALSE;
+        stream_set_read_buffer($h, 0);
+
+        $live = FALSE;
+
+        for ($attempt = 0; $attempt < 100; $attempt++) {
+                $seq = live_read_word($h, 8);
+                if ($seq === FALSE)
+                        break;
+                if ($seq & 1) {
+                        usleep(1000);
+                        continue;
+                }
+                $streams = live_read_word($h, 12);
+                $depth = live_read_word($h, 16);
+                if (($streams === FALSE) || ($depth === FALSE) || ($depth == 0))
+                        break;
+                $size = 64 + $streams * (16 + 8 * $depth);
+
+                fseek($h, 0);
+                $data = fread($h, $size);
+
+                if (live_read_word($h, 8) !== $seq)
+                        continue;
+                if ((strlen($data) != $size) || (substr($data, 0, 4) != "SBLV"))
+                        break;
+
+                $live = live_decode($data);
+                break;
+        }
+
+        fclose($h);
+        return $live;
+}
+
+function live_format_time($t)
+{
+        return ($t == 0)? "-" : date("Y-m-d H:i:s", $t);
+}
+
+function live_format_status($s)
+{
+        if ($s[0] == 0)
+                return "-";
+        return live_format_time($s[0]) . (($s[1] == 0)? " (ok)" : " (failed)");
+}
+
+?>